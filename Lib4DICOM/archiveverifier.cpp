@@ -0,0 +1,358 @@
+﻿// archiveverifier.cpp
+#include "archiveverifier.h"
+#include "dicomcharset.h"
+#include "dirwalker.h"
+#include "storageroots.h"
+
+#include <QFile>
+#include <QFileInfo>
+#include <QHash>
+#include <QSaveFile>
+#include <QThread>
+#include <QDebug>
+
+#include <dcmtk/dcmdata/dctk.h>
+#include <dcmtk/dcmdata/dcdeftag.h>
+#include <dcmtk/dcmdata/dcxfer.h>
+
+#if defined(Q_OS_WIN)
+#  ifndef NOMINMAX
+#    define NOMINMAX
+#  endif
+#  include <windows.h>
+#elif defined(Q_OS_LINUX)
+#  include <sys/syscall.h>
+#  include <unistd.h>
+#endif
+
+namespace {
+
+#if defined(Q_OS_LINUX)
+    // <linux/ioprio.h> есть не во всех sysroot — значения из ABI ядра
+    const int kIoprioWhoProcess = 1;
+    const int kIoprioIdle = 3 << 13;   // IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0)
+#endif
+
+    // приоритет ввода-вывода idle для текущего потока на время проверки
+    class IdleIoScope {
+    public:
+        explicit IdleIoScope(bool on) {
+            if (!on)
+                return;
+#if defined(Q_OS_WIN)
+            m_active = SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN) != 0;
+#elif defined(Q_OS_LINUX)
+            // pid 0 — вызывающий поток: остальные потоки процесса читают с обычным приоритетом
+            m_previous = int(::syscall(SYS_ioprio_get, kIoprioWhoProcess, 0));
+            m_active = m_previous >= 0
+                && ::syscall(SYS_ioprio_set, kIoprioWhoProcess, 0, kIoprioIdle) == 0;
+#endif
+        }
+        ~IdleIoScope() {
+            if (!m_active)
+                return;
+#if defined(Q_OS_WIN)
+            SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_END);
+#elif defined(Q_OS_LINUX)
+            ::syscall(SYS_ioprio_set, kIoprioWhoProcess, 0, m_previous);
+#endif
+        }
+        bool active() const { return m_active; }
+
+    private:
+        bool m_active = false;
+        int  m_previous = 0;
+    };
+
+    // длина несжатого PixelData против геометрии кадра; пусто — всё сходится
+    QString pixelLengthProblem(DcmDataset* ds, qint64 fileSize) {
+        DcmElement* px = nullptr;
+        if (ds->findAndGetElement(DCM_PixelData, px).bad() || !px)
+            return QString();
+        if (DcmXfer(ds->getOriginalXfer()).isEncapsulated())
+            return QString();   // фрагменты сжатого потока — длина кадра не определена
+
+        Uint16 rows = 0, cols = 0, spp = 1, bits = 0;
+        Sint32 frames = 1;
+        ds->findAndGetUint16(DCM_Rows, rows);
+        ds->findAndGetUint16(DCM_Columns, cols);
+        ds->findAndGetUint16(DCM_SamplesPerPixel, spp);
+        ds->findAndGetUint16(DCM_BitsAllocated, bits);
+        ds->findAndGetSint32(DCM_NumberOfFrames, frames);
+        if (rows == 0 || cols == 0 || bits == 0)
+            return QStringLiteral("PixelData without Rows/Columns/BitsAllocated");
+        if (spp == 0)
+            spp = 1;
+        if (frames < 1)
+            frames = 1;
+
+        const quint64 expected = (quint64(rows) * cols * spp * quint64(frames) * bits + 7) / 8;
+        const quint64 actual = px->getLength();
+        if (qint64(actual) > fileSize)
+            return QString("PixelData declares %1 bytes, file is %2 bytes").arg(actual).arg(fileSize);
+        if (actual == expected || actual == expected + (expected & 1))   // выравнивание до чётной длины
+            return QString();
+        return QString("PixelData %1 bytes, expected %2 (%3x%4, %5 samples, %6 bit, %7 frames)")
+            .arg(actual).arg(expected).arg(cols).arg(rows).arg(spp).arg(bits).arg(frames);
+    }
+
+}
+
+// Потолок скорости чтения: файл сначала «оплачивается», затем читается.
+// Долг копится не больше секунды — после долгого обхода папок нет всплеска.
+class ArchiveVerifier::Throttle {
+public:
+    Throttle(double mbPerSec, const std::atomic<bool>& cancel)
+        : m_bytesPerMs(mbPerSec * 1024.0 * 1024.0 / 1000.0), m_cancel(cancel)
+    {
+        m_clock.start();
+    }
+
+    void consume(qint64 bytes) {
+        if (m_bytesPerMs <= 0.0)
+            return;
+        m_bytes += bytes;
+        qint64 ahead = qint64(m_bytes / m_bytesPerMs) - m_clock.elapsed();
+        if (ahead < -1000) {
+            m_clock.restart();
+            m_bytes = bytes;
+            ahead = qint64(m_bytes / m_bytesPerMs);
+        }
+        while (ahead > 0 && !m_cancel) {
+            const qint64 step = qMin<qint64>(ahead, 100);   // отмена — не дольше 0.1 с
+            QThread::msleep(quint64(step));
+            m_sleptMs += step;
+            ahead -= step;
+        }
+    }
+
+    qint64 sleptMs() const { return m_sleptMs; }
+
+private:
+    double                   m_bytesPerMs;
+    const std::atomic<bool>& m_cancel;
+    QElapsedTimer            m_clock;
+    double                   m_bytes = 0.0;
+    qint64                   m_sleptMs = 0;
+};
+
+QString ArchiveVerifier::kindName(int kind)
+{
+    switch (kind) {
+    case Unreadable:      return QStringLiteral("unreadable");
+    case PixelLength:     return QStringLiteral("pixel-length");
+    case MissingStub:     return QStringLiteral("missing-stub");
+    case PatientMismatch: return QStringLiteral("patient-mismatch");
+    }
+    return QStringLiteral("unknown");
+}
+
+void ArchiveVerifier::report(int kind, const QString& path, const QString& detail)
+{
+    m_items.append({ kind, path, detail });
+    emit finding(kind, path, detail);
+}
+
+// ---------------- Проверка одной папки ----------------
+void ArchiveVerifier::verifyFolder(const QString& folder, bool patientFolder, int depth, Throttle& throttle)
+{
+    struct Seen {
+        QString path;
+        QString patientID;
+        QString name;
+    };
+    QVector<Seen> seen;
+    int stub = -1;   // индекс stub в seen
+
+    DirWalker::walk(folder, depth, [&](const DirWalker::Entry& e) {
+        if (m_cancel)
+            return;
+        const qint64 size = QFileInfo(e.filePath).size();
+        throttle.consume(size);
+        ++m_files;
+        m_bytes += size;
+        if (m_progressClock.elapsed() >= 200) {
+            m_progressClock.restart();
+            emit progress(m_files, m_bytes);
+        }
+
+        DcmFileFormat ff;
+        const OFCondition st = ff.loadFile(QFile::encodeName(e.filePath).constData());
+        if (st.bad()) {
+            report(Unreadable, e.filePath, QString::fromLatin1(st.text()));
+            return;
+        }
+        DcmDataset* ds = ff.getDataset();
+
+        const QString pixel = pixelLengthProblem(ds, size);
+        if (!pixel.isEmpty())
+            report(PixelLength, e.filePath, pixel);
+
+        if (!patientFolder)
+            return;
+
+        OFString v, cs;
+        ds->findAndGetOFStringArray(DCM_SpecificCharacterSet, cs);
+        const DicomTextDecoder& dec = DicomTextDecoder::forCharset(cs);
+        Seen s;
+        s.path = e.filePath;
+        if (ds->findAndGetOFString(DCM_PatientID, v).good())
+            s.patientID = dec.decode(v).trimmed();
+        if (ds->findAndGetOFString(DCM_PatientName, v).good())
+            s.name = dec.decode(v, true).trimmed();
+
+        // stub лежит прямо в папке пациента
+        if (e.depth == 0 && stub < 0) {
+            const bool byDescription = ds->findAndGetOFString(DCM_SeriesDescription, v).good()
+                && QString::fromLatin1(v.c_str()).trimmed().compare(QLatin1String("PATIENT_STUB"), Qt::CaseInsensitive) == 0;
+            if (byDescription || QFileInfo(e.filePath).fileName().contains("_patient", Qt::CaseInsensitive))
+                stub = seen.size();
+        }
+        seen.append(s);
+    });
+
+    if (!patientFolder || m_cancel || seen.isEmpty())
+        return;
+
+    if (stub < 0)
+        report(MissingStub, folder, QString("%1 files, no _patient.dcm").arg(seen.size()));
+
+    // эталон — stub, без него — самое частое сочетание PatientID + ФИО в папке
+    QString refID, refName;
+    if (stub >= 0) {
+        refID = seen.at(stub).patientID;
+        refName = seen.at(stub).name;
+    }
+    else {
+        QHash<QString, int> votes;
+        int best = 0;
+        for (const Seen& s : seen) {
+            const int n = ++votes[s.patientID + QChar(0x1F) + s.name];
+            if (n > best) {
+                best = n;
+                refID = s.patientID;
+                refName = s.name;
+            }
+        }
+    }
+    for (const Seen& s : seen) {
+        if (s.patientID == refID && s.name == refName)
+            continue;
+        report(PatientMismatch, s.path, QString("'%1' / '%2', folder has '%3' / '%4'")
+            .arg(s.patientID, s.name, refID, refName));
+    }
+}
+
+// ---------------- Проверка архива ----------------
+QVariantMap ArchiveVerifier::verify(const QStringList& roots, const Options& opt)
+{
+    m_cancel = false;
+    m_items.clear();
+    m_files = 0;
+    m_bytes = 0;
+
+    QElapsedTimer timer;
+    timer.start();
+    m_progressClock.start();
+
+    const IdleIoScope idle(opt.idleIo);
+    Throttle throttle(opt.mbPerSec, m_cancel);
+    const int depth = qMax(0, opt.depth);
+
+    int folders = 0;
+    for (const QString& root : roots) {
+        // файлы прямо в корне — только разбор и PixelData
+        verifyFolder(root, false, 0, throttle);
+        if (depth == 0)
+            continue;
+        for (const QString& folder : StorageRoots::patientDirs(root)) {
+            if (m_cancel)
+                break;
+            verifyFolder(folder, true, depth - 1, throttle);
+            ++folders;
+        }
+    }
+    emit progress(m_files, m_bytes);
+
+    QVariantMap out;
+    int counts[4] = { 0, 0, 0, 0 };
+    for (const Item& it : m_items)
+        ++counts[it.kind];
+
+    if (!opt.reportPath.isEmpty()) {
+        QSaveFile f(opt.reportPath);
+        if (f.open(QIODevice::WriteOnly | QIODevice::Text)) {
+            f.write("kind\tpath\tdetail\n");
+            for (const Item& it : m_items)
+                f.write(QString("%1\t%2\t%3\n").arg(kindName(it.kind), it.path, it.detail).toUtf8());
+            if (f.commit())
+                out["report"] = opt.reportPath;
+        }
+        if (!out.contains("report"))
+            qWarning().noquote() << "[Lib4DICOM] ArchiveVerifier: cannot write report" << opt.reportPath;
+    }
+
+    const double seconds = timer.elapsed() / 1000.0;
+    out["cancelled"] = bool(m_cancel);
+    out["folders"] = folders;
+    out["files"] = m_files;
+    out["bytes"] = m_bytes;
+    out["findings"] = m_items.size();
+    out["unreadable"] = counts[Unreadable];
+    out["pixelLength"] = counts[PixelLength];
+    out["missingStub"] = counts[MissingStub];
+    out["patientMismatch"] = counts[PatientMismatch];
+    out["seconds"] = seconds;
+    out["mbPerSec"] = seconds > 0 ? m_bytes / (1024.0 * 1024.0) / seconds : 0.0;
+    out["throttledMs"] = throttle.sleptMs();
+    out["idleIo"] = idle.active();
+
+    qDebug().noquote() << "[Lib4DICOM] ArchiveVerifier:" << m_files << "files in" << folders << "patient folders,"
+        << m_items.size() << "findings," << seconds << "s," << throttle.sleptMs() << "ms throttled"
+        << (idle.active() ? "(idle I/O)" : "");
+    return out;
+}
+
+// ---------------- Модель находок ----------------
+int VerifyFindingsModel::rowCount(const QModelIndex& parent) const
+{
+    return parent.isValid() ? 0 : m_rows.size();
+}
+
+QVariant VerifyFindingsModel::data(const QModelIndex& index, int role) const
+{
+    if (!index.isValid() || index.row() >= m_rows.size())
+        return QVariant();
+    const Row& r = m_rows.at(index.row());
+    switch (role) {
+    case KindRole:     return r.kind;
+    case KindNameRole: return ArchiveVerifier::kindName(r.kind);
+    case PathRole:     return r.path;
+    case DetailRole:   return r.detail;
+    }
+    return QVariant();
+}
+
+QHash<int, QByteArray> VerifyFindingsModel::roleNames() const
+{
+    return {
+        { KindRole,     "kind"     },
+        { KindNameRole, "kindName" },
+        { PathRole,     "path"     },
+        { DetailRole,   "detail"   }
+    };
+}
+
+void VerifyFindingsModel::append(int kind, const QString& path, const QString& detail)
+{
+    beginInsertRows(QModelIndex(), m_rows.size(), m_rows.size());
+    m_rows.append({ kind, path, detail });
+    endInsertRows();
+}
+
+void VerifyFindingsModel::clear()
+{
+    beginResetModel();
+    m_rows.clear();
+    endResetModel();
+}
@@ -0,0 +1,96 @@
+﻿#pragma once
+
+#include <QAbstractListModel>
+#include <QElapsedTimer>
+#include <QObject>
+#include <QString>
+#include <QStringList>
+#include <QVariantMap>
+#include <QVector>
+
+#include <atomic>
+
+#include "lib4dicom_global.h"
+
+// Фоновая проверка архива: каждый .dcm читается целиком и разбирается, у несжатых снимков
+// длина PixelData сверяется с Rows×Columns×SamplesPerPixel×NumberOfFrames×BitsAllocated,
+// в папке пациента ищется stub и сверяются PatientID и ФИО всех файлов.
+// Поток проверки понижает себе приоритет ввода-вывода до idle (Linux: ioprio_set,
+// Windows: THREAD_MODE_BACKGROUND_BEGIN), а чтение ограничено потолком МБ/с, поэтому
+// сканирование и запись в GUI почти не замечают проверку.
+class LIB4DICOM_EXPORT ArchiveVerifier : public QObject {
+    Q_OBJECT
+
+public:
+    enum Kind {
+        Unreadable = 0,     // файл не разбирается (обрезан или испорчен)
+        PixelLength,        // длина PixelData не совпадает с геометрией кадра
+        MissingStub,        // в папке пациента нет stub (_patient.dcm / PATIENT_STUB)
+        PatientMismatch     // PatientID или ФИО файла расходятся с остальной папкой
+    };
+
+    struct Options {
+        double  mbPerSec = 20.0;   // потолок чтения; 0 — без ограничения
+        bool    idleIo = true;     // приоритет ввода-вывода idle для потока проверки
+        int     depth = 2;         // глубина как у scanDepth: корень -> пациент -> исследование
+        QString reportPath;        // отчёт TSV "вид\tпуть\tподробности"; пусто — без отчёта
+    };
+
+    explicit ArchiveVerifier(QObject* parent = nullptr) : QObject(parent) {}
+
+    static QString kindName(int kind);
+
+    // Блокирующая проверка корней архива (обе раскладки); находки приходят сигналом finding().
+    // folders, files, bytes, findings, unreadable, pixelLength, missingStub, patientMismatch,
+    // seconds, mbPerSec, throttledMs, idleIo, report
+    QVariantMap verify(const QStringList& roots, const Options& opt);
+
+    void cancel() { m_cancel = true; }
+
+signals:
+    void finding(int kind, const QString& path, const QString& detail);
+    void progress(int files, qint64 bytes);
+
+private:
+    class Throttle;
+
+    void verifyFolder(const QString& folder, bool patientFolder, int depth, Throttle& throttle);
+    void report(int kind, const QString& path, const QString& detail);
+
+    struct Item {
+        int     kind;
+        QString path;
+        QString detail;
+    };
+
+    std::atomic<bool> m_cancel{ false };
+    QVector<Item>     m_items;
+    int               m_files = 0;
+    qint64            m_bytes = 0;
+    QElapsedTimer     m_progressClock;
+};
+
+// Находки проверки для QML: kind, kindName, path, detail
+class LIB4DICOM_EXPORT VerifyFindingsModel : public QAbstractListModel {
+    Q_OBJECT
+
+public:
+    enum Roles { KindRole = Qt::UserRole + 1, KindNameRole, PathRole, DetailRole };
+
+    explicit VerifyFindingsModel(QObject* parent = nullptr) : QAbstractListModel(parent) {}
+
+    int rowCount(const QModelIndex& parent = QModelIndex()) const override;
+    QVariant data(const QModelIndex& index, int role) const override;
+    QHash<int, QByteArray> roleNames() const override;
+
+    void append(int kind, const QString& path, const QString& detail);
+    Q_INVOKABLE void clear();
+
+private:
+    struct Row {
+        int     kind;
+        QString path;
+        QString detail;
+    };
+    QVector<Row> m_rows;
+};
@@ -0,0 +1,57 @@
+﻿#pragma once
+
+#include <QMutex>
+#include <QWaitCondition>
+
+#include <deque>
+#include <utility>
+
+// Очередь фиксированной ёмкости между потоками-производителями и потребителями.
+// push() ждёт, пока есть место, pop() — пока есть элемент; после close()
+// push() отказывает, а pop() отдаёт остаток и затем возвращает false.
+template <class T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(int capacity) : m_capacity(capacity > 0 ? capacity : 1) {}
+
+    bool push(T value)
+    {
+        QMutexLocker lock(&m_mutex);
+        while (!m_closed && int(m_items.size()) >= m_capacity)
+            m_notFull.wait(&m_mutex);
+        if (m_closed)
+            return false;
+        m_items.push_back(std::move(value));
+        m_notEmpty.wakeOne();
+        return true;
+    }
+
+    bool pop(T& value)
+    {
+        QMutexLocker lock(&m_mutex);
+        while (!m_closed && m_items.empty())
+            m_notEmpty.wait(&m_mutex);
+        if (m_items.empty())
+            return false;
+        value = std::move(m_items.front());
+        m_items.pop_front();
+        m_notFull.wakeOne();
+        return true;
+    }
+
+    void close()
+    {
+        QMutexLocker lock(&m_mutex);
+        m_closed = true;
+        m_notFull.wakeAll();
+        m_notEmpty.wakeAll();
+    }
+
+private:
+    const int      m_capacity;
+    bool           m_closed = false;
+    std::deque<T>  m_items;
+    QMutex         m_mutex;
+    QWaitCondition m_notFull;
+    QWaitCondition m_notEmpty;
+};
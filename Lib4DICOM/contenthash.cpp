@@ -0,0 +1,195 @@
+﻿// contenthash.cpp
+#include "contenthash.h"
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QDebug>
+
+#include <cstring>
+
+namespace {
+    const quint64 kPrime1 = 0x9E3779B185EBCA87ULL;
+    const quint64 kPrime2 = 0xC2B2AE3D27D4EB4FULL;
+    const quint64 kPrime3 = 0x165667B19E3779F9ULL;
+    const quint64 kPrime4 = 0x85EBCA77C2B2AE63ULL;
+    const quint64 kPrime5 = 0x27D4EB2F165667C5ULL;
+
+    inline quint64 rotl(quint64 x, int r) { return (x << r) | (x >> (64 - r)); }
+
+    // чтение без требований к выравниванию; на x86/ARM little-endian
+    inline quint64 read64(const uchar* p) { quint64 v; std::memcpy(&v, p, 8); return v; }
+    inline quint32 read32(const uchar* p) { quint32 v; std::memcpy(&v, p, 4); return v; }
+
+    inline quint64 xxRound(quint64 acc, quint64 input)
+    {
+        acc += input * kPrime2;
+        acc = rotl(acc, 31);
+        return acc * kPrime1;
+    }
+
+    inline quint64 mergeRound(quint64 acc, quint64 val)
+    {
+        acc ^= xxRound(0, val);
+        return acc * kPrime1 + kPrime4;
+    }
+
+    const char* const kIndexName = ".contenthash";   // скрытый — сканер архива его не видит
+}
+
+quint64 xxh64(const void* data, size_t len, quint64 seed)
+{
+    const uchar* p = static_cast<const uchar*>(data);
+    const uchar* const end = p + len;
+    quint64 h;
+
+    if (len >= 32) {
+        quint64 v1 = seed + kPrime1 + kPrime2;
+        quint64 v2 = seed + kPrime2;
+        quint64 v3 = seed;
+        quint64 v4 = seed - kPrime1;
+        const uchar* const limit = end - 32;
+        do {
+            v1 = xxRound(v1, read64(p));      p += 8;
+            v2 = xxRound(v2, read64(p));      p += 8;
+            v3 = xxRound(v3, read64(p));      p += 8;
+            v4 = xxRound(v4, read64(p));      p += 8;
+        } while (p <= limit);
+
+        h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        h = mergeRound(h, v1);
+        h = mergeRound(h, v2);
+        h = mergeRound(h, v3);
+        h = mergeRound(h, v4);
+    }
+    else {
+        h = seed + kPrime5;
+    }
+
+    h += quint64(len);
+
+    for (; p + 8 <= end; p += 8) {
+        h ^= xxRound(0, read64(p));
+        h = rotl(h, 27) * kPrime1 + kPrime4;
+    }
+    if (p + 4 <= end) {
+        h ^= quint64(read32(p)) * kPrime1;
+        h = rotl(h, 23) * kPrime2 + kPrime3;
+        p += 4;
+    }
+    for (; p < end; ++p) {
+        h ^= quint64(*p) * kPrime5;
+        h = rotl(h, 11) * kPrime1;
+    }
+
+    h ^= h >> 33;
+    h *= kPrime2;
+    h ^= h >> 29;
+    h *= kPrime3;
+    h ^= h >> 32;
+    return h;
+}
+
+// ---------------- ContentHashIndex ----------------
+QString ContentHashIndex::indexPath(const QString& patientFolder)
+{
+    return patientFolder + '/' + QLatin1String(kIndexName);
+}
+
+ContentHashIndex::Folder& ContentHashIndex::folder(const QString& patientFolder)
+{
+    auto it = m_folders.find(patientFolder);
+    if (it != m_folders.end())
+        return it.value();
+
+    Folder& f = m_folders[patientFolder];
+    QFile file(indexPath(patientFolder));
+    if (file.open(QIODevice::ReadOnly)) {
+        while (!file.atEnd()) {
+            const QByteArray line = file.readLine().trimmed();
+            const int tab = line.indexOf('\t');
+            if (tab <= 0)
+                continue;
+            bool ok = false;
+            const quint64 hash = line.left(tab).toULongLong(&ok, 16);
+            if (ok)
+                f.files.insert(hash, QString::fromUtf8(line.mid(tab + 1)));
+        }
+    }
+    return f;
+}
+
+QString ContentHashIndex::claim(const QString& patientFolder, const QString& studyFolder,
+    quint64 hash, const QString& filePath, Scope scope)
+{
+    const QDir patientDir(patientFolder);
+    const QString studyRel = patientDir.relativeFilePath(studyFolder) + '/';
+
+    QMutexLocker lock(&m_mutex);
+    Folder& f = folder(patientFolder);
+    // тот же кадр в этой или параллельной порции: он лежит во временном файле или ещё не записан
+    for (auto it = f.inFlight.constFind(hash); it != f.inFlight.cend() && it.key() == hash; ++it) {
+        if (scope == SameStudy && !it.value().startsWith(studyRel))
+            continue;
+        return patientDir.absoluteFilePath(it.value());
+    }
+    for (auto it = f.files.find(hash); it != f.files.end() && it.key() == hash; ) {
+        const QString& rel = it.value();
+        if (scope == SameStudy && !rel.startsWith(studyRel)) {
+            ++it;
+            continue;
+        }
+        const QString existing = patientDir.absoluteFilePath(rel);
+        if (!QFileInfo::exists(existing)) {
+            it = f.files.erase(it);   // файл удалён вручную — запись устарела
+            continue;
+        }
+        return existing;
+    }
+    f.inFlight.insert(hash, patientDir.relativeFilePath(filePath));
+    return QString();
+}
+
+void ContentHashIndex::release(const QString& patientFolder, quint64 hash, const QString& filePath)
+{
+    QMutexLocker lock(&m_mutex);
+    Folder& f = folder(patientFolder);
+    f.inFlight.remove(hash, QDir(patientFolder).relativeFilePath(filePath));
+}
+
+void ContentHashIndex::persist(const QString& patientFolder,
+    const QVector<std::pair<quint64, QString>>& entries)
+{
+    if (entries.isEmpty())
+        return;
+
+    // индекс — кэш: при потере файла повторы просто не распознаются, поэтому без fsync
+    QMutexLocker lock(&m_mutex);
+    const QDir patientDir(patientFolder);
+    Folder& f = folder(patientFolder);
+    for (const auto& e : entries) {
+        const QString rel = patientDir.relativeFilePath(e.second);
+        f.inFlight.remove(e.first, rel);
+        f.files.insert(e.first, rel);
+    }
+
+    QFile file(indexPath(patientFolder));
+    if (!file.open(QIODevice::Append)) {
+        qWarning().noquote() << "[Lib4DICOM] ContentHashIndex: cannot append" << file.fileName();
+        return;
+    }
+    QByteArray out;
+    for (const auto& e : entries) {
+        out += QByteArray::number(e.first, 16).rightJustified(16, '0');
+        out += '\t';
+        out += patientDir.relativeFilePath(e.second).toUtf8();
+        out += '\n';
+    }
+    file.write(out);
+}
+
+void ContentHashIndex::clear()
+{
+    QMutexLocker lock(&m_mutex);
+    m_folders.clear();
+}
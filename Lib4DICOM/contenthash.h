@@ -0,0 +1,46 @@
+﻿#pragma once
+
+#include <QHash>
+#include <QMutex>
+#include <QString>
+#include <QVector>
+
+#include <utility>
+
+// 64-битный xxHash (XXH64): четыре независимые полосы по 8 байт, 32 байта за шаг —
+// компилятор раскладывает их по конвейеру и векторным регистрам.
+quint64 xxh64(const void* data, size_t len, quint64 seed = 0);
+
+// Индекс содержимого снимков: хэш плотного буфера пикселей + геометрии -> файл.
+// Хранится по пациенту в скрытом <папка пациента>/.contenthash (строки "hash\tпуть",
+// путь относительно папки пациента), загружается при первом обращении.
+// Повторный импорт того же кадра находится одним поиском в хэш-таблице.
+class ContentHashIndex {
+public:
+    enum Scope { Off = 0, SameStudy = 1, SamePatient = 2 };
+
+    // Занять хэш за новым файлом. Если в области уже есть живой файл с тем же
+    // содержимым или такой же кадр ещё пишется — вернуть его путь (ничего не занимая),
+    // иначе пустую строку. Занятый хэш остаётся «в полёте» до persist() или release():
+    // его файла на месте ещё нет, и устаревшим он не считается.
+    QString claim(const QString& patientFolder, const QString& studyFolder,
+        quint64 hash, const QString& filePath, Scope scope);
+    // файл не записан — снять занятый хэш
+    void release(const QString& patientFolder, quint64 hash, const QString& filePath);
+    // файлы опубликованы — перевести их из «в полёте» в индекс и дописать в .contenthash
+    void persist(const QString& patientFolder, const QVector<std::pair<quint64, QString>>& entries);
+
+    void clear();
+
+private:
+    struct Folder {
+        QMultiHash<quint64, QString> files;     // опубликованные, пути относительно папки пациента
+        QMultiHash<quint64, QString> inFlight;  // заняты claim(), файл ещё не опубликован
+    };
+
+    Folder& folder(const QString& patientFolder);   // под m_mutex
+    static QString indexPath(const QString& patientFolder);
+
+    QHash<QString, Folder> m_folders;
+    QMutex                 m_mutex;
+};
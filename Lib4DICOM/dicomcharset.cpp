@@ -0,0 +1,428 @@
+﻿// dicomcharset.cpp
+#include "dicomcharset.h"
+
+#include <QHash>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QList>
+
+#include <cstring>
+
+// DCMTK
+#include <dcmtk/ofstd/ofstring.h>
+
+struct DicomTextDecoder::CodeTable {
+    char16_t map[256];
+    bool     multiByte = false;   // ISO 2022 IR 87/159/149/58 — не поддерживаем, выдаём U+FFFD
+};
+
+namespace {
+
+    // Верхние половины (0xA0..0xFF) однобайтовых наборов ISO/IEC 8859 и TIS-620.
+    // 0x00..0x9F во всех наборах совпадают с ASCII/C1 и заполняются циклом.
+    // ISO 8859-2
+    const char16_t kLatin2[96] = {
+        0x00A0, 0x0104, 0x02D8, 0x0141, 0x00A4, 0x013D, 0x015A, 0x00A7,
+        0x00A8, 0x0160, 0x015E, 0x0164, 0x0179, 0x00AD, 0x017D, 0x017B,
+        0x00B0, 0x0105, 0x02DB, 0x0142, 0x00B4, 0x013E, 0x015B, 0x02C7,
+        0x00B8, 0x0161, 0x015F, 0x0165, 0x017A, 0x02DD, 0x017E, 0x017C,
+        0x0154, 0x00C1, 0x00C2, 0x0102, 0x00C4, 0x0139, 0x0106, 0x00C7,
+        0x010C, 0x00C9, 0x0118, 0x00CB, 0x011A, 0x00CD, 0x00CE, 0x010E,
+        0x0110, 0x0143, 0x0147, 0x00D3, 0x00D4, 0x0150, 0x00D6, 0x00D7,
+        0x0158, 0x016E, 0x00DA, 0x0170, 0x00DC, 0x00DD, 0x0162, 0x00DF,
+        0x0155, 0x00E1, 0x00E2, 0x0103, 0x00E4, 0x013A, 0x0107, 0x00E7,
+        0x010D, 0x00E9, 0x0119, 0x00EB, 0x011B, 0x00ED, 0x00EE, 0x010F,
+        0x0111, 0x0144, 0x0148, 0x00F3, 0x00F4, 0x0151, 0x00F6, 0x00F7,
+        0x0159, 0x016F, 0x00FA, 0x0171, 0x00FC, 0x00FD, 0x0163, 0x02D9,
+    };
+
+    // ISO 8859-3
+    const char16_t kLatin3[96] = {
+        0x00A0, 0x0126, 0x02D8, 0x00A3, 0x00A4, 0xFFFD, 0x0124, 0x00A7,
+        0x00A8, 0x0130, 0x015E, 0x011E, 0x0134, 0x00AD, 0xFFFD, 0x017B,
+        0x00B0, 0x0127, 0x00B2, 0x00B3, 0x00B4, 0x00B5, 0x0125, 0x00B7,
+        0x00B8, 0x0131, 0x015F, 0x011F, 0x0135, 0x00BD, 0xFFFD, 0x017C,
+        0x00C0, 0x00C1, 0x00C2, 0xFFFD, 0x00C4, 0x010A, 0x0108, 0x00C7,
+        0x00C8, 0x00C9, 0x00CA, 0x00CB, 0x00CC, 0x00CD, 0x00CE, 0x00CF,
+        0xFFFD, 0x00D1, 0x00D2, 0x00D3, 0x00D4, 0x0120, 0x00D6, 0x00D7,
+        0x011C, 0x00D9, 0x00DA, 0x00DB, 0x00DC, 0x016C, 0x015C, 0x00DF,
+        0x00E0, 0x00E1, 0x00E2, 0xFFFD, 0x00E4, 0x010B, 0x0109, 0x00E7,
+        0x00E8, 0x00E9, 0x00EA, 0x00EB, 0x00EC, 0x00ED, 0x00EE, 0x00EF,
+        0xFFFD, 0x00F1, 0x00F2, 0x00F3, 0x00F4, 0x0121, 0x00F6, 0x00F7,
+        0x011D, 0x00F9, 0x00FA, 0x00FB, 0x00FC, 0x016D, 0x015D, 0x02D9,
+    };
+
+    // ISO 8859-4
+    const char16_t kLatin4[96] = {
+        0x00A0, 0x0104, 0x0138, 0x0156, 0x00A4, 0x0128, 0x013B, 0x00A7,
+        0x00A8, 0x0160, 0x0112, 0x0122, 0x0166, 0x00AD, 0x017D, 0x00AF,
+        0x00B0, 0x0105, 0x02DB, 0x0157, 0x00B4, 0x0129, 0x013C, 0x02C7,
+        0x00B8, 0x0161, 0x0113, 0x0123, 0x0167, 0x014A, 0x017E, 0x014B,
+        0x0100, 0x00C1, 0x00C2, 0x00C3, 0x00C4, 0x00C5, 0x00C6, 0x012E,
+        0x010C, 0x00C9, 0x0118, 0x00CB, 0x0116, 0x00CD, 0x00CE, 0x012A,
+        0x0110, 0x0145, 0x014C, 0x0136, 0x00D4, 0x00D5, 0x00D6, 0x00D7,
+        0x00D8, 0x0172, 0x00DA, 0x00DB, 0x00DC, 0x0168, 0x016A, 0x00DF,
+        0x0101, 0x00E1, 0x00E2, 0x00E3, 0x00E4, 0x00E5, 0x00E6, 0x012F,
+        0x010D, 0x00E9, 0x0119, 0x00EB, 0x0117, 0x00ED, 0x00EE, 0x012B,
+        0x0111, 0x0146, 0x014D, 0x0137, 0x00F4, 0x00F5, 0x00F6, 0x00F7,
+        0x00F8, 0x0173, 0x00FA, 0x00FB, 0x00FC, 0x0169, 0x016B, 0x02D9,
+    };
+
+    // ISO 8859-5
+    const char16_t kCyrillic[96] = {
+        0x00A0, 0x0401, 0x0402, 0x0403, 0x0404, 0x0405, 0x0406, 0x0407,
+        0x0408, 0x0409, 0x040A, 0x040B, 0x040C, 0x00AD, 0x040E, 0x040F,
+        0x0410, 0x0411, 0x0412, 0x0413, 0x0414, 0x0415, 0x0416, 0x0417,
+        0x0418, 0x0419, 0x041A, 0x041B, 0x041C, 0x041D, 0x041E, 0x041F,
+        0x0420, 0x0421, 0x0422, 0x0423, 0x0424, 0x0425, 0x0426, 0x0427,
+        0x0428, 0x0429, 0x042A, 0x042B, 0x042C, 0x042D, 0x042E, 0x042F,
+        0x0430, 0x0431, 0x0432, 0x0433, 0x0434, 0x0435, 0x0436, 0x0437,
+        0x0438, 0x0439, 0x043A, 0x043B, 0x043C, 0x043D, 0x043E, 0x043F,
+        0x0440, 0x0441, 0x0442, 0x0443, 0x0444, 0x0445, 0x0446, 0x0447,
+        0x0448, 0x0449, 0x044A, 0x044B, 0x044C, 0x044D, 0x044E, 0x044F,
+        0x2116, 0x0451, 0x0452, 0x0453, 0x0454, 0x0455, 0x0456, 0x0457,
+        0x0458, 0x0459, 0x045A, 0x045B, 0x045C, 0x00A7, 0x045E, 0x045F,
+    };
+
+    // ISO 8859-6
+    const char16_t kArabic[96] = {
+        0x00A0, 0xFFFD, 0xFFFD, 0xFFFD, 0x00A4, 0xFFFD, 0xFFFD, 0xFFFD,
+        0xFFFD, 0xFFFD, 0xFFFD, 0xFFFD, 0x060C, 0x00AD, 0xFFFD, 0xFFFD,
+        0xFFFD, 0xFFFD, 0xFFFD, 0xFFFD, 0xFFFD, 0xFFFD, 0xFFFD, 0xFFFD,
+        0xFFFD, 0xFFFD, 0xFFFD, 0x061B, 0xFFFD, 0xFFFD, 0xFFFD, 0x061F,
+        0xFFFD, 0x0621, 0x0622, 0x0623, 0x0624, 0x0625, 0x0626, 0x0627,
+        0x0628, 0x0629, 0x062A, 0x062B, 0x062C, 0x062D, 0x062E, 0x062F,
+        0x0630, 0x0631, 0x0632, 0x0633, 0x0634, 0x0635, 0x0636, 0x0637,
+        0x0638, 0x0639, 0x063A, 0xFFFD, 0xFFFD, 0xFFFD, 0xFFFD, 0xFFFD,
+        0x0640, 0x0641, 0x0642, 0x0643, 0x0644, 0x0645, 0x0646, 0x0647,
+        0x0648, 0x0649, 0x064A, 0x064B, 0x064C, 0x064D, 0x064E, 0x064F,
+        0x0650, 0x0651, 0x0652, 0xFFFD, 0xFFFD, 0xFFFD, 0xFFFD, 0xFFFD,
+        0xFFFD, 0xFFFD, 0xFFFD, 0xFFFD, 0xFFFD, 0xFFFD, 0xFFFD, 0xFFFD,
+    };
+
+    // ISO 8859-7
+    const char16_t kGreek[96] = {
+        0x00A0, 0x2018, 0x2019, 0x00A3, 0x20AC, 0x20AF, 0x00A6, 0x00A7,
+        0x00A8, 0x00A9, 0x037A, 0x00AB, 0x00AC, 0x00AD, 0xFFFD, 0x2015,
+        0x00B0, 0x00B1, 0x00B2, 0x00B3, 0x0384, 0x0385, 0x0386, 0x00B7,
+        0x0388, 0x0389, 0x038A, 0x00BB, 0x038C, 0x00BD, 0x038E, 0x038F,
+        0x0390, 0x0391, 0x0392, 0x0393, 0x0394, 0x0395, 0x0396, 0x0397,
+        0x0398, 0x0399, 0x039A, 0x039B, 0x039C, 0x039D, 0x039E, 0x039F,
+        0x03A0, 0x03A1, 0xFFFD, 0x03A3, 0x03A4, 0x03A5, 0x03A6, 0x03A7,
+        0x03A8, 0x03A9, 0x03AA, 0x03AB, 0x03AC, 0x03AD, 0x03AE, 0x03AF,
+        0x03B0, 0x03B1, 0x03B2, 0x03B3, 0x03B4, 0x03B5, 0x03B6, 0x03B7,
+        0x03B8, 0x03B9, 0x03BA, 0x03BB, 0x03BC, 0x03BD, 0x03BE, 0x03BF,
+        0x03C0, 0x03C1, 0x03C2, 0x03C3, 0x03C4, 0x03C5, 0x03C6, 0x03C7,
+        0x03C8, 0x03C9, 0x03CA, 0x03CB, 0x03CC, 0x03CD, 0x03CE, 0xFFFD,
+    };
+
+    // ISO 8859-8
+    const char16_t kHebrew[96] = {
+        0x00A0, 0xFFFD, 0x00A2, 0x00A3, 0x00A4, 0x00A5, 0x00A6, 0x00A7,
+        0x00A8, 0x00A9, 0x00D7, 0x00AB, 0x00AC, 0x00AD, 0x00AE, 0x00AF,
+        0x00B0, 0x00B1, 0x00B2, 0x00B3, 0x00B4, 0x00B5, 0x00B6, 0x00B7,
+        0x00B8, 0x00B9, 0x00F7, 0x00BB, 0x00BC, 0x00BD, 0x00BE, 0xFFFD,
+        0xFFFD, 0xFFFD, 0xFFFD, 0xFFFD, 0xFFFD, 0xFFFD, 0xFFFD, 0xFFFD,
+        0xFFFD, 0xFFFD, 0xFFFD, 0xFFFD, 0xFFFD, 0xFFFD, 0xFFFD, 0xFFFD,
+        0xFFFD, 0xFFFD, 0xFFFD, 0xFFFD, 0xFFFD, 0xFFFD, 0xFFFD, 0xFFFD,
+        0xFFFD, 0xFFFD, 0xFFFD, 0xFFFD, 0xFFFD, 0xFFFD, 0xFFFD, 0x2017,
+        0x05D0, 0x05D1, 0x05D2, 0x05D3, 0x05D4, 0x05D5, 0x05D6, 0x05D7,
+        0x05D8, 0x05D9, 0x05DA, 0x05DB, 0x05DC, 0x05DD, 0x05DE, 0x05DF,
+        0x05E0, 0x05E1, 0x05E2, 0x05E3, 0x05E4, 0x05E5, 0x05E6, 0x05E7,
+        0x05E8, 0x05E9, 0x05EA, 0xFFFD, 0xFFFD, 0x200E, 0x200F, 0xFFFD,
+    };
+
+    // ISO 8859-9
+    const char16_t kLatin5[96] = {
+        0x00A0, 0x00A1, 0x00A2, 0x00A3, 0x00A4, 0x00A5, 0x00A6, 0x00A7,
+        0x00A8, 0x00A9, 0x00AA, 0x00AB, 0x00AC, 0x00AD, 0x00AE, 0x00AF,
+        0x00B0, 0x00B1, 0x00B2, 0x00B3, 0x00B4, 0x00B5, 0x00B6, 0x00B7,
+        0x00B8, 0x00B9, 0x00BA, 0x00BB, 0x00BC, 0x00BD, 0x00BE, 0x00BF,
+        0x00C0, 0x00C1, 0x00C2, 0x00C3, 0x00C4, 0x00C5, 0x00C6, 0x00C7,
+        0x00C8, 0x00C9, 0x00CA, 0x00CB, 0x00CC, 0x00CD, 0x00CE, 0x00CF,
+        0x011E, 0x00D1, 0x00D2, 0x00D3, 0x00D4, 0x00D5, 0x00D6, 0x00D7,
+        0x00D8, 0x00D9, 0x00DA, 0x00DB, 0x00DC, 0x0130, 0x015E, 0x00DF,
+        0x00E0, 0x00E1, 0x00E2, 0x00E3, 0x00E4, 0x00E5, 0x00E6, 0x00E7,
+        0x00E8, 0x00E9, 0x00EA, 0x00EB, 0x00EC, 0x00ED, 0x00EE, 0x00EF,
+        0x011F, 0x00F1, 0x00F2, 0x00F3, 0x00F4, 0x00F5, 0x00F6, 0x00F7,
+        0x00F8, 0x00F9, 0x00FA, 0x00FB, 0x00FC, 0x0131, 0x015F, 0x00FF,
+    };
+
+    // ISO 8859-15
+    const char16_t kLatin9[96] = {
+        0x00A0, 0x00A1, 0x00A2, 0x00A3, 0x20AC, 0x00A5, 0x0160, 0x00A7,
+        0x0161, 0x00A9, 0x00AA, 0x00AB, 0x00AC, 0x00AD, 0x00AE, 0x00AF,
+        0x00B0, 0x00B1, 0x00B2, 0x00B3, 0x017D, 0x00B5, 0x00B6, 0x00B7,
+        0x017E, 0x00B9, 0x00BA, 0x00BB, 0x0152, 0x0153, 0x0178, 0x00BF,
+        0x00C0, 0x00C1, 0x00C2, 0x00C3, 0x00C4, 0x00C5, 0x00C6, 0x00C7,
+        0x00C8, 0x00C9, 0x00CA, 0x00CB, 0x00CC, 0x00CD, 0x00CE, 0x00CF,
+        0x00D0, 0x00D1, 0x00D2, 0x00D3, 0x00D4, 0x00D5, 0x00D6, 0x00D7,
+        0x00D8, 0x00D9, 0x00DA, 0x00DB, 0x00DC, 0x00DD, 0x00DE, 0x00DF,
+        0x00E0, 0x00E1, 0x00E2, 0x00E3, 0x00E4, 0x00E5, 0x00E6, 0x00E7,
+        0x00E8, 0x00E9, 0x00EA, 0x00EB, 0x00EC, 0x00ED, 0x00EE, 0x00EF,
+        0x00F0, 0x00F1, 0x00F2, 0x00F3, 0x00F4, 0x00F5, 0x00F6, 0x00F7,
+        0x00F8, 0x00F9, 0x00FA, 0x00FB, 0x00FC, 0x00FD, 0x00FE, 0x00FF,
+    };
+
+    // TIS-620 (ISO_IR 166)
+    const char16_t kThai[96] = {
+        0xFFFD, 0x0E01, 0x0E02, 0x0E03, 0x0E04, 0x0E05, 0x0E06, 0x0E07,
+        0x0E08, 0x0E09, 0x0E0A, 0x0E0B, 0x0E0C, 0x0E0D, 0x0E0E, 0x0E0F,
+        0x0E10, 0x0E11, 0x0E12, 0x0E13, 0x0E14, 0x0E15, 0x0E16, 0x0E17,
+        0x0E18, 0x0E19, 0x0E1A, 0x0E1B, 0x0E1C, 0x0E1D, 0x0E1E, 0x0E1F,
+        0x0E20, 0x0E21, 0x0E22, 0x0E23, 0x0E24, 0x0E25, 0x0E26, 0x0E27,
+        0x0E28, 0x0E29, 0x0E2A, 0x0E2B, 0x0E2C, 0x0E2D, 0x0E2E, 0x0E2F,
+        0x0E30, 0x0E31, 0x0E32, 0x0E33, 0x0E34, 0x0E35, 0x0E36, 0x0E37,
+        0x0E38, 0x0E39, 0x0E3A, 0xFFFD, 0xFFFD, 0xFFFD, 0xFFFD, 0x0E3F,
+        0x0E40, 0x0E41, 0x0E42, 0x0E43, 0x0E44, 0x0E45, 0x0E46, 0x0E47,
+        0x0E48, 0x0E49, 0x0E4A, 0x0E4B, 0x0E4C, 0x0E4D, 0x0E4E, 0x0E4F,
+        0x0E50, 0x0E51, 0x0E52, 0x0E53, 0x0E54, 0x0E55, 0x0E56, 0x0E57,
+        0x0E58, 0x0E59, 0x0E5A, 0x0E5B, 0xFFFD, 0xFFFD, 0xFFFD, 0xFFFD,
+    };
+
+    using CodeTable = DicomTextDecoder::CodeTable;
+
+    CodeTable makeTable(const char16_t* high96) {
+        CodeTable t;
+        for (int i = 0; i < 0xA0; ++i)
+            t.map[i] = char16_t(i);
+        for (int i = 0; i < 96; ++i)
+            t.map[0xA0 + i] = high96 ? high96[i] : char16_t(0xA0 + i);
+        return t;
+    }
+
+    // JIS X 0201: G0 — латиница с ¥ и ‾, G1 — полуширинная катакана 0xA1..0xDF
+    CodeTable makeRomaji() {
+        CodeTable t = makeTable(nullptr);
+        t.map[0x5C] = 0x00A5;
+        t.map[0x7E] = 0x203E;
+        return t;
+    }
+
+    CodeTable makeKatakana() {
+        CodeTable t = makeTable(nullptr);
+        for (int i = 0xA0; i < 0x100; ++i)
+            t.map[i] = (i >= 0xA1 && i <= 0xDF) ? char16_t(0xFF61 + (i - 0xA1)) : char16_t(0xFFFD);
+        return t;
+    }
+
+    CodeTable makeMultiByte() {
+        CodeTable t = makeTable(nullptr);
+        t.multiByte = true;
+        return t;
+    }
+
+    const CodeTable tAscii = makeTable(nullptr);
+    const CodeTable tLatin1 = makeTable(nullptr);
+    const CodeTable tLatin2 = makeTable(kLatin2);
+    const CodeTable tLatin3 = makeTable(kLatin3);
+    const CodeTable tLatin4 = makeTable(kLatin4);
+    const CodeTable tCyrillic = makeTable(kCyrillic);
+    const CodeTable tArabic = makeTable(kArabic);
+    const CodeTable tGreek = makeTable(kGreek);
+    const CodeTable tHebrew = makeTable(kHebrew);
+    const CodeTable tLatin5 = makeTable(kLatin5);
+    const CodeTable tLatin9 = makeTable(kLatin9);
+    const CodeTable tThai = makeTable(kThai);
+    const CodeTable tRomaji = makeRomaji();
+    const CodeTable tKatakana = makeKatakana();
+    const CodeTable tMultiByte = makeMultiByte();
+
+    // Определённые термины DICOM (PS3.3 C.12.1.1.2) и их escape-последовательности
+    struct Term {
+        const char*      single;   // "ISO_IR 144"
+        const char*      iso2022;  // "ISO 2022 IR 144"
+        const char*      escape;   // байты после ESC
+        bool             g0;       // набор назначается в G0 (иначе G1)
+        const CodeTable* table;
+    };
+
+    const Term kTerms[] = {
+        { "ISO_IR 6",   "ISO 2022 IR 6",   "(B",  true,  &tAscii },
+        { "ISO_IR 100", "ISO 2022 IR 100", "-A",  false, &tLatin1 },
+        { "ISO_IR 101", "ISO 2022 IR 101", "-B",  false, &tLatin2 },
+        { "ISO_IR 109", "ISO 2022 IR 109", "-C",  false, &tLatin3 },
+        { "ISO_IR 110", "ISO 2022 IR 110", "-D",  false, &tLatin4 },
+        { "ISO_IR 144", "ISO 2022 IR 144", "-L",  false, &tCyrillic },
+        { "ISO_IR 127", "ISO 2022 IR 127", "-G",  false, &tArabic },
+        { "ISO_IR 126", "ISO 2022 IR 126", "-F",  false, &tGreek },
+        { "ISO_IR 138", "ISO 2022 IR 138", "-H",  false, &tHebrew },
+        { "ISO_IR 148", "ISO 2022 IR 148", "-M",  false, &tLatin5 },
+        { "ISO_IR 203", "ISO 2022 IR 203", "-b",  false, &tLatin9 },
+        { "ISO_IR 166", "ISO 2022 IR 166", "-T",  false, &tThai },
+        { "ISO_IR 13",  "ISO 2022 IR 13",  ")I",  false, &tKatakana },
+        { nullptr,      nullptr,           "(J",  true,  &tRomaji },      // G0 для ISO 2022 IR 13
+        { nullptr,      "ISO 2022 IR 87",  "$B",  true,  &tMultiByte },
+        { nullptr,      "ISO 2022 IR 159", "$(D", true,  &tMultiByte },
+        { nullptr,      "ISO 2022 IR 149", "$)C", false, &tMultiByte },
+        { nullptr,      "ISO 2022 IR 58",  "$)A", false, &tMultiByte },
+    };
+
+    const Term* findTerm(const QByteArray& value, bool& iso2022) {
+        for (const Term& t : kTerms) {
+            if (t.single && value == t.single) { iso2022 = false; return &t; }
+            if (t.iso2022 && value == t.iso2022) { iso2022 = true; return &t; }
+        }
+        return nullptr;
+    }
+
+    // Разделители, после которых ISO 2022 возвращается к начальному состоянию
+    inline bool isDelimiter(uchar c, bool personName) {
+        switch (c) {
+        case '\\': case '\r': case '\n': case '\f': case '\t':
+            return true;
+        case '^': case '=':
+            return personName;
+        }
+        return false;
+    }
+}
+
+// ---------------- Разбор SpecificCharacterSet ----------------
+DicomTextDecoder::DicomTextDecoder(const QByteArray& charset) : m_charset(charset)
+{
+    const QList<QByteArray> values = charset.split('\\');
+    const QByteArray first = values.isEmpty() ? QByteArray() : values.first().trimmed();
+
+    m_g0 = &tAscii;
+    m_g1 = &tLatin1;   // пусто: как и раньше, считаем Latin-1
+
+    if (first == "ISO_IR 192" && values.size() == 1) {
+        m_mode = Utf8;
+        return;
+    }
+
+    bool anyIso2022 = false;
+    bool firstKnown = first.isEmpty();
+    for (int i = 0; i < values.size(); ++i) {
+        const QByteArray v = values.at(i).trimmed();
+        if (v.isEmpty())
+            continue;
+        bool iso2022 = false;
+        const Term* t = findTerm(v, iso2022);
+        if (!t) {
+            m_supported = false;
+            continue;
+        }
+        anyIso2022 = anyIso2022 || iso2022;
+        // начальное состояние задаёт первое значение
+        if (i == 0) {
+            firstKnown = true;
+            if (t->g0) m_g0 = t->table;
+            else       m_g1 = t->table;
+            if (t->table == &tKatakana)
+                m_g0 = &tRomaji;   // ISO_IR 13 = JIS X 0201 целиком
+        }
+    }
+
+    if (!firstKnown) {
+        // незнакомая кодировка (GB18030, GBK, ...): как раньше — UTF-8
+        m_mode = Utf8;
+        return;
+    }
+    m_mode = (anyIso2022 || values.size() > 1) ? Iso2022 : SingleByte;
+}
+
+const DicomTextDecoder& DicomTextDecoder::forCharset(const OFString& specificCharacterSet)
+{
+    return forCharset(QByteArray(specificCharacterSet.c_str(), int(specificCharacterSet.length())));
+}
+
+const DicomTextDecoder& DicomTextDecoder::forCharset(const QByteArray& specificCharacterSet)
+{
+    // быстрый путь: обычно весь архив в одной кодировке
+    thread_local QByteArray lastKey;
+    thread_local const DicomTextDecoder* last = nullptr;
+    if (last && lastKey == specificCharacterSet)
+        return *last;
+
+    static QMutex mutex;
+    static QHash<QByteArray, const DicomTextDecoder*> cache;   // живут до конца процесса
+
+    QMutexLocker lock(&mutex);
+    const DicomTextDecoder*& d = cache[specificCharacterSet];
+    if (!d)
+        d = new DicomTextDecoder(specificCharacterSet);
+    lastKey = specificCharacterSet;
+    last = d;
+    return *d;
+}
+
+// ---------------- Декодирование ----------------
+QString DicomTextDecoder::decode(const OFString& value, bool personName) const
+{
+    return decode(value.c_str(), value.length(), personName);
+}
+
+QString DicomTextDecoder::decode(const char* data, size_t len, bool personName) const
+{
+    if (!data || len == 0)
+        return QString();
+
+    if (m_mode == Utf8)
+        return QString::fromUtf8(data, int(len));
+
+    const uchar* in = reinterpret_cast<const uchar*>(data);
+    QString out(int(len), Qt::Uninitialized);
+    char16_t* dst = reinterpret_cast<char16_t*>(out.data());
+    int n = 0;
+
+    if (m_mode == SingleByte) {
+        const char16_t* map = m_g1->map;   // G0 всегда ASCII, у таблиц он совпадает
+        if (m_g0 != &tAscii) {
+            for (size_t i = 0; i < len; ++i)
+                dst[n++] = in[i] < 0x80 ? m_g0->map[in[i]] : map[in[i]];
+        }
+        else {
+            for (size_t i = 0; i < len; ++i)
+                dst[n++] = map[in[i]];
+        }
+        return out;
+    }
+
+    // ISO 2022: G0/G1 переключаются по ESC, сбрасываются на разделителях
+    const CodeTable* g0 = m_g0;
+    const CodeTable* g1 = m_g1;
+    for (size_t i = 0; i < len; ++i) {
+        const uchar c = in[i];
+
+        if (c == 0x1B) {
+            const Term* hit = nullptr;
+            size_t escLen = 0;
+            for (const Term& t : kTerms) {
+                const size_t l = std::strlen(t.escape);
+                if (i + 1 + l <= len && std::memcmp(in + i + 1, t.escape, l) == 0) {
+                    hit = &t;
+                    escLen = l;
+                    break;
+                }
+            }
+            if (hit) {
+                if (hit->g0) g0 = hit->table;
+                else         g1 = hit->table;
+                i += escLen;
+                continue;
+            }
+            dst[n++] = char16_t(0xFFFD);   // незнакомая последовательность
+            continue;
+        }
+
+        if (isDelimiter(c, personName)) {
+            g0 = m_g0;
+            g1 = m_g1;
+            dst[n++] = char16_t(c);
+            continue;
+        }
+
+        const CodeTable* t = c < 0x80 ? g0 : g1;
+        if (t->multiByte && c > 0x20 && c != 0x7F) {
+            // двухбайтовые наборы (JIS X 0208/0212, KS X 1001, GB 2312) не поддерживаются
+            dst[n++] = char16_t(0xFFFD);
+            if (i + 1 < len) ++i;
+            continue;
+        }
+        dst[n++] = t->map[c];
+    }
+    out.truncate(n);
+    return out;
+}
@@ -0,0 +1,39 @@
+﻿#pragma once
+
+#include <QByteArray>
+#include <QString>
+
+class OFString;
+
+// Декодер текстовых значений DICOM по SpecificCharacterSet (0008,0005).
+// Строка кодировки разбирается один раз, экземпляры кэшируются на весь процесс.
+// Однобайтовые ISO_IR (100, 101, 109, 110, 144, 127, 126, 138, 148, 203, 166, 13)
+// декодируются таблицей на 256 символов, ISO 2022 — с переключением G0/G1
+// по escape-последовательностям, ISO_IR 192 — как UTF-8.
+class DicomTextDecoder {
+public:
+    // кэшированный декодер для значения SpecificCharacterSet (может быть многозначным)
+    static const DicomTextDecoder& forCharset(const OFString& specificCharacterSet);
+    static const DicomTextDecoder& forCharset(const QByteArray& specificCharacterSet);
+
+    // personName: для PN состояние ISO 2022 сбрасывается ещё и на '^' и '='
+    QString decode(const char* data, size_t len, bool personName = false) const;
+    QString decode(const OFString& value, bool personName = false) const;
+
+    // false — в строке кодировки были незнакомые термины (декодируем как можем)
+    bool isSupported() const { return m_supported; }
+    const QByteArray& charset() const { return m_charset; }
+
+    struct CodeTable;
+
+private:
+    explicit DicomTextDecoder(const QByteArray& charset);
+
+    enum Mode { SingleByte, Utf8, Iso2022 };
+
+    QByteArray       m_charset;
+    Mode             m_mode = SingleByte;
+    bool             m_supported = true;
+    const CodeTable* m_g0 = nullptr;    // начальное состояние G0 (байты < 0x80)
+    const CodeTable* m_g1 = nullptr;    // начальное состояние G1 (байты >= 0x80)
+};
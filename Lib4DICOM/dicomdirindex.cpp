@@ -0,0 +1,211 @@
+﻿// dicomdirindex.cpp
+#include "dicomdirindex.h"
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QDebug>
+
+// DCMTK
+#include <dcmtk/dcmdata/dctk.h>
+#include <dcmtk/dcmdata/dcddirif.h>
+#include <dcmtk/dcmdata/dcdicdir.h>
+#include <dcmtk/dcmdata/dcdirrec.h>
+
+namespace {
+    const char* const kFileSetID = "LIB4DICOM";
+
+    void visitRecord(DcmDirectoryRecord* rec, DicomDirIndex::Entry e, const DicomDirIndex::Visitor& visit)
+    {
+        switch (rec->getRecordType()) {
+        case ERT_Patient: e.patient = rec; break;
+        case ERT_Study:   e.study = rec; break;
+        case ERT_Series:  e.series = rec; break;
+        default: {
+            OFString fileID;
+            if (e.patient && rec->findAndGetOFStringArray(DCM_ReferencedFileID, fileID).good()
+                && !fileID.empty())
+            {
+                e.relPath = QString::fromLocal8Bit(fileID.c_str()).replace('\\', '/');
+                visit(e);
+            }
+            break;
+        }
+        }
+
+        const unsigned long n = rec->cardSub();
+        for (unsigned long i = 0; i < n; ++i)
+            visitRecord(rec->getSub(i), e, visit);
+    }
+}
+
+void DicomDirIndex::setRoot(const QString& rootDir)
+{
+    QMutexLocker lock(&m_mutex);
+    m_root = QDir(rootDir).absolutePath();
+    m_skipped.clear();
+    m_skippedLoaded = false;
+}
+
+QString DicomDirIndex::path() const
+{
+    return m_root + "/DICOMDIR";
+}
+
+QString DicomDirIndex::skippedPath() const
+{
+    return m_root + "/.dicomdir-skipped";
+}
+
+void DicomDirIndex::loadSkipped() const
+{
+    if (m_skippedLoaded)
+        return;
+    m_skippedLoaded = true;
+    QFile file(skippedPath());
+    if (!file.open(QIODevice::ReadOnly))
+        return;
+    while (!file.atEnd()) {
+        const QString rel = QString::fromUtf8(file.readLine()).trimmed();
+        if (!rel.isEmpty())
+            m_skipped.insert(rel);
+    }
+}
+
+void DicomDirIndex::saveSkipped() const
+{
+    if (m_skipped.isEmpty()) {
+        QFile::remove(skippedPath());
+        return;
+    }
+    QFile file(skippedPath());
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qWarning().noquote() << "[Lib4DICOM] DICOMDIR: cannot write" << file.fileName();
+        return;
+    }
+    QByteArray out;
+    for (const QString& rel : m_skipped)
+        out += rel.toUtf8() + '\n';
+    file.write(out);
+}
+
+QSet<QString> DicomDirIndex::skippedFiles() const
+{
+    QMutexLocker lock(&m_mutex);
+    if (m_root.isEmpty())
+        return {};
+    loadSkipped();
+    QSet<QString> out;
+    out.reserve(m_skipped.size());
+    for (const QString& rel : m_skipped)
+        out.insert(m_root + '/' + rel);
+    return out;
+}
+
+bool DicomDirIndex::exists() const
+{
+    return QFileInfo::exists(path());
+}
+
+QDateTime DicomDirIndex::lastModified() const
+{
+    const QFileInfo fi(path());
+    return fi.exists() ? fi.lastModified() : QDateTime();
+}
+
+bool DicomDirIndex::addFiles(const QStringList& files)
+{
+    if (files.isEmpty())
+        return true;
+    return write(files, true);
+}
+
+bool DicomDirIndex::rebuild(const QStringList& files)
+{
+    return write(files, false);
+}
+
+bool DicomDirIndex::write(const QStringList& files, bool append)
+{
+    QMutexLocker lock(&m_mutex);
+    if (m_root.isEmpty())
+        return false;
+
+    const QByteArray dicomDirPath = QFile::encodeName(path());
+    const QByteArray rootPath = QFile::encodeName(QDir::toNativeSeparators(m_root));
+
+    DicomDirInterface ddir;
+    ddir.disableFilenameCheck(OFTrue);   // длинные и не-ASCII имена папок пациентов
+    ddir.enableInventMode(OFTrue);       // у SC нет Modality и прочих type 1 для записей
+    ddir.disableTransferSyntaxCheck(OFTrue);   // принятые по сети файлы лежат в своём синтаксисе
+    ddir.enableBackupMode(OFFalse);
+
+    OFCondition st = (append && QFileInfo::exists(path()))
+        ? ddir.appendToDicomDir(DicomDirInterface::AP_GeneralPurpose, OFFilename(dicomDirPath.constData()))
+        : ddir.createNewDicomDir(DicomDirInterface::AP_GeneralPurpose, OFFilename(dicomDirPath.constData()),
+            kFileSetID);
+    if (st.bad()) {
+        qWarning().noquote() << "[Lib4DICOM] DICOMDIR: cannot open" << path() << ":" << st.text();
+        return false;
+    }
+
+    loadSkipped();
+    bool skippedChanged = !append && !m_skipped.isEmpty();
+    if (!append)
+        m_skipped.clear();
+
+    const QDir rootDir(m_root);
+    int added = 0;
+    for (const QString& f : files) {
+        const QString rel = rootDir.relativeFilePath(f);
+        if (rel.startsWith("..") || QDir::isAbsolutePath(rel))
+            continue;   // файл вне архива
+        const QByteArray relNative = QFile::encodeName(QDir::toNativeSeparators(rel));
+        st = ddir.addDicomFile(OFFilename(relNative.constData()), OFFilename(rootPath.constData()));
+        if (st.good()) {
+            ++added;
+            if (append && m_skipped.remove(rel))
+                skippedChanged = true;
+        }
+        else {
+            qWarning().noquote() << "[Lib4DICOM] DICOMDIR: skip" << rel << ":" << st.text();
+            if (!m_skipped.contains(rel)) {
+                m_skipped.insert(rel);
+                skippedChanged = true;
+            }
+        }
+    }
+
+    // список пропусков пишется до DICOMDIR: его папки не должны оказаться «старше» индекса без пометки
+    if (skippedChanged)
+        saveSkipped();
+
+    st = ddir.writeDicomDir();
+    if (st.bad()) {
+        qWarning().noquote() << "[Lib4DICOM] DICOMDIR: write failed:" << st.text();
+        return false;
+    }
+
+    qDebug().noquote() << "[Lib4DICOM] DICOMDIR:" << (append ? "appended" : "rebuilt with")
+        << added << "of" << files.size() << "files," << m_skipped.size() << "skipped in total";
+    return true;
+}
+
+bool DicomDirIndex::load(const Visitor& visit) const
+{
+    QMutexLocker lock(&m_mutex);
+    if (m_root.isEmpty() || !QFileInfo::exists(path()))
+        return false;
+
+    DcmDicomDir dir(OFFilename(QFile::encodeName(path()).constData()));
+    if (dir.error().bad()) {
+        qWarning().noquote() << "[Lib4DICOM] DICOMDIR: cannot read" << path() << ":" << dir.error().text();
+        return false;
+    }
+
+    DcmDirectoryRecord& root = dir.getRootRecord();
+    const unsigned long n = root.cardSub();
+    for (unsigned long i = 0; i < n; ++i)
+        visitRecord(root.getSub(i), Entry(), visit);
+    return true;
+}
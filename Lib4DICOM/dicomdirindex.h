@@ -0,0 +1,60 @@
+﻿#pragma once
+
+#include <QDateTime>
+#include <QMutex>
+#include <QSet>
+#include <QString>
+#include <QStringList>
+
+#include <functional>
+
+class DcmItem;
+
+// DICOMDIR в корне архива пациентов (DCMTK DicomDirInterface, профиль General Purpose).
+// Дописывается пачками (сессия импорта — на endSeries или каждые 4096 файлов, приём
+// C-STORE — по таймеру): каждая запись переписывает файл целиком. Служит индексом при запуске:
+// scanPatients() берёт из него папки, не менявшиеся после его записи.
+// Имена папок пациентов длиннее 8 символов и не в ISO 9660, поэтому проверка имён отключена.
+// Проверка синтаксиса передачи тоже отключена: приём C-STORE хранит файлы как пришли (Implicit LE,
+// JPEG, RLE...). Файлы, которые DICOMDIR всё же не принял, перечислены в <root>/.dicomdir-skipped —
+// их папки scanPatients() читает с диска, иначе такие файлы пропали бы из индекса.
+class DicomDirIndex {
+public:
+    // запись IMAGE и её предки; указатели живут только во время вызова
+    struct Entry {
+        QString  relPath;            // путь файла относительно корня, через '/'
+        DcmItem* patient = nullptr;  // запись PATIENT
+        DcmItem* study = nullptr;    // запись STUDY
+        DcmItem* series = nullptr;   // запись SERIES
+    };
+    using Visitor = std::function<void(const Entry&)>;
+
+    void setRoot(const QString& rootDir);
+    QString root() const { return m_root; }
+    QString path() const;   // <root>/DICOMDIR
+
+    bool exists() const;
+    QDateTime lastModified() const;   // невалидна, если файла нет
+
+    // дописать записанные файлы (абсолютные пути внутри корня); нет DICOMDIR — создаётся
+    bool addFiles(const QStringList& files);
+    // пересоздать DICOMDIR по полному списку файлов
+    bool rebuild(const QStringList& files);
+
+    // обойти все записи со ссылкой на файл
+    bool load(const Visitor& visit) const;
+
+    // абсолютные пути файлов, не попавших в DICOMDIR
+    QSet<QString> skippedFiles() const;
+
+private:
+    bool write(const QStringList& files, bool append);
+    QString skippedPath() const;        // <root>/.dicomdir-skipped
+    void loadSkipped() const;           // под m_mutex
+    void saveSkipped() const;           // под m_mutex
+
+    QString        m_root;
+    mutable QMutex m_mutex;
+    mutable QSet<QString> m_skipped;    // пути относительно корня, через '/'
+    mutable bool   m_skippedLoaded = false;
+};
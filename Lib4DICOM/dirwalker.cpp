@@ -0,0 +1,198 @@
+﻿// dirwalker.cpp
+#include "dirwalker.h"
+
+#include <QDir>
+#include <QFile>
+#include <QStringList>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#if defined(Q_OS_WIN)
+#  ifndef NOMINMAX
+#    define NOMINMAX
+#  endif
+#  include <windows.h>
+#else
+#  include <dirent.h>
+#  include <fcntl.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#  include <cstring>
+#endif
+
+namespace {
+
+    bool isHexDigit(ushort c) {
+        return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f');
+    }
+
+#if defined(Q_OS_WIN)
+
+    bool hasDicomExt(const QString& name) {
+        return name.endsWith(QLatin1String(".dcm"), Qt::CaseInsensitive);
+    }
+
+    // buckets — сколько уровней корзин веера ещё может встретиться на этом уровне
+    void walkDir(const QString& dirPath, const QString& topDir, int depth, int maxDepth, int buckets,
+        const DirWalker::Callback& cb, const DirWalker::DirCallback& onDir,
+        const DirWalker::DirFilter& wantFiles, DirWalker::Stats& st)
+    {
+        ++st.dirs;
+        const bool listFiles = !wantFiles || wantFiles(dirPath);
+
+        const std::wstring pattern = (QDir::toNativeSeparators(dirPath) + QLatin1String("\\*")).toStdWString();
+        WIN32_FIND_DATAW fd;
+        HANDLE h = FindFirstFileExW(pattern.c_str(), FindExInfoBasic, &fd,
+            FindExSearchNameMatch, nullptr, FIND_FIRST_EX_LARGE_FETCH);
+        if (h == INVALID_HANDLE_VALUE)
+            return;
+
+        QStringList files, dirs;
+        do {
+            if (fd.cFileName[0] == L'.')
+                continue;   // ".", "..", скрытые и временные
+            const QString name = QString::fromWCharArray(fd.cFileName);
+            if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+                if (onDir)
+                    onDir(dirPath, name);
+                if (depth < maxDepth && !(fd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+                    dirs << name;
+            }
+            else if (listFiles && hasDicomExt(name)) {
+                files << name;
+            }
+        } while (FindNextFileW(h, &fd));
+        FindClose(h);
+
+        files.sort();
+        dirs.sort();
+
+        DirWalker::Entry e;
+        e.dirPath = dirPath;
+        e.topDir = topDir;
+        e.depth = depth;
+        for (const QString& f : files) {
+            e.filePath = dirPath + '/' + f;
+            ++st.files;
+            cb(e);
+        }
+        for (const QString& d : dirs) {
+            const QString child = dirPath + '/' + d;
+            if (buckets > 0 && DirWalker::isBucketName(d))
+                walkDir(child, topDir, depth, maxDepth, buckets - 1, cb, onDir, wantFiles, st);
+            else
+                walkDir(child, depth == 0 ? child : topDir, depth + 1, maxDepth, 0, cb, onDir, wantFiles, st);
+        }
+    }
+
+#else
+
+    bool hasDicomExt(const char* name) {
+        const size_t len = std::strlen(name);
+        return len >= 4 && qstrnicmp(name + len - 4, ".dcm", 4) == 0;
+    }
+
+    // fd — открытый дескриптор папки; владение переходит к DIR
+    void walkDir(int fd, const QString& dirPath, const QString& topDir, int depth, int maxDepth, int buckets,
+        const DirWalker::Callback& cb, const DirWalker::DirCallback& onDir,
+        const DirWalker::DirFilter& wantFiles, DirWalker::Stats& st)
+    {
+        DIR* d = ::fdopendir(fd);
+        if (!d) {
+            ::close(fd);
+            return;
+        }
+        ++st.dirs;
+        const bool listFiles = !wantFiles || wantFiles(dirPath);
+
+        std::vector<std::string> files, dirs;
+        while (dirent* de = ::readdir(d)) {
+            const char* name = de->d_name;
+            if (name[0] == '.')
+                continue;   // ".", "..", скрытые и временные
+
+            unsigned char type = de->d_type;
+            if (type == DT_UNKNOWN || type == DT_LNK) {
+                struct stat sb;
+                ++st.stats;
+                if (::fstatat(::dirfd(d), name, &sb, 0) != 0)
+                    continue;
+                type = S_ISDIR(sb.st_mode) ? DT_DIR : (S_ISREG(sb.st_mode) ? DT_REG : DT_UNKNOWN);
+            }
+
+            if (type == DT_DIR) {
+                if (onDir)
+                    onDir(dirPath, QFile::decodeName(name));
+                if (depth < maxDepth)
+                    dirs.emplace_back(name);
+            }
+            else if (listFiles && type == DT_REG && hasDicomExt(name)) {
+                files.emplace_back(name);
+            }
+        }
+
+        std::sort(files.begin(), files.end());
+        std::sort(dirs.begin(), dirs.end());
+
+        DirWalker::Entry e;
+        e.dirPath = dirPath;
+        e.topDir = topDir;
+        e.depth = depth;
+        for (const std::string& f : files) {
+            e.filePath = dirPath + '/' + QFile::decodeName(f.c_str());
+            ++st.files;
+            cb(e);
+        }
+        for (const std::string& name : dirs) {
+            const int child = ::openat(::dirfd(d), name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (child < 0)
+                continue;
+            const QString childName = QFile::decodeName(name.c_str());
+            const QString childPath = dirPath + '/' + childName;
+            if (buckets > 0 && DirWalker::isBucketName(childName))
+                walkDir(child, childPath, topDir, depth, maxDepth, buckets - 1, cb, onDir, wantFiles, st);
+            else
+                walkDir(child, childPath, depth == 0 ? childPath : topDir, depth + 1, maxDepth, 0, cb, onDir, wantFiles, st);
+        }
+        ::closedir(d);
+    }
+
+#endif
+
+    DirWalker::Stats walkFrom(const QString& root, int maxDepth, int buckets, const DirWalker::Callback& onFile,
+        const DirWalker::DirCallback& onDir, const DirWalker::DirFilter& wantFiles)
+    {
+        DirWalker::Stats st;
+        const QString rootPath = QDir(root).absolutePath();
+
+#if defined(Q_OS_WIN)
+        walkDir(rootPath, rootPath, 0, maxDepth, buckets, onFile, onDir, wantFiles, st);
+#else
+        const int fd = ::open(QFile::encodeName(rootPath).constData(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd >= 0)
+            walkDir(fd, rootPath, rootPath, 0, maxDepth, buckets, onFile, onDir, wantFiles, st);
+#endif
+        return st;
+    }
+
+}
+
+DirWalker::Stats DirWalker::walk(const QString& root, int maxDepth, const Callback& onFile,
+    const DirCallback& onDir, const DirFilter& wantFiles)
+{
+    return walkFrom(root, maxDepth, 0, onFile, onDir, wantFiles);
+}
+
+DirWalker::Stats DirWalker::walkRoot(const QString& root, int maxDepth, const Callback& onFile,
+    const DirCallback& onDir, const DirFilter& wantFiles)
+{
+    // корзины спускаются только туда, куда обход пошёл бы и без них (maxDepth >= 1)
+    return walkFrom(root, maxDepth, maxDepth > 0 ? 2 : 0, onFile, onDir, wantFiles);
+}
+
+bool DirWalker::isBucketName(const QString& name)
+{
+    return name.size() == 2 && isHexDigit(name.at(0).unicode()) && isHexDigit(name.at(1).unicode());
+}
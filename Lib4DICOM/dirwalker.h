@@ -0,0 +1,45 @@
+﻿#pragma once
+
+#include <QString>
+
+#include <functional>
+
+// Быстрый рекурсивный обход архива.
+// POSIX: openat/fdopendir/readdir с d_type (stat только при DT_UNKNOWN/DT_LNK),
+// Windows: FindFirstFileExW(FindExInfoBasic, LARGE_FETCH).
+// Отбор .dcm идёт по имени, без stat; скрытые записи (".xxx") пропускаются.
+// walkRoot понимает раскладку с веером: <корень>/ab/cd/<пациент>/... — папки-корзины
+// (две шестнадцатеричные цифры, не больше двух уровней) прозрачны для depth и topDir.
+class DirWalker {
+public:
+    struct Entry {
+        QString filePath;   // абсолютный путь к файлу
+        QString dirPath;    // папка, в которой лежит файл
+        QString topDir;     // подпапка первого уровня под корнем (папка пациента) или сам корень
+        int     depth = 0;  // 0 — файл лежит прямо в корне (или в корзине веера)
+    };
+
+    struct Stats {
+        qint64 dirs = 0;
+        qint64 files = 0;   // найдено .dcm
+        qint64 stats = 0;   // сколько раз пришлось вызвать stat
+    };
+
+    using Callback = std::function<void(const Entry&)>;
+    // вызывается для каждой найденной подпапки (родитель, имя), в том числе
+    // на последнем уровне, куда обход уже не спускается
+    using DirCallback = std::function<void(const QString& parentDir, const QString& name)>;
+    // нужны ли файлы папки dirPath; false — в папке отдаются только подпапки
+    using DirFilter = std::function<bool(const QString& dirPath)>;
+
+    // maxDepth: 0 — только корень, 1 — корень и папки пациентов, 2 — ещё и исследования...
+    // Файлы отдаются в callback по мере обнаружения (внутри папки — по имени).
+    static Stats walk(const QString& root, int maxDepth, const Callback& onFile,
+        const DirCallback& onDir = DirCallback(), const DirFilter& wantFiles = DirFilter());
+    // то же для корня архива: папки пациентов ищутся и в корне, и в корзинах веера
+    static Stats walkRoot(const QString& root, int maxDepth, const Callback& onFile,
+        const DirCallback& onDir = DirCallback(), const DirFilter& wantFiles = DirFilter());
+
+    // "00".."ff": имя папки-корзины (в именах папок пациентов всегда есть '_')
+    static bool isBucketName(const QString& name);
+};
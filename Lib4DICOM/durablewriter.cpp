@@ -0,0 +1,196 @@
+﻿// durablewriter.cpp
+#include "durablewriter.h"
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QDebug>
+
+#if defined(Q_OS_WIN)
+#  ifndef NOMINMAX
+#    define NOMINMAX
+#  endif
+#  include <windows.h>
+#else
+#  include <fcntl.h>
+#  include <unistd.h>
+#  include <cstdio>
+#endif
+
+// ---------------- Системные примитивы ----------------
+namespace DurableIO {
+
+#if defined(Q_OS_WIN)
+
+    bool syncFile(const QString& path) {
+        const std::wstring native = QDir::toNativeSeparators(path).toStdWString();
+        HANDLE h = CreateFileW(native.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+            nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (h == INVALID_HANDLE_VALUE)
+            return false;
+        const bool ok = FlushFileBuffers(h) != 0;
+        CloseHandle(h);
+        return ok;
+    }
+
+    void startWriteback(const QString&) {}
+
+    bool syncDir(const QString&) {
+        return true;   // NTFS журналирует метаданные; MOVEFILE_WRITE_THROUGH достаточно
+    }
+
+    bool replaceFile(const QString& tempPath, const QString& finalPath) {
+        const std::wstring from = QDir::toNativeSeparators(tempPath).toStdWString();
+        const std::wstring to = QDir::toNativeSeparators(finalPath).toStdWString();
+        return MoveFileExW(from.c_str(), to.c_str(),
+            MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+    }
+
+#else
+
+    bool syncFile(const QString& path) {
+        const int fd = ::open(QFile::encodeName(path).constData(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return false;
+#  if defined(Q_OS_LINUX)
+        const bool ok = ::fdatasync(fd) == 0;   // размер нового файла fdatasync тоже сбрасывает
+#  else
+        const bool ok = ::fsync(fd) == 0;
+#  endif
+        ::close(fd);
+        return ok;
+    }
+
+    void startWriteback(const QString& path) {
+#  if defined(Q_OS_LINUX)
+        const int fd = ::open(QFile::encodeName(path).constData(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return;
+        ::sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+        ::close(fd);
+#  else
+        Q_UNUSED(path);
+#  endif
+    }
+
+    bool syncDir(const QString& dir) {
+        const int fd = ::open(QFile::encodeName(dir).constData(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0)
+            return false;
+        const bool ok = ::fsync(fd) == 0;
+        ::close(fd);
+        return ok;
+    }
+
+    bool replaceFile(const QString& tempPath, const QString& finalPath) {
+        return ::rename(QFile::encodeName(tempPath).constData(),
+            QFile::encodeName(finalPath).constData()) == 0;
+    }
+
+#endif
+
+}
+
+// ---------------- DurableBatch ----------------
+DurableBatch::DurableBatch(const QString& folder, Mode mode)
+    : m_folder(folder), m_mode(mode)
+{
+}
+
+DurableBatch::~DurableBatch()
+{
+    for (const Pending& p : m_pending)
+        QFile::remove(p.temp);
+}
+
+QString DurableBatch::modeName(Mode mode)
+{
+    switch (mode) {
+    case Unsafe:       return QStringLiteral("unsafe");
+    case SyncEachFile: return QStringLiteral("per-file-fsync");
+    case GroupCommit:  return QStringLiteral("group-commit");
+    }
+    return QString();
+}
+
+QString DurableBatch::tempPathFor(const QString& finalPath) const
+{
+    if (m_mode == Unsafe)
+        return finalPath;
+    const QFileInfo fi(finalPath);
+    return fi.absolutePath() + "/." + fi.fileName() + ".tmp";
+}
+
+bool DurableBatch::publish(const Pending& p, bool syncData)
+{
+    if (syncData && !DurableIO::syncFile(p.temp)) {
+        qWarning().noquote() << "[Lib4DICOM] DurableBatch: fsync failed:" << p.temp;
+        QFile::remove(p.temp);
+        return false;
+    }
+    if (!DurableIO::replaceFile(p.temp, p.target)) {
+        qWarning().noquote() << "[Lib4DICOM] DurableBatch: rename failed:" << p.temp << "->" << p.target;
+        QFile::remove(p.temp);
+        return false;
+    }
+    m_committed << p.target;
+    return true;
+}
+
+bool DurableBatch::add(const QString& tempPath, const QString& finalPath)
+{
+    switch (m_mode) {
+    case Unsafe:
+        m_committed << finalPath;
+        return true;
+
+    case SyncEachFile: {
+        if (!publish({ tempPath, finalPath }, true))
+            return false;
+        if (!DurableIO::syncDir(m_folder))
+            qWarning().noquote() << "[Lib4DICOM] DurableBatch: directory fsync failed:" << m_folder;
+        return true;
+    }
+
+    case GroupCommit:
+        // запись страниц стартует сразу, ждать её будем один раз в commit()
+        DurableIO::startWriteback(tempPath);
+        m_pending.append({ tempPath, finalPath });
+        return true;
+    }
+    return false;
+}
+
+bool DurableBatch::commit()
+{
+    if (m_pending.isEmpty())
+        return true;
+
+    bool ok = true;
+
+    // 1) данные всех файлов на диске (writeback уже идёт, fsync лишь дожидается)
+    QVector<Pending> synced;
+    synced.reserve(m_pending.size());
+    for (const Pending& p : m_pending) {
+        if (DurableIO::syncFile(p.temp)) {
+            synced.append(p);
+        }
+        else {
+            qWarning().noquote() << "[Lib4DICOM] DurableBatch: fsync failed:" << p.temp;
+            QFile::remove(p.temp);
+            ok = false;
+        }
+    }
+    m_pending.clear();
+
+    // 2) публикация именами
+    for (const Pending& p : synced)
+        ok = publish(p, false) && ok;
+
+    // 3) один fsync папки на весь пакет
+    if (!DurableIO::syncDir(m_folder)) {
+        qWarning().noquote() << "[Lib4DICOM] DurableBatch: directory fsync failed:" << m_folder;
+        ok = false;
+    }
+    return ok;
+}
@@ -0,0 +1,63 @@
+﻿#pragma once
+
+#include <QString>
+#include <QStringList>
+#include <QVector>
+
+#include "lib4dicom_global.h"
+
+// Атомарная запись файлов серии: каждый снимок пишется во временный
+// ".<имя>.tmp" в папке исследования и переименовывается в итоговое имя.
+// После сбоя в архиве не остаётся обрезанных .dcm (временные скрыты от сканирования).
+class LIB4DICOM_EXPORT DurableBatch {
+public:
+    enum Mode {
+        Unsafe = 0,     // сразу в итоговый файл, без fsync (прежнее поведение)
+        SyncEachFile,   // fsync + rename + fsync папки на каждый файл
+        GroupCommit     // все файлы пакета: fsync данных, rename, один fsync папки
+    };
+
+    DurableBatch(const QString& folder, Mode mode);
+    ~DurableBatch();   // удаляет временные файлы, не дошедшие до commit()
+
+    DurableBatch(const DurableBatch&) = delete;
+    DurableBatch& operator=(const DurableBatch&) = delete;
+
+    Mode mode() const { return m_mode; }
+
+    // куда писать данные для finalPath (в режиме Unsafe — сам finalPath)
+    QString tempPathFor(const QString& finalPath) const;
+
+    // файл записан в tempPath; SyncEachFile публикует его сразу,
+    // GroupCommit — ставит в очередь до commit()
+    bool add(const QString& tempPath, const QString& finalPath);
+
+    // опубликовать очередь; возвращает false, если хоть один файл не удалось
+    bool commit();
+
+    // итоговые пути, уже опубликованные этим пакетом
+    const QStringList& committed() const { return m_committed; }
+
+    static QString modeName(Mode mode);
+
+private:
+    struct Pending { QString temp; QString target; };
+
+    bool publish(const Pending& p, bool syncData);
+
+    QString          m_folder;
+    Mode             m_mode;
+    QVector<Pending> m_pending;
+    QStringList      m_committed;
+};
+
+namespace DurableIO {
+    // принудительно сбросить данные файла на диск
+    bool syncFile(const QString& path);
+    // начать асинхронную запись страниц файла (Linux: sync_file_range), не дожидаясь
+    void startWriteback(const QString& path);
+    // fsync каталога — делает rename устойчивым к сбою питания (на Windows — no-op)
+    bool syncDir(const QString& dir);
+    // атомарная замена finalPath файлом tempPath
+    bool replaceFile(const QString& tempPath, const QString& finalPath);
+}
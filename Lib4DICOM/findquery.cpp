@@ -0,0 +1,308 @@
+﻿// findquery.cpp
+#include "findquery.h"
+#include "patientstore.h"
+#include "dicomcharset.h"
+#include "lib4dicom.h"
+
+#include <QElapsedTimer>
+#include <QVector>
+
+#include <algorithm>
+#include <random>
+
+// DCMTK
+#include <dcmtk/dcmdata/dctk.h>
+
+namespace {
+    // пусто или "*" — универсальное совпадение
+    QString matchKey(const QString& v) {
+        return v == QLatin1String("*") ? QString() : v;
+    }
+
+    bool sameChar(QChar a, QChar b, Qt::CaseSensitivity cs) {
+        return a == b || (cs == Qt::CaseInsensitive && a.toCaseFolded() == b.toCaseFolded());
+    }
+
+    bool hasWildcards(const QString& s) {
+        return s.contains('*') || s.contains('?');
+    }
+}
+
+bool IndexQuery::wildcardMatch(const QString& pattern, const QString& value, Qt::CaseSensitivity cs)
+{
+    if (!hasWildcards(pattern))
+        return QString::compare(pattern, value, cs) == 0;
+
+    // жадный разбор с откатом к последней '*'
+    int p = 0, v = 0, star = -1, mark = 0;
+    while (v < value.size()) {
+        if (p < pattern.size() && (pattern[p] == '?' || sameChar(pattern[p], value[v], cs))) {
+            ++p; ++v;
+        }
+        else if (p < pattern.size() && pattern[p] == '*') {
+            star = p++;
+            mark = v;
+        }
+        else if (star >= 0) {
+            p = star + 1;
+            v = ++mark;
+        }
+        else {
+            return false;
+        }
+    }
+    while (p < pattern.size() && pattern[p] == '*')
+        ++p;
+    return p == pattern.size();
+}
+
+// "20240101", "20240101-", "-20241231", "20240101-20241231"
+IndexQuery::Range IndexQuery::parseRange(const QString& value, int digits)
+{
+    Range r;
+    const QString v = value.section('\\', 0, 0).trimmed();
+    if (v.isEmpty())
+        return r;
+
+    r.set = true;
+    const int dash = v.indexOf('-');
+    if (dash < 0) {
+        r.from = r.to = v.left(digits).toUInt();
+        return r;
+    }
+    const QString lo = v.left(dash).trimmed();
+    const QString hi = v.mid(dash + 1).trimmed();
+    if (!lo.isEmpty())
+        r.from = lo.left(digits).toUInt();
+    if (!hi.isEmpty())
+        r.to = hi.left(digits).toUInt();
+    return r;
+}
+
+bool IndexQuery::parse(DcmDataset* request, bool studyRoot)
+{
+    if (!request)
+        return false;
+
+    OFString v, cs;
+    request->findAndGetOFStringArray(DCM_SpecificCharacterSet, cs);
+    const DicomTextDecoder& dec = DicomTextDecoder::forCharset(cs);
+    auto text = [&](const DcmTagKey& tag, bool pn = false) -> QString {
+        return request->findAndGetOFStringArray(tag, v).good() ? dec.decode(v, pn).trimmed() : QString();
+    };
+
+    const QString level = text(DCM_QueryRetrieveLevel).toUpper();
+    if (level == QLatin1String("PATIENT") && !studyRoot)
+        m_level = PatientLevel;
+    else if (level == QLatin1String("STUDY"))
+        m_level = StudyLevel;
+    else
+        return false;   // SERIES/IMAGE: в индексе нет серий
+
+    m_requested.clear();
+    for (unsigned long i = 0; i < request->card(); ++i) {
+        const DcmTag& tag = request->getElement(i)->getTag();
+        if (tag == DCM_SpecificCharacterSet || tag == DCM_QueryRetrieveLevel)
+            continue;
+        m_requested.append((quint32(tag.getGroup()) << 16) | tag.getElement());
+    }
+
+    // в индексе компоненты имени разделены пробелами; идеографическая часть (после '=') не хранится
+    QString name = text(DCM_PatientName, true).section('=', 0, 0);
+    name.replace('^', ' ');
+    m_name = matchKey(name.trimmed());
+    m_patientID = matchKey(text(DCM_PatientID));
+    m_sex = matchKey(text(DCM_PatientSex));
+
+    const Range birth = parseRange(text(DCM_PatientBirthDate), 8);
+    m_birthYear = Range();
+    if (birth.set) {
+        m_birthYear.set = true;
+        m_birthYear.from = birth.from / 10000;
+        m_birthYear.to = birth.to == 0xFFFFFFFFu ? birth.to : birth.to / 10000;
+    }
+
+    m_studyUIDs.clear();
+    for (const QString& uid : text(DCM_StudyInstanceUID).split('\\', Qt::SkipEmptyParts))
+        m_studyUIDs << uid.trimmed();
+    m_studyDate = parseRange(text(DCM_StudyDate), 8);
+    return true;
+}
+
+bool IndexQuery::matchPatient(const PatientStore& store, int row) const
+{
+    if (!m_name.isEmpty() && !wildcardMatch(m_name, store.fullName(row), Qt::CaseInsensitive))
+        return false;
+    if (!m_patientID.isEmpty() && !wildcardMatch(m_patientID, store.patientID(row), Qt::CaseSensitive))
+        return false;
+    if (!m_sex.isEmpty() && QString::compare(m_sex, store.sex(row), Qt::CaseInsensitive) != 0)
+        return false;
+    if (m_birthYear.set && !m_birthYear.contains(store.birthYear(row).toUInt()))
+        return false;
+    return true;
+}
+
+void IndexQuery::fillResponse(DcmDataset& rsp, const PatientStore& store, int row, int srow) const
+{
+    rsp.putAndInsertString(DCM_SpecificCharacterSet, "ISO_IR 192");
+    rsp.putAndInsertString(DCM_QueryRetrieveLevel, m_level == PatientLevel ? "PATIENT" : "STUDY");
+
+    for (const quint32 key : m_requested) {
+        const DcmTagKey tag(Uint16(key >> 16), Uint16(key & 0xFFFF));
+        QString value;
+        if (tag == DCM_PatientName)
+            value = store.fullName(row).replace(' ', '^');
+        else if (tag == DCM_PatientID)
+            value = store.patientID(row);
+        else if (tag == DCM_PatientSex)
+            value = store.sex(row) == QLatin1String("--") ? QString() : store.sex(row);
+        else if (tag == DCM_NumberOfPatientRelatedStudies)
+            value = QString::number(store.studyCount(row));
+        else if (tag == DCM_NumberOfPatientRelatedInstances)
+            value = QString::number(store.imageCount(row));
+        else if (tag == DCM_RetrieveAETitle)
+            value = m_retrieveAE;
+        else if (srow >= 0 && tag == DCM_StudyInstanceUID)
+            value = store.studyUID(srow);
+        else if (srow >= 0 && tag == DCM_StudyDate)
+            value = store.studyDate(srow) ? QString::number(store.studyDate(srow)) : QString();
+        else if (srow >= 0 && tag == DCM_NumberOfStudyRelatedInstances)
+            value = QString::number(store.studyImages(srow));
+        // StudyTime в индексе хранится без числа разрядов, поэтому вместе с прочими ключами отдаётся пустым
+
+        if (value.isEmpty())
+            rsp.insertEmptyElement(DcmTag(tag));
+        else
+            rsp.putAndInsertString(tag, value.toUtf8().constData());
+    }
+}
+
+int IndexQuery::run(const PatientStore& store, const std::function<bool(DcmDataset&)>& onMatch) const
+{
+    int matches = 0;
+
+    if (m_level == PatientLevel) {
+        for (int row = 0; row < store.size(); ++row) {
+            if (!matchPatient(store, row))
+                continue;
+            DcmDataset rsp;
+            fillResponse(rsp, store, row, -1);
+            ++matches;
+            if (!onMatch(rsp))
+                break;
+        }
+        return matches;
+    }
+
+    // STUDY: условия по пациенту проверяются один раз на пациента
+    QVector<qint8> patientOk(store.size(), -1);
+    for (int srow = 0; srow < store.studyRows(); ++srow) {
+        if (!m_studyDate.contains(store.studyDate(srow)))
+            continue;
+        if (!m_studyUIDs.isEmpty() && !m_studyUIDs.contains(store.studyUID(srow)))
+            continue;
+        const int row = store.studyPatient(srow);
+        qint8& ok = patientOk[row];
+        if (ok < 0)
+            ok = matchPatient(store, row) ? 1 : 0;
+        if (!ok)
+            continue;
+
+        DcmDataset rsp;
+        fillResponse(rsp, store, row, srow);
+        ++matches;
+        if (!onMatch(rsp))
+            break;
+    }
+    return matches;
+}
+
+QVariantMap IndexQuery::benchmark(int patients, int studiesPerPatient, int iterations)
+{
+    patients = qBound(1, patients, 2000000);
+    studiesPerPatient = qBound(1, studiesPerPatient, 20);
+    iterations = qBound(1, iterations, 1000);
+
+    // индекс как после scanPatients(): 50 фамилий x 40 имён, годы 1930..2019, 2015..2024 исследования
+    static const char* const kSurnames[] = {
+        "IVANOV", "PETROV", "SIDOROV", "SMIRNOV", "KUZNETSOV", "POPOV", "VASILIEV", "SOKOLOV", "MIKHAILOV",
+        "NOVIKOV", "FEDOROV", "MOROZOV", "VOLKOV", "ALEKSEEV", "LEBEDEV", "SEMENOV", "EGOROV", "PAVLOV",
+        "KOZLOV", "STEPANOV", "NIKOLAEV", "ORLOV", "ANDREEV", "MAKAROV", "NIKITIN", "ZAKHAROV", "ZAITSEV",
+        "SOLOVIEV", "BORISOV", "YAKOVLEV", "GRIGORIEV", "ROMANOV", "VOROBIEV", "SERGEEV", "KUZMIN", "FROLOV",
+        "ALEKSANDROV", "DMITRIEV", "KOROLEV", "GUSEV", "KISELEV", "ILYIN", "MAKSIMOV", "POLYAKOV", "SOROKIN",
+        "VINOGRADOV", "KOVALEV", "BELOV", "MEDVEDEV", "ANTONOV" };
+    const int surnames = int(sizeof(kSurnames) / sizeof(kSurnames[0]));
+
+    PatientStore store;
+    store.reserve(patients);
+    std::mt19937 rng(42);
+    QElapsedTimer build;
+    build.start();
+    for (int i = 0; i < patients; ++i) {
+        Patient p;
+        p.fullName = QString("%1 GIVEN%2").arg(kSurnames[i % surnames]).arg((i / surnames) % 40);
+        p.patientID = QString("P%1").arg(i, 7, 10, QChar('0'));
+        p.birthYear = QString::number(1930 + int(rng() % 90));
+        p.sex = (i & 1) ? "M" : "F";
+        p.patientFolder = QString("/bench/%1_%2").arg(p.fullName, p.birthYear);
+        const int row = store.addPatient(PatientStore::hashString(p.patientID, 'p'), p);
+        for (int s = 0; s < studiesPerPatient; ++s) {
+            const QString uid = QString("1.2.826.0.1.3680043.10.1.%1.%2").arg(i).arg(s);
+            const quint32 date = quint32((2015 + int(rng() % 10)) * 10000 + (1 + int(rng() % 12)) * 100 + 1 + int(rng() % 28));
+            const int srow = store.addStudy(PatientStore::hashString(uid, 's'), row, uid, date, 120000,
+                p.patientFolder + "/Study_" + QString::number(s));
+            store.countInstance(row, srow);
+        }
+    }
+    const double buildMs = build.nsecsElapsed() / 1e6;
+
+    struct Case {
+        const char* name;
+        const char* level;
+        DcmTagKey   key;
+        QString     value;
+    };
+    const int probe = patients / 2;
+    const Case cases[] = {
+        { "patient_exact_id",     "PATIENT", DCM_PatientID,   QString("P%1").arg(probe, 7, 10, QChar('0')) },
+        { "patient_wildcard_name", "PATIENT", DCM_PatientName, "PETROV^GIVEN1*" },
+        { "study_exact_uid",      "STUDY",   DCM_StudyInstanceUID, QString("1.2.826.0.1.3680043.10.1.%1.0").arg(probe) },
+        { "study_wildcard_name",  "STUDY",   DCM_PatientName, "SMIRNOV*" },
+    };
+
+    QVariantMap out;
+    out["patients"] = store.size();
+    out["studies"] = store.studyRows();
+    out["iterations"] = iterations;
+    out["buildMs"] = buildMs;
+    for (const Case& c : cases) {
+        DcmDataset request;
+        request.putAndInsertString(DCM_QueryRetrieveLevel, c.level);
+        for (const DcmTagKey& tag : { DCM_PatientName, DCM_PatientID, DCM_PatientBirthDate, DCM_PatientSex,
+                                      DCM_StudyInstanceUID, DCM_StudyDate, DCM_NumberOfPatientRelatedStudies })
+            request.insertEmptyElement(DcmTag(tag));
+        request.putAndInsertString(c.key, c.value.toUtf8().constData());
+
+        IndexQuery query;
+        if (!query.parse(&request, false))
+            continue;
+
+        QVector<qint64> ns;
+        ns.reserve(iterations);
+        int matches = 0;
+        for (int i = 0; i < iterations; ++i) {
+            QElapsedTimer t;
+            t.start();
+            matches = query.run(store, [](DcmDataset&) { return true; });
+            ns << t.nsecsElapsed();
+        }
+        std::sort(ns.begin(), ns.end());
+        auto percentileMs = [&ns](double q) { return ns[int(q * (ns.size() - 1) + 0.5)] / 1e6; };
+
+        const QString name = QString::fromLatin1(c.name);
+        out[name + "_matches"] = matches;
+        out[name + "_p50Ms"] = percentileMs(0.50);
+        out[name + "_p99Ms"] = percentileMs(0.99);
+    }
+    return out;
+}
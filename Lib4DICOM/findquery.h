@@ -0,0 +1,59 @@
+﻿#pragma once
+
+#include <QString>
+#include <QStringList>
+#include <QVariantMap>
+#include <QVector>
+
+#include <functional>
+
+class DcmDataset;
+class PatientStore;
+
+// Сопоставление идентификатора C-FIND с индексом архива (PatientStore), без чтения файлов.
+// Уровни PATIENT (только Patient Root) и STUDY. Поддержаны ключи:
+// PatientName (wildcard * ?, без учёта регистра), PatientID (wildcard), PatientSex,
+// PatientBirthDate (по году — полная дата в индексе не хранится), StudyInstanceUID (список),
+// StudyDate (дата или диапазон). Остальные запрошенные атрибуты возвращаются пустыми.
+class IndexQuery {
+public:
+    enum Level { PatientLevel, StudyLevel };
+
+    // разобрать запрос; false — уровень не поддерживается или идентификатор испорчен
+    bool parse(DcmDataset* request, bool studyRoot);
+    Level level() const { return m_level; }
+    void setRetrieveAETitle(const QString& ae) { m_retrieveAE = ae; }
+
+    // Обходит совпадения и собирает ответ для каждого; onMatch вернул false — обход прерывается.
+    // Возвращает число совпадений.
+    int run(const PatientStore& store, const std::function<bool(DcmDataset&)>& onMatch) const;
+
+    static bool wildcardMatch(const QString& pattern, const QString& value, Qt::CaseSensitivity cs);
+
+    // Задержка run() на синтетическом индексе patients x studiesPerPatient: p50/p99 в мс и число
+    // совпадений для PATIENT и STUDY с точным ключом и с wildcard (ответы собираются, как в C-FIND SCP)
+    static QVariantMap benchmark(int patients = 100000, int studiesPerPatient = 3, int iterations = 50);
+
+private:
+    struct Range {
+        bool    set = false;
+        quint32 from = 0;
+        quint32 to = 0xFFFFFFFFu;
+        bool contains(quint32 v) const { return !set || (v != 0 && v >= from && v <= to); }
+    };
+
+    bool matchPatient(const PatientStore& store, int row) const;
+    void fillResponse(DcmDataset& rsp, const PatientStore& store, int row, int srow) const;
+    static Range parseRange(const QString& value, int digits);
+
+    Level       m_level = StudyLevel;
+    QString     m_retrieveAE;
+    QVector<quint32> m_requested;      // (group << 16) | element запрошенных атрибутов
+
+    QString     m_name;                // ^ заменены пробелами, как в индексе
+    QString     m_patientID;
+    QString     m_sex;
+    Range       m_birthYear;
+    QStringList m_studyUIDs;
+    Range       m_studyDate;
+};
@@ -0,0 +1,144 @@
+﻿// folderallocator.cpp
+#include "folderallocator.h"
+#include "dirwalker.h"
+
+#include <QDir>
+#include <QFile>
+#include <QDebug>
+
+#if defined(Q_OS_WIN)
+#  ifndef NOMINMAX
+#    define NOMINMAX
+#  endif
+#  include <windows.h>
+#else
+#  include <sys/stat.h>
+#  include <sys/types.h>
+#  include <cerrno>
+#endif
+
+namespace {
+    enum class MkdirResult { Created, Exists, Failed };
+
+    // Один системный вызов: создаёт папку или сообщает, что имя уже занято
+    MkdirResult makeDirAtomic(const QString& path) {
+#if defined(Q_OS_WIN)
+        const std::wstring native = QDir::toNativeSeparators(path).toStdWString();
+        if (CreateDirectoryW(native.c_str(), nullptr))
+            return MkdirResult::Created;
+        return GetLastError() == ERROR_ALREADY_EXISTS ? MkdirResult::Exists : MkdirResult::Failed;
+#else
+        if (::mkdir(QFile::encodeName(path).constData(), 0777) == 0)
+            return MkdirResult::Created;
+        return errno == EEXIST ? MkdirResult::Exists : MkdirResult::Failed;
+#endif
+    }
+
+    // "Base_12" -> ("Base", 12); иначе 0
+    int splitSuffix(const QString& name, QString& base) {
+        const int us = name.lastIndexOf('_');
+        const int digits = name.size() - us - 1;
+        if (us <= 0 || digits < 1 || digits > 4)
+            return 0;
+        int n = 0;
+        for (int i = us + 1; i < name.size(); ++i) {
+            const ushort c = name.at(i).unicode();
+            if (c < '0' || c > '9')
+                return 0;
+            n = n * 10 + (c - '0');
+        }
+        if (n < 2)
+            return 0;
+        base = name.left(us);
+        return n;
+    }
+}
+
+QString FolderAllocator::slotKey(const QString& parentDir, const QString& base)
+{
+#if defined(Q_OS_WIN)
+    return (parentDir + '\n' + base).toLower();   // NTFS не различает регистр
+#else
+    return parentDir + '\n' + base;
+#endif
+}
+
+void FolderAllocator::markLocked(const QString& parentDir, const QString& name)
+{
+    int& own = m_maxSuffix[slotKey(parentDir, name)];
+    own = qMax(own, 1);
+
+    // "Base_7" занимает ещё и суффикс 7 у "Base"
+    QString base;
+    const int n = splitSuffix(name, base);
+    if (n > 0) {
+        int& max = m_maxSuffix[slotKey(parentDir, base)];
+        max = qMax(max, n);
+    }
+}
+
+void FolderAllocator::seedParentLocked(const QString& parentDir)
+{
+    DirWalker::walk(parentDir, 0, [](const DirWalker::Entry&) {},
+        [this](const QString& parent, const QString& name) { markLocked(QDir::cleanPath(parent), name); });
+    m_seededParents.insert(parentDir);
+}
+
+void FolderAllocator::seed(const QString& parentDir, const QString& name)
+{
+    const QString parent = QDir::cleanPath(parentDir);
+    QMutexLocker lock(&m_mutex);
+    markLocked(parent, name);
+    // обход при сканировании перечисляет папку целиком
+    m_seededParents.insert(parent);
+}
+
+void FolderAllocator::clear()
+{
+    QMutexLocker lock(&m_mutex);
+    m_maxSuffix.clear();
+    m_seededParents.clear();
+}
+
+QString FolderAllocator::allocate(const QString& parentDir, const QString& base, int maxSuffix)
+{
+    const QString parent = QDir::cleanPath(parentDir);
+    if (!QDir(parent).exists() && !QDir().mkpath(parent)) {
+        qWarning().noquote() << "[Lib4DICOM] FolderAllocator: cannot create parent:" << parent;
+        return {};
+    }
+
+    for (;;) {
+        int suffix = 0;
+        {
+            QMutexLocker lock(&m_mutex);
+            if (!m_seededParents.contains(parent))
+                seedParentLocked(parent);   // папка не попала в сканирование — один readdir
+
+            int& max = m_maxSuffix[slotKey(parent, base)];
+            suffix = max + 1;
+            if (suffix > maxSuffix) {
+                qWarning() << "[Lib4DICOM] FolderAllocator: too many duplicates for" << base;
+                return {};
+            }
+            max = suffix;
+        }
+
+        const QString name = suffix == 1 ? base : base + "_" + QString::number(suffix);
+        const QString path = parent + "/" + name;
+
+        switch (makeDirAtomic(path)) {
+        case MkdirResult::Created: {
+            QMutexLocker lock(&m_mutex);
+            markLocked(parent, name);
+            return path;
+        }
+        case MkdirResult::Exists:
+            // имя заняли в обход нашего индекса (другая станция) — пробуем следующий
+            continue;
+        case MkdirResult::Failed:
+            qWarning().noquote() << "[Lib4DICOM] FolderAllocator: mkdir failed:" << path;
+            return {};
+        }
+    }
+}
@@ -0,0 +1,30 @@
+﻿#pragma once
+
+#include <QHash>
+#include <QMutex>
+#include <QSet>
+#include <QString>
+
+// Выделение уникальных имён папок <base>, <base>_2, <base>_3, ...
+// Занятые суффиксы хранятся в памяти по (родитель, base) и засеваются при сканировании,
+// поэтому новое имя выбирается за O(1), а создаётся одним атомарным mkdir.
+// Если папку успела создать другая станция (EEXIST) — берём следующий суффикс.
+class FolderAllocator {
+public:
+    // учесть существующую папку parentDir/name
+    void seed(const QString& parentDir, const QString& name);
+    // забыть всё (перед пересканированием)
+    void clear();
+
+    // создать parentDir/base[_n]; пустая строка — не удалось
+    QString allocate(const QString& parentDir, const QString& base, int maxSuffix = 9999);
+
+private:
+    static QString slotKey(const QString& parentDir, const QString& base);
+    void seedParentLocked(const QString& parentDir);
+    void markLocked(const QString& parentDir, const QString& name);
+
+    QMutex              m_mutex;
+    QHash<QString, int> m_maxSuffix;       // (родитель, base) -> наибольший занятый суффикс (1 — без суффикса)
+    QSet<QString>       m_seededParents;   // папки, содержимое которых уже учтено
+};
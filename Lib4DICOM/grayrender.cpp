@@ -0,0 +1,391 @@
+﻿// grayrender.cpp
+#include "grayrender.h"
+#include "parallelfor.h"
+
+#include <QElapsedTimer>
+#include <QThread>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <random>
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(_M_IX86) || defined(__i386__)
+#  define L4D_X86 1
+#  include <immintrin.h>
+#  if defined(_MSC_VER)
+#    include <intrin.h>
+#  else
+#    include <cpuid.h>
+#  endif
+#endif
+
+#if defined(L4D_X86) && (defined(__GNUC__) || defined(__clang__))
+#  define L4D_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#else
+#  define L4D_TARGET_AVX2   // MSVC разрешает интринсики AVX2 без /arch
+#endif
+
+// DCMTK
+#include <dcmtk/dcmdata/dctk.h>
+
+namespace {
+    const int kBandRows = 64;   // строк в полосе: кусок по ~0.5 МБ на 4k-снимке
+
+    // out = clamp(v * a + b, 0, 255): окно вместе с rescale и инверсией
+    struct Affine {
+        float a = 1.0f;
+        float b = 0.0f;
+    };
+
+    Affine affineFor(const GrayRenderer::Params& p)
+    {
+        // PS3.3 C.11.2.1.2: y = ((x - (c - 0.5)) / (w - 1) + 0.5) * 255, x = v * slope + intercept
+        const double w = std::max(1.0, p.width - 1.0);
+        double a = p.slope * 255.0 / w;
+        double b = ((p.intercept - (p.center - 0.5)) / w + 0.5) * 255.0;
+        if (p.invert) {
+            a = -a;
+            b = 255.0 - b;
+        }
+        return { float(a), float(b) };
+    }
+
+    // ---- скалярное ядро: одна строка ----
+    void windowRowScalar(const quint16* src, uchar* dst, int n, int shift, bool isSigned, Affine f)
+    {
+        for (int x = 0; x < n; ++x) {
+            const int v = isSigned ? int(qint16(quint16(src[x] << shift))) >> shift
+                                   : int(quint16(src[x] << shift) >> shift);
+            const float y = std::min(255.0f, std::max(0.0f, float(v) * f.a + f.b));
+            dst[x] = uchar(std::lrintf(y));
+        }
+    }
+
+#if defined(L4D_X86)
+    // ---- SSE2 (база x86-64): 8 пикселей за шаг ----
+    void windowRowSse2(const quint16* src, uchar* dst, int n, int shift, bool isSigned, Affine f)
+    {
+        const __m128i sh = _mm_cvtsi32_si128(shift);
+        const __m128i zero = _mm_setzero_si128();
+        const __m128 va = _mm_set1_ps(f.a), vb = _mm_set1_ps(f.b);
+        const __m128 lo = _mm_setzero_ps(), hi = _mm_set1_ps(255.0f);
+        int x = 0;
+        for (; x + 8 <= n; x += 8) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x));
+            v = _mm_sll_epi16(v, sh);
+            __m128i v0, v1;
+            if (isSigned) {
+                v = _mm_sra_epi16(v, sh);
+                v0 = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+                v1 = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+            }
+            else {
+                v = _mm_srl_epi16(v, sh);
+                v0 = _mm_unpacklo_epi16(v, zero);
+                v1 = _mm_unpackhi_epi16(v, zero);
+            }
+            __m128 f0 = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(v0), va), vb);
+            __m128 f1 = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(v1), va), vb);
+            f0 = _mm_min_ps(_mm_max_ps(f0, lo), hi);
+            f1 = _mm_min_ps(_mm_max_ps(f1, lo), hi);
+            const __m128i w = _mm_packs_epi32(_mm_cvtps_epi32(f0), _mm_cvtps_epi32(f1));
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + x), _mm_packus_epi16(w, w));
+        }
+        windowRowScalar(src + x, dst + x, n - x, shift, isSigned, f);
+    }
+
+    // ---- AVX2 + FMA: 16 пикселей за шаг ----
+    L4D_TARGET_AVX2
+    void windowRowAvx2(const quint16* src, uchar* dst, int n, int shift, bool isSigned, Affine f)
+    {
+        const __m128i sh = _mm_cvtsi32_si128(shift);
+        const __m256 va = _mm256_set1_ps(f.a), vb = _mm256_set1_ps(f.b);
+        const __m256 lo = _mm256_setzero_ps(), hi = _mm256_set1_ps(255.0f);
+        int x = 0;
+        for (; x + 16 <= n; x += 16) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + x));
+            v = _mm256_sll_epi16(v, sh);
+            v = isSigned ? _mm256_sra_epi16(v, sh) : _mm256_srl_epi16(v, sh);
+            const __m128i h0 = _mm256_castsi256_si128(v);
+            const __m128i h1 = _mm256_extracti128_si256(v, 1);
+            const __m256i v0 = isSigned ? _mm256_cvtepi16_epi32(h0) : _mm256_cvtepu16_epi32(h0);
+            const __m256i v1 = isSigned ? _mm256_cvtepi16_epi32(h1) : _mm256_cvtepu16_epi32(h1);
+            __m256 f0 = _mm256_fmadd_ps(_mm256_cvtepi32_ps(v0), va, vb);
+            __m256 f1 = _mm256_fmadd_ps(_mm256_cvtepi32_ps(v1), va, vb);
+            f0 = _mm256_min_ps(_mm256_max_ps(f0, lo), hi);
+            f1 = _mm256_min_ps(_mm256_max_ps(f1, lo), hi);
+            // packs работает внутри 128-битных половин — возвращаем порядок перестановкой
+            __m256i w = _mm256_packs_epi32(_mm256_cvtps_epi32(f0), _mm256_cvtps_epi32(f1));
+            w = _mm256_permute4x64_epi64(w, 0xD8);
+            const __m128i bytes = _mm_packus_epi16(_mm256_castsi256_si128(w), _mm256_extracti128_si256(w, 1));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x), bytes);
+        }
+        windowRowScalar(src + x, dst + x, n - x, shift, isSigned, f);
+    }
+
+    bool cpuHasAvx2()
+    {
+#if defined(_MSC_VER)
+        int r[4];
+        __cpuid(r, 0);
+        if (r[0] < 7)
+            return false;
+        __cpuid(r, 1);
+        const bool osxsave = (r[2] & (1 << 27)) != 0, fma = (r[2] & (1 << 12)) != 0;
+        if (!osxsave || !fma || (_xgetbv(0) & 0x6) != 0x6)   // ОС сохраняет YMM
+            return false;
+        __cpuidex(r, 7, 0);
+        return (r[1] & (1 << 5)) != 0;
+#else
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+    }
+#endif
+
+    using RowKernel = void (*)(const quint16*, uchar*, int, int, bool, Affine);
+
+    GrayRenderer::Isa detectIsa()
+    {
+#if defined(L4D_X86)
+        return cpuHasAvx2() ? GrayRenderer::AVX2 : GrayRenderer::SSE2;
+#else
+        return GrayRenderer::Scalar;
+#endif
+    }
+
+    std::atomic<int> s_isa{ -1 };
+
+    RowKernel kernelFor(GrayRenderer::Isa isa)
+    {
+#if defined(L4D_X86)
+        if (isa == GrayRenderer::AVX2) return windowRowAvx2;
+        if (isa == GrayRenderer::SSE2) return windowRowSse2;
+#endif
+        Q_UNUSED(isa);
+        return windowRowScalar;
+    }
+
+    // полосы строк по потокам
+    template <class Row>
+    void forBands(int height, int threads, Row&& row)
+    {
+        const int bands = (height + kBandRows - 1) / kBandRows;
+        parallelFor(bands, threads, [&](int band) {
+            const int end = std::min(height, (band + 1) * kBandRows);
+            for (int y = band * kBandRows; y < end; ++y)
+                row(y);
+        });
+    }
+}
+
+// ---------------- Выбор набора команд ----------------
+GrayRenderer::Isa GrayRenderer::isa()
+{
+    int v = s_isa.load();
+    if (v < 0) {
+        v = detectIsa();
+        s_isa = v;
+    }
+    return Isa(v);
+}
+
+void GrayRenderer::forceIsa(Isa isa)
+{
+    s_isa = std::min(int(isa), int(detectIsa()));
+}
+
+QString GrayRenderer::isaName(Isa isa)
+{
+    switch (isa) {
+    case AVX2: return QStringLiteral("avx2");
+    case SSE2: return QStringLiteral("sse2");
+    default:   return QStringLiteral("scalar");
+    }
+}
+
+// ---------------- Ядра ----------------
+void GrayRenderer::renderWindow(const quint16* src, int srcStride, uchar* dst, int dstStride,
+    int width, int height, const Params& p, int threads)
+{
+    const int bits = qBound(1, p.bitsStored, 16);
+    const int shift = 16 - bits;
+    const Affine f = affineFor(p);
+    const RowKernel kernel = kernelFor(isa());
+    forBands(height, threads, [&](int y) {
+        kernel(src + size_t(y) * srcStride, dst + size_t(y) * dstStride, width, shift, p.isSigned, f);
+    });
+}
+
+void GrayRenderer::renderLut(const quint16* src, int srcStride, uchar* dst, int dstStride,
+    int width, int height, const Params& p, const VoiLut& lut, int threads)
+{
+    if (!lut.isValid()) {
+        renderWindow(src, srcStride, dst, dstStride, width, height, p, threads);
+        return;
+    }
+
+    // Rescale + VOI LUT + приведение к 8 битам сводятся в одну таблицу по хранимому значению:
+    // на снимок приходится одно обращение к таблице на пиксель (≤ 64 КБ, живёт в L2).
+    const int bits = qBound(1, p.bitsStored, 16);
+    const int shift = 16 - bits;
+    const int minValue = p.isSigned ? -(1 << (bits - 1)) : 0;
+    const int count = 1 << bits;
+    const int last = int(lut.data.size()) - 1;
+    const double outMax = double((1 << qBound(1, lut.bits, 16)) - 1);
+
+    QVector<uchar> table(count);
+    for (int i = 0; i < count; ++i) {
+        const double m = (minValue + i) * p.slope + p.intercept;
+        const int idx = qBound(0, int(std::floor(m + 0.5)) - lut.firstMapped, last);
+        int y = int(lut.data[idx] * 255.0 / outMax + 0.5);
+        y = qBound(0, y, 255);
+        table[i] = uchar(p.invert ? 255 - y : y);
+    }
+
+    const uchar* t = table.constData();
+    const quint16 mask = quint16(0xFFFFu >> shift);
+    forBands(height, threads, [&](int y) {
+        const quint16* s = src + size_t(y) * srcStride;
+        uchar* d = dst + size_t(y) * dstStride;
+        if (p.isSigned) {
+            for (int x = 0; x < width; ++x)
+                d[x] = t[(int(qint16(quint16(s[x] << shift))) >> shift) - minValue];
+        }
+        else {
+            for (int x = 0; x < width; ++x)
+                d[x] = t[s[x] & mask];
+        }
+    });
+}
+
+// ---------------- Параметры из набора данных ----------------
+GrayRenderer::Params GrayRenderer::paramsFromDataset(DcmItem* ds)
+{
+    Params p;
+    Uint16 bitsAllocated = 16, bitsStored = 0, pixelRepr = 0;
+    ds->findAndGetUint16(DCM_BitsAllocated, bitsAllocated);
+    ds->findAndGetUint16(DCM_BitsStored, bitsStored);
+    ds->findAndGetUint16(DCM_PixelRepresentation, pixelRepr);
+    p.bitsStored = (bitsStored == 0 || bitsStored > bitsAllocated) ? bitsAllocated : bitsStored;
+    p.isSigned = pixelRepr == 1;
+
+    Float64 v = 0.0;
+    if (ds->findAndGetFloat64(DCM_RescaleSlope, v).good() && v != 0.0)
+        p.slope = v;
+    if (ds->findAndGetFloat64(DCM_RescaleIntercept, v).good())
+        p.intercept = v;
+
+    Float64 c = 0.0, w = 0.0;
+    if (ds->findAndGetFloat64(DCM_WindowCenter, c).good()
+        && ds->findAndGetFloat64(DCM_WindowWidth, w).good() && w >= 1.0)
+    {
+        p.center = c;
+        p.width = w;
+    }
+    else {
+        p.center = p.width = 0.0;
+    }
+
+    OFString photometric;
+    ds->findAndGetOFString(DCM_PhotometricInterpretation, photometric);
+    p.invert = photometric == "MONOCHROME1";
+    return p;
+}
+
+GrayRenderer::VoiLut GrayRenderer::voiLutFromDataset(DcmItem* ds)
+{
+    VoiLut lut;
+    DcmItem* item = nullptr;
+    if (ds->findAndGetSequenceItem(DCM_VOILUTSequence, item, 0).bad() || !item)
+        return lut;
+
+    Uint16 entries = 0, first = 0, bits = 0;
+    if (item->findAndGetUint16(DCM_LUTDescriptor, entries, 0).bad()
+        || item->findAndGetUint16(DCM_LUTDescriptor, first, 1).bad()
+        || item->findAndGetUint16(DCM_LUTDescriptor, bits, 2).bad())
+        return lut;
+
+    const Uint16* data = nullptr;
+    unsigned long count = 0;
+    const unsigned long n = entries == 0 ? 65536ul : entries;
+    if (item->findAndGetUint16Array(DCM_LUTData, data, &count).bad() || count < n)
+        return lut;
+
+    Uint16 pixelRepr = 0;
+    ds->findAndGetUint16(DCM_PixelRepresentation, pixelRepr);
+    lut.firstMapped = pixelRepr == 1 ? int(qint16(first)) : int(first);
+    lut.bits = bits;
+    lut.data.resize(int(n));
+    std::copy(data, data + n, lut.data.begin());
+    return lut;
+}
+
+// ---------------- Бенчмарк ----------------
+QVariantMap GrayRenderer::benchmark(int width, int height, int iterations, int threads)
+{
+    width = qBound(16, width, 16384);
+    height = qBound(16, height, 16384);
+    iterations = qBound(1, iterations, 1000);
+    threads = threads > 0 ? threads : QThread::idealThreadCount();
+
+    // шумный 12-битный снимок, как у КТ
+    QVector<quint16> src(width * height);
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<int> dist(0, 4095);
+    for (quint16& v : src)
+        v = quint16(dist(rng));
+    QVector<uchar> dst(width * height);
+
+    Params p;
+    p.bitsStored = 12;
+    p.slope = 1.0;
+    p.intercept = -1024.0;
+    p.center = 40.0;
+    p.width = 400.0;
+
+    VoiLut lut;
+    lut.bits = 12;
+    lut.firstMapped = -1024;
+    lut.data.resize(4096);
+    for (int i = 0; i < lut.data.size(); ++i)   // сигмоида, как у типичного VOI LUT
+        lut.data[i] = quint16(4095.0 / (1.0 + std::exp(-(i - 1064) / 80.0)));
+
+    const double mp = double(width) * height * iterations / 1e6;
+    auto measure = [&](auto&& fn) {
+        fn();   // прогрев
+        QElapsedTimer t;
+        t.start();
+        for (int i = 0; i < iterations; ++i)
+            fn();
+        const double sec = t.nsecsElapsed() / 1e9;
+        return sec > 0 ? mp / sec : 0.0;
+    };
+
+    QVariantMap out;
+    out["width"] = width;
+    out["height"] = height;
+    out["threads"] = threads;
+    out["isa"] = isaName(isa());
+
+    const Isa best = isa();
+    for (int i = Scalar; i <= best; ++i) {
+        forceIsa(Isa(i));
+        const QString name = isaName(Isa(i));
+        out["window_" + name + "_1t"] = measure([&] {
+            renderWindow(src.constData(), width, dst.data(), width, width, height, p, 1);
+        });
+        out["window_" + name + "_mt"] = measure([&] {
+            renderWindow(src.constData(), width, dst.data(), width, width, height, p, threads);
+        });
+    }
+    forceIsa(best);
+    out["lut_1t"] = measure([&] {
+        renderLut(src.constData(), width, dst.data(), width, width, height, p, lut, 1);
+    });
+    out["lut_mt"] = measure([&] {
+        renderLut(src.constData(), width, dst.data(), width, width, height, p, lut, threads);
+    });
+    return out;
+}
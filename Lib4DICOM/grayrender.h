@@ -0,0 +1,54 @@
+﻿#pragma once
+
+#include <QString>
+#include <QVariantMap>
+#include <QVector>
+
+#include "lib4dicom_global.h"
+
+class DcmItem;
+
+// Отображение 16-битных MONOCHROME в 8 бит для предпросмотра и выгрузки.
+// Два пути: линейное окно/уровень с учётом Rescale Slope/Intercept (ядра AVX2/SSE2,
+// скалярный запасной вариант, выбор по CPU при запуске) и VOI LUT, который вместе
+// с rescale заранее сводится в таблицу на все хранимые значения.
+// Изображение режется на полосы строк, полосы обрабатываются параллельно.
+class LIB4DICOM_EXPORT GrayRenderer {
+public:
+    enum Isa { Scalar, SSE2, AVX2 };
+
+    struct Params {
+        int    bitsStored = 16;
+        bool   isSigned = false;      // PixelRepresentation = 1
+        double slope = 1.0;           // Rescale Slope / Intercept
+        double intercept = 0.0;
+        double center = 32768.0;      // окно в единицах после rescale
+        double width = 65536.0;
+        bool   invert = false;        // MONOCHROME1
+    };
+
+    // VOI LUT (PS3.3 C.11.2): вход — значения после rescale
+    struct VoiLut {
+        QVector<quint16> data;
+        int firstMapped = 0;
+        int bits = 8;
+        bool isValid() const { return !data.isEmpty(); }
+    };
+
+    // src/dst: шаг строки в элементах (пикселях); threads <= 1 — в текущем потоке
+    static void renderWindow(const quint16* src, int srcStride, uchar* dst, int dstStride,
+        int width, int height, const Params& p, int threads = 1);
+    static void renderLut(const quint16* src, int srcStride, uchar* dst, int dstStride,
+        int width, int height, const Params& p, const VoiLut& lut, int threads = 1);
+
+    // Rescale, окно и VOI LUT из набора данных (первые значения); окна нет — center/width = 0
+    static Params paramsFromDataset(DcmItem* ds);
+    static VoiLut voiLutFromDataset(DcmItem* ds);
+
+    static Isa isa();                // лучший доступный набор команд
+    static void forceIsa(Isa isa);   // для сравнения в бенчмарке
+    static QString isaName(Isa isa);
+
+    // Мпикс/с по каждому ядру на синтетическом снимке width x height
+    static QVariantMap benchmark(int width = 4096, int height = 4096, int iterations = 20, int threads = 0);
+};
@@ -0,0 +1,109 @@
+﻿// headercache.cpp
+#include "headercache.h"
+#include "dicomcharset.h"
+
+#include <QFile>
+#include <QFileInfo>
+#include <QDateTime>
+
+#include <dcmtk/dcmdata/dctk.h>
+#include <dcmtk/dcmdata/dcdeftag.h>
+
+namespace {
+    // Значения больше этого порога (PixelData) DCMTK оставляет на диске
+    const Uint32 kHeaderOnlyReadLength = 256;
+}
+
+HeaderCache::HeaderCache(int capacity)
+    : m_entries(qMax(1, capacity))
+{
+}
+
+HeaderFields HeaderCache::fields(const QString& path)
+{
+    return fields(QFileInfo(path));
+}
+
+HeaderFields HeaderCache::fields(const QFileInfo& fi)
+{
+    if (!fi.exists())
+        return HeaderFields();
+
+    const QString path = fi.absoluteFilePath();
+    const qint64 mtime = fi.lastModified().toMSecsSinceEpoch();
+    const qint64 size = fi.size();
+    {
+        QMutexLocker lock(&m_mutex);
+        if (const Entry* e = m_entries.object(path)) {   // object() поднимает запись в начало LRU
+            if (e->mtimeMs == mtime && e->size == size) {
+                ++m_hits;
+                return e->fields;
+            }
+        }
+        ++m_misses;
+    }
+
+    // два потока могут одновременно прочитать один файл — результат одинаков, вставит последний
+    auto* e = new Entry;
+    e->fields = read(path);
+    e->mtimeMs = mtime;
+    e->size = size;
+    const HeaderFields out = e->fields;
+
+    QMutexLocker lock(&m_mutex);
+    m_entries.insert(path, e);
+    return out;
+}
+
+HeaderFields HeaderCache::read(const QString& path)
+{
+    HeaderFields f;
+    DcmFileFormat ff;
+    if (!ff.loadFile(QFile::encodeName(path).constData(), EXS_Unknown,
+        EGL_noChange, kHeaderOnlyReadLength).good())
+        return f;
+
+    DcmDataset* ds = ff.getDataset();
+    OFString v, cs;
+    ds->findAndGetOFStringArray(DCM_SpecificCharacterSet, cs);
+    const DicomTextDecoder& dec = DicomTextDecoder::forCharset(cs);
+
+    auto text = [&](const DcmTagKey& tag, bool personName = false) -> QString {
+        return ds->findAndGetOFString(tag, v).good() ? dec.decode(v, personName) : QString();
+    };
+    f.patientName = text(DCM_PatientName, true);
+    f.patientID = text(DCM_PatientID);
+    f.birthDate = text(DCM_PatientBirthDate);
+    f.sex = text(DCM_PatientSex);
+    f.seriesDescription = text(DCM_SeriesDescription);
+    if (ds->findAndGetOFString(DCM_SeriesInstanceUID, v).good())
+        f.seriesInstanceUID = QString::fromLatin1(v.c_str());
+    Sint32 number = 0;
+    ds->findAndGetSint32(DCM_InstanceNumber, number);
+    f.instanceNumber = int(number);
+    f.ok = true;
+    return f;
+}
+
+void HeaderCache::setCapacity(int entries)
+{
+    QMutexLocker lock(&m_mutex);
+    m_entries.setMaxCost(qMax(1, entries));
+}
+
+void HeaderCache::clear()
+{
+    QMutexLocker lock(&m_mutex);
+    m_entries.clear();
+}
+
+HeaderCache::Stats HeaderCache::stats() const
+{
+    QMutexLocker lock(&m_mutex);
+    Stats s;
+    s.hits = m_hits;
+    s.misses = m_misses;
+    s.entries = int(m_entries.size());
+    s.capacity = int(m_entries.maxCost());
+    return s;
+}
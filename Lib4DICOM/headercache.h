@@ -0,0 +1,57 @@
+﻿#pragma once
+
+#include <QCache>
+#include <QMutex>
+#include <QString>
+
+class QFileInfo;
+
+// Поля заголовка DICOM, которые нужны карточке пациента, поиску stub и дереву (строки уже декодированы)
+struct HeaderFields {
+    bool    ok = false;            // файл прочитан и разобран
+    QString patientName;           // как в файле, с "^"
+    QString patientID;
+    QString birthDate;             // "YYYYMMDD" или "YYYY" — как есть
+    QString sex;
+    QString seriesInstanceUID;
+    QString seriesDescription;
+    int     instanceNumber = 0;
+};
+
+// Общий потокобезопасный LRU-кэш разобранных заголовков для всех путей чтения.
+// Ключ — путь; запись годна, пока у файла прежние mtime и размер, поэтому повторное
+// обращение стоит одного stat без открытия файла. Ёмкость — в записях, вытесняются
+// давно не читанные. Файл читается вне блокировки, до PixelData.
+class HeaderCache {
+public:
+    struct Stats {
+        qint64 hits = 0;
+        qint64 misses = 0;     // файла не было в кэше или он изменился
+        int    entries = 0;
+        int    capacity = 0;
+    };
+
+    explicit HeaderCache(int capacity = 4096);
+
+    HeaderFields fields(const QString& path);
+    // fi из листинга папки: mtime и размер берутся из него
+    HeaderFields fields(const QFileInfo& fi);
+
+    void  setCapacity(int entries);
+    void  clear();
+    Stats stats() const;
+
+private:
+    struct Entry {
+        HeaderFields fields;
+        qint64       mtimeMs = 0;
+        qint64       size = 0;
+    };
+
+    static HeaderFields read(const QString& path);
+
+    mutable QMutex         m_mutex;
+    QCache<QString, Entry> m_entries;
+    qint64                 m_hits = 0;
+    qint64                 m_misses = 0;
+};
@@ -0,0 +1,300 @@
+﻿// imageexport.cpp
+#include "imageexport.h"
+#include "boundedqueue.h"
+#include "dirwalker.h"
+#include "grayrender.h"
+
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QImageWriter>
+#include <QMutex>
+#include <QThread>
+#include <QThreadPool>
+#include <QVector>
+#include <QDebug>
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <memory>
+
+// DCMTK
+#include <dcmtk/dcmdata/dctk.h>
+#include <dcmtk/dcmdata/dcxfer.h>
+
+namespace {
+    struct Job {
+        QString source;   // исходный файл
+        QString target;   // куда писать картинку
+        std::unique_ptr<DcmFileFormat> ff;
+    };
+
+    // Линейное окно DICOM (PS3.3 C.11.2.1.2) в таблицу на весь диапазон значений
+    QVector<uchar> windowLut(int minValue, int maxValue, double center, double width, bool invert)
+    {
+        QVector<uchar> lut(maxValue - minValue + 1);
+        const double lo = center - 0.5 - (width - 1.0) / 2.0;
+        const double hi = center - 0.5 + (width - 1.0) / 2.0;
+        for (int v = minValue; v <= maxValue; ++v) {
+            double y;
+            if (v <= lo)      y = 0.0;
+            else if (v > hi)  y = 255.0;
+            else              y = ((v - (center - 0.5)) / (width - 1.0) + 0.5) * 255.0;
+            const int out = qBound(0, int(y + 0.5), 255);
+            lut[v - minValue] = uchar(invert ? 255 - out : out);
+        }
+        return lut;
+    }
+}
+
+QImage ImageExporter::toImage(DcmDataset* ds, double windowCenter, double windowWidth, QString* error)
+{
+    auto fail = [error](const QString& why) {
+        if (error)
+            *error = why;
+        return QImage();
+    };
+
+    if (DcmXfer(ds->getOriginalXfer()).isEncapsulated())
+        return fail("compressed PixelData is not supported");
+
+    Uint16 rows = 0, cols = 0, spp = 1, bitsAllocated = 8, bitsStored = 0, pixelRepr = 0, planar = 0;
+    ds->findAndGetUint16(DCM_Rows, rows);
+    ds->findAndGetUint16(DCM_Columns, cols);
+    ds->findAndGetUint16(DCM_SamplesPerPixel, spp);
+    ds->findAndGetUint16(DCM_BitsAllocated, bitsAllocated);
+    ds->findAndGetUint16(DCM_BitsStored, bitsStored);
+    ds->findAndGetUint16(DCM_PixelRepresentation, pixelRepr);
+    ds->findAndGetUint16(DCM_PlanarConfiguration, planar);
+    OFString photometric;
+    ds->findAndGetOFString(DCM_PhotometricInterpretation, photometric);
+    if (rows == 0 || cols == 0)
+        return fail("no image geometry");
+    if (bitsStored == 0 || bitsStored > bitsAllocated)
+        bitsStored = bitsAllocated;
+
+    const size_t pixels = size_t(rows) * cols;
+
+    // ---- RGB 8 бит ----
+    if (spp == 3 && bitsAllocated == 8 && photometric == "RGB") {
+        const Uint8* src = nullptr;
+        unsigned long count = 0;
+        if (ds->findAndGetUint8Array(DCM_PixelData, src, &count).bad() || count < pixels * 3)
+            return fail("short PixelData");
+
+        QImage img(cols, rows, QImage::Format_RGB888);
+        for (int y = 0; y < rows; ++y) {
+            uchar* dst = img.scanLine(y);
+            if (planar == 0) {
+                std::memcpy(dst, src + size_t(y) * cols * 3, size_t(cols) * 3);
+                continue;
+            }
+            const Uint8* r = src + size_t(y) * cols;
+            const Uint8* g = r + pixels;
+            const Uint8* b = g + pixels;
+            for (int x = 0; x < cols; ++x) {
+                dst[3 * x] = r[x];
+                dst[3 * x + 1] = g[x];
+                dst[3 * x + 2] = b[x];
+            }
+        }
+        return img;
+    }
+
+    if (spp != 1 || (photometric != "MONOCHROME2" && photometric != "MONOCHROME1"))
+        return fail(QString("unsupported layout %1, %2 samples").arg(photometric.c_str()).arg(spp));
+    const bool invert = photometric == "MONOCHROME1";
+
+    QImage img(cols, rows, QImage::Format_Grayscale8);
+
+    // ---- MONOCHROME 8 бит: без окна — как есть ----
+    if (bitsAllocated == 8) {
+        const Uint8* src = nullptr;
+        unsigned long count = 0;
+        if (ds->findAndGetUint8Array(DCM_PixelData, src, &count).bad() || count < pixels)
+            return fail("short PixelData");
+        QVector<uchar> lut;
+        if (windowWidth > 0.0 || invert)
+            lut = windowLut(0, 255, windowWidth > 0.0 ? windowCenter : 127.5,
+                windowWidth > 0.0 ? windowWidth : 256.0, invert);
+        for (int y = 0; y < rows; ++y) {
+            const Uint8* s = src + size_t(y) * cols;
+            uchar* dst = img.scanLine(y);
+            if (lut.isEmpty()) {
+                std::memcpy(dst, s, cols);
+                continue;
+            }
+            for (int x = 0; x < cols; ++x)
+                dst[x] = lut[s[x]];
+        }
+        return img;
+    }
+
+    if (bitsAllocated != 16)
+        return fail(QString("unsupported BitsAllocated %1").arg(bitsAllocated));
+
+    // ---- MONOCHROME 16 бит: rescale, затем окно или VOI LUT (GrayRenderer) ----
+    const Uint16* src = nullptr;
+    unsigned long count = 0;
+    if (ds->findAndGetUint16Array(DCM_PixelData, src, &count).bad() || count < pixels)
+        return fail("short PixelData");
+
+    GrayRenderer::Params params = GrayRenderer::paramsFromDataset(ds);
+    params.invert = invert;
+    GrayRenderer::VoiLut lut;
+    if (windowWidth > 0.0) {
+        params.center = windowCenter;
+        params.width = windowWidth;
+    }
+    else if (params.width <= 0.0) {
+        lut = GrayRenderer::voiLutFromDataset(ds);
+        if (!lut.isValid()) {
+            // ни окна, ни VOI LUT — растягиваем фактический диапазон снимка
+            const int shift = 16 - params.bitsStored;
+            int lo = INT_MAX, hi = INT_MIN;
+            for (size_t i = 0; i < pixels; ++i) {
+                const int v = params.isSigned ? int(qint16(Uint16(src[i] << shift))) >> shift
+                                              : int(Uint16(src[i] << shift) >> shift);
+                lo = std::min(lo, v);
+                hi = std::max(hi, v);
+            }
+            const double mlo = std::min(lo * params.slope, hi * params.slope) + params.intercept;
+            const double mhi = std::max(lo * params.slope, hi * params.slope) + params.intercept;
+            params.width = std::max(1.0, mhi - mlo + 1.0);
+            params.center = mlo + params.width / 2.0;
+        }
+    }
+
+    if (lut.isValid())
+        GrayRenderer::renderLut(src, cols, img.bits(), int(img.bytesPerLine()), cols, rows, params, lut);
+    else
+        GrayRenderer::renderWindow(src, cols, img.bits(), int(img.bytesPerLine()), cols, rows, params);
+    return img;
+}
+
+QVariantMap ImageExporter::run(const QStringList& sources, const Options& opt)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    const QString format = opt.format.toLower() == QLatin1String("jpeg") ? QStringLiteral("jpg") : opt.format.toLower();
+    const int threads = opt.threads > 0 ? opt.threads : QThread::idealThreadCount();
+    const int readers = qBound(1, opt.readThreads, 8);
+    const int inFlight = opt.inFlight > 0 ? opt.inFlight : 2 * threads;
+
+    // ---- список файлов и куда их писать ----
+    QStringList files, targets;
+    const QDir outDir(opt.outDir);
+    for (const QString& src : sources) {
+        const QFileInfo fi(QDir::cleanPath(src));
+        const QDir base = fi.absoluteDir();   // под outDir начинаем с имени источника
+        auto add = [&](const QString& path) {
+            const QString rel = base.relativeFilePath(path);
+            files << path;
+            targets << outDir.absoluteFilePath(QFileInfo(rel).path() + '/' + QFileInfo(rel).completeBaseName()
+                + '.' + format);
+        };
+        if (fi.isFile())
+            add(fi.absoluteFilePath());
+        else
+            DirWalker::walk(fi.absoluteFilePath(), 2, [&](const DirWalker::Entry& e) { add(e.filePath); });
+    }
+
+    std::atomic<int>    next{ 0 };
+    std::atomic<int>    activeReaders{ readers };
+    std::atomic<int>    written{ 0 };
+    std::atomic<int>    skipped{ 0 };
+    std::atomic<qint64> bytesIn{ 0 };
+    std::atomic<qint64> bytesOut{ 0 };
+    QMutex              failMutex;
+    QStringList         failedFiles;
+    auto fail = [&](const QString& path, const QString& why) {
+        qWarning().noquote() << "[Lib4DICOM] ImageExporter:" << why << path;
+        QMutexLocker lock(&failMutex);
+        failedFiles << path;
+    };
+
+    BoundedQueue<Job> queue(inFlight);
+
+    auto readLoop = [&]() {
+        for (int i = next.fetch_add(1); i < files.size(); i = next.fetch_add(1)) {
+            Job job;
+            job.source = files[i];
+            job.target = targets[i];
+            job.ff.reset(new DcmFileFormat);
+            if (job.ff->loadFile(QFile::encodeName(job.source).constData()).bad()) {
+                fail(job.source, "cannot read");
+                continue;
+            }
+            DcmDataset* ds = job.ff->getDataset();
+            OFString v;
+            if (ds->findAndGetOFString(DCM_SeriesDescription, v).good() && v == "PATIENT_STUB") {
+                ++skipped;   // служебный файл пациента
+                continue;
+            }
+            if (!opt.seriesUID.isEmpty()
+                && (ds->findAndGetOFString(DCM_SeriesInstanceUID, v).bad() || opt.seriesUID != v.c_str()))
+            {
+                ++skipped;
+                continue;
+            }
+            bytesIn += QFileInfo(job.source).size();
+            if (!queue.push(std::move(job)))
+                break;
+        }
+        if (--activeReaders == 0)
+            queue.close();
+    };
+
+    auto encodeLoop = [&]() {
+        Job job;
+        while (queue.pop(job)) {
+            QString why;
+            const QImage img = toImage(job.ff->getDataset(), opt.windowCenter, opt.windowWidth, &why);
+            job.ff.reset();   // набор данных больше не нужен — память отдаём сразу
+            if (img.isNull()) {
+                fail(job.source, why + ':');
+                continue;
+            }
+
+            QDir().mkpath(QFileInfo(job.target).absolutePath());
+            QImageWriter writer(job.target, format.toLatin1());
+            if (format == QLatin1String("jpg"))
+                writer.setQuality(qBound(1, opt.quality, 100));
+            if (!writer.write(img)) {
+                fail(job.source, "cannot write " + job.target + " (" + writer.errorString() + "):");
+                continue;
+            }
+            bytesOut += QFileInfo(job.target).size();
+            ++written;
+        }
+    };
+
+    QThreadPool pool;
+    pool.setMaxThreadCount(readers + threads);
+    for (int r = 0; r < readers; ++r)
+        pool.start(readLoop);
+    for (int t = 0; t < threads; ++t)
+        pool.start(encodeLoop);
+    pool.waitForDone();
+
+    const double sec = timer.nsecsElapsed() / 1e9;
+    QVariantMap out;
+    out["total"] = int(files.size());
+    out["written"] = written.load();
+    out["skipped"] = skipped.load();
+    out["failed"] = int(failedFiles.size());
+    out["bytesIn"] = bytesIn.load();
+    out["bytesOut"] = bytesOut.load();
+    out["seconds"] = sec;
+    out["imagesPerSec"] = sec > 0 ? written.load() / sec : 0.0;
+    out["failedFiles"] = failedFiles;
+
+    qDebug().noquote() << "[Lib4DICOM] ImageExporter:" << written.load() << "of" << files.size()
+        << "images written as" << format << "in" << sec << "s with" << threads << "threads";
+    return out;
+}
@@ -0,0 +1,39 @@
+﻿#pragma once
+
+#include <QImage>
+#include <QString>
+#include <QStringList>
+#include <QVariantMap>
+
+#include "lib4dicom_global.h"
+
+class DcmDataset;
+
+// Выгрузка снимков архива в PNG/JPEG для отчётов и учебных наборов.
+// Понимает несжатые PixelData в той раскладке, что пишет saveImagesAsDicom:
+// MONOCHROME1/2 8 и 16 бит (16 бит — rescale и окно или VOI LUT), RGB 8 бит (interleaved и planar).
+// Чтение файлов и кодирование идут разными потоками через ограниченную очередь:
+// в памяти одновременно не больше inFlight прочитанных наборов данных.
+class LIB4DICOM_EXPORT ImageExporter {
+public:
+    struct Options {
+        QString outDir;
+        QString format = "png";       // png | jpg
+        int     quality = 90;         // для JPEG
+        QString seriesUID;            // пусто — все серии
+        int     threads = 0;          // потоков кодирования; 0 — все ядра
+        int     readThreads = 2;      // потоков чтения файлов
+        int     inFlight = 0;         // 0 — 2 × threads
+        double  windowCenter = 0.0;   // windowWidth <= 0 — окно или VOI LUT из файла, иначе min/max
+        double  windowWidth = 0.0;
+    };
+
+    // Источник — папка пациента, исследования или отдельный файл; структура папок
+    // под outDir повторяет исходную начиная с имени источника.
+    // total, written, skipped, failed, bytesIn, bytesOut, seconds, imagesPerSec, failedFiles
+    static QVariantMap run(const QStringList& sources, const Options& opt);
+
+    // первый кадр набора данных -> Grayscale8 / RGB888; пустой QImage — не поддерживается
+    static QImage toImage(DcmDataset* ds, double windowCenter = 0.0, double windowWidth = 0.0,
+        QString* error = nullptr);
+};
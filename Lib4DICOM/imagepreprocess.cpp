@@ -0,0 +1,442 @@
+﻿// imagepreprocess.cpp
+#include "imagepreprocess.h"
+#include "grayrender.h"
+#include "parallelfor.h"
+
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QThread>
+#include <QVector>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(_M_IX86) || defined(__i386__)
+#  define L4D_X86 1
+#  include <immintrin.h>
+#endif
+
+#if defined(L4D_X86) && (defined(__GNUC__) || defined(__clang__))
+#  define L4D_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#  define L4D_TARGET_AVX2   // MSVC разрешает интринсики AVX2 без /arch
+#endif
+
+namespace {
+    const int kBandRows = 32;
+    const int kPrecision = 14;   // вес 1.0 = 1 << 14: произведение на 255 и сумма пары влезают в int32
+
+    // Веса одной оси: выход i = сумма weights[i * maxTaps + k] * in[first[i] + k], k < count[i]
+    struct Taps {
+        int outSize = 0;
+        int maxTaps = 0;
+        QVector<int>    first;
+        QVector<int>    count;
+        QVector<qint16> weights;
+    };
+
+    Taps makeTaps(int inSize, int outSize)
+    {
+        Taps t;
+        t.outSize = outSize;
+        const double scale = double(inSize) / outSize;
+        const bool box = scale >= 2.0;
+        const double stretch = std::max(1.0, scale);
+        const double support = (box ? 0.5 : 1.0) * stretch;
+        t.maxTaps = int(std::ceil(support)) * 2 + 1;
+        t.first.resize(outSize);
+        t.count.resize(outSize);
+        t.weights.fill(0, outSize * t.maxTaps);
+
+        std::vector<double> w(t.maxTaps);
+        for (int i = 0; i < outSize; ++i) {
+            const double center = (i + 0.5) * scale;
+            const int lo = std::max(0, int(std::floor(center - support)));
+            const int hi = std::min(inSize, int(std::ceil(center + support)));
+            int first = -1, n = 0;
+            double sum = 0.0;
+            for (int k = lo; k < hi; ++k) {
+                const double x = (k + 0.5 - center) / stretch;
+                const double v = box ? ((x >= -0.5 && x < 0.5) ? 1.0 : 0.0)
+                                     : std::max(0.0, 1.0 - std::abs(x));
+                if (v <= 0.0) {
+                    if (first >= 0) break;
+                    continue;
+                }
+                if (first < 0) first = k;
+                if (n == t.maxTaps) break;
+                w[n++] = v;
+                sum += v;
+            }
+            if (first < 0) {   // вырожденный случай: ближайший пиксель
+                first = std::min(inSize - 1, int(center));
+                w[0] = sum = 1.0;
+                n = 1;
+            }
+
+            // сумма весов ровно 1 << kPrecision: ровное поле остаётся ровным
+            qint16* dst = t.weights.data() + size_t(i) * t.maxTaps;
+            int total = 0, largest = 0;
+            for (int k = 0; k < n; ++k) {
+                dst[k] = qint16(std::lround(w[k] / sum * (1 << kPrecision)));
+                total += dst[k];
+                if (dst[k] > dst[largest]) largest = k;
+            }
+            dst[largest] = qint16(dst[largest] + ((1 << kPrecision) - total));
+            t.first[i] = first;
+            t.count[i] = n;
+        }
+        return t;
+    }
+
+    // ---- вертикальный проход: строка выхода = взвешенная сумма n строк src (шаг stride) ----
+    // Канал не важен: строка обрабатывается как bytes байт
+    void verticalTail(const uchar* src, qsizetype stride, int n, const qint16* w, uchar* dst, int from, int bytes)
+    {
+        for (int x = from; x < bytes; ++x) {
+            int acc = 1 << (kPrecision - 1);
+            for (int k = 0; k < n; ++k)
+                acc += w[k] * src[k * stride + x];
+            dst[x] = uchar(std::min(255, acc >> kPrecision));
+        }
+    }
+
+    void verticalScalar(const uchar* src, qsizetype stride, int n, const qint16* w, uchar* dst, int bytes)
+    {
+        // строки src читаются подряд, суммы копятся в буфере потока
+        thread_local std::vector<int> acc;
+        acc.assign(bytes, 1 << (kPrecision - 1));
+        for (int k = 0; k < n; ++k) {
+            const uchar* s = src + k * stride;
+            const int wk = w[k];
+            for (int x = 0; x < bytes; ++x)
+                acc[x] += wk * s[x];
+        }
+        for (int x = 0; x < bytes; ++x)
+            dst[x] = uchar(std::min(255, acc[x] >> kPrecision));
+    }
+
+#if defined(L4D_X86)
+    // ---- SSE2: 8 байт за шаг, две строки на одно _mm_madd_epi16 ----
+    void verticalSse2(const uchar* src, qsizetype stride, int n, const qint16* w, uchar* dst, int bytes)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i round = _mm_set1_epi32(1 << (kPrecision - 1));
+        int x = 0;
+        for (; x + 8 <= bytes; x += 8) {
+            __m128i acc0 = round, acc1 = round;
+            int k = 0;
+            for (; k + 2 <= n; k += 2) {
+                const __m128i a = _mm_unpacklo_epi8(
+                    _mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + k * stride + x)), zero);
+                const __m128i b = _mm_unpacklo_epi8(
+                    _mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + (k + 1) * stride + x)), zero);
+                const __m128i wk = _mm_set1_epi32(int(quint16(w[k])) | (int(w[k + 1]) << 16));
+                acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), wk));
+                acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), wk));
+            }
+            if (k < n) {
+                const __m128i a = _mm_unpacklo_epi8(
+                    _mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + k * stride + x)), zero);
+                const __m128i wk = _mm_set1_epi32(int(quint16(w[k])));
+                acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_unpacklo_epi16(a, zero), wk));
+                acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_unpackhi_epi16(a, zero), wk));
+            }
+            const __m128i v = _mm_packs_epi32(_mm_srai_epi32(acc0, kPrecision), _mm_srai_epi32(acc1, kPrecision));
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + x), _mm_packus_epi16(v, v));
+        }
+        verticalTail(src, stride, n, w, dst, x, bytes);
+    }
+
+    // ---- AVX2: 16 байт за шаг; unpack/pack работают внутри 128-битных половин и порядок сохраняют ----
+    L4D_TARGET_AVX2
+    void verticalAvx2(const uchar* src, qsizetype stride, int n, const qint16* w, uchar* dst, int bytes)
+    {
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i round = _mm256_set1_epi32(1 << (kPrecision - 1));
+        int x = 0;
+        for (; x + 16 <= bytes; x += 16) {
+            __m256i acc0 = round, acc1 = round;
+            int k = 0;
+            for (; k + 2 <= n; k += 2) {
+                const __m256i a = _mm256_cvtepu8_epi16(
+                    _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + k * stride + x)));
+                const __m256i b = _mm256_cvtepu8_epi16(
+                    _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + (k + 1) * stride + x)));
+                const __m256i wk = _mm256_set1_epi32(int(quint16(w[k])) | (int(w[k + 1]) << 16));
+                acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), wk));
+                acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), wk));
+            }
+            if (k < n) {
+                const __m256i a = _mm256_cvtepu8_epi16(
+                    _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + k * stride + x)));
+                const __m256i wk = _mm256_set1_epi32(int(quint16(w[k])));
+                acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, zero), wk));
+                acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, zero), wk));
+            }
+            const __m256i v = _mm256_packs_epi32(_mm256_srai_epi32(acc0, kPrecision), _mm256_srai_epi32(acc1, kPrecision));
+            const __m128i bytes16 = _mm_packus_epi16(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x), bytes16);
+        }
+        verticalTail(src, stride, n, w, dst, x, bytes);
+    }
+#endif
+
+    // ---- горизонтальный проход по уже сокращённой строке ----
+    void horizontalRow(const uchar* src, uchar* dst, int channels, const Taps& t)
+    {
+        for (int i = 0; i < t.outSize; ++i) {
+            const qint16* w = t.weights.constData() + size_t(i) * t.maxTaps;
+            const uchar* s = src + size_t(t.first[i]) * channels;
+            const int n = t.count[i];
+            for (int c = 0; c < channels; ++c) {
+                int acc = 1 << (kPrecision - 1);
+                for (int k = 0; k < n; ++k)
+                    acc += w[k] * s[k * channels + c];
+                dst[i * channels + c] = uchar(std::min(255, acc >> kPrecision));
+            }
+        }
+    }
+
+    // ---- RGB32 (QRgb) -> яркость: (77 R + 150 G + 29 B + 128) >> 8 ----
+    void grayRowScalar(const uchar* src, uchar* dst, int n)
+    {
+        const QRgb* p = reinterpret_cast<const QRgb*>(src);
+        for (int x = 0; x < n; ++x)
+            dst[x] = uchar((qRed(p[x]) * 77 + qGreen(p[x]) * 150 + qBlue(p[x]) * 29 + 128) >> 8);
+    }
+
+#if defined(L4D_X86)
+    // 4 пикселя за шаг: в памяти x86 QRgb лежит как B, G, R, A
+    void grayRowSse2(const uchar* src, uchar* dst, int n)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i coef = _mm_set_epi16(0, 77, 150, 29, 0, 77, 150, 29);
+        const __m128i round = _mm_set1_epi32(128);
+        int x = 0;
+        for (; x + 4 <= n; x += 4) {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x * 4));
+            const __m128i m0 = _mm_madd_epi16(_mm_unpacklo_epi8(v, zero), coef);   // B*29+G*150, R*77 на пиксель
+            const __m128i m1 = _mm_madd_epi16(_mm_unpackhi_epi8(v, zero), coef);
+            const __m128i s0 = _mm_add_epi32(m0, _mm_shuffle_epi32(m0, _MM_SHUFFLE(2, 3, 0, 1)));
+            const __m128i s1 = _mm_add_epi32(m1, _mm_shuffle_epi32(m1, _MM_SHUFFLE(2, 3, 0, 1)));
+            __m128i y = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(s0), _mm_castsi128_ps(s1),
+                _MM_SHUFFLE(2, 0, 2, 0)));
+            y = _mm_srli_epi32(_mm_add_epi32(y, round), 8);
+            y = _mm_packs_epi32(y, y);
+            const int packed = _mm_cvtsi128_si32(_mm_packus_epi16(y, y));
+            std::memcpy(dst + x, &packed, 4);
+        }
+        grayRowScalar(src + x * 4, dst + x, n - x);
+    }
+#endif
+
+    using VerticalKernel = void (*)(const uchar*, qsizetype, int, const qint16*, uchar*, int);
+    using GrayKernel = void (*)(const uchar*, uchar*, int);
+
+    VerticalKernel verticalFor(GrayRenderer::Isa isa)
+    {
+#if defined(L4D_X86)
+        if (isa == GrayRenderer::AVX2) return verticalAvx2;
+        if (isa == GrayRenderer::SSE2) return verticalSse2;
+#endif
+        Q_UNUSED(isa);
+        return verticalScalar;
+    }
+
+    GrayKernel grayFor(GrayRenderer::Isa isa)
+    {
+#if defined(L4D_X86)
+        if (isa != GrayRenderer::Scalar) return grayRowSse2;   // упирается в память, AVX2 не даёт прироста
+#endif
+        Q_UNUSED(isa);
+        return grayRowScalar;
+    }
+
+    template <class Row>
+    void forBands(int height, int threads, Row&& row)
+    {
+        const int bands = (height + kBandRows - 1) / kBandRows;
+        parallelFor(bands, threads, [&](int band) {
+            const int end = std::min(height, (band + 1) * kBandRows);
+            for (int y = band * kBandRows; y < end; ++y)
+                row(y);
+        });
+    }
+
+    QImage toGray8(QImage img, int threads)
+    {
+        if (img.format() != QImage::Format_RGB32 && img.format() != QImage::Format_ARGB32)
+            img = img.convertToFormat(QImage::Format_RGB32);
+        QImage out(img.size(), QImage::Format_Grayscale8);
+        if (out.isNull())
+            return out;
+        const GrayKernel kernel = grayFor(GrayRenderer::isa());
+        uchar* dst = out.bits();
+        const uchar* src = img.constBits();
+        forBands(img.height(), threads, [&](int y) {
+            kernel(src + size_t(y) * img.bytesPerLine(), dst + size_t(y) * out.bytesPerLine(), img.width());
+        });
+        return out;
+    }
+
+    // src: Grayscale8 или RGB888
+    QImage resample(const QImage& src, int outW, int outH, int threads)
+    {
+        const int channels = src.format() == QImage::Format_Grayscale8 ? 1 : 3;
+        const Taps tx = makeTaps(src.width(), outW);
+        const Taps ty = makeTaps(src.height(), outH);
+
+        // 1) по вертикали на полной ширине: сюда приходится основная работа
+        QImage mid(src.width(), outH, src.format());
+        QImage out(outW, outH, src.format());
+        if (mid.isNull() || out.isNull())
+            return QImage();
+        const VerticalKernel vertical = verticalFor(GrayRenderer::isa());
+        const uchar* in = src.constBits();
+        uchar* midBits = mid.bits();
+        const int bytes = src.width() * channels;
+        forBands(outH, threads, [&](int y) {
+            vertical(in + size_t(ty.first[y]) * src.bytesPerLine(), src.bytesPerLine(), ty.count[y],
+                ty.weights.constData() + size_t(y) * ty.maxTaps, midBits + size_t(y) * mid.bytesPerLine(), bytes);
+        });
+
+        // 2) по горизонтали на outH строках
+        uchar* outBits = out.bits();
+        forBands(outH, threads, [&](int y) {
+            horizontalRow(midBits + size_t(y) * mid.bytesPerLine(), outBits + size_t(y) * out.bytesPerLine(), channels, tx);
+        });
+        return out;
+    }
+}
+
+QImage ImagePreprocessor::apply(const QImage& in, const Options& opt)
+{
+    if (in.isNull() || !opt.isActive())
+        return in;
+
+    QRect rect = in.rect();
+    if (!opt.crop.isEmpty()) {
+        rect = opt.crop.intersected(in.rect());
+        if (rect.isEmpty()) {
+            qWarning().noquote() << "[Lib4DICOM] ImagePreprocessor: crop" << opt.crop
+                                 << "is outside the image" << in.size() << "- full frame is kept";
+            rect = in.rect();
+        }
+    }
+    QImage img = rect == in.rect() ? in : in.copy(rect);
+    const int threads = std::max(1, opt.threads);
+
+    QSize target = img.size();
+    const int longest = std::max(img.width(), img.height());
+    if (opt.maxDimension > 0 && longest > opt.maxDimension) {
+        const double s = double(opt.maxDimension) / longest;
+        target = QSize(std::max(1, int(std::lround(img.width() * s))),
+                       std::max(1, int(std::lround(img.height() * s))));
+    }
+
+    // 16 бит в этом пути редкость (снимки экрана и камеры 8-битные) — уменьшает Qt
+    if (img.format() == QImage::Format_Grayscale16) {
+        if (target != img.size())
+            img = img.scaled(target, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+        return img;
+    }
+
+    const bool gray = opt.grayscale || img.format() == QImage::Format_Grayscale8;
+    if (gray && img.format() != QImage::Format_Grayscale8)
+        img = toGray8(img, threads);
+    else if (!gray && img.format() != QImage::Format_RGB888)
+        img = img.convertToFormat(QImage::Format_RGB888);   // так writeSeries всё равно пишет цвет
+
+    if (target != img.size())
+        img = resample(img, target.width(), target.height(), threads);
+    return img;
+}
+
+qint64 ImagePreprocessor::storedBytes(const QImage& img)
+{
+    const qint64 px = qint64(img.width()) * img.height();
+    switch (img.format()) {
+    case QImage::Format_Grayscale8:  return px;
+    case QImage::Format_Grayscale16: return px * 2;
+    default:                         return px * 3;
+    }
+}
+
+QVariantMap ImagePreprocessor::benchmark(int width, int height, int maxDimension, int iterations, int threads)
+{
+    width = qBound(16, width, 16384);
+    height = qBound(16, height, 16384);
+    maxDimension = qBound(8, maxDimension, std::max(width, height));
+    iterations = qBound(1, iterations, 1000);
+    threads = threads > 0 ? threads : QThread::idealThreadCount();
+
+    // фото-подобный кадр: плавный градиент плюс шум сенсора
+    QImage src(width, height, QImage::Format_RGB888);
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<int> noise(-12, 12);
+    for (int y = 0; y < height; ++y) {
+        uchar* row = src.scanLine(y);
+        for (int x = 0; x < width; ++x) {
+            row[x * 3 + 0] = uchar(qBound(0, x * 255 / width + noise(rng), 255));
+            row[x * 3 + 1] = uchar(qBound(0, y * 255 / height + noise(rng), 255));
+            row[x * 3 + 2] = uchar(qBound(0, 128 + noise(rng), 255));
+        }
+    }
+
+    const double mp = double(width) * height * iterations / 1e6;
+    auto measure = [&](auto&& fn) {
+        fn();   // прогрев
+        QElapsedTimer t;
+        t.start();
+        for (int i = 0; i < iterations; ++i)
+            fn();
+        const double sec = t.nsecsElapsed() / 1e9;
+        return sec > 0 ? mp / sec : 0.0;
+    };
+
+    Options resize;
+    resize.maxDimension = maxDimension;
+    Options gray = resize;
+    gray.grayscale = true;
+
+    QVariantMap out;
+    out["width"] = width;
+    out["height"] = height;
+    out["maxDimension"] = maxDimension;
+    out["threads"] = threads;
+    out["isa"] = GrayRenderer::isaName(GrayRenderer::isa());
+
+    const GrayRenderer::Isa best = GrayRenderer::isa();
+    for (int i = GrayRenderer::Scalar; i <= best; ++i) {
+        GrayRenderer::forceIsa(GrayRenderer::Isa(i));
+        const QString name = GrayRenderer::isaName(GrayRenderer::Isa(i));
+        resize.threads = 1;
+        out["resize_" + name + "_1t"] = measure([&] { apply(src, resize); });
+        resize.threads = threads;
+        out["resize_" + name + "_mt"] = measure([&] { apply(src, resize); });
+    }
+    GrayRenderer::forceIsa(best);
+    gray.threads = threads;
+    out["gray_resize_mt"] = measure([&] { apply(src, gray); });
+    const QSize target = apply(src, resize).size();
+    out["qt_smooth_1t"] = measure([&] {
+        src.scaled(target, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+    });
+
+    // место под пиксели в DICOM: исходный RGB против уменьшенного цветного и серого
+    const qint64 before = storedBytes(src);
+    const qint64 color = storedBytes(apply(src, resize));
+    const qint64 mono = storedBytes(apply(src, gray));
+    out["outWidth"] = target.width();
+    out["outHeight"] = target.height();
+    out["bytesIn"] = before;
+    out["bytesOutColor"] = color;
+    out["bytesOutGray"] = mono;
+    out["savedPercentColor"] = 100.0 * (before - color) / before;
+    out["savedPercentGray"] = 100.0 * (before - mono) / before;
+    return out;
+}
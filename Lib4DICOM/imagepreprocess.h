@@ -0,0 +1,36 @@
+﻿#pragma once
+
+#include <QImage>
+#include <QRect>
+#include <QVariantMap>
+
+#include "lib4dicom_global.h"
+
+// Предобработка кадров перед записью в DICOM (включается на сессию импорта):
+// обрезка до области интереса, перевод в оттенки серого и уменьшение до заданной
+// наибольшей стороны. Уменьшение раздельное: сначала по вертикали на полной ширине
+// (основной объём работы, ядра AVX2/SSE2 по набору команд GrayRenderer), затем по
+// горизонтали на уже сокращённых строках. Фильтр — «ящик» при сжатии в 2 раза и больше,
+// билинейный (треугольник) при меньшем; веса считаются один раз на ось.
+class LIB4DICOM_EXPORT ImagePreprocessor {
+public:
+    struct Options {
+        QRect crop;               // область интереса в пикселях исходного кадра; пусто — весь кадр
+        int   maxDimension = 0;   // наибольшая сторона после уменьшения; 0 — не уменьшать
+        bool  grayscale = false;  // записывать как MONOCHROME2 (яркость BT.601)
+        int   threads = 1;        // полосы строк одного кадра по потокам
+
+        bool isActive() const { return !crop.isEmpty() || maxDimension > 0 || grayscale; }
+    };
+
+    // Кадр Grayscale8 или RGB888 (Grayscale16 остаётся 16-битным); опции не заданы — in как есть
+    static QImage apply(const QImage& in, const Options& opt);
+
+    // Размер пикселей кадра в DICOM: 1 байт на пиксель в сером, 2 — в 16 бит, 3 — в RGB
+    static qint64 storedBytes(const QImage& img);
+
+    // Мпикс/с исходных пикселей по каждому ядру и против QImage::scaled(SmoothTransformation),
+    // а также экономия места на синтетическом цветном снимке width x height
+    static QVariantMap benchmark(int width = 4000, int height = 3000, int maxDimension = 1024,
+        int iterations = 10, int threads = 0);
+};
@@ -0,0 +1,245 @@
+﻿// importsession.cpp
+#include "importsession.h"
+#include "parallelfor.h"
+
+#include <QDate>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QRegularExpression>
+#include <QDebug>
+
+#include <utility> // std::exchange
+
+ImportSession::ImportSession(Lib4DICOM* lib, const Patient& patient)
+    : m_lib(lib), m_patient(patient)
+{
+    ++m_lib->m_liveSessions;   // пока сессия жива, Lib4DICOM не меняет корни архива
+}
+
+ImportSession::~ImportSession()
+{
+    flushDicomDir();
+    --m_lib->m_liveSessions;
+}
+
+void ImportSession::queueDicomDir(const QStringList& files)
+{
+    if (!m_lib->useDicomDir() || files.isEmpty())
+        return;
+    m_pendingDicomDir << files;
+    if (m_pendingDicomDir.size() >= kDicomDirBatch)
+        flushDicomDir();
+}
+
+void ImportSession::flushDicomDir()
+{
+    if (m_pendingDicomDir.isEmpty())
+        return;
+    m_lib->m_roots.addToDicomDir(std::exchange(m_pendingDicomDir, QStringList()));
+}
+
+bool ImportSession::hasPatient() const
+{
+    return !m_patient.fullName.trimmed().isEmpty() || !m_patient.patientID.trimmed().isEmpty();
+}
+
+bool ImportSession::setBirthDA(const QString& da)
+{
+    const QString v = da.trimmed();
+    if (v == m_patient.birthDA) return false;
+    // сохраняем только валидную полную дату; иначе очищаем
+    if (v.size() == 8 && QDate::fromString(v, "yyyyMMdd").isValid()) {
+        m_patient.birthDA = v;
+        if (m_patient.birthYear.isEmpty())
+            m_patient.birthYear = v.left(4);
+    }
+    else {
+        m_patient.birthDA.clear();
+    }
+    return true;
+}
+
+QVariantMap ImportSession::toMap() const
+{
+    QVariantMap map;
+    if (!hasPatient()) {
+        map["ok"] = false;
+        return map;
+    }
+
+    map["ok"] = true;
+    map["fullName"] = m_patient.fullName;
+    map["birthYear"] = m_patient.birthYear;
+    map["sex"] = m_patient.sex;
+    map["patientID"] = m_patient.patientID;
+    map["patientFolder"] = m_patient.patientFolder;
+    map["studyFolder"] = m_patient.studyFolder;
+    map["studyUID"] = m_patient.studyUID;
+    map["seriesName"] = m_patient.seriesName;
+    map["seriesUID"] = m_patient.seriesUID;
+    // при необходимости можно вернуть и birthDA:
+    // map["birthDA"]   = m_patient.birthDA;
+    return map;
+}
+
+// Имя исследования = <ИмяПациента>_<Дата>_<Метка>, папка — одним атомарным mkdir
+QVariantMap ImportSession::createStudyIn(const QString& patientFolder, const QString& patientName)
+{
+    QVariantMap out;
+
+    const QString label = m_lib->studyLabel();
+    const QString safeName = m_lib->sanitizeName(patientName.isEmpty() ? "Unnamed" : patientName);
+    const QString dateStr = QDate::currentDate().toString("yyyyMMdd");
+    const QString safeLabel = m_lib->sanitizeName(label.isEmpty() ? "Study" : label);
+    const QString base = QString("%1_%2_%3").arg(safeName, dateStr, safeLabel);
+
+    const QString studyFolder = m_lib->m_folders.allocate(patientFolder, base);
+    if (studyFolder.isEmpty()) {
+        out["ok"] = false; out["error"] = "failed to create study folder"; return out;
+    }
+
+    const QString studyUID = Lib4DICOM::generateDicomUID();
+
+    qDebug().noquote() << "[Lib4DICOM] Study created:"
+        << "\n  patientFolder =" << patientFolder
+        << "\n  studyFolder   =" << studyFolder
+        << "\n  studyName     =" << QFileInfo(studyFolder).fileName()
+        << "\n  studyUID      =" << studyUID;
+
+    out["ok"] = true;
+    out["patientFolder"] = patientFolder;
+    out["studyFolder"] = studyFolder;
+    out["studyName"] = QFileInfo(studyFolder).fileName();
+    out["studyUID"] = studyUID;
+
+    // текущее исследование сессии (studyFolder/UID + дефолт seriesName)
+    m_patient.patientFolder = patientFolder;
+    m_patient.studyFolder = studyFolder;
+    m_patient.studyUID = studyUID;
+    if (m_patient.seriesName.trimmed().isEmpty())
+        m_patient.seriesName = safeLabel;
+    return out;
+}
+
+QVariantMap ImportSession::createStudyForNewPatient()
+{
+    if (!hasPatient())
+        return { { "ok", false }, { "error", "no selected patient" } };
+
+    const QString patientFolder = m_lib->ensurePatientFolder(m_patient.fullName, m_patient.birthYear,
+        m_patient.patientID);
+    if (patientFolder.isEmpty()) {
+        qWarning().noquote() << "[Lib4DICOM] createStudyForNewPatient: patient folder not created";
+        return { { "ok", false }, { "error", "patient folder not created" } };
+    }
+
+    QVariantMap out = createStudyIn(patientFolder, m_patient.fullName);
+    out["patientFolder"] = patientFolder;
+    return out;
+}
+
+QVariantMap ImportSession::createStudyInPatientFolder(const QString& patientFolder)
+{
+    if (patientFolder.isEmpty() || !QDir(patientFolder).exists())
+        return { { "ok", false }, { "error", "patient folder does not exist" } };
+
+    // === Извлечь "имя пациента" из имени папки пациента: <ФИО>_<год|---->[_n] ===
+    QString dirName = QFileInfo(patientFolder).fileName();
+
+    dirName.remove(QRegularExpression(R"(_\d{1,4}$)"));
+
+    const int us = dirName.lastIndexOf('_');
+    if (us > 0) {
+        const QString tail = dirName.mid(us + 1);
+        const bool isYear4 = (tail.size() == 4 &&
+            tail.at(0).isDigit() && tail.at(1).isDigit() &&
+            tail.at(2).isDigit() && tail.at(3).isDigit());
+        if (tail == "----" || isYear4) {
+            dirName = dirName.left(us);
+        }
+    }
+
+    return createStudyIn(patientFolder, dirName);
+}
+
+QVariantMap ImportSession::createPatientStub(const QString& patientFolder)
+{
+    if (!hasPatient())
+        return { { "ok", false }, { "error", "no selected patient" } };
+
+    const QVariantMap out = m_lib->writePatientStub(m_patient, patientFolder);
+    if (out.value("ok").toBool())
+        queueDicomDir({ out.value("path").toString() });
+    return out;
+}
+
+void ImportSession::beginSeries(const QString& seriesName)
+{
+    if (!seriesName.trimmed().isEmpty())
+        m_patient.seriesName = m_lib->sanitizeName(seriesName);
+    m_patient.seriesUID = Lib4DICOM::generateDicomUID();
+}
+
+void ImportSession::endSeries()
+{
+    m_patient.seriesUID.clear();
+    flushDicomDir();
+}
+
+SeriesWriteStats ImportSession::saveImages(const QVector<QImage>& images, int firstInstance)
+{
+    if (!hasPatient()) {
+        qWarning().noquote() << "[Lib4DICOM] saveImagesAsDicom: no selected patient";
+        return {};
+    }
+    if (images.isEmpty()) {
+        qWarning().noquote() << "[Lib4DICOM] saveImagesAsDicom: images is empty";
+        return {};
+    }
+
+    if (!m_preprocess.isActive()) {
+        const SeriesWriteStats stats = m_lib->writeSeries(m_patient, images,
+            DurableBatch::Mode(m_lib->saveDurability()), qMax(1, firstInstance));
+        queueDicomDir(stats.files);
+        return stats;
+    }
+
+    // Порция не меньше числа потоков — по кадру на поток; иначе каждый кадр режется на полосы
+    QElapsedTimer timer;
+    timer.start();
+    const int threads = qMax(1, m_lib->saveThreads());
+    const bool perImage = images.size() >= threads;
+    ImagePreprocessor::Options opt = m_preprocess;
+    opt.threads = perImage ? 1 : threads;
+    QVector<QImage> prepared(images.size());
+    parallelFor(images.size(), perImage ? threads : 1, [&](int i) {
+        prepared[i] = ImagePreprocessor::apply(images[i], opt);
+    });
+    const qint64 preprocessNs = timer.nsecsElapsed();
+
+    SeriesWriteStats stats = m_lib->writeSeries(m_patient, prepared,
+        DurableBatch::Mode(m_lib->saveDurability()), qMax(1, firstInstance));
+    for (int i = 0; i < images.size(); ++i) {
+        stats.pixelBytesIn += ImagePreprocessor::storedBytes(images[i]);
+        stats.pixelBytesOut += ImagePreprocessor::storedBytes(prepared[i]);
+    }
+    stats.preprocessNs = preprocessNs;
+    queueDicomDir(stats.files);
+    return stats;
+}
+
+SeriesWriteStats ImportSession::convertAndSaveImage(const QString& imagePath)
+{
+    if (!hasPatient()) {
+        qWarning().noquote() << "[Lib4DICOM] convertAndSaveImageAsDicom: no selected patient";
+        return {};
+    }
+
+    const QImage img = m_lib->TESTloadImageFromFile(imagePath);
+    if (img.isNull()) {
+        qWarning().noquote() << "[Lib4DICOM] convertAndSaveImageAsDicom: failed to load image:" << imagePath;
+        return {};
+    }
+    return saveImages({ img });
+}
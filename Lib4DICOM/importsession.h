@@ -0,0 +1,69 @@
+﻿#pragma once
+
+#include <QImage>
+#include <QString>
+#include <QVariantMap>
+#include <QVector>
+
+#include "lib4dicom.h"
+#include "imagepreprocess.h"
+
+// Сессия импорта: свой пациент, папка и UID исследования, текущая серия.
+// Создаётся через Lib4DICOM::createImportSession() из любого потока; сама сессия ведётся
+// одним потоком, а разные сессии пишут параллельно — общие части (FolderAllocator,
+// ContentHashIndex, DICOMDIR) защищены своими мьютексами.
+// QML-методы Lib4DICOM (selectNewPatient, createStudy*, saveImagesAsDicom, ...) —
+// обёртки над сессией по умолчанию. Lib4DICOM должен пережить свои сессии.
+class LIB4DICOM_EXPORT ImportSession {
+public:
+    explicit ImportSession(Lib4DICOM* lib, const Patient& patient = Patient());
+    ~ImportSession();   // дописывает в DICOMDIR накопленные файлы
+
+    ImportSession(const ImportSession&) = delete;
+    ImportSession& operator=(const ImportSession&) = delete;
+
+    const Patient& patient() const { return m_patient; }
+    void setPatient(const Patient& p) { m_patient = p; }
+    bool hasPatient() const;
+    // полная дата рождения YYYYMMDD; false — значение не изменилось
+    bool setBirthDA(const QString& da);
+    // ok, fullName, birthYear, sex, patientID, patientFolder, studyFolder, studyUID, seriesName, seriesUID
+    QVariantMap toMap() const;
+
+    // папка пациента <ФИО>_<год> (создаётся) и исследование в ней
+    QVariantMap createStudyForNewPatient();
+    // новое исследование в существующей папке пациента
+    QVariantMap createStudyInPatientFolder(const QString& patientFolder);
+    QVariantMap createPatientStub(const QString& patientFolder);
+
+    // следующие saveImages пишут в одну серию до endSeries()
+    void beginSeries(const QString& seriesName = QString());
+    void endSeries();   // заодно сбрасывает DICOMDIR
+
+    // Записанные файлы попадают в DICOMDIR пачкой: при endSeries(), в деструкторе или
+    // когда их накопится kDicomDirBatch. DICOMDIR переписывается целиком, поэтому запись
+    // на каждую порцию делала бы импорт квадратичным. Пока файлы не внесены, их папки
+    // новее DICOMDIR, и scanPatients() читает их с диска.
+    void flushDicomDir();
+
+    // Обрезка, серый и уменьшение перед записью; по умолчанию выключено.
+    // threads в опциях не используется: берётся saveThreads библиотеки
+    void setPreprocess(const ImagePreprocessor::Options& opt) { m_preprocess = opt; }
+    const ImagePreprocessor::Options& preprocess() const { return m_preprocess; }
+
+    // firstInstance — номер первого снимка (для записи серии несколькими порциями)
+    SeriesWriteStats saveImages(const QVector<QImage>& images, int firstInstance = 1);
+    SeriesWriteStats convertAndSaveImage(const QString& imagePath);
+
+private:
+    QVariantMap createStudyIn(const QString& patientFolder, const QString& patientName);
+
+    void queueDicomDir(const QStringList& files);
+
+    static constexpr int kDicomDirBatch = 4096;
+
+    Lib4DICOM* m_lib;
+    Patient    m_patient;
+    ImagePreprocessor::Options m_preprocess;
+    QStringList m_pendingDicomDir;   // записаны, но ещё не внесены в DICOMDIR
+};
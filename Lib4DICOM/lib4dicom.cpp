@@ -1,5 +1,21 @@
 ﻿// lib4dicom.cpp
 #include "lib4dicom.h"
+#include "patienttreemodel.h"
+#include "dirwalker.h"
+#include "dicomcharset.h"
+#include "durablewriter.h"
+#include "parallelfor.h"
+#include "dicomdirindex.h"
+#include "storescp.h"
+#include "storescu.h"
+#include "contenthash.h"
+#include "imageexport.h"
+#include "grayrender.h"
+#include "findquery.h"
+#include "imagepreprocess.h"
+#include "importsession.h"
+#include "tageditor.h"
+#include "archiveverifier.h"
 
 #include <QCoreApplication>
 #include <QFileInfo>
@@ -12,7 +28,13 @@
 #include <QImageReader>
 #include <QDebug>
 #include <QRegularExpression>
+#include <QElapsedTimer>
+#include <QSet>
+#include <QTimer>
+#include <QThread>
+#include <algorithm>
 #include <cstring> // std::memcpy
+#include <utility> // std::exchange
 
 // DCMTK
 #include <dcmtk/dcmdata/dctk.h>
@@ -20,25 +42,113 @@
 #include <dcmtk/dcmdata/dcuid.h>
 #include <dcmtk/ofstd/ofstring.h>
 
+namespace {
+    // Сколько строк списка пациентов отдаётся вью за один fetchMore
+    const int kPatientPageSize = 256;
+
+    // Значения больше этого порога (PixelData) DCMTK оставляет на диске
+    const Uint32 kHeaderOnlyReadLength = 256;
+
+    // журнал незаконченного перевода раскладки в корне архива
+    const char* const kLayoutJournal = ".layout-migration";
+
+    // сырое значение тега без ведущих/хвостовых пробелов
+    const char* rawValue(DcmItem* item, const DcmTagKey& tag, size_t& len) {
+        const char* s = nullptr;
+        len = 0;
+        if (!item || item->findAndGetString(tag, s).bad() || !s)
+            return nullptr;
+        len = std::strlen(s);
+        while (len > 0 && *s == ' ') { ++s; --len; }
+        while (len > 0 && s[len - 1] == ' ') --len;
+        return s;
+    }
+}
+
 // ---------------- Конструктор ----------------
-Lib4DICOM::Lib4DICOM(QObject* parent) : QAbstractListModel(parent) {
+Lib4DICOM::Lib4DICOM(QObject* parent) : Lib4DICOM(QString(), parent) {}
+
+Lib4DICOM::Lib4DICOM(const QString& patientsRoot, QObject* parent)
+    : Lib4DICOM(patientsRoot.isEmpty() ? QStringList() : QStringList{ patientsRoot }, parent) {}
+
+Lib4DICOM::Lib4DICOM(const QStringList& storageRoots, QObject* parent)
+    : QAbstractListModel(parent)
+{
+    m_roots.setPaths(storageRoots);
+    if (m_roots.size() == 0)
+        m_roots.setPaths({ QCoreApplication::applicationDirPath() + "/patients" });
+    m_session = std::make_unique<ImportSession>(this);
     scanPatients();
+    m_tree = new PatientTreeModel(this, this);
+    m_findings = new VerifyFindingsModel(this);
+}
+
+Lib4DICOM::~Lib4DICOM()
+{
+    // потоки приёма и отправки обращаются к полям объекта — останавливаем их до разрушения полей
+    stopStoreSCP();
+    if (m_exportThread) {
+        m_exporter->cancel();
+        m_exportThread->wait();
+        delete m_exportThread;
+        m_exportThread = nullptr;
+    }
+    if (m_verifyThread) {
+        m_verifier->cancel();
+        m_verifyThread->wait();
+        delete m_verifyThread;
+        m_verifyThread = nullptr;
+    }
+    if (m_migrateThread) {
+        // перенос папки не прерывается посередине; недоделанное продолжит следующий запуск
+        m_migrateThread->wait();
+        delete m_migrateThread;
+        m_migrateThread = nullptr;
+    }
 }
 
-// Подсчёт количества пациентов
+// Подсчёт количества пациентов (только подгруженные строки)
 int Lib4DICOM::rowCount(const QModelIndex& parent) const {
-    return parent.isValid() ? 0 : m_patients.size();
+    return parent.isValid() ? 0 : m_loadedRows;
+}
+
+int Lib4DICOM::patientCount() const {
+    return m_store.size();
+}
+
+// Постраничная подгрузка строк списка
+bool Lib4DICOM::canFetchMore(const QModelIndex& parent) const {
+    return !parent.isValid() && m_loadedRows < m_store.size();
+}
+
+void Lib4DICOM::fetchMore(const QModelIndex& parent) {
+    if (parent.isValid())
+        return;
+    const int remaining = m_store.size() - m_loadedRows;
+    const int n = qMin(kPatientPageSize, remaining);
+    if (n <= 0)
+        return;
+    beginInsertRows(QModelIndex(), m_loadedRows, m_loadedRows + n - 1);
+    m_loadedRows += n;
+    endInsertRows();
+}
+
+QObject* Lib4DICOM::studyTree() const {
+    return m_tree;
 }
 
 // Возвращает данные пациента по индексу
 QVariant Lib4DICOM::data(const QModelIndex& index, int role) const {
-    if (!index.isValid() || index.row() < 0 || index.row() >= m_patients.size())
+    if (!index.isValid() || index.row() < 0 || index.row() >= m_loadedRows)
         return {};
-    const auto& p = m_patients[index.row()];
+    const int row = index.row();
     switch (role) {
-    case FullNameRole:  return p.fullName;
-    case BirthYearRole: return p.birthYear;
-    case SexRole:       return p.sex;
+    case FullNameRole:      return m_store.fullName(row);
+    case BirthYearRole:     return m_store.birthYear(row);
+    case SexRole:           return m_store.sex(row);
+    case StudyCountRole:    return m_store.studyCount(row);
+    case ImageCountRole:    return m_store.imageCount(row);
+    case LastStudyDateRole: return m_store.lastStudyDate(row);
     }
     return {};
 }
@@ -48,7 +158,10 @@ QHash<int, QByteArray> Lib4DICOM::roleNames() const {
     return {
         { FullNameRole, "fullName" },
         { BirthYearRole,"birthYear"},
-        { SexRole,      "sex"      }
+        { SexRole,      "sex"      },
+        { StudyCountRole,    "studyCount"    },
+        { ImageCountRole,    "imageCount"    },
+        { LastStudyDateRole, "lastStudyDate" }
     };
 }
 
@@ -116,75 +229,12 @@ QString Lib4DICOM::generateDicomUID()
     return QString::fromLatin1(uid);
 }
 
-// Создание исследования для нового пациента (использует m_selectedPatient)
+// Создание исследования для нового пациента (сессия по умолчанию)
 QVariantMap Lib4DICOM::createStudyForNewPatient()
 {
-    QVariantMap out;
-
-    // 0) Проверим, что пациент выбран
-    if (m_selectedPatient.fullName.trimmed().isEmpty() &&
-        m_selectedPatient.patientID.trimmed().isEmpty())
-    {
-        out["ok"] = false;
-        out["error"] = "no selected patient";
-        return out;
-    }
-
-    const Patient& p = m_selectedPatient;
-
-    // 1) Папка пациента
-    const QString patientFolder = ensurePatientFolder(p.fullName, p.birthYear);
-    if (patientFolder.isEmpty()) {
-        qWarning().noquote() << "[Lib4DICOM] createStudyForNewPatient: patient folder not created";
-        out["ok"] = false;
-        out["error"] = "patient folder not created";
-        return out;
-    }
-    out["patientFolder"] = patientFolder;
-
-    // 2) Имя исследования = <ИмяПациента>_<Дата>_<Метка>
-    const QString dateStr = QDate::currentDate().toString("yyyyMMdd");
-    const QString safeName = sanitizeName(p.fullName.isEmpty() ? "Unnamed" : p.fullName);
-    const QString safeLabel = sanitizeName(m_studyLabel.isEmpty() ? "Study" : m_studyLabel);
-    const QString base = QString("%1_%2_%3").arg(safeName, dateStr, safeLabel);
-
-    // 3) Создание папки исследования с авто-нумерацией
-    QString studyFolder = QDir(patientFolder).absoluteFilePath(base);
-    int n = 2;
-    while (QDir(studyFolder).exists() && n <= 9999) {
-        studyFolder = QDir(patientFolder).absoluteFilePath(base + "_" + QString::number(n++));
-    }
-    if (n > 9999) {
-        out["ok"] = false; out["error"] = "too many duplicates for study"; return out;
-    }
-    if (!QDir().mkpath(studyFolder)) {
-        out["ok"] = false; out["error"] = "failed to create study folder"; return out;
-    }
-
-    // 4) UID исследования
-    const QString studyUID = generateDicomUID();
-
-    qDebug().noquote() << "[Lib4DICOM] Study created:"
-        << "\n  patientFolder =" << patientFolder
-        << "\n  studyFolder   =" << studyFolder
-        << "\n  studyName     =" << QFileInfo(studyFolder).fileName()
-        << "\n  studyUID      =" << studyUID;
-
-    // 5) Выходные данные
-    out["ok"] = true;
-    out["studyFolder"] = studyFolder;
-    out["studyName"] = QFileInfo(studyFolder).fileName();
-    out["studyUID"] = studyUID;
-    out["patientFolder"] = patientFolder;
-
-    // 6) Обновим глобального пациента (studyFolder/UID + дефолт seriesName)
-    m_selectedPatient.patientFolder = patientFolder;
-    m_selectedPatient.studyFolder = studyFolder;
-    m_selectedPatient.studyUID = studyUID;
-    if (m_selectedPatient.seriesName.trimmed().isEmpty())
-        m_selectedPatient.seriesName = safeLabel; // дефолт
-    emit selectedPatientChanged();
-
+    const QVariantMap out = m_session->createStudyForNewPatient();
+    if (out.value("ok").toBool())
+        emit selectedPatientChanged();
     return out;
 }
 
@@ -225,142 +275,1128 @@ QVector<QImage> Lib4DICOM::TESTloadImageVectorFromFile(const QString& localPath)
 // ---------------- Комбайн: загрузить картинку и сохранить как DICOM ----------------
 void Lib4DICOM::convertAndSaveImageAsDicom(const QString& imagePath)
 {
-    if (m_selectedPatient.fullName.trimmed().isEmpty() &&
-        m_selectedPatient.patientID.trimmed().isEmpty())
-    {
-        qWarning().noquote() << "[Lib4DICOM] convertAndSaveImageAsDicom: no selected patient";
-        return;
-    }
-
-    QImage img = TESTloadImageFromFile(imagePath);
-    if (img.isNull()) {
-        qWarning().noquote() << "[Lib4DICOM] convertAndSaveImageAsDicom: failed to load image:" << imagePath;
-        return;
-    }
-
-    QVector<QImage> vec;
-    vec.push_back(img);
-    saveImagesAsDicom(vec);
+    m_session->convertAndSaveImage(imagePath);
 }
 
 // ---------------- Декодер строк из DICOM с учётом кодировки ----------------
-QString Lib4DICOM::decodeDicomText(const OFString& value, const OFString& specificCharacterSet)
+// Разбор кодировки кэшируется в DicomTextDecoder; здесь — тонкая обёртка
+QString Lib4DICOM::decodeDicomText(const OFString& value, const OFString& specificCharacterSet,
+    bool personName)
 {
     if (value.empty())
         return QString();
-
-    QByteArray bytes(value.c_str(), int(value.length()));
-    const QString charset = QString::fromLatin1(specificCharacterSet.c_str());
-
-    if (charset == "ISO_IR 192") {             // UTF-8
-        return QString::fromUtf8(bytes);
-    }
-    else if (charset.isEmpty() || charset == "ISO_IR 100") {
-        return QString::fromLatin1(bytes);     // Latin-1 (по умолчанию)
-    }
-    else {
-        return QString::fromUtf8(bytes);       // на всякий случай
-    }
+    return DicomTextDecoder::forCharset(specificCharacterSet).decode(value, personName);
 }
 
 // ---------------- Сканирование пациентов ----------------
 void Lib4DICOM::scanPatients() {
+    QElapsedTimer timer;
+    timer.start();
+
     beginResetModel();
-    m_patients.clear();
+    QWriteLocker storeLock(&m_storeLock);
+    m_store.clear();
+    m_folders.clear();
+    m_contentHashes.clear();
+
+    // Каждый корень (свой диск) обходится в своём потоке: чтение каталогов и заголовков идёт
+    // параллельно, в хранилище пациентов строки добавляются под indexMutex
+    struct RootScan {
+        DirWalker::Stats walk;
+        QDateTime        indexTime;
+        QSet<QString>    freshDirs;
+        QStringList      crawled;
+        QSet<QString>    indexedStale;   // файлы из DICOMDIR в перечитанных папках
+        QSet<QString>    skipped;        // файлы, которые DICOMDIR не принял
+        qint64           fromIndex = 0;
+        bool             needRebuild = false;
+    };
+    const int rootCount = m_roots.size();
+    QVector<RootScan> scans(rootCount);
+    QMutex indexMutex;
+    const bool useDicomDir = m_useDicomDir;
+    const int depth = m_scanDepth;
+
+    auto scanRoot = [&](int r) {
+        RootScan& rs = scans[r];
+        const QString rootPath = m_roots.path(r);
+        const DicomDirIndex& dicomDir = m_roots.dicomDir(r);
+        QDir().mkpath(rootPath);
+
+        // Папки, не менявшиеся после записи DICOMDIR, берутся из него без открытия файлов;
+        // остальные (или все, если DICOMDIR нет) читаются с диска
+        // во время перевода раскладки папки переезжают без смены mtime — DICOMDIR не в счёт
+        const bool migrating = QFileInfo::exists(rootPath + '/' + kLayoutJournal);
+        rs.indexTime = useDicomDir && !migrating ? dicomDir.lastModified() : QDateTime();
+        const QDateTime indexTime = rs.indexTime;
+        // папки с файлами, которых нет в DICOMDIR, читаются с диска при любом mtime
+        QSet<QString> skippedDirs;
+        if (indexTime.isValid()) {
+            rs.skipped = dicomDir.skippedFiles();
+            for (const QString& f : rs.skipped)
+                skippedDirs.insert(f.left(f.lastIndexOf('/')));
+        }
+
+        // Обход до m_scanDepth уровней (корень -> пациент -> исследование, корзины веера не в счёт);
+        // каждый найденный .dcm сразу уходит в разбор
+        // заодно засеваем индекс занятых имён папок пациентов и исследований
+        rs.walk = DirWalker::walkRoot(rootPath, depth,
+            [this, &rs, &indexMutex](const DirWalker::Entry& e) {
+                rs.crawled << e.filePath;
+                indexDicomFile(e.filePath, e.topDir, e.dirPath, &indexMutex);
+            },
+            [this](const QString& parentDir, const QString& name) {
+                m_folders.seed(parentDir, name);
+            },
+            [&indexTime, &rs, &skippedDirs](const QString& dirPath) {
+                if (indexTime.isValid() && !skippedDirs.contains(dirPath)
+                    && QFileInfo(dirPath).lastModified() <= indexTime) {
+                    rs.freshDirs.insert(dirPath);
+                    return false;
+                }
+                return true;
+            });
+
+        rs.needRebuild = !indexTime.isValid();
+        if (!indexTime.isValid())
+            return;
+
+        QHash<QString, int> patientRows;   // (запись PATIENT, папка пациента) -> строка
+        const bool loaded = dicomDir.load([&](const DicomDirIndex::Entry& e) {
+            const QString filePath = rootPath + '/' + e.relPath;
+            const QString dirPath = filePath.left(filePath.lastIndexOf('/'));
+            if (!rs.freshDirs.contains(dirPath)) {
+                // папка перечитана с диска, или её нет (удалена / глубже m_scanDepth)
+                rs.indexedStale.insert(filePath);
+                if (!QFileInfo::exists(filePath))
+                    rs.needRebuild = true;
+                return;
+            }
 
-    QDir root(QCoreApplication::applicationDirPath() + "/patients");
-    if (!root.exists())
-        root.mkpath(".");
+            const QString patientFolder = StorageRoots::patientFolderOf(rootPath, e.relPath);
 
-    const QStringList nameFilters = { "*.dcm", "*.DCM" };
+            const QString cacheKey = QString::number(quintptr(e.patient), 16) + patientFolder;
+            int row = patientRows.value(cacheKey, -1);
+            DcmFileFormat ff;
+            DcmItem* demographics = e.patient;
+            if (row < 0) {
+                // профиль General Purpose не кладёт в PATIENT дату рождения и пол —
+                // берём их из заголовка одного файла пациента
+                if (!e.patient->tagExists(DCM_PatientBirthDate) && !e.patient->tagExists(DCM_PatientSex)
+                    && ff.loadFile(QFile::encodeName(filePath).constData(), EXS_Unknown,
+                        EGL_noChange, kHeaderOnlyReadLength).good())
+                    demographics = ff.getDataset();
+            }
 
-    // Соберём все .dcm в /patients и всех подкаталогах первого уровня
-    QFileInfoList files = root.entryInfoList(nameFilters, QDir::Files | QDir::NoDotAndDotDot, QDir::Name);
-    const QFileInfoList dirs = root.entryInfoList(QDir::Dirs | QDir::NoDotAndDotDot, QDir::Name);
-    for (const QFileInfo& d : dirs) {
-        QDir sub(d.absoluteFilePath());
-        const QFileInfoList subFiles = sub.entryInfoList(nameFilters, QDir::Files | QDir::NoDotAndDotDot, QDir::Name);
-        files.append(subFiles);
+            // stub лежит прямо в папке пациента
+            size_t len = 0;
+            const char* desc = rawValue(e.series, DCM_SeriesDescription, len);
+            const bool stub = desc
+                ? (len == 12 && qstrnicmp(desc, "PATIENT_STUB", 12) == 0)
+                : (dirPath == patientFolder && filePath.contains("_patient", Qt::CaseInsensitive));
+
+            QMutexLocker lock(&indexMutex);
+            if (row < 0) {
+                row = indexPatient(demographics, patientFolder);
+                patientRows.insert(cacheKey, row);
+            }
+            if (!stub)
+                indexStudyInstance(row, e.study ? e.study : e.patient, dirPath);
+            ++rs.fromIndex;
+        });
+
+        if (!loaded) {
+            // DICOMDIR не читается — дочитываем нетронутые папки с диска и пересоздаём его
+            DirWalker::walkRoot(rootPath, depth,
+                [this, &rs, &indexMutex](const DirWalker::Entry& e) {
+                    rs.crawled << e.filePath;
+                    indexDicomFile(e.filePath, e.topDir, e.dirPath, &indexMutex);
+                },
+                DirWalker::DirCallback(),
+                [&rs](const QString& dirPath) { return rs.freshDirs.contains(dirPath); });
+            rs.needRebuild = true;
+        }
+    };
+    parallelFor(rootCount, rootCount, scanRoot);
+
+    m_lastScan = DirWalker::Stats();
+    m_lastScanFromIndex = 0;
+    qint64 crawledFiles = 0, freshDirs = 0;
+    for (const RootScan& rs : scans) {
+        m_lastScan.dirs += rs.walk.dirs;
+        m_lastScan.files += rs.walk.files;
+        m_lastScan.stats += rs.walk.stats;
+        m_lastScanFromIndex += rs.fromIndex;
+        crawledFiles += rs.crawled.size();
+        freshDirs += rs.freshDirs.size();
     }
 
-    auto patientFolderOf = [](const QString& filePath) -> QString {
-        QFileInfo fi(filePath);
-        QDir d = fi.dir();
-        if (d.dirName().contains('_'))
-            d.cdUp(); // поднимаемся из study-папки
-        return d.absolutePath();
-        };
+    m_loadedRows = qMin(kPatientPageSize, m_store.size());
+    storeLock.unlock();
+    endResetModel();
 
-    QHash<QString, Patient> uniq;  // ключ -> Patient
-    auto makeKey = [](const Patient& p, const QString& fallbackFolder) -> QString {
-        const QString pid = p.patientID.trimmed();
-        if (!pid.isEmpty() && pid != "--")
-            return "pid:" + pid;
-        // если нет ID — склеим по демографии
-        return QString("pn:%1|by:%2|sx:%3|pf:%4")
-            .arg(p.fullName.isEmpty() ? "--" : p.fullName)
-            .arg(p.birthYear.isEmpty() ? "--" : p.birthYear)
-            .arg(p.sex.isEmpty() ? "--" : p.sex)
-            .arg(fallbackFolder);
-        };
+    // Поддержка DICOMDIR: новые файлы дописываются, удалённые — только пересозданием
+    if (useDicomDir) {
+        parallelFor(rootCount, rootCount, [&](int r) {
+            const RootScan& rs = scans[r];
+            DicomDirIndex& dicomDir = m_roots.dicomDir(r);
+            if (rs.needRebuild) {
+                QStringList all = rs.crawled;
+                if (rs.indexTime.isValid()) {
+                    all.clear();
+                    DirWalker::walkRoot(m_roots.path(r), depth,
+                        [&all](const DirWalker::Entry& e) { all << e.filePath; });
+                }
+                dicomDir.rebuild(all);
+            }
+            else {
+                // уже отвергнутые DICOMDIR файлы не предлагаем снова — иначе он переписывался бы при каждом запуске
+                QStringList added;
+                for (const QString& f : rs.crawled)
+                    if (!rs.indexedStale.contains(f) && !rs.skipped.contains(f))
+                        added << f;
+                dicomDir.addFiles(added);
+            }
+        });
+    }
+    m_lastScanMs = timer.elapsed();
 
-    for (const QFileInfo& fi : files) {
-        const QString path = fi.absoluteFilePath();
+    qDebug().noquote() << "[Lib4DICOM] scanPatients:" << m_store.size() << "patients,"
+        << m_store.studyRows() << "studies in" << rootCount << "roots," << m_lastScanFromIndex << "files from DICOMDIR,"
+        << crawledFiles << "read from" << m_lastScan.dirs - freshDirs << "of" << m_lastScan.dirs << "dirs,"
+        << m_lastScanMs << "ms;"
+        << "store" << m_store.memoryUsage() << "bytes";
+}
 
-        DcmFileFormat ff;
-        if (!ff.loadFile(QFile::encodeName(path).constData()).good())
-            continue;
+// Разбор одного файла архива в хранилище пациентов.
+// Ключ пациента считается по сырым байтам тегов; строки декодируются
+// только для нового пациента или нового исследования.
+int Lib4DICOM::indexDicomFile(const QString& path, const QString& patientFolder,
+    const QString& studyFolder, QMutex* storeMutex)
+{
+    DcmFileFormat ff;
+    if (!ff.loadFile(QFile::encodeName(path).constData(), EXS_Unknown,
+        EGL_noChange, kHeaderOnlyReadLength).good())
+        return -1;
+
+    // файл читается без блокировки, в хранилище — под storeMutex (если задан)
+    QMutexLocker lock(storeMutex);
+    DcmDataset* ds = ff.getDataset();
+    const int row = indexPatient(ds, patientFolder);
 
-        DcmDataset* ds = ff.getDataset();
+    // stub пациента не считается ни исследованием, ни снимком
+    size_t len = 0;
+    const char* desc = rawValue(ds, DCM_SeriesDescription, len);
+    if (desc && len == 12 && qstrnicmp(desc, "PATIENT_STUB", 12) == 0)
+        return row;
+
+    indexStudyInstance(row, ds, studyFolder);
+    return row;
+}
+
+// Строка пациента для набора тегов item (датасет файла или запись PATIENT из DICOMDIR)
+int Lib4DICOM::indexPatient(DcmItem* item, const QString& patientFolder)
+{
+    size_t pidLen = 0;
+    const char* pid = rawValue(item, DCM_PatientID, pidLen);
+
+    quint64 key = 0;
+    if (pid && pidLen > 0 && !(pidLen == 2 && std::strncmp(pid, "--", 2) == 0)) {
+        key = PatientStore::hashBytes(pid, pidLen, 'p');
+    }
+    else {
+        // если нет ID — склеим по демографии и папке
+        size_t len = 0;
+        const char* s = rawValue(item, DCM_PatientName, len);
+        key = PatientStore::hashBytes(s, len, 'n');
+        s = rawValue(item, DCM_PatientBirthDate, len);
+        key = PatientStore::hashBytes(s, qMin<size_t>(len, 4), key);
+        s = rawValue(item, DCM_PatientSex, len);
+        key = PatientStore::hashBytes(s, len, key);
+        key = PatientStore::hashString(patientFolder, key);
+    }
+
+    int row = m_store.findPatient(key);
+    if (row < 0) {
+        // кодировка разбирается один раз на набор данных
         OFString v, cs;
-        ds->findAndGetOFString(DCM_SpecificCharacterSet, cs);
+        item->findAndGetOFStringArray(DCM_SpecificCharacterSet, cs);
+        const DicomTextDecoder& dec = DicomTextDecoder::forCharset(cs);
 
         Patient p;
-        if (ds->findAndGetOFString(DCM_PatientName, v).good())
-            p.fullName = decodeDicomText(v, cs).replace("^", " ");
+        if (item->findAndGetOFString(DCM_PatientName, v).good())
+            p.fullName = dec.decode(v, true).replace("^", " ");
         else
             p.fullName = "--";
 
-        if (ds->findAndGetOFString(DCM_PatientBirthDate, v).good() && v.length() >= 4)
-            p.birthYear = decodeDicomText(v, cs).left(4);
+        if (item->findAndGetOFString(DCM_PatientBirthDate, v).good() && v.length() >= 4)
+            p.birthYear = dec.decode(v).left(4);
         else
             p.birthYear = "--";
 
-        if (ds->findAndGetOFString(DCM_PatientSex, v).good())
-            p.sex = decodeDicomText(v, cs);
+        if (item->findAndGetOFString(DCM_PatientSex, v).good())
+            p.sex = dec.decode(v);
         else
             p.sex = "--";
 
-        if (ds->findAndGetOFString(DCM_PatientID, v).good())
-            p.patientID = decodeDicomText(v, cs);
+        if (item->findAndGetOFString(DCM_PatientID, v).good())
+            p.patientID = dec.decode(v);
         else
             p.patientID = "--";
 
-        const QString pf = patientFolderOf(path);
-        p.patientFolder = pf;
-        const QString key = makeKey(p, pf);
+        p.patientFolder = patientFolder;
+        row = m_store.addPatient(key, p);
+    }
+    return row;
+}
+
+// Учесть снимок исследования из item (датасет файла или запись STUDY из DICOMDIR)
+void Lib4DICOM::indexStudyInstance(int row, DcmItem* item, const QString& studyFolder)
+{
+    size_t len = 0;
+    const char* uid = rawValue(item, DCM_StudyInstanceUID, len);
+    // без StudyInstanceUID исследование определяет папка внутри пациента: иначе такие
+    // файлы разных пациентов слились бы в одну строку первого проиндексированного
+    quint64 studyKey = 0;
+    if (uid && len > 0) {
+        studyKey = PatientStore::hashBytes(uid, len, 's');
+    }
+    else {
+        const QByteArray folder = studyFolder.toUtf8();
+        studyKey = PatientStore::hashBytes(folder.constData(), size_t(folder.size()), 'f' + quint64(row) * 0x9E3779B97F4A7C15ull);
+    }
+    int srow = m_store.findStudy(studyKey);
+    if (srow < 0) {
+        size_t dlen = 0, tlen = 0;
+        const char* date = rawValue(item, DCM_StudyDate, dlen);
+        const char* time = rawValue(item, DCM_StudyTime, tlen);
+        quint32 t = 0;
+        for (size_t i = 0; time && i < tlen && i < 6 && time[i] >= '0' && time[i] <= '9'; ++i)
+            t = t * 10 + quint32(time[i] - '0');
+        srow = m_store.addStudy(studyKey, row, QString::fromLatin1(uid, int(len)),
+            PatientStore::parseDate(date, dlen), t, studyFolder);
+    }
+    m_store.countInstance(row, srow);
+}
+
+// Статистика памяти хранилища пациентов. bytes — подсчёт по колонкам хранилища,
+// legacyBytesEstimate — расчётная оценка прежнего QList<Patient>, а не замер
+QVariantMap Lib4DICOM::patientStoreStats() const
+{
+    QVariantMap out;
+    const int n = m_store.size();
+    const qint64 bytes = m_store.memoryUsage();
+    const qint64 legacy = m_store.estimateLegacyMemoryUsage();
+    out["patients"] = n;
+    out["studies"] = m_store.studyRows();
+    out["bytes"] = bytes;
+    out["legacyBytesEstimate"] = legacy;
+    out["bytesPerPatient"] = n > 0 ? double(bytes) / n : 0.0;
+    out["legacyBytesPerPatientEstimate"] = n > 0 ? double(legacy) / n : 0.0;
+    out["scanFiles"] = m_lastScan.files;
+    out["scanIndexFiles"] = m_lastScanFromIndex;
+    out["scanDirs"] = m_lastScan.dirs;
+    out["scanMs"] = m_lastScanMs;
+    return out;
+}
 
-        if (!uniq.contains(key)) {
-            uniq.insert(key, p);
+bool Lib4DICOM::startStoreSCP(int port, const QString& aeTitle, int maxAssociations)
+{
+    if (port <= 0 || port > 65535) {
+        qWarning().noquote() << "[Lib4DICOM] StoreSCP: invalid port" << port;
+        return false;
+    }
+    if (!m_scp) {
+        m_scp = new StoreSCP(this);
+        connect(m_scp, &StoreSCP::instanceStored, this, &Lib4DICOM::onInstanceStored,
+            Qt::QueuedConnection);
+        connect(m_scp, &StoreSCP::runningChanged, this, &Lib4DICOM::storeSCPRunningChanged);
+    }
+    return m_scp->start(quint16(port), aeTitle, qBound(1, maxAssociations, 64));
+}
+
+void Lib4DICOM::stopStoreSCP()
+{
+    if (m_scp)
+        m_scp->stop();
+}
+
+bool Lib4DICOM::storeSCPRunning() const
+{
+    return m_scp && m_scp->isRunning();
+}
+
+QVariantMap Lib4DICOM::storeSCPStats() const
+{
+    if (!m_scp)
+        return { { "running", false } };
+    QVariantMap out = m_scp->stats();
+    out["running"] = m_scp->isRunning();
+    return out;
+}
+
+QVariantMap Lib4DICOM::benchmarkFind(int patients, int studiesPerPatient, int iterations)
+{
+    const QVariantMap out = IndexQuery::benchmark(patients, studiesPerPatient, iterations);
+    qDebug().noquote() << "[Lib4DICOM] benchmarkFind:" << out;
+    return out;
+}
+
+QVariantMap Lib4DICOM::benchmarkWindowLevel(int width, int height, int iterations)
+{
+    const QVariantMap out = GrayRenderer::benchmark(width, height, iterations);
+    qDebug().noquote() << "[Lib4DICOM] benchmarkWindowLevel:" << out;
+    return out;
+}
+
+QVariantMap Lib4DICOM::benchmarkPreprocess(int width, int height, int maxDimension, int iterations)
+{
+    const QVariantMap out = ImagePreprocessor::benchmark(width, height, maxDimension, iterations);
+    qDebug().noquote() << "[Lib4DICOM] benchmarkPreprocess:" << out;
+    return out;
+}
+
+QVariantMap Lib4DICOM::exportImages(const QStringList& folders, const QString& outDir,
+    const QString& format, const QString& seriesUID)
+{
+    const QString fmt = format.toLower();
+    if (fmt != QLatin1String("png") && fmt != QLatin1String("jpg") && fmt != QLatin1String("jpeg"))
+        return { { "ok", false }, { "error", "format must be png or jpg" } };
+    if (folders.isEmpty() || outDir.isEmpty())
+        return { { "ok", false }, { "error", "nothing to export" } };
+
+    ImageExporter::Options opt;
+    opt.outDir = outDir;
+    opt.format = fmt;
+    opt.seriesUID = seriesUID;
+    QVariantMap out = ImageExporter::run(folders, opt);
+    out["ok"] = out.value("failed").toInt() == 0;
+    return out;
+}
+
+namespace {
+    // все .dcm пациента: stub в корне папки (depth 0) и снимки исследований (depth 1)
+    QVector<DirWalker::Entry> patientFiles(const QString& patientFolder)
+    {
+        QVector<DirWalker::Entry> files;
+        DirWalker::walk(patientFolder, 1, [&](const DirWalker::Entry& e) { files.append(e); });
+        return files;
+    }
+
+    QVector<TagEditor::Edit> demographicEdits(const QVariantMap& p)
+    {
+        QVector<TagEditor::Edit> edits;
+        auto set = [&](const DcmTagKey& k, const QString& v) {
+            edits.append({ TagEditor::tagKey(k.getGroup(), k.getElement()), v, false });
+        };
+        if (p.contains("fullName"))
+            set(DCM_PatientName, p.value("fullName").toString().trimmed());
+        if (p.contains("patientID"))
+            set(DCM_PatientID, p.value("patientID").toString().trimmed());
+        if (p.contains("sex"))
+            set(DCM_PatientSex, p.value("sex").toString().trimmed().toUpper());
+
+        // дата рождения как в stub: birthDA (YYYYMMDD), иначе YYYY0101 из birthYear
+        const QString da = p.value("birthDA").toString().trimmed();
+        const QString by = p.value("birthYear").toString().trimmed();
+        if (da.size() == 8 && QDate::fromString(da, "yyyyMMdd").isValid())
+            set(DCM_PatientBirthDate, da);
+        else if (by.size() == 4 && QDate::fromString(by + "0101", "yyyyMMdd").isValid())
+            set(DCM_PatientBirthDate, by + "0101");
+        return edits;
+    }
+}
+
+QVariantMap Lib4DICOM::editPatientFiles(int index, const QVariantMap& patient)
+{
+    const QString folder = m_store.patientFolder(index);
+    if (folder.isEmpty() || m_roots.isRoot(folder))
+        return { { "ok", false }, { "error", "patient has no own folder" } };
+
+    const QVector<TagEditor::Edit> edits = demographicEdits(patient);
+    if (edits.isEmpty())
+        return { { "ok", false }, { "error", "nothing to change" } };
+
+    QVector<TagEditor::Item> items;
+    for (const DirWalker::Entry& e : patientFiles(folder))
+        items.append({ e.filePath, QString() });
+
+    TagEditor::Options opt;
+    opt.threads = m_saveThreads > 1 ? m_saveThreads.load() : 0;
+    opt.durability = m_saveDurability;
+    QVariantMap out = TagEditor::apply(items, edits, opt);
+    out["ok"] = out.value("failed").toInt() == 0;
+    return out;
+}
+
+void Lib4DICOM::rebuildDicomDir(int root)
+{
+    if (!m_useDicomDir || root < 0 || root >= m_roots.size())
+        return;
+    QStringList all;
+    DirWalker::walkRoot(m_roots.path(root), m_scanDepth, [&all](const DirWalker::Entry& e) { all << e.filePath; });
+    m_roots.dicomDir(root).rebuild(all);
+}
+
+QVariantMap Lib4DICOM::renamePatient(int index, const QVariantMap& patient)
+{
+    if (index < 0 || index >= m_store.size())
+        return { { "ok", false }, { "error", "index out of range" } };
+
+    QVariantMap out = editPatientFiles(index, patient);
+    if (out.value("edited").toInt() > 0) {
+        // в DICOMDIR остались старые ФИО/ID: после следующей его записи папка оказалась бы
+        // «не менявшейся» и правка откатилась бы при сканировании
+        rebuildDicomDir(m_roots.rootOf(m_store.patientFolder(index)));
+        scanPatients();
+    }
+    return out;
+}
+
+QVariantMap Lib4DICOM::mergePatients(int fromIndex, int intoIndex)
+{
+    if (fromIndex < 0 || fromIndex >= m_store.size() || intoIndex < 0 || intoIndex >= m_store.size()
+        || fromIndex == intoIndex)
+        return { { "ok", false }, { "error", "bad patient indexes" } };
+
+    const QString fromFolder = m_store.patientFolder(fromIndex);
+    const QString intoFolder = m_store.patientFolder(intoIndex);
+    if (QDir::cleanPath(fromFolder) == QDir::cleanPath(intoFolder))
+        return { { "ok", false }, { "error", "patients share one folder" } };
+
+    // демография целевого пациента: полная дата рождения есть только в stub
+    QVariantMap target;
+    target["fullName"] = m_store.fullName(intoIndex);
+    target["patientID"] = m_store.patientID(intoIndex);
+    target["sex"] = m_store.sex(intoIndex);
+    target["birthYear"] = m_store.birthYear(intoIndex);
+    const QVariantMap stub = findPatientStubByIndex(intoIndex);
+    if (stub.value("ok").toBool()) {
+        const QVariantMap d = readDemographicsFromFile(stub.value("stubPath").toString());
+        if (d.value("patientBirth").toString().size() == 8)
+            target["birthDA"] = d.value("patientBirth");
+    }
+
+    // DICOMDIR обоих корней пересоздаётся: в нём старая демография источника и старые пути
+    const int fromRoot = m_roots.rootOf(fromFolder);
+    const int intoRoot = m_roots.rootOf(intoFolder);
+    QVariantMap out = editPatientFiles(fromIndex, target);
+    if (!out.value("ok").toBool()) {
+        if (out.value("edited").toInt() > 0) {
+            rebuildDicomDir(fromRoot);
+            scanPatients();
+        }
+        return out;
+    }
+
+    // исследования переезжают целиком (rename папки), stub и .contenthash источника больше не нужны
+    int moved = 0;
+    const QDir from(fromFolder);
+    for (const QFileInfo& fi : from.entryInfoList(QDir::Dirs | QDir::NoDotAndDotDot, QDir::Name)) {
+        const QString slot = m_folders.allocate(intoFolder, fi.fileName());
+        if (slot.isEmpty() || !QDir().rmdir(slot) || !QDir().rename(fi.absoluteFilePath(), slot)) {
+            qWarning().noquote() << "[Lib4DICOM] mergePatients: cannot move" << fi.absoluteFilePath() << "->" << intoFolder;
+            out["ok"] = false;
+            continue;
         }
+        ++moved;
     }
+    if (out.value("ok").toBool()) {
+        for (const QFileInfo& fi : from.entryInfoList(QDir::Files | QDir::Hidden | QDir::NoDotAndDotDot))
+            QFile::remove(fi.absoluteFilePath());
+        QDir().rmdir(fromFolder);
+    }
+    out["studiesMoved"] = moved;
 
-    m_patients = uniq.values();
-    endResetModel();
+    qDebug().noquote() << "[Lib4DICOM] mergePatients:" << fromFolder << "->" << intoFolder
+        << "," << moved << "studies moved";
+    rebuildDicomDir(fromRoot);
+    if (intoRoot != fromRoot)
+        rebuildDicomDir(intoRoot);
+    scanPatients();
+    return out;
 }
 
-// DICOM файл-заглушка в корне папки пациента
-QVariantMap Lib4DICOM::createPatientStubDicom(const QString& patientFolder)
+QVariantMap Lib4DICOM::pseudonymizePatient(int index, const QString& outDir,
+    const QString& pseudonym, const QString& pseudoID)
 {
-    QVariantMap out;
+    if (index < 0 || index >= m_store.size())
+        return { { "ok", false }, { "error", "index out of range" } };
+    if (outDir.isEmpty() || pseudonym.trimmed().isEmpty())
+        return { { "ok", false }, { "error", "outDir and pseudonym are required" } };
+
+    const QString folder = m_store.patientFolder(index);
+    if (folder.isEmpty() || m_roots.isRoot(folder))
+        return { { "ok", false }, { "error", "patient has no own folder" } };
+
+    // имена папок и файлов архива содержат ФИО и PatientID, поэтому на выходе — порядковые имена:
+    // <outDir>/<псевдоним>/STUDY_001/IMG_00001.dcm; stub пациента не выгружается
+    const QString base = QDir(outDir).absoluteFilePath(sanitizeName(pseudonym.trimmed()));
+    QHash<QString, QString> studyDirs;
+    QHash<QString, int> counters;
+    QVector<TagEditor::Item> items;
+    QVector<DirWalker::Entry> files = patientFiles(folder);
+    std::sort(files.begin(), files.end(), [](const DirWalker::Entry& a, const DirWalker::Entry& b) {
+        return a.filePath < b.filePath;
+    });
+    for (const DirWalker::Entry& e : files) {
+        if (e.depth == 0)
+            continue;
+        QString& dir = studyDirs[e.dirPath];
+        if (dir.isEmpty())
+            dir = QString("%1/STUDY_%2").arg(base).arg(studyDirs.size(), 3, 10, QChar('0'));
+        const int n = ++counters[e.dirPath];
+        items.append({ e.filePath, QString("%1/IMG_%2.dcm").arg(dir).arg(n, 5, 10, QChar('0')) });
+    }
+    if (items.isEmpty())
+        return { { "ok", false }, { "error", "patient has no images" } };
+
+    TagEditor::Options opt;
+    opt.threads = m_saveThreads > 1 ? m_saveThreads.load() : 0;
+    opt.durability = m_saveDurability;
+    opt.newUIDs = true;
+    QVariantMap out = TagEditor::apply(items,
+        TagEditor::pseudonymizeEdits(pseudonym.trimmed(), pseudoID.isEmpty() ? pseudonym.trimmed() : pseudoID),
+        opt);
+    out["ok"] = out.value("failed").toInt() == 0;
+    out["outDir"] = base;
+    return out;
+}
 
-    if (m_selectedPatient.fullName.trimmed().isEmpty() &&
-        m_selectedPatient.patientID.trimmed().isEmpty())
+// ---------------- Перевод раскладки архива ----------------
+QString Lib4DICOM::prepareMigration(int layout)
+{
+    if (layout != StorageRoots::Flat && layout != StorageRoots::FanOut)
+        return "unknown layout";
+    if (m_migrateThread)
+        return "layout migration already running";
+    if (m_scp && m_scp->isRunning())
+        return "stop the C-STORE receiver first";
+
+    setArchiveLayout(layout);   // новые пациенты сразу идут в целевую раскладку
+    m_session->flushDicomDir(); // отложенные пути сессии после переноса устарели бы
+    return QString();
+}
+
+QVariantMap Lib4DICOM::migrateLayout(int layout)
+{
+    const QString error = prepareMigration(layout);
+    if (!error.isEmpty())
+        return { { "ok", false }, { "error", error } };
+    return runMigration(StorageRoots::Layout(layout), DurableBatch::Mode(m_saveDurability.load()));
+}
+
+bool Lib4DICOM::startMigrateLayout(int layout)
+{
+    const QString error = prepareMigration(layout);
+    if (!error.isEmpty()) {
+        qWarning().noquote() << "[Lib4DICOM] startMigrateLayout:" << error;
+        return false;
+    }
+
+    const StorageRoots::Layout target = StorageRoots::Layout(layout);
+    const DurableBatch::Mode durability = DurableBatch::Mode(m_saveDurability.load());
+    m_migrateThread = QThread::create([this, target, durability]() {
+        const QVariantMap result = runMigration(target, durability);
+        QMetaObject::invokeMethod(this, [this, result]() {
+            m_migrateThread->wait();
+            delete m_migrateThread;
+            m_migrateThread = nullptr;
+            emit migratingChanged();
+            emit migrateFinished(result);
+        }, Qt::QueuedConnection);
+    });
+    m_migrateThread->setObjectName("LayoutMigration");
+    m_migrateThread->start();
+    emit migratingChanged();
+    return true;
+}
+
+void Lib4DICOM::notifyFoldersMoved()
+{
+    // пути в строках списка и узлах дерева устарели; сброс списка перестраивает и дерево
+    auto reset = [this]() {
+        beginResetModel();
+        endResetModel();
+    };
+    if (QThread::currentThread() == thread())
+        reset();
+    else
+        QMetaObject::invokeMethod(this, reset, Qt::QueuedConnection);
+}
+
+QVariantMap Lib4DICOM::runMigration(StorageRoots::Layout target, DurableBatch::Mode durability)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    // Что известно индексу о каждой папке пациента (снимок под блокировкой чтения)
+    struct Known {
+        QString      patientID;
+        QString      base;      // ключ веера для пациента без PatientID
+        QVector<int> rows;      // в одной папке может лежать несколько строк индекса
+        QVector<int> studies;
+    };
+    QHash<QString, Known> known;
     {
-        out["ok"] = false; out["error"] = "no selected patient"; return out;
+        QReadLocker lock(&m_storeLock);
+        for (int row = 0; row < m_store.size(); ++row) {
+            const QString folder = m_store.patientFolder(row);
+            if (folder.isEmpty() || m_roots.isRoot(folder))
+                continue;
+            Known& k = known[folder];
+            if (k.rows.isEmpty()) {
+                const QString name = m_store.fullName(row);
+                const QString year = m_store.birthYear(row);
+                k.patientID = m_store.patientID(row);
+                k.base = patientFolderBase(name == "--" ? QString() : name, year == "--" ? QString() : year);
+            }
+            k.rows << row;
+        }
+        for (int srow = 0; srow < m_store.studyRows(); ++srow) {
+            const auto it = known.find(m_store.patientFolder(m_store.studyPatient(srow)));
+            if (it != known.end())
+                it->studies << srow;
+        }
+    }
+
+    // PatientID папки, которой нет в индексе (глубже scanDepth, не читалась) — из первого снимка
+    auto folderPatientID = [](const QString& folder) -> QString {
+        for (const DirWalker::Entry& e : patientFiles(folder)) {
+            DcmFileFormat ff;
+            if (ff.loadFile(QFile::encodeName(e.filePath).constData(), EXS_Unknown,
+                EGL_noChange, kHeaderOnlyReadLength).bad())
+                continue;
+            OFString v, cs;
+            DcmDataset* ds = ff.getDataset();
+            ds->findAndGetOFStringArray(DCM_SpecificCharacterSet, cs);
+            if (ds->findAndGetOFString(DCM_PatientID, v).good())
+                return decodeDicomText(v, cs).trimmed();
+            return QString();
+        }
+        return QString();
+    };
+
+    const bool sync = durability != DurableBatch::Unsafe;
+    int moved = 0, kept = 0, failed = 0;
+    for (int r = 0; r < m_roots.size(); ++r) {
+        const QString root = m_roots.path(r);
+        const QString journal = root + '/' + kLayoutJournal;
+        const QStringList folders = StorageRoots::patientDirs(root);
+
+        // журнал пишется до первого переноса и снимается только после пересоздания DICOMDIR
+        {
+            QFile j(journal);
+            if (!j.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+                qWarning().noquote() << "[Lib4DICOM] migrateLayout: cannot write" << journal;
+                failed += folders.size();
+                continue;
+            }
+            j.write(target == StorageRoots::FanOut ? "fanout\n" : "flat\n");
+        }
+        if (sync) {
+            DurableIO::syncFile(journal);
+            DurableIO::syncDir(root);
+        }
+
+        int movedHere = 0, failedHere = 0;
+        QSet<QString> touchedDirs;
+        for (const QString& folder : folders) {
+            const QString name = QFileInfo(folder).fileName();
+            const auto it = known.constFind(folder);
+            const QString pid = it != known.cend() ? it->patientID : folderPatientID(folder);
+            const QString base = it != known.cend() ? it->base : name;
+
+            const QString oldParent = QFileInfo(folder).absolutePath();
+            const QString parent = StorageRoots::patientParent(root, target, pid, base);
+            if (QDir::cleanPath(oldParent) == QDir::cleanPath(parent)) {
+                ++kept;
+                continue;
+            }
+
+            // папка переезжает одним rename; имя сохраняется, если в корзине оно свободно
+            const QString slot = QDir().mkpath(parent) ? m_folders.allocate(parent, name) : QString();
+            if (slot.isEmpty() || !QDir().rmdir(slot) || !QDir().rename(folder, slot)) {
+                qWarning().noquote() << "[Lib4DICOM] migrateLayout: cannot move" << folder << "->" << parent;
+                ++failedHere;
+                continue;
+            }
+            touchedDirs << oldParent << parent;
+            ++movedHere;
+
+            if (it != known.cend()) {
+                // строки, которые успел заменить scanPatients, не трогаем
+                QWriteLocker lock(&m_storeLock);
+                for (int row : it->rows)
+                    if (row < m_store.size() && m_store.patientFolder(row) == folder)
+                        m_store.setPatientFolder(row, slot);
+                for (int srow : it->studies) {
+                    if (srow >= m_store.studyRows())
+                        continue;
+                    const QString studyFolder = m_store.studyFolder(srow);
+                    if (studyFolder.startsWith(folder + '/'))
+                        m_store.setStudyFolder(srow, slot + studyFolder.mid(folder.size()));
+                }
+            }
+        }
+
+        if (target == StorageRoots::Flat) {
+            // опустевшие корзины веера (rmdir непустой папки просто не срабатывает)
+            const QDir::Filters dirs = QDir::Dirs | QDir::NoDotAndDotDot;
+            for (const QFileInfo& b1 : QDir(root).entryInfoList(dirs)) {
+                if (!DirWalker::isBucketName(b1.fileName()))
+                    continue;
+                for (const QFileInfo& b2 : QDir(b1.absoluteFilePath()).entryInfoList(dirs))
+                    if (DirWalker::isBucketName(b2.fileName()) && QDir().rmdir(b2.absoluteFilePath()))
+                        touchedDirs << b1.absoluteFilePath();
+                if (QDir().rmdir(b1.absoluteFilePath()))
+                    touchedDirs << root;
+            }
+        }
+        if (sync)
+            for (const QString& d : touchedDirs)
+                if (QFileInfo::exists(d))
+                    DurableIO::syncDir(d);
+
+        // DICOMDIR хранит пути файлов — после переноса он пересоздаётся обходом корня
+        if (movedHere > 0) {
+            rebuildDicomDir(r);
+            notifyFoldersMoved();
+        }
+        if (failedHere == 0) {
+            QFile::remove(journal);
+            if (sync)
+                DurableIO::syncDir(root);
+        }
+        moved += movedHere;
+        failed += failedHere;
+    }
+    if (moved > 0)
+        m_contentHashes.clear();   // кэш .contenthash по старым путям папок
+
+    const double seconds = timer.elapsed() / 1000.0;
+    qDebug().noquote() << "[Lib4DICOM] migrateLayout:" << (target == StorageRoots::FanOut ? "fan-out," : "flat,")
+        << moved << "moved," << kept << "already in place," << failed << "failed in" << seconds << "s";
+
+    QVariantMap out;
+    out["ok"] = failed == 0;
+    out["moved"] = moved;
+    out["kept"] = kept;
+    out["failed"] = failed;
+    out["roots"] = m_roots.size();
+    out["seconds"] = seconds;
+    return out;
+}
+
+bool Lib4DICOM::exportStudies(const QStringList& folders, const QString& host, int port,
+    const QString& calledAE, int associations)
+{
+    if (m_exportThread) {
+        qWarning().noquote() << "[Lib4DICOM] exportStudies: export already running";
+        return false;
+    }
+    if (folders.isEmpty() || host.isEmpty() || port <= 0 || port > 65535) {
+        qWarning().noquote() << "[Lib4DICOM] exportStudies: nothing to send or bad peer" << host << port;
+        return false;
+    }
+
+    if (!m_exporter) {
+        m_exporter = new StoreSCU(this);
+        connect(m_exporter, &StoreSCU::progress, this, &Lib4DICOM::exportProgress, Qt::QueuedConnection);
+    }
+
+    StoreSCU::Options opt;
+    opt.host = host;
+    opt.port = quint16(port);
+    opt.calledAE = calledAE.isEmpty() ? QStringLiteral("ANY-SCP") : calledAE;
+    opt.associations = qBound(1, associations, 32);
+
+    StoreSCU* scu = m_exporter;
+    m_exportThread = QThread::create([this, scu, folders, opt]() {
+        const QVariantMap result = scu->send(StoreSCU::collectFiles(folders), opt);
+        QMetaObject::invokeMethod(this, [this, result]() {
+            m_exportThread->wait();
+            delete m_exportThread;
+            m_exportThread = nullptr;
+            emit exportingChanged();
+            emit exportFinished(result);
+        }, Qt::QueuedConnection);
+    });
+    m_exportThread->setObjectName("StoreSCU");
+    m_exportThread->start();
+    emit exportingChanged();
+    return true;
+}
+
+void Lib4DICOM::cancelExport()
+{
+    if (m_exportThread)
+        m_exporter->cancel();
+}
+
+// ---------------- Фоновая проверка архива ----------------
+bool Lib4DICOM::startVerify(double mbPerSec, const QString& reportPath)
+{
+    if (m_verifyThread) {
+        qWarning().noquote() << "[Lib4DICOM] startVerify: verification already running";
+        return false;
+    }
+
+    if (!m_verifier) {
+        m_verifier = new ArchiveVerifier(this);
+        connect(m_verifier, &ArchiveVerifier::progress, this, &Lib4DICOM::verifyProgress, Qt::QueuedConnection);
+        connect(m_verifier, &ArchiveVerifier::finding, m_findings, &VerifyFindingsModel::append, Qt::QueuedConnection);
+    }
+    m_findings->clear();
+
+    ArchiveVerifier::Options opt;
+    opt.mbPerSec = qMax(0.0, mbPerSec);
+    opt.depth = m_scanDepth;
+    opt.reportPath = reportPath;
+
+    // корни копируются: список меняется только в потоке GUI
+    ArchiveVerifier* verifier = m_verifier;
+    const QStringList roots = m_roots.paths();
+    m_verifyThread = QThread::create([this, verifier, roots, opt]() {
+        const QVariantMap result = verifier->verify(roots, opt);
+        QMetaObject::invokeMethod(this, [this, result]() {
+            m_verifyThread->wait();
+            delete m_verifyThread;
+            m_verifyThread = nullptr;
+            emit verifyingChanged();
+            emit verifyFinished(result);
+        }, Qt::QueuedConnection);
+    });
+    m_verifyThread->setObjectName("ArchiveVerifier");
+    m_verifyThread->start(QThread::LowestPriority);
+    emit verifyingChanged();
+    return true;
+}
+
+void Lib4DICOM::cancelVerify()
+{
+    if (m_verifyThread)
+        m_verifier->cancel();
+}
+
+QObject* Lib4DICOM::verifyFindings() const {
+    return m_findings;
+}
+
+void Lib4DICOM::onInstanceStored(const QString& path, const QString& patientFolder,
+    const QString& studyFolder)
+{
+    // Принятый снимок уже лежит на месте: дописываем индекс и модель без пересканирования.
+    QWriteLocker storeLock(&m_storeLock);
+    const int before = m_store.size();
+    const int row = indexDicomFile(path, patientFolder, studyFolder);
+    storeLock.unlock();
+    if (row < 0)
+        return;
+
+    if (m_store.size() > before && m_loadedRows == before) {
+        // все строки уже показаны — новый пациент сразу появляется в списке
+        beginInsertRows(QModelIndex(), before, m_store.size() - 1);
+        m_loadedRows = m_store.size();
+        endInsertRows();
+    }
+    else if (row < m_loadedRows) {   // иначе новая строка подгрузится через fetchMore
+        const QModelIndex idx = index(row);
+        emit dataChanged(idx, idx, { StudyCountRole, ImageCountRole, LastStudyDateRole });
+    }
+
+    if (!m_useDicomDir)
+        return;
+
+    // DICOMDIR дописывается пачками: при потоковом приёме переписывать его на каждый снимок дорого
+    m_pendingDicomDir << path;
+    if (!m_dicomDirFlush) {
+        m_dicomDirFlush = new QTimer(this);
+        m_dicomDirFlush->setSingleShot(true);
+        m_dicomDirFlush->setInterval(2000);
+        connect(m_dicomDirFlush, &QTimer::timeout, this, [this] {
+            const QStringList files = std::exchange(m_pendingDicomDir, QStringList());
+            m_roots.addToDicomDir(files);
+        });
+    }
+    m_dicomDirFlush->start();
+}
+
+// Замер режимов записи на том же томе, что и архив.
+// Серия синтетических снимков пишется в скрытую папку patients/.durability-bench
+// (сканер её не видит) по разу в каждом режиме; папка удаляется после замера.
+QVariantMap Lib4DICOM::benchmarkSaveDurability(int files, int width, int height)
+{
+    QVariantMap out;
+    files = qBound(1, files, 10000);
+    width = qBound(4, width, 8192);   // первые пиксели строки — метка кадра
+    height = qBound(1, height, 8192);
+
+    const QString benchRoot = patientsRoot() + "/.durability-bench";
+    QDir(benchRoot).removeRecursively();
+
+    QImage img(width, height, QImage::Format_Grayscale8);
+    for (int y = 0; y < height; ++y) {
+        uchar* line = img.scanLine(y);
+        for (int x = 0; x < width; ++x)
+            line[x] = uchar((x + y) & 0xFF);
+    }
+    QVector<QImage> images(files, img);
+
+    Patient p;
+    p.fullName = "BENCH";
+    p.patientID = "BENCH";
+    p.sex = "O";
+    p.seriesName = "BENCH";
+
+    const DurableBatch::Mode modes[] = {
+        DurableBatch::Unsafe, DurableBatch::SyncEachFile, DurableBatch::GroupCommit
+    };
+    for (DurableBatch::Mode mode : modes) {
+        const QString name = DurableBatch::modeName(mode);
+        // метка (номер кадра, режим) в первых пикселях: одинаковые кадры отсеяла бы проверка
+        // дублей, и замер мерил бы пропуск, а не запись
+        for (int i = 0; i < files; ++i) {
+            uchar* line = images[i].scanLine(0);
+            line[0] = uchar(i & 0xFF);
+            line[1] = uchar((i >> 8) & 0xFF);
+            line[2] = uchar(mode);
+        }
+        p.studyFolder = benchRoot + '/' + name;
+        if (!QDir().mkpath(p.studyFolder)) {
+            out["ok"] = false; out["error"] = "cannot create " + p.studyFolder; return out;
+        }
+
+        QElapsedTimer timer;
+        timer.start();
+        const int saved = writeSeries(p, images, mode, 1).saved;
+        const double sec = timer.nsecsElapsed() / 1e9;
+
+        QVariantMap r;
+        r["files"] = saved;
+        r["ms"] = sec * 1000.0;
+        r["filesPerSec"] = sec > 0 ? saved / sec : 0.0;
+        out[name] = r;
+
+        qDebug().noquote() << "[Lib4DICOM] durability bench:" << name << saved << "files,"
+            << QString::number(sec > 0 ? saved / sec : 0.0, 'f', 1) << "files/s";
     }
 
-    const Patient& p = m_selectedPatient;
+    QDir(benchRoot).removeRecursively();
+    out["ok"] = true;
+    return out;
+}
+
+QVariantMap Lib4DICOM::pixelPoolStats() const
+{
+    const PixelBufferPool::Stats s = m_pixelPool.stats();
+    QVariantMap out;
+    out["takes"] = s.takes;
+    out["reused"] = s.reused;
+    out["allocated"] = s.allocated;
+    out["allocatedBytes"] = s.allocatedBytes;
+    out["conversions"] = s.conversions;
+    out["dropped"] = s.dropped;
+    out["cachedBytes"] = s.cachedBytes;
+    out["cachedBuffers"] = s.cachedBuffers;
+    out["enabled"] = s.enabled;
+    out["reuseRate"] = s.takes > 0 ? double(s.reused) / double(s.takes) : 0.0;
+    return out;
+}
+
+QVariantMap Lib4DICOM::benchmarkPixelPool(int batches, int perBatch, int width, int height)
+{
+    QVariantMap out;
+    batches = qBound(2, batches, 200);
+    perBatch = qBound(1, perBatch, 1000);
+    width = qBound(1, width, 8192);
+    height = qBound(1, height, 8192);
+
+    const QString benchRoot = patientsRoot() + "/.pool-bench";
+    QDir(benchRoot).removeRecursively();
+
+    // RGB32, как у снимков экрана: идёт в Pixel Data без промежуточного QImage
+    QVector<QImage> images(perBatch);
+    for (int i = 0; i < perBatch; ++i) {
+        images[i] = QImage(width, height, QImage::Format_RGB32);
+        for (int y = 0; y < height; ++y) {
+            QRgb* line = reinterpret_cast<QRgb*>(images[i].scanLine(y));
+            for (int x = 0; x < width; ++x)
+                line[x] = qRgb((x + i) & 0xFF, (y + i) & 0xFF, (x ^ y) & 0xFF);
+        }
+    }
+
+    Patient p;
+    p.fullName = "BENCH";
+    p.patientID = "BENCH";
+    p.sex = "O";
+    p.seriesName = "BENCH";
+
+    const bool wasEnabled = m_pixelPool.stats().enabled;
+    for (const bool pooled : { false, true }) {
+        const QString name = pooled ? "pooled" : "unpooled";
+        m_pixelPool.setEnabled(pooled);
+        m_pixelPool.clear();
+
+        QVariantList perImage;
+        int steadyAllocs = 0, steadyImages = 0, saved = 0;
+        qint64 ns = 0;
+        for (int b = 0; b < batches; ++b) {
+            // метка порции в первом пикселе: иначе кадры следующей порции отсеет проверка дублей
+            for (int i = 0; i < perBatch; ++i)
+                images[i].setPixel(0, 0, qRgb(b & 0xFF, i & 0xFF, (b >> 8) & 0xFF));
+            p.studyFolder = benchRoot + '/' + name + '/' + QString::number(b);
+            p.seriesUID.clear();
+            if (!QDir().mkpath(p.studyFolder)) {
+                m_pixelPool.setEnabled(wasEnabled);
+                out["ok"] = false; out["error"] = "cannot create " + p.studyFolder; return out;
+            }
+
+            QElapsedTimer timer;
+            timer.start();
+            const SeriesWriteStats st = writeSeries(p, images, DurableBatch::Unsafe, 1);
+            ns += timer.nsecsElapsed();
+            saved += st.saved;
+            perImage << double(st.bufferAllocations) / perBatch;
+            if (b > 0) {   // первая порция наполняет пул
+                steadyAllocs += st.bufferAllocations;
+                steadyImages += perBatch;
+            }
+        }
+
+        const double sec = ns / 1e9;
+        QVariantMap r;
+        r["files"] = saved;
+        r["filesPerSec"] = sec > 0 ? saved / sec : 0.0;
+        r["allocationsPerImage"] = perImage;
+        r["steadyAllocationsPerImage"] = steadyImages > 0 ? double(steadyAllocs) / steadyImages : 0.0;
+        out[name] = r;
+
+        qDebug().noquote() << "[Lib4DICOM] pixel pool bench:" << name << saved << "files,"
+            << QString::number(sec > 0 ? saved / sec : 0.0, 'f', 1) << "files/s,"
+            << r.value("steadyAllocationsPerImage").toDouble() << "allocations per image";
+    }
+    out["pool"] = pixelPoolStats();
+    m_pixelPool.setEnabled(wasEnabled);
+
+    QDir(benchRoot).removeRecursively();
+    out["width"] = width;
+    out["height"] = height;
+    out["threads"] = m_saveThreads.load();
+    out["ok"] = true;
+    return out;
+}
+
+// DICOM файл-заглушка в корне папки пациента
+QVariantMap Lib4DICOM::createPatientStubDicom(const QString& patientFolder)
+{
+    return m_session->createPatientStub(patientFolder);
+}
+
+// Запись stub-файла пациента p в patientFolder; потокобезопасна (вызывается и из приёма C-STORE)
+QVariantMap Lib4DICOM::writePatientStub(const Patient& p, const QString& patientFolder) const
+{
+    QVariantMap out;
 
     if (patientFolder.isEmpty() || !QDir(patientFolder).exists()) {
         out["ok"] = false; out["error"] = "patient folder does not exist"; return out;
@@ -446,35 +1482,57 @@ QVariantMap Lib4DICOM::createPatientStubDicom(const QString& patientFolder)
         absPath = QDir(patientFolder).absoluteFilePath(fileName);
     }
 
-    const OFCondition st = file.saveFile(absPath.toLocal8Bit().constData(),
+    DurableBatch batch(QDir(patientFolder).absolutePath(), DurableBatch::Mode(m_saveDurability.load()));
+    const QString tmpPath = batch.tempPathFor(absPath);
+
+    const OFCondition st = file.saveFile(tmpPath.toLocal8Bit().constData(),
         EXS_LittleEndianExplicit, EET_ExplicitLength, EGL_recalcGL, EPD_withoutPadding);
-    if (st.good()) {
-        qDebug().noquote() << "[Lib4DICOM] patient stub saved:" << absPath;
-        out["ok"] = true;
-        out["path"] = absPath;
-    }
-    else {
+    if (st.bad()) {
         qWarning().noquote() << "[Lib4DICOM] patient stub save failed:" << st.text();
+        if (tmpPath != absPath)
+            QFile::remove(tmpPath);
         out["ok"] = false;
         out["error"] = QString::fromLatin1(st.text());
     }
+    else if (!batch.add(tmpPath, absPath) || !batch.commit()) {
+        qWarning().noquote() << "[Lib4DICOM] patient stub publish failed:" << absPath;
+        out["ok"] = false;
+        out["error"] = "cannot publish stub file";
+    }
+    else {
+        qDebug().noquote() << "[Lib4DICOM] patient stub saved:" << absPath;
+        out["ok"] = true;
+        out["path"] = absPath;
+    }
     return out;
 }
 
 // ---------------- Сохранение DICOM (SC) ----------------
-void Lib4DICOM::saveImagesAsDicom(const QVector<QImage>& images)
+SeriesWriteStats Lib4DICOM::saveImagesAsDicom(const QVector<QImage>& images, int firstInstance)
 {
-    if (m_selectedPatient.fullName.trimmed().isEmpty() &&
-        m_selectedPatient.patientID.trimmed().isEmpty()) {
-        qWarning().noquote() << "[Lib4DICOM] saveImagesAsDicom: no selected patient";
-        return;
-    }
-    if (images.isEmpty()) {
-        qWarning().noquote() << "[Lib4DICOM] saveImagesAsDicom: images is empty";
-        return;
-    }
+    return m_session->saveImages(images, firstInstance);
+}
+
+std::unique_ptr<ImportSession> Lib4DICOM::createImportSession(const QVariantMap& patient)
+{
+    return std::make_unique<ImportSession>(this, newPatientFromMap(patient));
+}
+
+std::unique_ptr<ImportSession> Lib4DICOM::createImportSession(int index)
+{
+    // m_store перестраивается scanPatients() в потоке GUI
+    QReadLocker lock(&m_storeLock);
+    if (index < 0 || index >= m_store.size())
+        return nullptr;
+    return std::make_unique<ImportSession>(this, m_store.patient(index));
+}
 
-    const Patient& p = m_selectedPatient;
+// Запись серии в p.studyFolder: каждый файл через DurableBatch (временный файл + rename).
+// Снимки готовятся и пишутся в m_saveThreads потоков, публикуются по порядку номеров.
+SeriesWriteStats Lib4DICOM::writeSeries(const Patient& p, const QVector<QImage>& images,
+    DurableBatch::Mode mode, int firstInstance)
+{
+    SeriesWriteStats stats;
 
     const QString outFolder = p.studyFolder;
     const QString seriesName = p.seriesName;
@@ -483,7 +1541,7 @@ void Lib4DICOM::saveImagesAsDicom(const QVector<QImage>& images)
     QDir dir(outFolder);
     if (outFolder.isEmpty() || !dir.exists()) {
         qWarning().noquote() << "[Lib4DICOM] saveImagesAsDicom: output folder does not exist:" << outFolder;
-        return;
+        return stats;
     }
 
     const QDateTime now = QDateTime::currentDateTime();
@@ -491,24 +1549,32 @@ void Lib4DICOM::saveImagesAsDicom(const QVector<QImage>& images)
     const QString   studyTime = now.time().toString("HHmmss");
 
     const QString studyUID = studyUIDIn.isEmpty() ? generateDicomUID() : studyUIDIn;
-    const QString seriesUID = generateDicomUID();
+    const QString seriesUID = p.seriesUID.isEmpty() ? generateDicomUID() : p.seriesUID;
 
     const QString idToken = p.patientID.isEmpty() ? QStringLiteral("--") : p.patientID;
+    const QString label = studyLabel();
     const QString seriesToken = seriesName.trimmed().isEmpty()
-        ? (m_studyLabel.isEmpty() ? QStringLiteral("SER") : m_studyLabel)
+        ? (label.isEmpty() ? QStringLiteral("SER") : label)
         : seriesName.trimmed();
 
     const QByteArray baPN = p.fullName.toUtf8();
     const QByteArray baPID = idToken.toUtf8();
     const QByteArray baSex = p.sex.toUtf8();
 
-    QStringList outFiles;
-    int saved = 0;
+    DurableBatch batch(dir.absolutePath(), mode);
 
-    auto makeDenseBuffer = [](const QImage& in,
-        QByteArray& pixelData, int& rows, int& cols,
+    const auto dedup = ContentHashIndex::Scope(m_dedupScope.load());
+    const QString patientFolder = p.patientFolder.isEmpty()
+        ? QFileInfo(dir.absolutePath()).absolutePath() : QDir(p.patientFolder).absolutePath();
+
+    // Кадр пишется прямо в значение Pixel Data из m_pixelPool (DCMTK при put копирует массив,
+    // промежуточный буфер не нужен). RGB32/ARGB32 переводятся в RGB построчно на месте,
+    // прочие цветные форматы — через QImage::convertToFormat.
+    auto makePixelData = [this](const QImage& in, std::unique_ptr<DcmPixelData>& pixels,
+        int& rows, int& cols,
         int& samplesPerPixel, int& bitsAllocated, int& bitsStored, int& highBit,
-        int& planarConfig, int& pixelRepr, const char*& photometric)->bool
+        int& planarConfig, int& pixelRepr, const char*& photometric, quint64& contentHash,
+        int& allocations)->bool
         {
             QImage img = in;
 
@@ -523,37 +1589,105 @@ void Lib4DICOM::saveImagesAsDicom(const QVector<QImage>& images)
                 samplesPerPixel = 1; bitsAllocated = 16; bitsStored = 16; highBit = 15; photometric = "MONOCHROME2";
             }
 #endif
-            else {
+            else if (img.format() != QImage::Format_RGB888 && img.format() != QImage::Format_RGB32
+                && img.format() != QImage::Format_ARGB32) {
                 img = img.convertToFormat(QImage::Format_RGB888);
+                m_pixelPool.noteConversion();
+                ++allocations;
             }
 
             rows = img.height(); cols = img.width();
             const int srcStride = img.bytesPerLine();
             const int dstStride = cols * samplesPerPixel * (bitsAllocated / 8);
+            const qint64 dense = qint64(rows) * dstStride;
+            if (dense <= 0 || dense >= 0xFFFFFFFFll) {
+                qWarning().noquote() << "[Lib4DICOM] image" << cols << "x" << rows << "does not fit into Pixel Data";
+                return false;
+            }
+            const quint32 length = quint32(dense + 1) & ~1u;   // длина значения DICOM чётная
 
-            pixelData.clear();
-            pixelData.resize(rows * dstStride);
+            uchar* dst = nullptr;
+            bool reused = false;
+            pixels = m_pixelPool.take(length, dst, &reused);
+            if (!pixels)
+                return false;
+            if (!reused)
+                ++allocations;
 
             const uchar* src = img.constBits();
-            uchar* dst = reinterpret_cast<uchar*>(pixelData.data());
-            for (int y = 0; y < rows; ++y)
-                std::memcpy(dst + y * dstStride, src + y * srcStride, size_t(dstStride));
+            if (img.format() == QImage::Format_RGB32 || img.format() == QImage::Format_ARGB32) {
+                for (int y = 0; y < rows; ++y) {
+                    const QRgb* s = reinterpret_cast<const QRgb*>(src + y * srcStride);
+                    uchar* d = dst + y * dstStride;
+                    for (int x = 0; x < cols; ++x, d += 3) {
+                        d[0] = uchar(qRed(s[x]));
+                        d[1] = uchar(qGreen(s[x]));
+                        d[2] = uchar(qBlue(s[x]));
+                    }
+                }
+            }
+            else {
+                for (int y = 0; y < rows; ++y)
+                    std::memcpy(dst + y * dstStride, src + y * srcStride, size_t(dstStride));
+            }
+            if (length != quint32(dense))
+                dst[length - 1] = 0;
 
-            if (pixelData.size() % 2 != 0) pixelData.append('\0');
+            // отпечаток кадра: пиксели + геометрия (те же байты в другой раскладке — другой кадр)
+            const quint32 geometry[4] = { quint32(rows), quint32(cols),
+                quint32(samplesPerPixel), quint32(bitsAllocated) };
+            contentHash = xxh64(dst, size_t(length), xxh64(geometry, sizeof(geometry)));
             return true;
         };
 
-    for (int i = 0; i < images.size(); ++i) {
+    const int n = images.size();
+    QVector<QString> tmpPaths(n), absPaths(n);
+    QVector<qint64> fileBytes(n, -1), fileNs(n, 0);
+    QVector<quint64> hashes(n, 0);
+    QVector<bool> claimed(n, false);
+    QVector<QString> duplicateOf(n);
+    std::atomic<int> allocations{ 0 };
+
+    // подготовка датасета и запись во временный файл; потокобезопасна по i
+    auto writeOne = [&](int i) {
+        QElapsedTimer timer;
+        timer.start();
+        const int instance = firstInstance + i;
+
         if (images[i].isNull()) {
             qWarning().noquote() << "[Lib4DICOM] image" << i << "is null";
-            continue;
+            return;
         }
 
-        QByteArray pixelData; int rows = 0, cols = 0;
+        std::unique_ptr<DcmPixelData> pixels; int rows = 0, cols = 0;
         int samplesPerPixel = 0, bitsAllocated = 0, bitsStored = 0, highBit = 0;
         int planarConfig = 0, pixelRepr = 0; const char* photometric = "RGB";
-        if (!makeDenseBuffer(images[i], pixelData, rows, cols, samplesPerPixel, bitsAllocated, bitsStored, highBit, planarConfig, pixelRepr, photometric))
-            continue;
+        quint64 contentHash = 0; int allocated = 0;
+        const bool made = makePixelData(images[i], pixels, rows, cols, samplesPerPixel, bitsAllocated, bitsStored,
+            highBit, planarConfig, pixelRepr, photometric, contentHash, allocated);
+        allocations += allocated;
+        if (!made)
+            return;
+
+        const QString fileName = QString("%1_%2_%3_%4_%5.dcm")
+            .arg(idToken).arg(seriesToken).arg(studyDate).arg(studyTime)
+            .arg(instance, 3, 10, QChar('0'));
+        const QString absPath = dir.absoluteFilePath(fileName);
+
+        if (dedup != ContentHashIndex::Off) {
+            const QString existing = m_contentHashes.claim(patientFolder, dir.absolutePath(),
+                contentHash, absPath, dedup);
+            if (!existing.isEmpty()) {
+                qDebug().noquote() << "[Lib4DICOM] image" << i << "is already stored as" << existing;
+                duplicateOf[i] = existing;
+                m_pixelPool.give(std::move(pixels));
+                fileNs[i] = timer.nsecsElapsed();
+                return;
+            }
+            hashes[i] = contentHash;
+            claimed[i] = true;
+            absPaths[i] = absPath;
+        }
 
         DcmFileFormat file; DcmDataset* ds = file.getDataset();
         ds->putAndInsertString(DCM_SpecificCharacterSet, "ISO_IR 192");
@@ -593,7 +1727,7 @@ void Lib4DICOM::saveImagesAsDicom(const QVector<QImage>& images)
         ds->putAndInsertString(DCM_SeriesDate, studyDate.toLatin1().constData());
         ds->putAndInsertString(DCM_SeriesTime, studyTime.toLatin1().constData());
         ds->putAndInsertUint16(DCM_SeriesNumber, 1);
-        ds->putAndInsertUint16(DCM_InstanceNumber, static_cast<Uint16>(i + 1));
+        ds->putAndInsertUint16(DCM_InstanceNumber, static_cast<Uint16>(instance));
 
         ds->putAndInsertUint16(DCM_Rows, rows);
         ds->putAndInsertUint16(DCM_Columns, cols);
@@ -605,50 +1739,105 @@ void Lib4DICOM::saveImagesAsDicom(const QVector<QImage>& images)
         ds->putAndInsertUint16(DCM_PixelRepresentation, pixelRepr);
         if (samplesPerPixel == 3) ds->putAndInsertUint16(DCM_PlanarConfiguration, 0);
 
-        ds->putAndInsertUint8Array(DCM_PixelData,
-            reinterpret_cast<const Uint8*>(pixelData.constData()),
-            static_cast<unsigned long>(pixelData.size()));
+        ds->insert(pixels.release(), true);
 
         ds->putAndInsertString(DCM_ConversionType, "WSD");
         ds->putAndInsertString(DCM_SeriesDescription, seriesToken.toUtf8().constData());
 
-        const QString fileName = QString("%1_%2_%3_%4_%5.dcm")
-            .arg(idToken).arg(seriesToken).arg(studyDate).arg(studyTime)
-            .arg(i + 1, 3, 10, QChar('0'));
-        const QString absPath = dir.absoluteFilePath(fileName);
+        const QString tmpPath = batch.tempPathFor(absPath);
 
-        const OFCondition st = file.saveFile(absPath.toLocal8Bit().constData(),
+        const OFCondition st = file.saveFile(tmpPath.toLocal8Bit().constData(),
             EXS_LittleEndianExplicit, EET_ExplicitLength, EGL_recalcGL, EPD_withoutPadding);
+        // элемент снимается с набора данных (remove не удаляет) и со своим буфером ждёт следующий кадр
+        m_pixelPool.give(std::unique_ptr<DcmPixelData>(static_cast<DcmPixelData*>(ds->remove(DCM_PixelData))));
         if (st.good()) {
-            ++saved; outFiles << absPath;
+            tmpPaths[i] = tmpPath;
+            absPaths[i] = absPath;
+            fileBytes[i] = QFileInfo(tmpPath).size();
         }
         else {
             qWarning().noquote() << "[Lib4DICOM] save failed for" << absPath << ":" << st.text();
+            if (tmpPath != absPath)
+                QFile::remove(tmpPath);
         }
+        fileNs[i] = timer.nsecsElapsed();
+    };
+
+    parallelFor(n, m_saveThreads.load(), writeOne);
+
+    // публикация — последовательно и в порядке номеров снимков
+    QVector<int> added;
+    added.reserve(n);
+    for (int i = 0; i < n; ++i) {
+        if (fileBytes[i] < 0)
+            continue;
+        QElapsedTimer timer;
+        timer.start();
+        if (batch.add(tmpPaths[i], absPaths[i]))
+            added << i;
+        fileNs[i] += timer.nsecsElapsed();
+    }
+
+    QElapsedTimer commitTimer;
+    commitTimer.start();
+    batch.commit();
+    const qint64 commitShare = added.isEmpty() ? 0 : commitTimer.nsecsElapsed() / added.size();
+
+    const QStringList& outFiles = batch.committed();
+    const QSet<QString> published(outFiles.cbegin(), outFiles.cend());
+    for (int i : added) {
+        if (!published.contains(absPaths[i]))
+            continue;
+        stats.bytes += fileBytes[i];
+        stats.latencyNs << fileNs[i] + commitShare;
     }
 
+    // индекс содержимого: опубликованные дописываем, несостоявшиеся освобождаем
+    QVector<std::pair<quint64, QString>> hashed;
+    for (int i = 0; i < n; ++i) {
+        if (!claimed[i])
+            continue;
+        if (published.contains(absPaths[i]))
+            hashed.append({ hashes[i], absPaths[i] });
+        else
+            m_contentHashes.release(patientFolder, hashes[i], absPaths[i]);
+    }
+    m_contentHashes.persist(patientFolder, hashed);
+    for (const QString& d : duplicateOf) {
+        if (!d.isEmpty())
+            stats.duplicateOf << d;
+    }
+    stats.duplicates = stats.duplicateOf.size();
+    stats.bufferAllocations = allocations.load();
+
+    stats.files = outFiles;
+    stats.saved = outFiles.size();
+    const int saved = stats.saved;
     qDebug().noquote() << "[Lib4DICOM] saveImagesAsDicom: saved" << saved
         << "of" << images.size()
-        << "files.";
-    if (saved != images.size()) {
+        << "files (" << DurableBatch::modeName(mode) << "," << stats.duplicates << "duplicates skipped).";
+    if (saved + stats.duplicates != images.size()) {
         qWarning().noquote() << "[Lib4DICOM] saveImagesAsDicom: partial save, files:"
             << outFiles.join(", ");
     }
+    return stats;
 }
 
 // Получение демографии пациента по индексу
 QVariantMap Lib4DICOM::getPatientDemographics(int index) const {
     QVariantMap out;
-    if (index < 0 || index >= m_patients.size()) {
+    if (index < 0 || index >= m_store.size()) {
         out["ok"] = false; out["error"] = "index out of range"; return out;
     }
-    const auto& p = m_patients.at(index);
     out["ok"] = true;
-    out["fullName"] = p.fullName;
-    out["birthYear"] = p.birthYear;
-    out["sex"] = p.sex;
-    out["patientID"] = p.patientID;
-    out["patientFolder"] = p.patientFolder;
+    out["fullName"] = m_store.fullName(index);
+    out["birthYear"] = m_store.birthYear(index);
+    out["sex"] = m_store.sex(index);
+    out["patientID"] = m_store.patientID(index);
+    out["patientFolder"] = m_store.patientFolder(index);
+    out["studyCount"] = m_store.studyCount(index);
+    out["imageCount"] = m_store.imageCount(index);
+    out["lastStudyDate"] = m_store.lastStudyDate(index);
     return out;
 }
 
@@ -656,92 +1845,49 @@ QVariantMap Lib4DICOM::getPatientDemographics(int index) const {
 QVariantMap Lib4DICOM::createStudyInPatientFolder(const QString& patientFolder,
     const QString& /*patientID*/)
 {
-    QVariantMap out;
-
-    if (patientFolder.isEmpty() || !QDir(patientFolder).exists()) {
-        out["ok"] = false;
-        out["error"] = "patient folder does not exist";
-        return out;
-    }
-
-    // === Извлечь "имя пациента" из имени папки пациента ===
-    QString dirName = QFileInfo(patientFolder).fileName();
-
-    dirName.remove(QRegularExpression(R"(_\d{1,4}$)"));
-
-    int us = dirName.lastIndexOf('_');
-    if (us > 0) {
-        const QString tail = dirName.mid(us + 1);
-        const bool isYear4 = (tail.size() == 4 &&
-            tail.at(0).isDigit() && tail.at(1).isDigit() &&
-            tail.at(2).isDigit() && tail.at(3).isDigit());
-        if (tail == "----" || isYear4) {
-            dirName = dirName.left(us);
-        }
-    }
-
-    const QString safeName = sanitizeName(dirName.isEmpty() ? "Unnamed" : dirName);
-    const QString dateStr = QDate::currentDate().toString("yyyyMMdd");
-    const QString safeLabel = sanitizeName(m_studyLabel.isEmpty() ? "Study" : m_studyLabel);
-
-    const QString base = QString("%1_%2_%3").arg(safeName, dateStr, safeLabel);
-
-    QString studyFolder = QDir(patientFolder).absoluteFilePath(base);
-    int n = 2;
-    while (QDir(studyFolder).exists() && n <= 9999) {
-        studyFolder = QDir(patientFolder).absoluteFilePath(base + "_" + QString::number(n++));
-    }
-    if (n > 9999) {
-        out["ok"] = false;
-        out["error"] = "too many duplicates for study";
-        return out;
-    }
-
-    if (!QDir().mkpath(studyFolder)) {
-        out["ok"] = false;
-        out["error"] = "failed to create study folder";
-        return out;
-    }
-
-    const QString studyUID = generateDicomUID();
-
-    qDebug().noquote() << "[Lib4DICOM] Study created:"
-        << "\n  patientFolder =" << patientFolder
-        << "\n  studyFolder   =" << studyFolder
-        << "\n  studyName     =" << QFileInfo(studyFolder).fileName()
-        << "\n  studyUID      =" << studyUID;
-
-    out["ok"] = true;
-    out["patientFolder"] = patientFolder;
-    out["studyFolder"] = studyFolder;
-    out["studyName"] = QFileInfo(studyFolder).fileName();
-    out["studyUID"] = studyUID;
-
-    // Синхронизируем m_selectedPatient
-    m_selectedPatient.patientFolder = patientFolder;
-    m_selectedPatient.studyFolder = studyFolder;
-    m_selectedPatient.studyUID = studyUID;
-    if (m_selectedPatient.seriesName.trimmed().isEmpty())
-        m_selectedPatient.seriesName = m_studyLabel.isEmpty() ? "SER" : m_studyLabel;
-    emit selectedPatientChanged();
+    const QVariantMap out = m_session->createStudyInPatientFolder(patientFolder);
+    if (out.value("ok").toBool())
+        emit selectedPatientChanged();
     return out;
 }
 
 // Получение пути к DICOM-файлу-заглушке пациента
 QVariantMap Lib4DICOM::findPatientStubByIndex(int index) const {
     QVariantMap out; out["ok"] = false;
-    if (index < 0 || index >= m_patients.size()) { out["error"] = "index out of range"; return out; }
+    if (index < 0 || index >= m_store.size()) { out["error"] = "index out of range"; return out; }
 
-    const Patient& P = m_patients.at(index);
+    const Patient P = m_store.patient(index);
     const QString  wantedPID = P.patientID.trimmed();
 
-    const QString root = QCoreApplication::applicationDirPath() + "/patients";
-
-    // 1) Базовая папка пациента
+    // 1) Базовая папка пациента; искать — только в корне, которому она принадлежит
     QString patientFolder = P.patientFolder;
+    const int rootIndex = m_roots.rootOf(patientFolder);
+    const QString root = m_roots.path(rootIndex < 0 ? 0 : rootIndex);
     if (patientFolder.isEmpty())
         patientFolder = root; // последняя страховка
 
+    // 0) Stub, уже найденный для этой папки: достаточно убедиться, что файл на месте (stat)
+    const QString hitKey = P.patientFolder + QChar(0x1F) + wantedPID;
+    {
+        QMutexLocker lock(&m_stubMutex);
+        if (const StubHit* hit = m_stubHits.object(hitKey)) {
+            const StubHit h = *hit;
+            lock.unlock();
+            if (m_headers.fields(h.stubPath).ok) {
+                QMutexLocker countLock(&m_stubMutex);
+                ++m_stubHitCount;
+                out["ok"] = true;
+                out["patientFolder"] = h.patientFolder;
+                out["stubPath"] = h.stubPath;
+                return out;
+            }
+        }
+    }
+    {
+        QMutexLocker lock(&m_stubMutex);
+        ++m_stubMissCount;
+    }
+
     auto tryFindStubIn = [&](const QString& folder)->QString {
         const QStringList nameFilters = { "*_patient*.dcm", "*_PATIENT*.dcm", "*_Patient*.dcm" };
         QFileInfoList stubs = QDir(folder).entryInfoList(nameFilters, QDir::Files | QDir::NoDotAndDotDot, QDir::Name);
@@ -751,15 +1897,9 @@ QVariantMap Lib4DICOM::findPatientStubByIndex(int index) const {
         const QFileInfoList all = QDir(folder).entryInfoList(QStringList() << "*.dcm" << "*.DCM",
             QDir::Files | QDir::NoDotAndDotDot, QDir::Name);
         for (const QFileInfo& fi : all) {
-            DcmFileFormat ff;
-            if (!ff.loadFile(QFile::encodeName(fi.absoluteFilePath()).constData()).good()) continue;
-            DcmDataset* ds = ff.getDataset();
-            OFString v;
-            if (ds->findAndGetOFString(DCM_SeriesDescription, v).good()) {
-                const QString desc = QString::fromLatin1(v.c_str());
-                if (desc.compare(QStringLiteral("PATIENT_STUB"), Qt::CaseInsensitive) == 0)
-                    return fi.absoluteFilePath();
-            }
+            const HeaderFields f = m_headers.fields(fi);
+            if (f.ok && f.seriesDescription.trimmed().compare(QStringLiteral("PATIENT_STUB"), Qt::CaseInsensitive) == 0)
+                return fi.absoluteFilePath();
         }
         return QString();
         };
@@ -767,28 +1907,18 @@ QVariantMap Lib4DICOM::findPatientStubByIndex(int index) const {
     // 2) Сначала пробуем в patientFolder
     QString stubPath = tryFindStubIn(patientFolder);
 
-    // 3) Если это корень /patients — пробегаемся по подпапкам и ищем по PatientID
+    // 3) Если это корень /patients — пробегаемся по папкам пациентов (в обеих раскладках) и ищем по PatientID
     if (stubPath.isEmpty() && QDir::cleanPath(patientFolder) == QDir::cleanPath(root)) {
-        const QFileInfoList subdirs = QDir(root).entryInfoList(QDir::Dirs | QDir::NoDotAndDotDot, QDir::Name);
-        for (const QFileInfo& sdi : subdirs) {
-            const QString candidate = sdi.absoluteFilePath();
+        for (const QString& candidate : StorageRoots::patientDirs(root)) {
 
             bool pidMatch = false;
             const QFileInfoList all = QDir(candidate).entryInfoList(QStringList() << "*.dcm" << "*.DCM",
                 QDir::Files | QDir::NoDotAndDotDot, QDir::Name);
             for (const QFileInfo& fi : all) {
-                DcmFileFormat ff;
-                if (!ff.loadFile(QFile::encodeName(fi.absoluteFilePath()).constData()).good()) continue;
-
-                DcmDataset* ds = ff.getDataset();
-                OFString v, cs;
-                ds->findAndGetOFString(DCM_SpecificCharacterSet, cs);
-                if (ds->findAndGetOFString(DCM_PatientID, v).good()) {
-                    const QString pid = decodeDicomText(v, cs).trimmed();
-                    if (!wantedPID.isEmpty() && wantedPID != "--" && pid == wantedPID) {
-                        pidMatch = true;
-                        break;
-                    }
+                const HeaderFields f = m_headers.fields(fi);
+                if (f.ok && !wantedPID.isEmpty() && wantedPID != "--" && f.patientID.trimmed() == wantedPID) {
+                    pidMatch = true;
+                    break;
                 }
             }
 
@@ -808,66 +1938,70 @@ QVariantMap Lib4DICOM::findPatientStubByIndex(int index) const {
         return out;
     }
 
+    {
+        QMutexLocker lock(&m_stubMutex);
+        m_stubHits.insert(hitKey, new StubHit{ stubPath, patientFolder });
+    }
+
     out["ok"] = true;
     out["patientFolder"] = patientFolder;
     out["stubPath"] = stubPath;
     return out;
 }
 
-// Чтение демографии пациента из DICOM-файла
+// Чтение демографии пациента из DICOM-файла (через кэш заголовков: повторно файл не открывается)
 QVariantMap Lib4DICOM::readDemographicsFromFile(const QString& dcmPath) const {
     QVariantMap out; out["ok"] = false;
-    if (dcmPath.isEmpty() || !QFileInfo::exists(dcmPath)) { out["error"] = "file not found"; return out; }
-
-    DcmFileFormat ff;
-    if (!ff.loadFile(QFile::encodeName(dcmPath).constData()).good()) { out["error"] = "load failed"; return out; }
-    DcmDataset* ds = ff.getDataset();
+    const QFileInfo fi(dcmPath);
+    if (dcmPath.isEmpty() || !fi.exists()) { out["error"] = "file not found"; return out; }
 
-    OFString v, cs;
-    ds->findAndGetOFString(DCM_SpecificCharacterSet, cs);
+    const HeaderFields f = m_headers.fields(fi);
+    if (!f.ok) { out["error"] = "load failed"; return out; }
 
-    auto q = [&](const DcmTagKey& tag) -> QString {
-        if (ds->findAndGetOFString(tag, v).good()) return decodeDicomText(v, cs);
-        return QString();
-        };
-
-    out["patientName"] = q(DCM_PatientName).replace("^", " ");
-    const QString birth = q(DCM_PatientBirthDate);
-    out["patientBirth"] = birth;   // "YYYY" или "YYYYMMDD" — как есть
-    out["patientSex"] = q(DCM_PatientSex);   // "M"/"F"/"O"
-    out["patientID"] = q(DCM_PatientID);
+    out["patientName"] = QString(f.patientName).replace("^", " ");
+    out["patientBirth"] = f.birthDate;   // "YYYY" или "YYYYMMDD" — как есть
+    out["patientSex"] = f.sex;           // "M"/"F"/"O"
+    out["patientID"] = f.patientID;
     out["ok"] = true;
     return out;
 }
 
+QVariantMap Lib4DICOM::headerCacheStats() const
+{
+    const HeaderCache::Stats s = m_headers.stats();
+    QVariantMap out;
+    out["hits"] = s.hits;
+    out["misses"] = s.misses;
+    out["hitRate"] = s.hits + s.misses > 0 ? double(s.hits) / double(s.hits + s.misses) : 0.0;
+    out["entries"] = s.entries;
+    out["capacity"] = s.capacity;
+    QMutexLocker lock(&m_stubMutex);
+    out["stubHits"] = m_stubHitCount;
+    out["stubMisses"] = m_stubMissCount;
+    return out;
+}
+
+void Lib4DICOM::setHeaderCacheCapacity(int entries)
+{
+    m_headers.setCapacity(entries);
+}
+
 // Создание папки пациента
 QString Lib4DICOM::ensurePatientFolder(const QString& fullName,
-    const QString& birthYear)
+    const QString& birthYear, const QString& patientID)
 {
-    const QString root = QCoreApplication::applicationDirPath() + "/patients";
-    QDir rootDir(root);
-    if (!rootDir.exists() && !rootDir.mkpath(".")) {
-        qWarning().noquote() << "[Lib4DICOM] ensurePatientFolder: cannot create root:" << root;
+    const QString root = m_roots.path(m_roots.place(StorageRoots::Policy(m_placement.load()), patientID));
+    const QString base = patientFolderBase(fullName, birthYear);
+    const QString parent = StorageRoots::patientParent(root, StorageRoots::Layout(m_layout.load()), patientID, base);
+    QDir parentDir(parent);
+    if (!parentDir.exists() && !parentDir.mkpath(".")) {
+        qWarning().noquote() << "[Lib4DICOM] ensurePatientFolder: cannot create folder:" << parent;
         return {};
     }
 
-    const QString namePart = sanitizeName(fullName.isEmpty() ? QStringLiteral("Unnamed") : fullName);
-    const QString yearPart = sanitizeName(birthYear.isEmpty() ? QStringLiteral("----") : birthYear);
-
-    QString base = namePart + "_" + yearPart;
-    QString candidate = root + "/" + base;
-
-    int n = 2;
-    while (QDir(candidate).exists()) {
-        candidate = root + "/" + base + "_" + QString::number(n++);
-        if (n > 9999) {
-            qWarning() << "[Lib4DICOM] ensurePatientFolder: too many duplicates for" << base;
-            return {};
-        }
-    }
-
-    if (!QDir().mkpath(candidate)) {
-        qWarning().noquote() << "[Lib4DICOM] ensurePatientFolder: failed to create:" << candidate;
+    const QString candidate = m_folders.allocate(parent, base);
+    if (candidate.isEmpty()) {
+        qWarning().noquote() << "[Lib4DICOM] ensurePatientFolder: failed to create folder for" << base;
         return {};
     }
 
@@ -875,6 +2009,13 @@ QString Lib4DICOM::ensurePatientFolder(const QString& fullName,
     return candidate;
 }
 
+QString Lib4DICOM::patientFolderBase(const QString& fullName, const QString& birthYear)
+{
+    const QString namePart = sanitizeName(fullName.isEmpty() ? QStringLiteral("Unnamed") : fullName);
+    const QString yearPart = sanitizeName(birthYear.isEmpty() ? QStringLiteral("----") : birthYear);
+    return namePart + "_" + yearPart;
+}
+
 Patient Lib4DICOM::patientFromMap(const QVariantMap& m) {
     Patient p;
     p.fullName = m.value("fullName").toString();
@@ -886,33 +2027,130 @@ Patient Lib4DICOM::patientFromMap(const QVariantMap& m) {
     p.studyFolder = m.value("studyFolder").toString();
     p.studyUID = m.value("studyUID").toString();
     p.seriesName = m.value("seriesName").toString();
+    p.seriesUID = m.value("seriesUID").toString();
+    return p;
+}
+
+Patient Lib4DICOM::newPatientFromMap(const QVariantMap& m) {
+    Patient p = patientFromMap(m);
+    if (p.fullName.trimmed() == "--") p.fullName.clear();
+    if (p.birthYear.trimmed() == "--") p.birthYear.clear();
+    if (p.sex.trimmed() == "--") p.sex.clear();
+    if (p.patientID.trimmed() == "--") p.patientID.clear();
     return p;
 }
 
-QString Lib4DICOM::studyLabel() const { return m_studyLabel; }
+QString Lib4DICOM::studyLabel() const {
+    QMutexLocker lock(&m_settingsMutex);
+    return m_studyLabel;
+}
+
+int Lib4DICOM::scanDepth() const { return m_scanDepth; }
+
+void Lib4DICOM::setStorageRoots(const QStringList& roots) {
+    // setPaths разрушает DicomDirIndex корней — никто не должен держать m_roots в другом потоке
+    const char* busy = nullptr;
+    if (m_scp && m_scp->isRunning())
+        busy = "stop the C-STORE receiver first";
+    else if (m_exportThread)
+        busy = "wait for the export to finish";
+    else if (m_verifyThread)
+        busy = "wait for the verification to finish";
+    else if (m_migrateThread)
+        busy = "wait for the layout migration to finish";
+    else if (m_liveSessions.load() > (m_session ? 1 : 0))   // сессия по умолчанию живёт в потоке GUI
+        busy = "close the import sessions first";
+    if (busy) {
+        qWarning().noquote() << "[Lib4DICOM] setStorageRoots:" << busy;
+        return;
+    }
+    StorageRoots next;
+    next.setPaths(roots);
+    if (next.size() == 0 || next.paths() == m_roots.paths()) return;
+
+    // отложенные записи DICOMDIR относятся к старым корням
+    m_session->flushDicomDir();
+    if (!m_pendingDicomDir.isEmpty()) {
+        if (m_dicomDirFlush)
+            m_dicomDirFlush->stop();
+        m_roots.addToDicomDir(std::exchange(m_pendingDicomDir, QStringList()));
+    }
+    m_roots.setPaths(roots);
+    emit storageRootsChanged();
+    scanPatients();
+}
+
+void Lib4DICOM::setPlacementPolicy(int policy) {
+    const int v = qBound(int(StorageRoots::MostFreeSpace), policy, int(StorageRoots::PatientIdHash));
+    if (v == m_placement) return;
+    m_placement = v;
+    emit placementPolicyChanged();
+}
+
+void Lib4DICOM::setArchiveLayout(int layout) {
+    const int v = qBound(int(StorageRoots::Flat), layout, int(StorageRoots::FanOut));
+    if (v == m_layout) return;
+    m_layout = v;
+    emit archiveLayoutChanged();
+}
+
+void Lib4DICOM::setScanDepth(int depth) {
+    const int v = qBound(0, depth, 16);
+    if (v == m_scanDepth) return;
+    m_scanDepth = v;
+    emit scanDepthChanged();
+}
+
+int Lib4DICOM::saveDurability() const { return m_saveDurability; }
+
+void Lib4DICOM::setSaveDurability(int mode) {
+    const int v = qBound(int(DurableBatch::Unsafe), mode, int(DurableBatch::GroupCommit));
+    if (v == m_saveDurability) return;
+    m_saveDurability = v;
+    emit saveDurabilityChanged();
+}
+
+int Lib4DICOM::saveThreads() const { return m_saveThreads; }
+
+void Lib4DICOM::setSaveThreads(int threads) {
+    const int v = qBound(1, threads, 64);
+    if (v == m_saveThreads) return;
+    m_saveThreads = v;
+    emit saveThreadsChanged();
+}
+
+bool Lib4DICOM::useDicomDir() const { return m_useDicomDir; }
+
+void Lib4DICOM::setUseDicomDir(bool on) {
+    if (on == m_useDicomDir) return;
+    m_useDicomDir = on;
+    emit useDicomDirChanged();
+}
+
+int Lib4DICOM::dedupScope() const { return m_dedupScope; }
+
+void Lib4DICOM::setDedupScope(int scope) {
+    scope = qBound(int(ContentHashIndex::Off), scope, int(ContentHashIndex::SamePatient));
+    if (scope == m_dedupScope) return;
+    m_dedupScope = scope;
+    emit dedupScopeChanged();
+}
 
 void Lib4DICOM::setStudyLabel(const QString& s) {
     QString v = s.trimmed().isEmpty() ? "Study" : s;
-    if (v == m_studyLabel) return;
-    m_studyLabel = v;
+    {
+        QMutexLocker lock(&m_settingsMutex);
+        if (v == m_studyLabel) return;
+        m_studyLabel = v;
+    }
     emit studyLabelChanged();
 }
 
 // Установка полной даты рождения выбранного пациента (YYYYMMDD)
 void Lib4DICOM::setSelectedBirthDA(const QString& da)
 {
-    const QString v = da.trimmed();
-    if (v == m_selectedPatient.birthDA) return;
-    // сохраняем только валидную полную дату; иначе очищаем
-    if (v.size() == 8 && QDate::fromString(v, "yyyyMMdd").isValid()) {
-        m_selectedPatient.birthDA = v;
-        if (m_selectedPatient.birthYear.isEmpty())
-            m_selectedPatient.birthYear = v.left(4);
-    }
-    else {
-        m_selectedPatient.birthDA.clear();
-    }
-    emit selectedPatientChanged();
+    if (m_session->setBirthDA(da))
+        emit selectedPatientChanged();
 }
 
 // Замена пробелов и опасных символов
@@ -927,79 +2165,85 @@ QString Lib4DICOM::sanitizeName(const QString& in)
 
 void Lib4DICOM::selectExistingPatient(int index)
 {
-    if (index < 0 || index >= m_patients.size()) {
+    if (index < 0 || index >= m_store.size()) {
         qWarning().noquote() << "[Lib4DICOM] selectExistingPatient: index out of range:" << index;
         return;
     }
 
-    const Patient& p = m_patients.at(index);
+    const Patient p = m_store.patient(index);
+    const Patient& cur = m_session->patient();
 
-    if (m_selectedPatient.patientID == p.patientID &&
-        m_selectedPatient.fullName == p.fullName &&
-        m_selectedPatient.birthYear == p.birthYear &&
-        m_selectedPatient.sex == p.sex) {
+    if (cur.patientID == p.patientID &&
+        cur.fullName == p.fullName &&
+        cur.birthYear == p.birthYear &&
+        cur.sex == p.sex) {
         return;
     }
 
-    m_selectedPatient = p; // обратите внимание: birthDA в списке пациентов не сканируем — будет задана через setSelectedBirthDA при наличии stub
+    m_session->setPatient(p); // обратите внимание: birthDA в списке пациентов не сканируем — будет задана через setSelectedBirthDA при наличии stub
     emit selectedPatientChanged();
 
     qDebug().noquote() << "[Lib4DICOM] selected existing patient:"
-        << m_selectedPatient.fullName
-        << m_selectedPatient.birthYear
-        << m_selectedPatient.sex
-        << m_selectedPatient.patientID;
+        << p.fullName
+        << p.birthYear
+        << p.sex
+        << p.patientID;
 }
 
 void Lib4DICOM::selectNewPatient(const QVariantMap& patient)
 {
-    Patient p = patientFromMap(patient);
-
-    if (p.fullName.trimmed() == "--") p.fullName.clear();
-    if (p.birthYear.trimmed() == "--") p.birthYear.clear();
-    if (p.sex.trimmed() == "--") p.sex.clear();
-    if (p.patientID.trimmed() == "--") p.patientID.clear();
-
-    m_selectedPatient = std::move(p);
+    const Patient p = newPatientFromMap(patient);
+    m_session->setPatient(p);
     emit selectedPatientChanged();
 
     qDebug().noquote() << "[Lib4DICOM] selected NEW patient:"
-        << m_selectedPatient.fullName
-        << m_selectedPatient.birthYear
-        << m_selectedPatient.sex
-        << m_selectedPatient.patientID
-        << "birthDA=" << (m_selectedPatient.birthDA.isEmpty() ? "--" : m_selectedPatient.birthDA);
+        << p.fullName
+        << p.birthYear
+        << p.sex
+        << p.patientID
+        << "birthDA=" << (p.birthDA.isEmpty() ? "--" : p.birthDA);
 }
 
 void Lib4DICOM::clearSelectedPatient()
 {
-    m_selectedPatient = Patient{};
+    m_session->setPatient(Patient{});
     emit selectedPatientChanged();
     qDebug().noquote() << "[Lib4DICOM] selected patient cleared";
 }
 
+void Lib4DICOM::beginSeries(const QString& seriesName)
+{
+    m_session->beginSeries(seriesName);
+    emit selectedPatientChanged();
+}
+
+void Lib4DICOM::endSeries()
+{
+    m_session->flushDicomDir();
+    if (m_session->patient().seriesUID.isEmpty()) return;
+    m_session->endSeries();
+    emit selectedPatientChanged();
+}
+
 QVariantMap Lib4DICOM::selectedPatient() const
 {
-    const bool none =
-        m_selectedPatient.fullName.trimmed().isEmpty() &&
-        m_selectedPatient.patientID.trimmed().isEmpty();
+    return m_session->toMap();
+}
 
-    QVariantMap map;
-    if (none) {
-        map["ok"] = false;
-        return map;
-    }
-
-    map["ok"] = true;
-    map["fullName"] = m_selectedPatient.fullName;
-    map["birthYear"] = m_selectedPatient.birthYear;
-    map["sex"] = m_selectedPatient.sex;
-    map["patientID"] = m_selectedPatient.patientID;
-    map["patientFolder"] = m_selectedPatient.patientFolder;
-    map["studyFolder"] = m_selectedPatient.studyFolder;
-    map["studyUID"] = m_selectedPatient.studyUID;
-    map["seriesName"] = m_selectedPatient.seriesName;
-    // при необходимости можно вернуть и birthDA:
-    // map["birthDA"]   = m_selectedPatient.birthDA;
-    return map;
+void Lib4DICOM::setImportPreprocess(const QVariantMap& options)
+{
+    ImagePreprocessor::Options opt;
+    opt.maxDimension = qMax(0, options.value("maxDimension").toInt());
+    opt.grayscale = options.value("grayscale").toBool();
+    const QVariant crop = options.value("crop");
+    if (crop.typeId() == QMetaType::QVariantMap) {
+        const QVariantMap r = crop.toMap();
+        opt.crop = QRect(r.value("x").toInt(), r.value("y").toInt(), r.value("width").toInt(), r.value("height").toInt());
+    }
+    else if (crop.isValid()) {
+        opt.crop = crop.toRect();   // rect из QML приходит как QRectF
+    }
+    m_session->setPreprocess(opt);
+    qDebug().noquote() << "[Lib4DICOM] setImportPreprocess: maxDimension" << opt.maxDimension
+                       << "grayscale" << opt.grayscale << "crop" << opt.crop;
 }
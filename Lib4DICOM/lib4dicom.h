@@ -5,10 +5,35 @@
 #include <QVector>
 #include <QVariant>
 #include <QString>
+#include <QStringList>
+#include <QReadWriteLock>
+#include <QMutex>
+#include <QCache>
+
+#include <atomic>
+#include <memory>
 
 #include "lib4dicom_global.h"
+#include "patientstore.h"
+#include "folderallocator.h"
+#include "durablewriter.h"
+#include "dirwalker.h"
+#include "dicomdirindex.h"
+#include "storageroots.h"
+#include "contenthash.h"
+#include "headercache.h"
+#include "pixelbufferpool.h"
 
 class OFString;
+class DcmItem;
+class PatientTreeModel;
+class StoreSCP;
+class QTimer;
+class StoreSCU;
+class QThread;
+class ImportSession;
+class ArchiveVerifier;
+class VerifyFindingsModel;
 
 struct Patient {
     QString fullName;     // "Иванов Иван"
@@ -21,25 +46,114 @@ struct Patient {
     QString studyFolder;   // текущая папка исследования
     QString studyUID;      // UID текущего исследования
     QString seriesName;    // предпочтительное имя серии
+    QString seriesUID;     // UID текущей серии (пусто — новая серия на каждое сохранение)
+};
+
+// Итог записи серии: сколько файлов опубликовано и сколько стоил каждый
+struct SeriesWriteStats {
+    int             saved = 0;
+    qint64          bytes = 0;    // суммарный размер опубликованных файлов
+    QVector<qint64> latencyNs;    // подготовка + запись + доля fsync на каждый файл
+    QStringList     files;
+    int             duplicates = 0;   // не записаны: такой кадр уже есть (см. dedupScope)
+    QStringList     duplicateOf;      // существующие файлы с тем же содержимым
+    // предобработка сессии (ImagePreprocessor): пиксели в DICOM до и после, время на порцию
+    qint64          pixelBytesIn = 0;
+    qint64          pixelBytesOut = 0;
+    qint64          preprocessNs = 0;
+    int             bufferAllocations = 0;   // кадры без готового буфера в PixelBufferPool (и переводы через QImage)
 };
 
 class LIB4DICOM_EXPORT Lib4DICOM : public QAbstractListModel {
     Q_OBJECT
         Q_PROPERTY(QString studyLabel READ studyLabel WRITE setStudyLabel NOTIFY studyLabelChanged)
+        Q_PROPERTY(QObject* studyTree READ studyTree CONSTANT)
+        Q_PROPERTY(int scanDepth READ scanDepth WRITE setScanDepth NOTIFY scanDepthChanged)
+        Q_PROPERTY(int saveDurability READ saveDurability WRITE setSaveDurability NOTIFY saveDurabilityChanged)
+        Q_PROPERTY(int saveThreads READ saveThreads WRITE setSaveThreads NOTIFY saveThreadsChanged)
+        Q_PROPERTY(bool useDicomDir READ useDicomDir WRITE setUseDicomDir NOTIFY useDicomDirChanged)
+        Q_PROPERTY(int dedupScope READ dedupScope WRITE setDedupScope NOTIFY dedupScopeChanged)
+        Q_PROPERTY(bool storeSCPRunning READ storeSCPRunning NOTIFY storeSCPRunningChanged)
+        Q_PROPERTY(bool exporting READ exporting NOTIFY exportingChanged)
+        Q_PROPERTY(QStringList storageRoots READ storageRoots WRITE setStorageRoots NOTIFY storageRootsChanged)
+        Q_PROPERTY(int placementPolicy READ placementPolicy WRITE setPlacementPolicy NOTIFY placementPolicyChanged)
+        Q_PROPERTY(int archiveLayout READ archiveLayout WRITE setArchiveLayout NOTIFY archiveLayoutChanged)
+        Q_PROPERTY(bool verifying READ verifying NOTIFY verifyingChanged)
+        Q_PROPERTY(bool migrating READ migrating NOTIFY migratingChanged)
+        Q_PROPERTY(QObject* verifyFindings READ verifyFindings CONSTANT)
 
 public:
     explicit Lib4DICOM(QObject* parent = nullptr);
+    // patientsRoot пуст — <папка приложения>/patients
+    explicit Lib4DICOM(const QString& patientsRoot, QObject* parent = nullptr);
+    // несколько корней архива (например, по одному на диск); пустой список — как выше
+    explicit Lib4DICOM(const QStringList& storageRoots, QObject* parent = nullptr);
+    ~Lib4DICOM() override;
+
+    // первый корень: служебные папки (.durability-bench, .incoming приёма)
+    QString patientsRoot() const { return m_roots.path(0); }
+
+    // корни архива; смена — только когда приём C-STORE не идёт, после неё — scanPatients()
+    QStringList storageRoots() const { return m_roots.paths(); }
+    void setStorageRoots(const QStringList& roots);
+
+    // куда класть новых пациентов: 0 — больше свободного места, 1 — по очереди, 2 — хэш PatientID
+    int  placementPolicy() const { return m_placement; }
+    void setPlacementPolicy(int policy);
+
+    // раскладка для новых пациентов: 0 — <корень>/<пациент>, 1 — веер <корень>/ab/cd/<пациент>;
+    // сканирование понимает обе, существующий архив переводится migrateLayout
+    int  archiveLayout() const { return m_layout; }
+    void setArchiveLayout(int layout);
 
     // ==== Свойство, используемое в QML ====
     QString studyLabel() const;
     void setStudyLabel(const QString& s);
 
+    // глубина обхода архива при сканировании (0 — только /patients)
+    int  scanDepth() const;
+    void setScanDepth(int depth);
+
+    // режим записи файлов: 0 — без fsync, 1 — fsync на каждый файл, 2 — групповой (по умолчанию)
+    int  saveDurability() const;
+    void setSaveDurability(int mode);
+
+    // сколько потоков готовят и пишут файлы серии (1 — последовательно)
+    int  saveThreads() const;
+    void setSaveThreads(int threads);
+
+    // вести DICOMDIR в корне архива и брать из него индекс при сканировании
+    bool useDicomDir() const;
+    void setUseDicomDir(bool on);
+
+    // пропуск повторно импортируемых кадров: 0 — выкл., 1 — в том же исследовании (по умолчанию),
+    // 2 — в любом исследовании пациента
+    int  dedupScope() const;
+    void setDedupScope(int scope);
+
     // ==== Модель ====
     int rowCount(const QModelIndex& parent = QModelIndex()) const override;
     QVariant data(const QModelIndex& index, int role) const override;
     QHash<int, QByteArray> roleNames() const override;
+    bool canFetchMore(const QModelIndex& parent) const override;
+    void fetchMore(const QModelIndex& parent) override;
+
+    // всего найдено пациентов (rowCount отдаёт только подгруженную часть)
+    Q_INVOKABLE int patientCount() const;
+
+    // дерево пациенты -> исследования -> серии -> снимки
+    QObject* studyTree() const;
+
+    // firstInstance — номер первого снимка (для записи серии несколькими порциями)
+    SeriesWriteStats saveImagesAsDicom(const QVector<QImage>& images, int firstInstance = 1);
 
-    void saveImagesAsDicom(const QVector<QImage>& images);
+    // ==== Сессии импорта (потокобезопасно): свой пациент/исследование/серия на каждую ====
+    // patient — как в selectNewPatient (fullName, birthYear, birthDA, sex, patientID)
+    std::unique_ptr<ImportSession> createImportSession(const QVariantMap& patient);
+    // существующий пациент по строке модели; nullptr — нет такой строки
+    std::unique_ptr<ImportSession> createImportSession(int index);
+    // сессия, через которую работают QML-методы (selectNewPatient, createStudy*, saveImagesAsDicom...)
+    ImportSession* defaultSession() const { return m_session.get(); }
 
     // ==== API для QML ====
     Q_INVOKABLE QVariantMap makePatientFromStrings(const QString& fullName,
@@ -61,18 +175,122 @@ public:
     Q_INVOKABLE void selectExistingPatient(int index);
     Q_INVOKABLE void selectNewPatient(const QVariantMap& patient);
     Q_INVOKABLE void clearSelectedPatient();
+
+    // начать новую серию у выбранного пациента: следующие saveImagesAsDicom пишут в неё
+    Q_INVOKABLE void beginSeries(const QString& seriesName = QString());
+    Q_INVOKABLE void endSeries();
     QVariantMap selectedPatient() const;
+    // предобработка кадров сессии по умолчанию: maxDimension, grayscale, crop (rect или x/y/width/height);
+    // пустая карта — кадры пишутся как есть
+    Q_INVOKABLE void setImportPreprocess(const QVariantMap& options);
 
     // ==== НОВОЕ: передача полной даты рождения YYYYMMDD из QML ====
     Q_INVOKABLE void setSelectedBirthDA(const QString& birthDA);
     Q_INVOKABLE void   scanPatients();
 
+    // память хранилища пациентов (bytesPerPatient против прежнего QList<Patient>) и итоги последнего сканирования
+    Q_INVOKABLE QVariantMap patientStoreStats() const;
+
+    // кэш заголовков (карточка пациента, поиск stub, дерево): hits, misses, hitRate, entries, capacity,
+    // stubHits, stubMisses — повторный выбор пациента обходится stat без открытия файлов
+    Q_INVOKABLE QVariantMap headerCacheStats() const;
+    Q_INVOKABLE void setHeaderCacheCapacity(int entries);
+
+    // сравнение режимов записи: files/s для unsafe, per-file-fsync и group-commit
+    Q_INVOKABLE QVariantMap benchmarkSaveDurability(int files = 50, int width = 512, int height = 512);
+
+    // Буферы Pixel Data, которые пакетная запись переиспользует между снимками и потоками
+    Q_INVOKABLE QVariantMap pixelPoolStats() const;
+    // batches порций по perBatch кадров с пулом и без: выделений на кадр по порциям и files/s
+    Q_INVOKABLE QVariantMap benchmarkPixelPool(int batches = 8, int perBatch = 32, int width = 1280, int height = 1024);
+
+    // Скорость окна/уровня и VOI LUT для 16 бит, Мпикс/с по каждому ядру (GrayRenderer)
+    Q_INVOKABLE QVariantMap benchmarkWindowLevel(int width = 4096, int height = 4096, int iterations = 20);
+
+    // Уменьшение кадров при импорте (ImagePreprocessor): Мпикс/с по ядрам и экономия места
+    Q_INVOKABLE QVariantMap benchmarkPreprocess(int width = 4000, int height = 3000, int maxDimension = 1024,
+        int iterations = 10);
+
+    // Выгрузка снимков пациента/исследования (папки) или одной серии (seriesUID) в PNG/JPEG.
+    // total, written, skipped, failed, bytesIn, bytesOut, seconds, imagesPerSec, failedFiles
+    Q_INVOKABLE QVariantMap exportImages(const QStringList& folders, const QString& outDir,
+        const QString& format = "png", const QString& seriesUID = QString());
+
+    // ==== Правка заголовков по строке модели (TagEditor: пиксели не перезаписываются) ====
+    // patient: fullName, patientID, sex, birthDA или birthYear — меняются только переданные поля
+    Q_INVOKABLE QVariantMap renamePatient(int index, const QVariantMap& patient);
+    // снимки from получают демографию into, исследования переезжают в папку into
+    Q_INVOKABLE QVariantMap mergePatients(int fromIndex, int intoIndex);
+    // копия всех исследований пациента в outDir/<псевдоним> без прямых идентификаторов и с новыми UID
+    Q_INVOKABLE QVariantMap pseudonymizePatient(int index, const QString& outDir,
+        const QString& pseudonym, const QString& pseudoID = QString());
+
+    // ==== Перевод архива в раскладку layout на месте (rename папок пациентов) ====
+    // Индекс обновляется после каждого переноса, а список и дерево сбрасываются после каждого
+    // корня, поэтому они и выгрузка продолжают работать; приём C-STORE на это время должен быть
+    // остановлен. Прерванный перевод продолжается повторным вызовом: уже перенесённые папки
+    // пропускаются, а пока в корне лежит журнал .layout-migration, сканирование не доверяет его DICOMDIR.
+    // startMigrateLayout — в фоновом потоке, итог в migrateFinished; migrateLayout — в вызывающем (консоль).
+    // moved, kept, failed, roots, seconds
+    Q_INVOKABLE bool startMigrateLayout(int layout);
+    Q_INVOKABLE QVariantMap migrateLayout(int layout);
+    bool migrating() const { return m_migrateThread != nullptr; }
+
+    // ==== Приём C-STORE по сети (снимки раскладываются в <пациент>/<исследование>) ====
+    Q_INVOKABLE bool startStoreSCP(int port = 11112, const QString& aeTitle = "LIB4DICOM",
+        int maxAssociations = 8);
+    Q_INVOKABLE void stopStoreSCP();
+    bool storeSCPRunning() const;
+    // instances, bytes, failures, associations, instancesPerSec, mbPerSec
+    Q_INVOKABLE QVariantMap storeSCPStats() const;
+    // Задержка ответа C-FIND по индексу на синтетическом архиве (IndexQuery::benchmark): p50/p99 в мс
+    Q_INVOKABLE QVariantMap benchmarkFind(int patients = 100000, int studiesPerPatient = 3, int iterations = 50);
+
+    // ==== Отправка в PACS (C-STORE SCU) ====
+    // Папки исследований (или пациентов) уходят в фоне; ход — exportProgress, итог — exportFinished.
+    Q_INVOKABLE bool exportStudies(const QStringList& folders, const QString& host, int port,
+        const QString& calledAE, int associations = 4);
+    Q_INVOKABLE void cancelExport();
+    bool exporting() const { return m_exportThread != nullptr; }
+
+    // ==== Фоновая проверка архива (ArchiveVerifier): idle-приоритет ввода-вывода и потолок МБ/с ====
+    // Находки копятся в verifyFindings и в reportPath (TSV), ход — verifyProgress, итог — verifyFinished.
+    Q_INVOKABLE bool startVerify(double mbPerSec = 20.0, const QString& reportPath = QString());
+    Q_INVOKABLE void cancelVerify();
+    bool verifying() const { return m_verifyThread != nullptr; }
+    // модель находок: kind, kindName, path, detail
+    QObject* verifyFindings() const;
+
 signals:
     void selectedPatientChanged();
     void studyLabelChanged();
+    void scanDepthChanged();
+    void saveDurabilityChanged();
+    void saveThreadsChanged();
+    void useDicomDirChanged();
+    void dedupScopeChanged();
+    void storeSCPRunningChanged();
+    void exportingChanged();
+    void storageRootsChanged();
+    void placementPolicyChanged();
+    void archiveLayoutChanged();
+    void exportProgress(int done, int failed, int total);
+    void exportFinished(const QVariantMap& result);
+    void verifyingChanged();
+    void verifyProgress(int files, qint64 bytes);
+    void verifyFinished(const QVariantMap& result);
+    void migratingChanged();
+    void migrateFinished(const QVariantMap& result);
 
 private:
-    enum Roles { FullNameRole = Qt::UserRole + 1, BirthYearRole, SexRole };
+    friend class PatientTreeModel;
+    friend class StoreSCP;
+    friend class ImportSession;
+
+    enum Roles {
+        FullNameRole = Qt::UserRole + 1, BirthYearRole, SexRole,
+        StudyCountRole, ImageCountRole, LastStudyDateRole
+    };
 
 
     Q_INVOKABLE void   TESTlogSelectedFileAndPatient(const QString& filePath,
@@ -82,16 +300,81 @@ private:
     Q_INVOKABLE QImage TESTloadImageFromFile(const QString& localPath);
     Q_INVOKABLE QVector<QImage> TESTloadImageVectorFromFile(const QString& localPath);
 
-    QString  ensurePatientFolder(const QString& fullName, const QString& birthYear);
+    // папка нового пациента в корне, выбранном placementPolicy
+    QString  ensurePatientFolder(const QString& fullName, const QString& birthYear,
+        const QString& patientID = QString());
+    // "<ФИО>_<год>" — имя папки пациента без суффикса и ключ веера для пациента без PatientID
+    QString  patientFolderBase(const QString& fullName, const QString& birthYear);
     QString  sanitizeName(const QString& in);
+    // storeMutex — если m_store пишут несколько потоков сканирования
+    int      indexDicomFile(const QString& path, const QString& patientFolder,
+        const QString& studyFolder, QMutex* storeMutex = nullptr);
+    void     onInstanceStored(const QString& path, const QString& patientFolder,
+        const QString& studyFolder);
+    QVariantMap writePatientStub(const Patient& p, const QString& patientFolder) const;
+    QVariantMap editPatientFiles(int index, const QVariantMap& patient);
+    // пересоздать DICOMDIR корня обходом с диска (после правки заголовков или переноса папок)
+    void     rebuildDicomDir(int root);
+    // проверка и подготовка перевода раскладки (поток GUI); пустая строка — можно начинать
+    QString  prepareMigration(int layout);
+    QVariantMap runMigration(StorageRoots::Layout target, DurableBatch::Mode durability);
+    // папки пациентов переехали — сбросить список и дерево (из любого потока)
+    void     notifyFoldersMoved();
+    int      indexPatient(DcmItem* item, const QString& patientFolder);
+    void     indexStudyInstance(int row, DcmItem* item, const QString& studyFolder);
+    SeriesWriteStats writeSeries(const Patient& p, const QVector<QImage>& images,
+        DurableBatch::Mode mode, int firstInstance);
 
     static QString generateDicomUID();
     static Patient patientFromMap(const QVariantMap& m);
+    // patientFromMap + "--" из полей ввода QML -> пусто
+    static Patient newPatientFromMap(const QVariantMap& m);
     static QString decodeDicomText(const OFString& value,
-        const OFString& specificCharacterSet);
+        const OFString& specificCharacterSet, bool personName = false);
 
-    QList<Patient> m_patients;
+    StorageRoots   m_roots;            // корни архива: <root>/<пациент>/<исследование>
+    std::atomic<int> m_liveSessions{ 0 };   // живые ImportSession, включая m_session
+    std::atomic<int> m_placement{ StorageRoots::MostFreeSpace };
+    std::atomic<int> m_layout{ StorageRoots::Flat };
+    PatientStore   m_store;
+    mutable QReadWriteLock m_storeLock; // m_store пишется в потоке GUI, читается и ответами C-FIND
+    FolderAllocator m_folders;         // занятые имена папок пациентов/исследований
+    std::atomic<bool> m_useDicomDir{ true };
+    ContentHashIndex m_contentHashes;  // <папка пациента>/.contenthash
+    std::atomic<int> m_dedupScope{ ContentHashIndex::SameStudy };
+    QStringList    m_pendingDicomDir;  // принятые по сети файлы, ещё не внесённые в DICOMDIR
+    QTimer*        m_dicomDirFlush = nullptr;
+    StoreSCP*      m_scp = nullptr;
+    StoreSCU*      m_exporter = nullptr;
+    QThread*       m_exportThread = nullptr;
+    ArchiveVerifier* m_verifier = nullptr;
+    QThread*       m_verifyThread = nullptr;
+    QThread*       m_migrateThread = nullptr;
+    VerifyFindingsModel* m_findings = nullptr;
+    int            m_loadedRows = 0;   // сколько строк уже отдано вью (fetchMore)
+    PatientTreeModel* m_tree = nullptr;
     QString        m_studyLabel = "Study";
+    mutable QMutex m_settingsMutex;    // m_studyLabel читается сессиями из своих потоков
+    int            m_scanDepth = 2;    // корень -> пациент -> исследование
+    std::atomic<int> m_saveDurability{ DurableBatch::GroupCommit };
+    std::atomic<int> m_saveThreads{ 1 };
+    DirWalker::Stats m_lastScan;       // итоги последнего scanPatients()
+    qint64         m_lastScanMs = 0;
+    qint64         m_lastScanFromIndex = 0;   // снимков взято из DICOMDIR
+
+    // разобранные заголовки по пути + mtime + размеру, общие для всех путей чтения
+    mutable HeaderCache m_headers;
+    // Pixel Data для writeSeries: переходит от снимка к снимку
+    PixelBufferPool m_pixelPool;
+    // найденный stub по (папка, PatientID): повторный поиск не листает папки
+    struct StubHit {
+        QString stubPath;
+        QString patientFolder;
+    };
+    mutable QMutex  m_stubMutex;
+    mutable QCache<QString, StubHit> m_stubHits{ 1024 };
+    mutable qint64  m_stubHitCount = 0;
+    mutable qint64  m_stubMissCount = 0;
 
-    Patient m_selectedPatient{};
+    std::unique_ptr<ImportSession> m_session;   // сессия по умолчанию (выбранный в QML пациент)
 };
@@ -0,0 +1,11 @@
+﻿// parallelfor.cpp
+#include "parallelfor.h"
+
+#include <QGlobalStatic>
+
+Q_GLOBAL_STATIC(QThreadPool, s_parallelForPool)
+
+QThreadPool* parallelForPool()
+{
+    return s_parallelForPool();
+}
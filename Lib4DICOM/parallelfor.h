@@ -0,0 +1,61 @@
+﻿#pragma once
+
+#include <QMutex>
+#include <QThreadPool>
+#include <QWaitCondition>
+
+#include <algorithm>
+#include <atomic>
+
+#include "lib4dicom_global.h"
+
+// Общий пул parallelFor: потоки переживают вызов (expiryTimeout пула) и не создаются заново
+// на каждую порцию записи или полосу кадра.
+LIB4DICOM_EXPORT QThreadPool* parallelForPool();
+
+// Параллельный цикл body(0..count-1) в threads потоках (threads <= 1 — в текущем).
+// Индексы раздаются по одному через атомарный счётчик, поэтому неравные по цене
+// итерации (снимки разного размера) распределяются сами собой.
+// Текущий поток считает наравне с помощниками, а помощники берутся только из свободных
+// потоков пула (tryStart не ставит задачу в очередь): вложенные и одновременные вызовы
+// не ждут друг друга, в худшем случае цикл идёт в меньшее число потоков.
+template <class Body>
+void parallelFor(int count, int threads, Body&& body)
+{
+    threads = std::min(threads, count);
+    if (threads <= 1) {
+        for (int i = 0; i < count; ++i)
+            body(i);
+        return;
+    }
+
+    std::atomic<int> next{ 0 };
+    auto run = [&]() {
+        for (int i = next.fetch_add(1); i < count; i = next.fetch_add(1))
+            body(i);
+    };
+
+    QThreadPool* pool = parallelForPool();
+    if (pool->maxThreadCount() < threads - 1)
+        pool->setMaxThreadCount(threads - 1);
+    // помощник отмечается под мьютексом: ожидающий поток не вернётся (и не разрушит их),
+    // пока последний помощник не отпустил мьютекс
+    QMutex mutex;
+    QWaitCondition finished;
+    int running = 0;
+    for (int t = 1; t < threads; ++t) {
+        QMutexLocker lock(&mutex);
+        if (!pool->tryStart([&]() {
+                run();
+                QMutexLocker done(&mutex);
+                if (--running == 0)
+                    finished.wakeAll();
+            }))
+            break;
+        ++running;
+    }
+    run();
+    QMutexLocker lock(&mutex);
+    while (running > 0)
+        finished.wait(&mutex);
+}
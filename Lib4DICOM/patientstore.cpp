@@ -0,0 +1,254 @@
+﻿// patientstore.cpp
+#include "patientstore.h"
+#include "lib4dicom.h"
+
+namespace {
+    // FNV-1a 64
+    const quint64 kFnvOffset = 1469598103934665603ULL;
+    const quint64 kFnvPrime = 1099511628211ULL;
+
+    // грубая оценка служебного заголовка QArrayData в куче
+    const qint64 kStringHeader = 16;
+    // оценка служебных расходов QHash на один элемент
+    const qint64 kHashNode = 16;
+
+    qint64 stringBytes(const QString& s) {
+        return s.isEmpty() ? 0 : kStringHeader + (qint64(s.size()) + 1) * 2;
+    }
+
+    template <typename T>
+    qint64 vectorBytes(const QVector<T>& v) {
+        return qint64(v.capacity()) * qint64(sizeof(T));
+    }
+}
+
+// ---------------- StringPool ----------------
+quint32 StringPool::intern(const QString& s)
+{
+    const auto it = m_index.constFind(s);
+    if (it != m_index.constEnd())
+        return it.value();
+    const quint32 id = quint32(m_strings.size());
+    m_strings.append(s);
+    m_index.insert(s, id);   // ключ разделяет данные со строкой из m_strings
+    return id;
+}
+
+void StringPool::clear()
+{
+    m_strings.clear();
+    m_index.clear();
+}
+
+qint64 StringPool::memoryUsage() const
+{
+    qint64 bytes = vectorBytes(m_strings);
+    for (const QString& s : m_strings)
+        bytes += stringBytes(s);
+    bytes += qint64(m_index.size()) * (qint64(sizeof(QString)) + qint64(sizeof(quint32)) + kHashNode);
+    return bytes;
+}
+
+// ---------------- Хэши ----------------
+quint64 PatientStore::hashBytes(const char* data, size_t len, quint64 seed)
+{
+    quint64 h = kFnvOffset ^ seed;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= quint8(data[i]);
+        h *= kFnvPrime;
+    }
+    return h;
+}
+
+quint64 PatientStore::hashString(const QString& s, quint64 seed)
+{
+    return hashBytes(reinterpret_cast<const char*>(s.constData()),
+        size_t(s.size()) * sizeof(QChar), seed);
+}
+
+quint32 PatientStore::parseDate(const char* s, size_t len)
+{
+    if (!s || len < 8)
+        return 0;
+    quint32 v = 0;
+    for (size_t i = 0; i < 8; ++i) {
+        if (s[i] < '0' || s[i] > '9')
+            return 0;
+        v = v * 10 + quint32(s[i] - '0');
+    }
+    return v;
+}
+
+// ---------------- Общие операции ----------------
+void PatientStore::clear()
+{
+    m_strings.clear();
+    m_sexDict = { QStringLiteral("--"), QStringLiteral("M"), QStringLiteral("F"), QStringLiteral("O") };
+
+    m_name.clear(); m_pid.clear(); m_year.clear(); m_sex.clear();
+    m_folderDir.clear(); m_folderLeaf.clear();
+    m_studyCount.clear(); m_imageCount.clear(); m_lastStudyDate.clear();
+    m_patientByKey.clear();
+
+    m_studyPatient.clear(); m_studyUid.clear(); m_studyDate.clear(); m_studyTime.clear();
+    m_studyDir.clear(); m_studyLeaf.clear(); m_studyImages.clear();
+    m_studyByKey.clear();
+}
+
+void PatientStore::reserve(int patients)
+{
+    m_name.reserve(patients); m_pid.reserve(patients); m_year.reserve(patients); m_sex.reserve(patients);
+    m_folderDir.reserve(patients); m_folderLeaf.reserve(patients);
+    m_studyCount.reserve(patients); m_imageCount.reserve(patients); m_lastStudyDate.reserve(patients);
+    m_patientByKey.reserve(patients);
+}
+
+void PatientStore::splitPath(const QString& path, quint32& dir, quint32& leaf)
+{
+    const int slash = path.lastIndexOf('/');
+    dir = m_strings.intern(slash > 0 ? path.left(slash) : QString());
+    leaf = m_strings.intern(slash >= 0 ? path.mid(slash + 1) : path);
+}
+
+QString PatientStore::joinPath(quint32 dir, quint32 leaf) const
+{
+    const QString& d = m_strings.at(dir);
+    return d.isEmpty() ? m_strings.at(leaf) : d + '/' + m_strings.at(leaf);
+}
+
+// ---------------- Пациенты ----------------
+int PatientStore::addPatient(quint64 key, const Patient& p)
+{
+    const int row = m_name.size();
+
+    m_name.append(m_strings.intern(p.fullName.isEmpty() ? QStringLiteral("--") : p.fullName));
+    m_pid.append(m_strings.intern(p.patientID.isEmpty() ? QStringLiteral("--") : p.patientID));
+
+    bool ok = false;
+    const int year = p.birthYear.size() == 4 ? p.birthYear.toInt(&ok) : 0;
+    m_year.append(ok ? qint16(year) : qint16(-1));
+
+    const QString sex = p.sex.isEmpty() ? QStringLiteral("--") : p.sex;
+    int code = m_sexDict.indexOf(sex);
+    if (code < 0 && m_sexDict.size() < 256) {
+        code = m_sexDict.size();
+        m_sexDict.append(sex);
+    }
+    m_sex.append(quint8(code < 0 ? 0 : code));
+
+    quint32 dir = 0, leaf = 0;
+    splitPath(p.patientFolder, dir, leaf);
+    m_folderDir.append(dir);
+    m_folderLeaf.append(leaf);
+
+    m_studyCount.append(0);
+    m_imageCount.append(0);
+    m_lastStudyDate.append(0);
+
+    m_patientByKey.insert(key, row);
+    return row;
+}
+
+Patient PatientStore::patient(int row) const
+{
+    Patient p;
+    p.fullName = fullName(row);
+    p.birthYear = birthYear(row);
+    p.sex = sex(row);
+    p.patientID = patientID(row);
+    p.patientFolder = patientFolder(row);
+    return p;
+}
+
+QString PatientStore::birthYear(int row) const
+{
+    const qint16 y = m_year.at(row);
+    return y < 0 ? QStringLiteral("--") : QString::number(y).rightJustified(4, '0');
+}
+
+QString PatientStore::patientFolder(int row) const
+{
+    return joinPath(m_folderDir.at(row), m_folderLeaf.at(row));
+}
+
+void PatientStore::setPatientFolder(int row, const QString& folder)
+{
+    splitPath(folder, m_folderDir[row], m_folderLeaf[row]);
+}
+
+QString PatientStore::lastStudyDate(int row) const
+{
+    const quint32 d = m_lastStudyDate.at(row);
+    return d == 0 ? QString() : QString::number(d);
+}
+
+// ---------------- Исследования ----------------
+int PatientStore::addStudy(quint64 key, int patientRow, const QString& studyUID,
+    quint32 studyDate, quint32 studyTime, const QString& studyFolder)
+{
+    const int srow = m_studyPatient.size();
+
+    m_studyPatient.append(patientRow);
+    m_studyUid.append(m_strings.intern(studyUID));
+    m_studyDate.append(studyDate);
+    m_studyTime.append(studyTime);
+
+    quint32 dir = 0, leaf = 0;
+    splitPath(studyFolder, dir, leaf);
+    m_studyDir.append(dir);
+    m_studyLeaf.append(leaf);
+    m_studyImages.append(0);
+
+    m_studyByKey.insert(key, srow);
+
+    ++m_studyCount[patientRow];
+    if (studyDate > m_lastStudyDate.at(patientRow))
+        m_lastStudyDate[patientRow] = studyDate;
+    return srow;
+}
+
+void PatientStore::countInstance(int patientRow, int studyRow)
+{
+    ++m_imageCount[patientRow];
+    if (studyRow >= 0)
+        ++m_studyImages[studyRow];
+}
+
+QString PatientStore::studyFolder(int srow) const
+{
+    return joinPath(m_studyDir.at(srow), m_studyLeaf.at(srow));
+}
+
+void PatientStore::setStudyFolder(int srow, const QString& folder)
+{
+    splitPath(folder, m_studyDir[srow], m_studyLeaf[srow]);
+}
+
+// ---------------- Память ----------------
+qint64 PatientStore::memoryUsage() const
+{
+    qint64 bytes = m_strings.memoryUsage();
+    bytes += vectorBytes(m_name) + vectorBytes(m_pid) + vectorBytes(m_year) + vectorBytes(m_sex)
+        + vectorBytes(m_folderDir) + vectorBytes(m_folderLeaf)
+        + vectorBytes(m_studyCount) + vectorBytes(m_imageCount) + vectorBytes(m_lastStudyDate);
+    bytes += qint64(m_patientByKey.size()) * (qint64(sizeof(quint64) + sizeof(int)) + kHashNode);
+
+    bytes += vectorBytes(m_studyPatient) + vectorBytes(m_studyUid)
+        + vectorBytes(m_studyDate) + vectorBytes(m_studyTime)
+        + vectorBytes(m_studyDir) + vectorBytes(m_studyLeaf) + vectorBytes(m_studyImages);
+    bytes += qint64(m_studyByKey.size()) * (qint64(sizeof(quint64) + sizeof(int)) + kHashNode);
+    return bytes;
+}
+
+qint64 PatientStore::estimateLegacyMemoryUsage() const
+{
+    // QList<Patient>: отдельные QString на запись, у каждой своя копия данных
+    qint64 bytes = 0;
+    for (int row = 0; row < size(); ++row) {
+        bytes += qint64(sizeof(Patient));
+        bytes += stringBytes(fullName(row)) + stringBytes(birthYear(row))
+            + stringBytes(sex(row)) + stringBytes(patientID(row))
+            + stringBytes(patientFolder(row));
+    }
+    return bytes;
+}
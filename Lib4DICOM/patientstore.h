@@ -0,0 +1,107 @@
+﻿#pragma once
+
+#include <QHash>
+#include <QString>
+#include <QVector>
+
+struct Patient;
+
+// Пул строк: каждая уникальная строка хранится один раз, наружу отдаётся id
+class StringPool {
+public:
+    quint32 intern(const QString& s);
+    const QString& at(quint32 id) const { return m_strings.at(int(id)); }
+    int size() const { return m_strings.size(); }
+    void clear();
+    qint64 memoryUsage() const;
+
+private:
+    QVector<QString>        m_strings;
+    QHash<QString, quint32> m_index;
+};
+
+// Колоночное хранилище пациентов и исследований архива.
+// Строки интернированы, пол и год рождения закодированы числами,
+// дедупликация по 64-битному хэшу без промежуточных QString-ключей.
+class PatientStore {
+public:
+    PatientStore() { clear(); }
+
+    // ---- хэш-ключи (по сырым байтам тегов, без декодирования) ----
+    static quint64 hashBytes(const char* data, size_t len, quint64 seed = 0);
+    static quint64 hashString(const QString& s, quint64 seed = 0);
+
+    void clear();
+    void reserve(int patients);
+
+    // ---- пациенты ----
+    int  size() const { return m_name.size(); }
+    int  findPatient(quint64 key) const { return m_patientByKey.value(key, -1); }
+    int  addPatient(quint64 key, const Patient& p);
+
+    Patient patient(int row) const;
+    QString fullName(int row) const    { return m_strings.at(m_name.at(row)); }
+    QString patientID(int row) const   { return m_strings.at(m_pid.at(row)); }
+    QString birthYear(int row) const;
+    QString sex(int row) const         { return m_sexDict.at(m_sex.at(row)); }
+    QString patientFolder(int row) const;
+    // папка пациента переехала (смена раскладки архива)
+    void    setPatientFolder(int row, const QString& folder);
+
+    int     studyCount(int row) const  { return int(m_studyCount.at(row)); }
+    int     imageCount(int row) const  { return int(m_imageCount.at(row)); }
+    QString lastStudyDate(int row) const;
+
+    // ---- исследования ----
+    int  studyRows() const { return m_studyPatient.size(); }
+    int  findStudy(quint64 key) const { return m_studyByKey.value(key, -1); }
+    int  addStudy(quint64 key, int patientRow, const QString& studyUID,
+                  quint32 studyDate, quint32 studyTime, const QString& studyFolder);
+    void countInstance(int patientRow, int studyRow);
+
+    int     studyPatient(int srow) const { return m_studyPatient.at(srow); }
+    QString studyUID(int srow) const     { return m_strings.at(m_studyUid.at(srow)); }
+    quint32 studyDate(int srow) const    { return m_studyDate.at(srow); }
+    quint32 studyTime(int srow) const    { return m_studyTime.at(srow); }
+    QString studyFolder(int srow) const;
+    void    setStudyFolder(int srow, const QString& folder);
+    int     studyImages(int srow) const  { return int(m_studyImages.at(srow)); }
+
+    // "YYYYMMDD" -> 20240131 (0 — нет даты)
+    static quint32 parseDate(const char* s, size_t len);
+
+    // ---- память ----
+    qint64 memoryUsage() const;
+    // Расчётная (не измеренная) оценка того же набора в виде QList<Patient>: sizeof(Patient)
+    // плюс отдельная копия каждой строки; накладные расходы кучи не учитываются
+    qint64 estimateLegacyMemoryUsage() const;
+
+private:
+    void splitPath(const QString& path, quint32& dir, quint32& leaf);
+    QString joinPath(quint32 dir, quint32 leaf) const;
+
+    StringPool m_strings;
+    QVector<QString> m_sexDict;          // код пола -> "M"/"F"/"O"/"--"/...
+
+    // пациенты
+    QVector<quint32> m_name;
+    QVector<quint32> m_pid;
+    QVector<qint16>  m_year;             // -1 — неизвестен
+    QVector<quint8>  m_sex;
+    QVector<quint32> m_folderDir;
+    QVector<quint32> m_folderLeaf;
+    QVector<quint32> m_studyCount;
+    QVector<quint32> m_imageCount;
+    QVector<quint32> m_lastStudyDate;
+    QHash<quint64, int> m_patientByKey;
+
+    // исследования
+    QVector<int>     m_studyPatient;
+    QVector<quint32> m_studyUid;
+    QVector<quint32> m_studyDate;
+    QVector<quint32> m_studyTime;
+    QVector<quint32> m_studyDir;
+    QVector<quint32> m_studyLeaf;
+    QVector<quint32> m_studyImages;
+    QHash<quint64, int> m_studyByKey;
+};
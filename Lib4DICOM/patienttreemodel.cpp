@@ -0,0 +1,379 @@
+﻿// patienttreemodel.cpp
+#include "patienttreemodel.h"
+#include "lib4dicom.h"
+#include "dirwalker.h"
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSet>
+#include <QDebug>
+
+#include <algorithm>
+
+namespace {
+    // Размер порции при подгрузке пациентов, снимков серии и чтении заголовков исследования
+    const int kPatientPage = 200;
+    const int kInstancePage = 256;
+    const int kHeaderPage = 256;
+}
+
+const char* PatientTreeModel::kindName(Node::Kind kind)
+{
+    switch (kind) {
+    case Node::Patient:  return "patient";
+    case Node::Study:    return "study";
+    case Node::Series:   return "series";
+    case Node::Instance: return "instance";
+    case Node::Root:     break;
+    }
+    return "root";
+}
+
+PatientTreeModel::PatientTreeModel(Lib4DICOM* source, QObject* parent)
+    : QAbstractItemModel(parent), m_source(source)
+{
+    m_root = std::make_unique<Node>();
+    if (m_source) {
+        connect(m_source, &QAbstractItemModel::modelReset, this, &PatientTreeModel::reload);
+        connect(m_source, &QAbstractItemModel::rowsInserted, this, &PatientTreeModel::onSourceRowsInserted);
+        connect(m_source, &QAbstractItemModel::dataChanged, this, &PatientTreeModel::onSourceDataChanged);
+        m_root->total = m_source->patientCount();
+    }
+}
+
+PatientTreeModel::~PatientTreeModel() = default;
+
+// ---------------- Навигация ----------------
+PatientTreeModel::Node* PatientTreeModel::nodeFrom(const QModelIndex& index) const
+{
+    if (!index.isValid())
+        return m_root.get();
+    return static_cast<Node*>(index.internalPointer());
+}
+
+QModelIndex PatientTreeModel::indexOf(Node* node) const
+{
+    if (!node || node == m_root.get())
+        return {};
+    return createIndex(node->row, 0, node);
+}
+
+QModelIndex PatientTreeModel::index(int row, int column, const QModelIndex& parent) const
+{
+    const Node* p = nodeFrom(parent);
+    if (column != 0 || row < 0 || row >= int(p->children.size()))
+        return {};
+    return createIndex(row, 0, p->children[size_t(row)].get());
+}
+
+QModelIndex PatientTreeModel::parent(const QModelIndex& child) const
+{
+    if (!child.isValid())
+        return {};
+    return indexOf(nodeFrom(child)->parent);
+}
+
+int PatientTreeModel::rowCount(const QModelIndex& parent) const
+{
+    if (parent.column() > 0)
+        return 0;
+    return int(nodeFrom(parent)->children.size());
+}
+
+int PatientTreeModel::columnCount(const QModelIndex&) const
+{
+    return 1;
+}
+
+QVariant PatientTreeModel::data(const QModelIndex& index, int role) const
+{
+    if (!index.isValid())
+        return {};
+    const Node* n = nodeFrom(index);
+    switch (role) {
+    case Qt::DisplayRole:
+    case LabelRole:    return n->label;
+    case NodeTypeRole: return QString::fromLatin1(kindName(n->kind));
+    case PathRole:     return n->path;
+    case UidRole:      return n->uid;
+    case CountRole:    return n->total;
+    }
+    return {};
+}
+
+QHash<int, QByteArray> PatientTreeModel::roleNames() const
+{
+    return {
+        { LabelRole,    "label"    },
+        { NodeTypeRole, "nodeType" },
+        { PathRole,     "path"     },
+        { UidRole,      "uid"      },
+        { CountRole,    "count"    }
+    };
+}
+
+// ---------------- Ленивая подгрузка ----------------
+bool PatientTreeModel::hasChildren(const QModelIndex& parent) const
+{
+    const Node* n = nodeFrom(parent);
+    if (n->kind == Node::Instance)
+        return false;
+    if (!n->children.empty())
+        return true;
+    // пока не читали диск — считаем, что дети есть (раскрытие вызовет fetchMore)
+    return n->total != 0;
+}
+
+bool PatientTreeModel::canFetchMore(const QModelIndex& parent) const
+{
+    const Node* n = nodeFrom(parent);
+    switch (n->kind) {
+    case Node::Root:
+        // пациенты могли добавиться и без rowsInserted (список подгружен не до конца)
+        return m_source && int(n->children.size()) < m_source->patientCount();
+    case Node::Patient:
+        return !n->listed;
+    case Node::Study:
+        return !n->listed || n->pendingFrom < n->pending.size();
+    case Node::Series:
+        return n->pendingFrom < n->pending.size();
+    case Node::Instance:
+        break;
+    }
+    return false;
+}
+
+void PatientTreeModel::fetchMore(const QModelIndex& parent)
+{
+    Node* n = nodeFrom(parent);
+    std::vector<std::unique_ptr<Node>> nodes;
+
+    switch (n->kind) {
+    case Node::Root: {
+        if (!m_source)
+            return;
+        n->total = m_source->patientCount();
+        const int from = int(n->children.size());
+        const int to = std::min(n->total, from + kPatientPage);
+        for (int i = from; i < to; ++i) {
+            auto node = std::make_unique<Node>();
+            node->kind = Node::Patient;
+            if (!fillPatient(node.get(), i)) {
+                // пациентов стало меньше, чем при сбросе: дальше строк нет
+                n->total = i;
+                break;
+            }
+            nodes.push_back(std::move(node));
+        }
+        break;
+    }
+    case Node::Patient:
+        nodes = listStudies(n);
+        n->listed = true;
+        n->total = int(nodes.size());
+        break;
+    case Node::Study:
+        if (!n->listed) {
+            // сам список файлов дешёвый: заголовки читаются порциями в readSeriesPage
+            DirWalker::walk(n->path, 0, [&](const DirWalker::Entry& e) { n->pending << e.filePath; });
+            n->listed = true;
+            n->total = 0;
+        }
+        nodes = readSeriesPage(n);
+        n->total += int(nodes.size());
+        break;
+    case Node::Series: {
+        const int from = n->pendingFrom;
+        const int take = std::min<int>(kInstancePage, n->pending.size() - from);
+        for (int i = from; i < from + take; ++i) {
+            auto node = std::make_unique<Node>();
+            node->kind = Node::Instance;
+            node->path = n->pending.at(i);
+            node->label = QFileInfo(node->path).fileName();
+            node->total = 0;
+            nodes.push_back(std::move(node));
+        }
+        n->pendingFrom += take;
+        if (n->pendingFrom == n->pending.size()) {   // всё выдано — список больше не нужен
+            n->pending.clear();
+            n->pendingNumbers.clear();
+            n->pendingFrom = 0;
+        }
+        break;
+    }
+    case Node::Instance:
+        return;
+    }
+
+    if (nodes.empty()) {
+        // узел оказался пустым — сообщим вью, что стрелку раскрытия можно убрать
+        if (n != m_root.get() && n->children.empty()) {
+            const QModelIndex idx = indexOf(n);
+            emit dataChanged(idx, idx, { CountRole });
+        }
+        return;
+    }
+    appendChildren(n, nodes);
+}
+
+void PatientTreeModel::appendChildren(Node* parent, std::vector<std::unique_ptr<Node>>& nodes)
+{
+    const int first = int(parent->children.size());
+    const int last = first + int(nodes.size()) - 1;
+
+    beginInsertRows(indexOf(parent), first, last);
+    parent->children.reserve(parent->children.size() + nodes.size());
+    for (auto& node : nodes) {
+        node->parent = parent;
+        node->row = int(parent->children.size());
+        parent->children.push_back(std::move(node));
+    }
+    endInsertRows();
+}
+
+void PatientTreeModel::reload()
+{
+    beginResetModel();
+    m_root = std::make_unique<Node>();
+    m_root->total = m_source ? m_source->patientCount() : 0;
+    endResetModel();
+}
+
+bool PatientTreeModel::fillPatient(Node* node, int row) const
+{
+    const QVariantMap d = m_source->getPatientDemographics(row);
+    if (!d.value("ok").toBool())
+        return false;
+    node->label = d.value("fullName").toString();
+    const QString by = d.value("birthYear").toString();
+    if (!by.isEmpty() && by != "--")
+        node->label += " (" + by + ")";
+    node->path = d.value("patientFolder").toString();
+    node->uid = d.value("patientID").toString();
+    return true;
+}
+
+// ---------------- Изменения списка пациентов ----------------
+
+// Строки списка вставляются и при его постраничной подгрузке — новыми пациентами считаются
+// только строки за пределами того, что было известно дереву
+void PatientTreeModel::onSourceRowsInserted(const QModelIndex& parent, int first, int)
+{
+    if (parent.isValid() || first < m_root->total)
+        return;
+    const bool allShown = int(m_root->children.size()) >= m_root->total;
+    m_root->total = m_source->patientCount();
+    if (allShown)
+        fetchMore(QModelIndex());   // иначе новые строки подгрузятся с очередной страницей
+}
+
+// У пациента появилось исследование или снимок: обновляем подпись и дописываем новые папки
+// исследований, если пациент уже раскрыт. Серии раскрытых исследований не перечитываются.
+void PatientTreeModel::onSourceDataChanged(const QModelIndex& topLeft, const QModelIndex& bottomRight)
+{
+    if (topLeft.parent().isValid())
+        return;
+    const int last = std::min(bottomRight.row(), int(m_root->children.size()) - 1);
+    for (int row = std::max(0, topLeft.row()); row <= last; ++row) {
+        Node* patient = m_root->children[size_t(row)].get();
+        if (!fillPatient(patient, row))
+            continue;
+
+        if (patient->listed) {
+            QSet<QString> known;
+            for (const auto& c : patient->children)
+                known.insert(c->path);
+            std::vector<std::unique_ptr<Node>> added;
+            for (auto& study : listStudies(patient))
+                if (!known.contains(study->path))
+                    added.push_back(std::move(study));
+            if (!added.empty()) {
+                patient->total += int(added.size());
+                appendChildren(patient, added);
+            }
+        }
+        const QModelIndex idx = indexOf(patient);
+        emit dataChanged(idx, idx, { Qt::DisplayRole, LabelRole, PathRole, UidRole, CountRole });
+    }
+}
+
+// ---------------- Чтение уровней с диска ----------------
+
+// Исследования = подпапки папки пациента (<Name>_<Date>_<Label>[_n])
+std::vector<std::unique_ptr<PatientTreeModel::Node>>
+PatientTreeModel::listStudies(const Node* patient) const
+{
+    std::vector<std::unique_ptr<Node>> out;
+    if (patient->path.isEmpty())
+        return out;
+
+    const QFileInfoList dirs = QDir(patient->path)
+        .entryInfoList(QDir::Dirs | QDir::NoDotAndDotDot, QDir::Name);
+    out.reserve(size_t(dirs.size()));
+    for (const QFileInfo& d : dirs) {
+        auto node = std::make_unique<Node>();
+        node->kind = Node::Study;
+        node->label = d.fileName();
+        node->path = d.absoluteFilePath();
+        out.push_back(std::move(node));
+    }
+    return out;
+}
+
+// Серии = группы файлов исследования по SeriesInstanceUID.
+// Заголовки берутся из общего кэша Lib4DICOM: повторное раскрытие исследования не читает файлы.
+// За вызов читается kHeaderPage заголовков; снимки встают в ещё не выданную часть серии по InstanceNumber.
+std::vector<std::unique_ptr<PatientTreeModel::Node>>
+PatientTreeModel::readSeriesPage(Node* study)
+{
+    QHash<QString, Node*> byUid;
+    for (const auto& c : study->children)
+        byUid.insert(c->uid, c.get());
+
+    std::vector<std::unique_ptr<Node>> out;
+    std::vector<Node*> grown;   // уже показанные серии, в которые добавились снимки
+    const int from = study->pendingFrom;
+    const int to = std::min<int>(from + kHeaderPage, study->pending.size());
+    for (int i = from; i < to; ++i) {
+        const QString& path = study->pending.at(i);
+        const HeaderFields f = m_source->m_headers.fields(path);
+        if (!f.ok)
+            continue;
+
+        Node* series = byUid.value(f.seriesInstanceUID, nullptr);
+        if (!series) {
+            auto node = std::make_unique<Node>();
+            node->kind = Node::Series;
+            node->uid = f.seriesInstanceUID;
+            node->label = f.seriesDescription.isEmpty() ? QStringLiteral("--") : f.seriesDescription;
+            node->path = study->path;
+            node->total = 0;
+            series = node.get();
+            byUid.insert(f.seriesInstanceUID, series);
+            out.push_back(std::move(node));
+        }
+        else if (series->parent && std::find(grown.begin(), grown.end(), series) == grown.end()) {
+            grown.push_back(series);
+        }
+
+        const auto begin = series->pendingNumbers.begin() + series->pendingFrom;
+        const auto pos = std::upper_bound(begin, series->pendingNumbers.end(), f.instanceNumber);
+        const int at = int(pos - series->pendingNumbers.begin());
+        series->pendingNumbers.insert(pos, f.instanceNumber);
+        series->pending.insert(at, path);
+        ++series->total;
+    }
+
+    study->pendingFrom = to;
+    if (study->pendingFrom == study->pending.size()) {   // все заголовки прочитаны
+        study->pending.clear();
+        study->pendingFrom = 0;
+    }
+
+    for (Node* series : grown) {
+        const QModelIndex idx = indexOf(series);
+        emit dataChanged(idx, idx, { CountRole });
+    }
+    return out;
+}
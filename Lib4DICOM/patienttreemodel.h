@@ -0,0 +1,85 @@
+﻿#pragma once
+
+#include <QAbstractItemModel>
+#include <QStringList>
+
+#include <memory>
+#include <vector>
+
+#include "lib4dicom_global.h"
+
+class Lib4DICOM;
+
+// Иерархическая модель архива: пациенты -> исследования -> серии -> снимки.
+// Дочерние узлы читаются с диска только при раскрытии (canFetchMore/fetchMore),
+// верхний уровень подгружается страницами из списка пациентов Lib4DICOM.
+// Заголовки снимков исследования читаются порциями: серии появляются и растут по мере чтения.
+// Новые пациенты и исследования (приём C-STORE) приходят из списка через rowsInserted/dataChanged.
+class LIB4DICOM_EXPORT PatientTreeModel : public QAbstractItemModel {
+    Q_OBJECT
+
+public:
+    enum Roles {
+        LabelRole = Qt::UserRole + 1,
+        NodeTypeRole,   // "patient" / "study" / "series" / "instance"
+        PathRole,       // папка пациента/исследования или путь к файлу
+        UidRole,        // PatientID / SeriesInstanceUID / SOPInstanceUID
+        CountRole       // число дочерних элементов, если уже известно
+    };
+
+    explicit PatientTreeModel(Lib4DICOM* source, QObject* parent = nullptr);
+    ~PatientTreeModel() override;
+
+    QModelIndex index(int row, int column, const QModelIndex& parent = QModelIndex()) const override;
+    QModelIndex parent(const QModelIndex& child) const override;
+    int rowCount(const QModelIndex& parent = QModelIndex()) const override;
+    int columnCount(const QModelIndex& parent = QModelIndex()) const override;
+    QVariant data(const QModelIndex& index, int role) const override;
+    QHash<int, QByteArray> roleNames() const override;
+
+    bool hasChildren(const QModelIndex& parent = QModelIndex()) const override;
+    bool canFetchMore(const QModelIndex& parent) const override;
+    void fetchMore(const QModelIndex& parent) override;
+
+    // Сброс дерева (после пересканирования пациентов)
+    Q_INVOKABLE void reload();
+
+private:
+    struct Node {
+        enum Kind { Root, Patient, Study, Series, Instance };
+
+        Kind    kind = Root;
+        QString label;
+        QString path;
+        QString uid;
+        int     total = -1;       // сколько детей всего (-1 — ещё не читали)
+
+        Node* parent = nullptr;
+        int   row = 0;
+        std::vector<std::unique_ptr<Node>> children;
+
+        // исследование: файлы, заголовки первых pendingFrom уже прочитаны;
+        // серия: файлы по InstanceNumber, узлами Instance выданы первые pendingFrom
+        QStringList pending;
+        std::vector<int> pendingNumbers;   // InstanceNumber к pending (только у серии)
+        int         pendingFrom = 0;
+        bool        listed = false;
+    };
+
+    static const char* kindName(Node::Kind kind);
+
+    Node* nodeFrom(const QModelIndex& index) const;
+    QModelIndex indexOf(Node* node) const;
+    void appendChildren(Node* parent, std::vector<std::unique_ptr<Node>>& nodes);
+
+    std::vector<std::unique_ptr<Node>> listStudies(const Node* patient) const;
+    // следующая порция заголовков исследования: новые серии возвращаются, известные растут на месте
+    std::vector<std::unique_ptr<Node>> readSeriesPage(Node* study);
+
+    void onSourceRowsInserted(const QModelIndex& parent, int first, int last);
+    void onSourceDataChanged(const QModelIndex& topLeft, const QModelIndex& bottomRight);
+    bool fillPatient(Node* node, int row) const;   // false — строки пациента уже нет
+
+    Lib4DICOM* m_source = nullptr;
+    std::unique_ptr<Node> m_root;
+};
@@ -0,0 +1,139 @@
+﻿// pixelbufferpool.cpp
+#include "pixelbufferpool.h"
+
+#include <QDebug>
+
+#include <dcmtk/dcmdata/dctk.h>
+#include <dcmtk/dcmdata/dcdeftag.h>
+#include <dcmtk/dcmdata/dcpixel.h>
+
+PixelBufferPool::PixelBufferPool(qint64 maxCachedBytes)
+    : m_maxCachedBytes(qMax<qint64>(0, maxCachedBytes))
+{
+}
+
+PixelBufferPool::~PixelBufferPool() = default;
+
+std::unique_ptr<DcmPixelData> PixelBufferPool::take(quint32 bytes, uchar*& data, bool* reused)
+{
+    data = nullptr;
+    if (reused)
+        *reused = false;
+
+    std::unique_ptr<DcmPixelData> elem;
+    {
+        QMutexLocker lock(&m_mutex);
+        ++m_stats.takes;
+        auto it = m_free.find(bytes);
+        if (it != m_free.end() && !it->second.empty()) {
+            elem = std::move(it->second.back());
+            it->second.pop_back();
+            if (it->second.empty())
+                m_free.erase(it);
+            m_cachedBytes -= bytes;
+            --m_cachedBuffers;
+        }
+    }
+
+    Uint8* p = nullptr;
+    if (elem && elem->getUint8Array(p).good() && p && elem->getLength() == bytes) {
+        data = p;
+        if (reused)
+            *reused = true;
+        QMutexLocker lock(&m_mutex);
+        ++m_stats.reused;
+        return elem;
+    }
+
+    elem.reset(new DcmPixelData(DCM_PixelData));
+    p = nullptr;
+    const OFCondition st = elem->createUint8Array(bytes, p);
+    if (st.bad() || !p) {
+        qWarning().noquote() << "[Lib4DICOM] PixelBufferPool: cannot allocate" << bytes << "bytes:" << st.text();
+        return nullptr;
+    }
+    data = p;
+    QMutexLocker lock(&m_mutex);
+    ++m_stats.allocated;
+    m_stats.allocatedBytes += bytes;
+    return elem;
+}
+
+void PixelBufferPool::give(std::unique_ptr<DcmPixelData> elem)
+{
+    if (!elem)
+        return;
+    const quint32 bytes = elem->getLength();
+
+    // вытесненные элементы освобождаются вне блокировки
+    std::vector<std::unique_ptr<DcmPixelData>> evicted;
+    {
+        QMutexLocker lock(&m_mutex);
+        if (m_enabled && bytes > 0 && bytes <= m_maxCachedBytes) {
+            // место под новый размер освобождают другие классы: серия сменила размер кадра
+            for (auto it = m_free.begin(); it != m_free.end() && m_cachedBytes + bytes > m_maxCachedBytes; ) {
+                if (it->first == bytes) {
+                    ++it;
+                    continue;
+                }
+                while (!it->second.empty() && m_cachedBytes + bytes > m_maxCachedBytes) {
+                    evicted.push_back(std::move(it->second.back()));
+                    it->second.pop_back();
+                    m_cachedBytes -= it->first;
+                    --m_cachedBuffers;
+                }
+                it = it->second.empty() ? m_free.erase(it) : std::next(it);
+            }
+            if (m_cachedBytes + bytes <= m_maxCachedBytes) {
+                m_free[bytes].push_back(std::move(elem));
+                m_cachedBytes += bytes;
+                ++m_cachedBuffers;
+                m_stats.dropped += qint64(evicted.size());
+                return;
+            }
+        }
+        m_stats.dropped += qint64(evicted.size()) + 1;
+    }
+}
+
+void PixelBufferPool::noteConversion()
+{
+    QMutexLocker lock(&m_mutex);
+    ++m_stats.conversions;
+}
+
+void PixelBufferPool::setEnabled(bool on)
+{
+    {
+        QMutexLocker lock(&m_mutex);
+        m_enabled = on;
+    }
+    if (!on)
+        clear();
+}
+
+void PixelBufferPool::setMaxCachedBytes(qint64 bytes)
+{
+    QMutexLocker lock(&m_mutex);
+    m_maxCachedBytes = qMax<qint64>(0, bytes);
+}
+
+void PixelBufferPool::clear()
+{
+    std::unordered_map<quint32, std::vector<std::unique_ptr<DcmPixelData>>> old;
+    QMutexLocker lock(&m_mutex);
+    old.swap(m_free);
+    m_cachedBytes = 0;
+    m_cachedBuffers = 0;
+    lock.unlock();
+}
+
+PixelBufferPool::Stats PixelBufferPool::stats() const
+{
+    QMutexLocker lock(&m_mutex);
+    Stats s = m_stats;
+    s.cachedBytes = m_cachedBytes;
+    s.cachedBuffers = m_cachedBuffers;
+    s.enabled = m_enabled;
+    return s;
+}
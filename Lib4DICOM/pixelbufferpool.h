@@ -0,0 +1,58 @@
+﻿#pragma once
+
+#include <QMutex>
+#include <QtGlobal>
+
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+class DcmPixelData;
+
+// Пул значений Pixel Data для пакетной записи серий. DCMTK копирует массив при put,
+// поэтому переиспользуется сам элемент DcmPixelData вместе со своим буфером: кадр пишется
+// прямо в него, после saveFile элемент снимается с набора данных и возвращается в пул.
+// Класс размера — точная длина значения (её DCMTK пишет в файл как есть), поэтому серия
+// одинаковых кадров в установившемся режиме память под пиксели не выделяет. Элементы
+// переходят между снимками, потоками и сессиями; объём свободных ограничен maxCachedBytes.
+class PixelBufferPool {
+public:
+    struct Stats {
+        qint64 takes = 0;
+        qint64 reused = 0;            // выделений памяти удалось избежать
+        qint64 allocated = 0;         // новый буфер: в классе не нашлось свободного
+        qint64 allocatedBytes = 0;
+        qint64 conversions = 0;       // кадр переводился в RGB888 через QImage (отдельный буфер)
+        qint64 dropped = 0;           // не вернулись в пул: превышен лимит или пул выключен
+        qint64 cachedBytes = 0;
+        int    cachedBuffers = 0;
+        bool   enabled = true;
+    };
+
+    explicit PixelBufferPool(qint64 maxCachedBytes = 256ll * 1024 * 1024);
+    ~PixelBufferPool();
+
+    PixelBufferPool(const PixelBufferPool&) = delete;
+    PixelBufferPool& operator=(const PixelBufferPool&) = delete;
+
+    // элемент со значением ровно bytes байт (bytes чётное); data — куда писать кадр.
+    // reused = false — буфер выделен заново. nullptr — не хватило памяти
+    std::unique_ptr<DcmPixelData> take(quint32 bytes, uchar*& data, bool* reused = nullptr);
+    void give(std::unique_ptr<DcmPixelData> elem);
+    void noteConversion();
+
+    // выключенный пул выделяет буфер на каждый кадр — для сравнения в бенчмарке
+    void  setEnabled(bool on);
+    void  setMaxCachedBytes(qint64 bytes);
+    void  clear();
+    Stats stats() const;
+
+private:
+    mutable QMutex m_mutex;
+    std::unordered_map<quint32, std::vector<std::unique_ptr<DcmPixelData>>> m_free;
+    qint64 m_maxCachedBytes;
+    qint64 m_cachedBytes = 0;
+    int    m_cachedBuffers = 0;
+    bool   m_enabled = true;
+    Stats  m_stats;
+};
@@ -0,0 +1,157 @@
+﻿// storageroots.cpp
+#include "storageroots.h"
+#include "contenthash.h"
+#include "dirwalker.h"
+
+#include <QDir>
+#include <QHash>
+#include <QStorageInfo>
+#include <QDebug>
+
+void StorageRoots::setPaths(const QStringList& paths)
+{
+    m_roots.clear();
+    for (const QString& p : paths) {
+        if (p.trimmed().isEmpty())
+            continue;
+        const QString abs = QDir::cleanPath(QDir(p.trimmed()).absolutePath());
+        bool dup = false;
+        for (const Root& r : m_roots)
+            dup = dup || r.path == abs;
+        if (dup)
+            continue;
+        if (!QDir().mkpath(abs))
+            qWarning().noquote() << "[Lib4DICOM] StorageRoots: cannot create root" << abs;
+
+        Root r;
+        r.path = abs;
+        r.dicomDir = std::make_unique<DicomDirIndex>();
+        r.dicomDir->setRoot(abs);
+        m_roots.push_back(std::move(r));
+    }
+}
+
+QStringList StorageRoots::paths() const
+{
+    QStringList out;
+    for (const Root& r : m_roots)
+        out << r.path;
+    return out;
+}
+
+int StorageRoots::rootOf(const QString& filePath) const
+{
+    const QString p = QDir::cleanPath(filePath);
+    int best = -1;
+    for (int i = 0; i < size(); ++i) {
+        const QString& root = m_roots[size_t(i)].path;
+        const bool inside = p == root
+            || (p.startsWith(root) && p.size() > root.size() && p.at(root.size()) == '/');
+        // вложенные корни: побеждает самый глубокий
+        if (inside && (best < 0 || root.size() > path(best).size()))
+            best = i;
+    }
+    return best;
+}
+
+bool StorageRoots::isRoot(const QString& dirPath) const
+{
+    const QString p = QDir::cleanPath(dirPath);
+    for (const Root& r : m_roots)
+        if (r.path == p)
+            return true;
+    return false;
+}
+
+int StorageRoots::place(Policy policy, const QString& patientID)
+{
+    const int n = size();
+    if (n <= 1)
+        return 0;
+
+    switch (policy) {
+    case MostFreeSpace: {
+        int best = 0;
+        qint64 bestFree = -1;
+        for (int i = 0; i < n; ++i) {
+            const qint64 avail = QStorageInfo(path(i)).bytesAvailable();
+            if (avail > bestFree) {
+                bestFree = avail;
+                best = i;
+            }
+        }
+        return best;
+    }
+    case PatientIdHash: {
+        const QByteArray id = patientID.trimmed().toUtf8();
+        if (!id.isEmpty() && id != "--")
+            return int(xxh64(id.constData(), size_t(id.size())) % quint64(n));
+        break;
+    }
+    case RoundRobin:
+        break;
+    }
+    return int(m_next.fetch_add(1) % quint32(n));
+}
+
+void StorageRoots::addToDicomDir(const QStringList& files) const
+{
+    if (files.isEmpty())
+        return;
+    QHash<int, QStringList> byRoot;
+    for (const QString& f : files) {
+        const int r = rootOf(f);
+        if (r >= 0)
+            byRoot[r] << f;
+    }
+    for (auto it = byRoot.cbegin(); it != byRoot.cend(); ++it)
+        dicomDir(it.key()).addFiles(it.value());
+}
+
+QString StorageRoots::bucketPath(const QString& patientID, const QString& fallbackKey)
+{
+    QByteArray key = patientID.trimmed().toUtf8();
+    if (key.isEmpty() || key == "--")
+        key = fallbackKey.toUtf8();
+    // старшие биты: младшие уже использует PatientIdHash при выборе корня
+    const quint64 h = xxh64(key.constData(), size_t(key.size())) >> 48;
+    return QString("%1/%2").arg(uint(h >> 8), 2, 16, QChar('0')).arg(uint(h & 0xFF), 2, 16, QChar('0'));
+}
+
+QString StorageRoots::patientParent(const QString& root, Layout layout,
+    const QString& patientID, const QString& fallbackKey)
+{
+    return layout == FanOut ? root + '/' + bucketPath(patientID, fallbackKey) : root;
+}
+
+QStringList StorageRoots::patientDirs(const QString& root)
+{
+    QStringList out;
+    const QDir::Filters filters = QDir::Dirs | QDir::NoDotAndDotDot;
+    for (const QFileInfo& fi : QDir(root).entryInfoList(filters, QDir::Name)) {
+        if (!DirWalker::isBucketName(fi.fileName())) {
+            out << fi.absoluteFilePath();
+            continue;
+        }
+        for (const QFileInfo& b2 : QDir(fi.absoluteFilePath()).entryInfoList(filters, QDir::Name)) {
+            if (!DirWalker::isBucketName(b2.fileName())) {
+                out << b2.absoluteFilePath();   // неполный веер: папка пациента в корзине первого уровня
+                continue;
+            }
+            for (const QFileInfo& p : QDir(b2.absoluteFilePath()).entryInfoList(filters, QDir::Name))
+                out << p.absoluteFilePath();
+        }
+    }
+    return out;
+}
+
+QString StorageRoots::patientFolderOf(const QString& root, const QString& relPath)
+{
+    const QStringList parts = relPath.split('/', Qt::SkipEmptyParts);
+    int first = 0;
+    while (first < 2 && first + 1 < parts.size() && DirWalker::isBucketName(parts.at(first)))
+        ++first;
+    if (first + 1 >= parts.size())
+        return root;
+    return root + '/' + parts.mid(0, first + 1).join('/');
+}
@@ -0,0 +1,69 @@
+﻿#pragma once
+
+#include <QString>
+#include <QStringList>
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "dicomdirindex.h"
+
+// Корни архива: <корень>/<пациент>/<исследование>, корни могут лежать на разных дисках.
+// Раскладка внутри корня — плоская или веер <корень>/ab/cd/<пациент> по хэшу PatientID;
+// обход, поиск stub и выделение папок понимают обе, поэтому архив можно переводить по частям.
+// У каждого корня свой DICOMDIR; пациент принадлежит корню, в котором лежит его папка,
+// поэтому поиск по пациенту идёт только в его корень. Новые пациенты раскладываются по политике.
+// Список корней меняется только из потока GUI; Lib4DICOM::setStorageRoots отказывает, пока идут
+// приём, отправка, проверка или перевод раскладки и пока живы сессии импорта, кроме сессии по умолчанию.
+class StorageRoots {
+public:
+    enum Policy {
+        MostFreeSpace = 0,  // корень с наибольшим свободным местом (QStorageInfo)
+        RoundRobin,         // по очереди
+        PatientIdHash       // xxh64(PatientID) mod N; пациент без ID — по очереди
+    };
+
+    enum Layout {
+        Flat = 0,           // <корень>/<пациент>
+        FanOut              // <корень>/ab/cd/<пациент>, ab/cd — старшие 16 бит xxh64(PatientID)
+    };
+
+    // пути приводятся к абсолютным, повторы отбрасываются, папки создаются
+    void setPaths(const QStringList& paths);
+    QStringList paths() const;
+
+    int size() const { return int(m_roots.size()); }
+    const QString& path(int i) const { return m_roots[size_t(i)].path; }
+    DicomDirIndex& dicomDir(int i) const { return *m_roots[size_t(i)].dicomDir; }
+
+    // индекс корня, внутри которого лежит path (сам корень тоже); -1 — вне архива
+    int rootOf(const QString& path) const;
+    bool isRoot(const QString& path) const;
+
+    // корень для папки нового пациента
+    int place(Policy policy, const QString& patientID);
+
+    // дописать файлы в DICOMDIR их корней (по одной записи DICOMDIR на корень)
+    void addToDicomDir(const QStringList& files) const;
+
+    // "ab/cd" для пациента; без PatientID ключом служит fallbackKey (имя папки пациента)
+    static QString bucketPath(const QString& patientID, const QString& fallbackKey);
+    // папка, в которую кладутся пациенты корня root при раскладке layout
+    static QString patientParent(const QString& root, Layout layout,
+        const QString& patientID, const QString& fallbackKey);
+    // все папки пациентов корня в обеих раскладках (служебные ".xxx" пропускаются)
+    static QStringList patientDirs(const QString& root);
+    // папка пациента для пути relPath относительно корня (корзины веера пропускаются);
+    // файл прямо в корне или в корзине — сам корень
+    static QString patientFolderOf(const QString& root, const QString& relPath);
+
+private:
+    struct Root {
+        QString                        path;
+        std::unique_ptr<DicomDirIndex> dicomDir;
+    };
+
+    std::vector<Root>     m_roots;
+    std::atomic<quint32>  m_next{ 0 };
+};
@@ -0,0 +1,518 @@
+﻿// storescp.cpp
+#include "storescp.h"
+#include "lib4dicom.h"
+#include "dicomcharset.h"
+#include "durablewriter.h"
+#include "findquery.h"
+
+#include <QDate>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QReadWriteLock>
+#include <QThread>
+#include <QDebug>
+
+#include <algorithm>
+#include <cstring>
+
+// DCMTK
+#include <dcmtk/dcmdata/dctk.h>
+#include <dcmtk/dcmnet/dimse.h>
+#include <dcmtk/dcmnet/scppool.h>
+#include <dcmtk/dcmnet/scpthrd.h>
+
+namespace {
+    // активный приёмник: рабочие потоки пула создаются без параметров
+    std::atomic<StoreSCP*> s_active{ nullptr };
+
+    const Uint32 kHeaderOnlyReadLength = 256;
+    // ограничение ответа на C-FIND: запрос "*" по большому архиву не должен съесть память
+    const int kMaxFindMatches = 10000;
+    const int kFindSamples = 4096;
+    // как часто проверять C-CANCEL при отправке ответов
+    const int kCancelCheckEvery = 64;
+
+    // Рабочий поток DcmSCPPool: одна ассоциация за раз
+    class StoreWorker : public DcmThreadSCP {
+    protected:
+        OFCondition handleIncomingCommand(T_DIMSE_Message* msg,
+            const DcmPresentationContextInfo& info) override
+        {
+            StoreSCP* scp = s_active.load();
+            if (scp && msg->CommandField == DIMSE_C_STORE_RQ)
+                return handleStore(scp, msg->msg.CStoreRQ, info);
+            if (scp && msg->CommandField == DIMSE_C_FIND_RQ)
+                return handleFind(scp, msg->msg.CFindRQ, info);
+            return DcmThreadSCP::handleIncomingCommand(msg, info);   // C-ECHO и прочее
+        }
+
+        OFCondition handleFind(StoreSCP* scp, T_DIMSE_C_FindRQ& req, const DcmPresentationContextInfo& info)
+        {
+            const T_ASC_PresentationContextID pc = info.presentationContextID;
+            DcmDataset* request = nullptr;
+            OFCondition cond = receiveFINDRequest(req, pc, request);
+            if (cond.bad())
+                return cond;
+            std::unique_ptr<DcmDataset> requestGuard(request);
+
+            std::vector<std::unique_ptr<DcmDataset>> matches;
+            const Uint16 status = scp->findMatches(request, req.AffectedSOPClassUID, matches);
+            if (status != STATUS_Success)
+                return sendFINDResponse(pc, req.MessageID, req.AffectedSOPClassUID, nullptr, status);
+
+            for (size_t i = 0; i < matches.size(); ++i) {
+                if (i % kCancelCheckEvery == 0 && checkForCANCEL(pc, req.MessageID).good())
+                    return sendFINDResponse(pc, req.MessageID, req.AffectedSOPClassUID, nullptr,
+                        STATUS_FIND_Cancel_MatchingTerminatedDueToCancelRequest);
+                cond = sendFINDResponse(pc, req.MessageID, req.AffectedSOPClassUID, matches[i].get(),
+                    STATUS_Pending);
+                if (cond.bad())
+                    return cond;
+            }
+            return sendFINDResponse(pc, req.MessageID, req.AffectedSOPClassUID, nullptr, STATUS_Success);
+        }
+
+        OFCondition handleStore(StoreSCP* scp, T_DIMSE_C_StoreRQ& req, const DcmPresentationContextInfo& info)
+        {
+            const QString tmpPath = scp->incomingPath();
+
+            // набор данных пишется в файл по мере приёма, без разбора в памяти
+            OFCondition cond = receiveSTORERequest(req, info.presentationContextID,
+                OFString(QFile::encodeName(tmpPath).constData()));
+            if (cond.bad()) {
+                QFile::remove(tmpPath);
+                if (cond == DIMSE_RECEIVEFAILED || cond == DUL_PEERABORTEDASSOCIATION)
+                    return cond;
+                sendSTOREResponse(info.presentationContextID, req, STATUS_STORE_Error_CannotUnderstand);
+                return EC_Normal;
+            }
+
+            const Uint16 status = scp->placeReceived(tmpPath)
+                ? STATUS_Success : STATUS_STORE_Refused_OutOfResources;
+            return sendSTOREResponse(info.presentationContextID, req, status);
+        }
+
+        void notifyAssociationAcknowledge() override {
+            if (StoreSCP* scp = s_active.load())
+                scp->associationStarted();
+        }
+
+        void notifyAssociationTermination() override {
+            if (StoreSCP* scp = s_active.load())
+                scp->associationEnded();
+        }
+    };
+
+    QString patientKey(const Patient& p) {
+        if (!p.patientID.isEmpty() && p.patientID != "--")
+            return "id:" + p.patientID;
+        return "dem:" + p.fullName + '\n' + p.birthYear + '\n' + p.sex;
+    }
+}
+
+struct StoreSCP::Pool : DcmSCPPool<StoreWorker> {};
+
+StoreSCP::StoreSCP(Lib4DICOM* lib)
+    : QObject(lib), m_lib(lib)
+{
+}
+
+StoreSCP::~StoreSCP()
+{
+    stop();
+}
+
+// ---------------- Запуск / остановка ----------------
+bool StoreSCP::start(quint16 port, const QString& aeTitle, int maxAssociations)
+{
+    if (m_thread)
+        return true;
+
+    StoreSCP* expected = nullptr;
+    if (!s_active.compare_exchange_strong(expected, this)) {
+        qWarning().noquote() << "[Lib4DICOM] StoreSCP: another receiver is already running";
+        return false;
+    }
+
+    m_root = m_lib->patientsRoot();
+    m_incoming = m_root + "/.incoming";   // скрытая папка — сканер её не видит
+    m_studyLabel = m_lib->studyLabel().isEmpty() ? QStringLiteral("Study") : m_lib->studyLabel();
+    m_durability = m_lib->m_saveDurability;
+    m_port = port;
+    m_aeTitle = aeTitle.isEmpty() ? QStringLiteral("LIB4DICOM") : aeTitle;
+
+    // остатки прерванного приёма; .incoming есть в каждом корне — туда файл копируется,
+    // если пациент живёт на другом диске (rename между томами невозможен)
+    for (int r = 0; r < m_lib->m_roots.size(); ++r) {
+        const QString incoming = m_lib->m_roots.path(r) + "/.incoming";
+        QDir(incoming).removeRecursively();
+        QDir().mkpath(incoming);
+    }
+
+    snapshotArchive();
+
+    m_pool.reset(new Pool);
+    m_pool->setMaxThreads(Uint16(qBound(1, maxAssociations, 64)));
+    DcmSCPConfig& cfg = m_pool->getConfig();
+    cfg.setPort(port);
+    cfg.setAETitle(m_aeTitle.toLatin1().constData());
+    cfg.setConnectionBlockingMode(DUL_NOBLOCK);   // listen() раз в секунду проверяет остановку
+    cfg.setConnectionTimeout(1);
+    cfg.setHostLookupEnabled(OFFalse);
+
+    // файлы сохраняются как получены, поэтому принимаем и сжатые синтаксисы
+    OFList<OFString> xfers;
+    xfers.push_back(UID_LittleEndianExplicitTransferSyntax);
+    xfers.push_back(UID_LittleEndianImplicitTransferSyntax);
+    xfers.push_back(UID_BigEndianExplicitTransferSyntax);
+    xfers.push_back(UID_JPEGProcess1TransferSyntax);
+    xfers.push_back(UID_JPEGProcess2_4TransferSyntax);
+    xfers.push_back(UID_JPEGProcess14SV1TransferSyntax);
+    xfers.push_back(UID_JPEGLSLosslessTransferSyntax);
+    xfers.push_back(UID_JPEG2000LosslessOnlyTransferSyntax);
+    xfers.push_back(UID_JPEG2000TransferSyntax);
+    xfers.push_back(UID_RLELosslessTransferSyntax);
+    xfers.push_back(UID_DeflatedExplicitVRLittleEndianTransferSyntax);
+
+    OFList<OFString> echoXfers;
+    echoXfers.push_back(UID_LittleEndianExplicitTransferSyntax);
+    echoXfers.push_back(UID_LittleEndianImplicitTransferSyntax);
+    cfg.addPresentationContext(UID_VerificationSOPClass, echoXfers);
+    cfg.addPresentationContext(UID_FINDPatientRootQueryRetrieveInformationModel, echoXfers);
+    cfg.addPresentationContext(UID_FINDStudyRootQueryRetrieveInformationModel, echoXfers);
+    for (int i = 0; i < numberOfDcmAllStorageSOPClassUIDs; ++i)
+        cfg.addPresentationContext(dcmAllStorageSOPClassUIDs[i], xfers);
+
+    m_instances = 0; m_bytes = 0; m_failures = 0;
+    m_firstNs = -1; m_lastNs = 0;
+    m_activeAssociations = 0; m_totalAssociations = 0;
+    m_findQueries = 0; m_findMatches = 0;
+    {
+        QMutexLocker lock(&m_findMutex);
+        m_findLatencyNs.clear();
+        m_findNext = 0;
+    }
+    m_clock.start();
+
+    Pool* pool = m_pool.get();
+    m_thread = QThread::create([pool, port]() {
+        const OFCondition st = pool->listen();
+        if (st.bad())
+            qWarning().noquote() << "[Lib4DICOM] StoreSCP: listen on port" << port << "ended:" << st.text();
+    });
+    m_thread->setObjectName("StoreSCP");
+    m_thread->start();
+
+    qDebug().noquote() << "[Lib4DICOM] StoreSCP: listening as" << m_aeTitle << "on port" << port
+        << "with up to" << maxAssociations << "associations";
+    emit runningChanged();
+    return true;
+}
+
+void StoreSCP::stop()
+{
+    if (!m_thread)
+        return;
+
+    m_pool->stopAfterCurrentAssociations();
+    m_thread->wait();
+    delete m_thread;
+    m_thread = nullptr;
+    m_pool.reset();
+    s_active.store(nullptr);
+
+    qDebug().noquote() << "[Lib4DICOM] StoreSCP: stopped;" << m_instances.load() << "instances received";
+    emit runningChanged();
+}
+
+// Текущее содержимое архива: сюда же пойдут снимки уже известных пациентов и исследований
+void StoreSCP::snapshotArchive()
+{
+    QMutexLocker lock(&m_routeMutex);
+    m_patientFolders.clear();
+    m_studyFolders.clear();
+
+    const PatientStore& store = m_lib->m_store;
+    for (int row = 0; row < store.size(); ++row) {
+        Patient p;
+        p.fullName = store.fullName(row);
+        p.birthYear = store.birthYear(row);
+        p.sex = store.sex(row);
+        p.patientID = store.patientID(row);
+        const QString folder = store.patientFolder(row);
+        if (!m_lib->m_roots.isRoot(folder))
+            m_patientFolders.insert(patientKey(p), folder);
+    }
+    for (int srow = 0; srow < store.studyRows(); ++srow)
+        m_studyFolders.insert(store.studyUID(srow), store.studyFolder(srow));
+}
+
+// ---------------- Рабочие потоки ----------------
+QString StoreSCP::incomingPath()
+{
+    return QString("%1/%2.tmp").arg(m_incoming).arg(++m_tmpCounter);
+}
+
+void StoreSCP::associationStarted()
+{
+    ++m_activeAssociations;
+    ++m_totalAssociations;
+}
+
+void StoreSCP::associationEnded()
+{
+    --m_activeAssociations;
+}
+
+QString StoreSCP::indexedPatientFolder(const QString& key, const Patient& p) const
+{
+    QReadLocker lock(&m_lib->m_storeLock);
+    const PatientStore& store = m_lib->m_store;
+    int row = -1;
+    if (!p.patientID.isEmpty() && p.patientID != "--") {
+        // ключ индекса — сырые байты PatientID; ID пишется в ASCII, так что UTF-8 с ними совпадает
+        const QByteArray id = p.patientID.toUtf8();
+        row = store.findPatient(PatientStore::hashBytes(id.constData(), size_t(id.size()), 'p'));
+    }
+    else {
+        // без ID ключ индекса включает папку — перебор по демографии, как в snapshotArchive
+        for (int r = 0; r < store.size() && row < 0; ++r) {
+            Patient known;
+            known.fullName = store.fullName(r);
+            known.birthYear = store.birthYear(r);
+            known.sex = store.sex(r);
+            known.patientID = store.patientID(r);
+            if (patientKey(known) == key)
+                row = r;
+        }
+    }
+    if (row < 0)
+        return QString();
+    const QString folder = store.patientFolder(row);
+    return m_lib->m_roots.isRoot(folder) || !QFileInfo::exists(folder) ? QString() : folder;
+}
+
+QString StoreSCP::indexedStudyFolder(const QString& studyUID) const
+{
+    QReadLocker lock(&m_lib->m_storeLock);
+    const PatientStore& store = m_lib->m_store;
+    const QByteArray uid = studyUID.toLatin1();
+    const int srow = store.findStudy(PatientStore::hashBytes(uid.constData(), size_t(uid.size()), 's'));
+    return srow < 0 ? QString() : store.studyFolder(srow);
+}
+
+QString StoreSCP::patientFolderFor(const QString& key, const Patient& p)
+{
+    // вызывается под m_routeMutex: папку и stub пациента создаёт ровно один поток
+    QString folder = m_patientFolders.value(key);
+    if (folder.isEmpty())
+        folder = indexedPatientFolder(key, p);
+    if (!folder.isEmpty()) {
+        m_patientFolders.insert(key, folder);
+        return folder;
+    }
+
+    folder = m_lib->ensurePatientFolder(p.fullName, p.birthYear, p.patientID);
+    if (folder.isEmpty())
+        return folder;
+
+    const QVariantMap stub = m_lib->writePatientStub(p, folder);
+    if (stub.value("ok").toBool())
+        emit instanceStored(stub.value("path").toString(), folder, folder);
+    m_patientFolders.insert(key, folder);
+    return folder;
+}
+
+QString StoreSCP::studyFolderFor(const QString& studyUID, const QString& patientFolder,
+    const QString& patientName, const QString& studyDate)
+{
+    QString folder = m_studyFolders.value(studyUID);
+    if (!folder.isEmpty())
+        return folder;
+    folder = indexedStudyFolder(studyUID);
+    if (!folder.isEmpty() && QFileInfo::exists(folder)) {
+        m_studyFolders.insert(studyUID, folder);
+        return folder;
+    }
+
+    // как в createStudyForNewPatient, но с датой исследования из модальности
+    const QString dateStr = studyDate.size() == 8 ? studyDate : QDate::currentDate().toString("yyyyMMdd");
+    const QString base = QString("%1_%2_%3").arg(
+        m_lib->sanitizeName(patientName.isEmpty() ? "Unnamed" : patientName),
+        dateStr, m_lib->sanitizeName(m_studyLabel));
+    folder = m_lib->m_folders.allocate(patientFolder, base);
+    if (!folder.isEmpty())
+        m_studyFolders.insert(studyUID, folder);
+    return folder;
+}
+
+bool StoreSCP::placeReceived(const QString& tmpPath)
+{
+    auto fail = [&](const char* why) {
+        qWarning().noquote() << "[Lib4DICOM] StoreSCP:" << why << tmpPath;
+        QFile::remove(tmpPath);
+        ++m_failures;
+        return false;
+    };
+
+    DcmFileFormat ff;
+    if (ff.loadFile(QFile::encodeName(tmpPath).constData(), EXS_Unknown,
+        EGL_noChange, kHeaderOnlyReadLength).bad())
+        return fail("cannot parse");
+    DcmDataset* ds = ff.getDataset();
+
+    OFString v, cs;
+    ds->findAndGetOFStringArray(DCM_SpecificCharacterSet, cs);
+    const DicomTextDecoder& dec = DicomTextDecoder::forCharset(cs);
+    auto text = [&](const DcmTagKey& tag, bool pn = false) -> QString {
+        return ds->findAndGetOFString(tag, v).good() ? dec.decode(v, pn).trimmed() : QString();
+    };
+
+    Patient p;
+    p.fullName = text(DCM_PatientName, true).replace("^", " ").trimmed();
+    p.patientID = text(DCM_PatientID);
+    const QString birth = text(DCM_PatientBirthDate);
+    if (birth.size() == 8 && QDate::fromString(birth, "yyyyMMdd").isValid())
+        p.birthDA = birth;
+    p.birthYear = birth.size() >= 4 ? birth.left(4) : QString();
+    p.sex = text(DCM_PatientSex);
+
+    const QString studyUID = text(DCM_StudyInstanceUID);
+    const QString sopUID = text(DCM_SOPInstanceUID);
+    if (studyUID.isEmpty() || sopUID.isEmpty())
+        return fail("no Study/SOP Instance UID in");
+
+    QString patientFolder, studyFolder;
+    {
+        QMutexLocker lock(&m_routeMutex);
+        patientFolder = patientFolderFor(patientKey(p), p);
+        if (!patientFolder.isEmpty())
+            studyFolder = studyFolderFor(studyUID, patientFolder, p.fullName, text(DCM_StudyDate));
+    }
+    if (studyFolder.isEmpty())
+        return fail("cannot create folders for");
+
+    // имя детерминировано по SOPInstanceUID: повторная посылка заменяет файл
+    const QString modality = m_lib->sanitizeName(text(DCM_Modality));
+    const QString fileName = QString("%1_%2_%3_%4_%5.dcm")
+        .arg(p.patientID.isEmpty() ? QStringLiteral("--") : m_lib->sanitizeName(p.patientID))
+        .arg(modality.isEmpty() ? QStringLiteral("OT") : modality)
+        .arg(text(DCM_SeriesNumber).toInt())
+        .arg(text(DCM_InstanceNumber).toInt(), 3, 10, QChar('0'))
+        .arg(PatientStore::hashString(sopUID) & 0xFFFFFFFFu, 8, 16, QChar('0'));
+    const QString finalPath = studyFolder + '/' + fileName;
+
+    const qint64 size = QFileInfo(tmpPath).size();
+    QString source = tmpPath;
+    const int targetRoot = m_lib->m_roots.rootOf(finalPath);
+    if (targetRoot > 0) {
+        source = m_lib->m_roots.path(targetRoot) + "/.incoming/" + QFileInfo(tmpPath).fileName();
+        QFile::remove(source);
+        const bool copied = QFile::copy(tmpPath, source);
+        QFile::remove(tmpPath);
+        if (!copied) {
+            QFile::remove(source);
+            return fail("cannot copy to the patient's root:");
+        }
+    }
+    if (m_durability != DurableBatch::Unsafe && !DurableIO::syncFile(source)) {
+        QFile::remove(source);
+        return fail("fsync failed for");
+    }
+    if (!DurableIO::replaceFile(source, finalPath)) {
+        QFile::remove(source);
+        return fail("cannot move");
+    }
+    if (m_durability != DurableBatch::Unsafe)
+        DurableIO::syncDir(studyFolder);
+
+    const qint64 now = m_clock.nsecsElapsed();
+    qint64 expected = -1;
+    m_firstNs.compare_exchange_strong(expected, now);
+    m_lastNs = now;
+    ++m_instances;
+    m_bytes += size;
+
+    emit instanceStored(finalPath, patientFolder, studyFolder);
+    return true;
+}
+
+// ---------------- C-FIND ----------------
+quint16 StoreSCP::findMatches(DcmDataset* request, const char* sopClass,
+    std::vector<std::unique_ptr<DcmDataset>>& matches)
+{
+    const bool studyRoot = sopClass && strcmp(sopClass, UID_FINDStudyRootQueryRetrieveInformationModel) == 0;
+    IndexQuery query;
+    if (!query.parse(request, studyRoot))
+        return STATUS_FIND_Failed_IdentifierDoesNotMatchSOPClass;
+    query.setRetrieveAETitle(m_aeTitle);
+
+    QElapsedTimer timer;
+    timer.start();
+    bool truncated = false;
+    {
+        // индекс меняется в потоке GUI (scanPatients, приём снимков) — читаем под блокировкой
+        QReadLocker lock(&m_lib->m_storeLock);
+        query.run(m_lib->m_store, [&](DcmDataset& rsp) {
+            if (int(matches.size()) >= kMaxFindMatches) {
+                truncated = true;
+                return false;
+            }
+            matches.emplace_back(new DcmDataset(rsp));
+            return true;
+        });
+    }
+    const qint64 ns = timer.nsecsElapsed();
+
+    if (truncated)
+        qWarning().noquote() << "[Lib4DICOM] StoreSCP: C-FIND answer cut to" << kMaxFindMatches << "matches";
+
+    ++m_findQueries;
+    m_findMatches += qint64(matches.size());
+    QMutexLocker lock(&m_findMutex);
+    if (m_findLatencyNs.size() < kFindSamples)
+        m_findLatencyNs.append(ns);
+    else
+        m_findLatencyNs[m_findNext] = ns;
+    m_findNext = (m_findNext + 1) % kFindSamples;
+    return STATUS_Success;
+}
+
+// ---------------- Статистика ----------------
+QVariantMap StoreSCP::stats() const
+{
+    QVariantMap out;
+    const qint64 n = m_instances.load();
+    const qint64 bytes = m_bytes.load();
+    const qint64 first = m_firstNs.load();
+    // устойчивая скорость: от первого до последнего принятого снимка
+    const double sec = (first >= 0 && n > 1) ? (m_lastNs.load() - first) / 1e9 : 0.0;
+
+    out["running"] = isRunning();
+    out["port"] = m_port;
+    out["aeTitle"] = m_aeTitle;
+    out["instances"] = n;
+    out["bytes"] = bytes;
+    out["failures"] = m_failures.load();
+    out["activeAssociations"] = m_activeAssociations.load();
+    out["associations"] = m_totalAssociations.load();
+    out["seconds"] = sec;
+    out["instancesPerSec"] = sec > 0 ? (n - 1) / sec : 0.0;
+    out["mbPerSec"] = sec > 0 ? bytes / 1e6 / sec : 0.0;
+
+    QVector<qint64> findNs;
+    {
+        QMutexLocker lock(&m_findMutex);
+        findNs = m_findLatencyNs;
+    }
+    std::sort(findNs.begin(), findNs.end());
+    auto percentileMs = [&findNs](double q) {
+        return findNs.isEmpty() ? 0.0 : findNs[int(q * (findNs.size() - 1) + 0.5)] / 1e6;
+    };
+    out["findQueries"] = m_findQueries.load();
+    out["findMatches"] = m_findMatches.load();
+    out["findP50Ms"] = percentileMs(0.50);
+    out["findP99Ms"] = percentileMs(0.99);
+    return out;
+}
@@ -0,0 +1,102 @@
+﻿#pragma once
+
+#include <QElapsedTimer>
+#include <QHash>
+#include <QMutex>
+#include <QObject>
+#include <QString>
+#include <QVariantMap>
+#include <QVector>
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+class Lib4DICOM;
+class QThread;
+class DcmDataset;
+struct Patient;
+
+// Приём C-STORE (DCMTK dcmnet, DcmSCPPool): несколько ассоциаций параллельно на пуле потоков.
+// Каждый снимок пишется как есть в <первый корень>/.incoming и переименовывается в <пациент>/<исследование>
+// (пациент на другом корне — через копию в .incoming того корня);
+// папки и stub новых пациентов создаются той же логикой, что и в GUI.
+// На том же порту отвечает на C-FIND (Patient Root / Study Root) по индексу в памяти.
+// Рабочие потоки DcmSCPPool создаются конструктором по умолчанию, поэтому
+// одновременно в процессе может работать только один приёмник.
+class StoreSCP : public QObject {
+    Q_OBJECT
+
+public:
+    explicit StoreSCP(Lib4DICOM* lib);
+    ~StoreSCP() override;
+
+    bool start(quint16 port, const QString& aeTitle, int maxAssociations);
+    void stop();
+    bool isRunning() const { return m_thread != nullptr; }
+
+    // instances, bytes, failures, associations, seconds, instancesPerSec, mbPerSec,
+    // findQueries, findMatches, findP50Ms, findP99Ms
+    QVariantMap stats() const;
+
+    // ---- вызывается из рабочих потоков ----
+    QString incomingPath();
+    // разложить принятый файл по папкам; false — ответить ошибкой
+    bool placeReceived(const QString& tmpPath);
+    // ответы на C-FIND; статус DIMSE (STATUS_Success — можно отправлять matches)
+    quint16 findMatches(DcmDataset* request, const char* sopClass,
+        std::vector<std::unique_ptr<DcmDataset>>& matches);
+    void associationStarted();
+    void associationEnded();
+
+signals:
+    // файл опубликован; доставляется в поток Lib4DICOM
+    void instanceStored(const QString& path, const QString& patientFolder, const QString& studyFolder);
+    void runningChanged();
+
+private:
+    struct Pool;
+
+    void snapshotArchive();
+    QString patientFolderFor(const QString& key, const Patient& p);
+    // промах снимка: пациент или исследование могли появиться после start() (GUI, импорт)
+    QString indexedPatientFolder(const QString& key, const Patient& p) const;
+    QString indexedStudyFolder(const QString& studyUID) const;
+    QString studyFolderFor(const QString& studyUID, const QString& patientFolder,
+        const QString& patientName, const QString& studyDate);
+
+    Lib4DICOM*            m_lib;
+    std::unique_ptr<Pool> m_pool;
+    QThread*              m_thread = nullptr;
+
+    // снимок настроек Lib4DICOM на момент запуска
+    QString m_root;
+    QString m_incoming;
+    QString m_studyLabel;
+    int     m_durability = 0;
+    quint16 m_port = 0;
+    QString m_aeTitle;
+
+    // маршрутизация: ключ пациента -> папка, StudyInstanceUID -> папка
+    QMutex                  m_routeMutex;
+    QHash<QString, QString> m_patientFolders;
+    QHash<QString, QString> m_studyFolders;
+
+    // счётчики
+    QElapsedTimer        m_clock;
+    std::atomic<qint64>  m_instances{ 0 };
+    std::atomic<qint64>  m_bytes{ 0 };
+    std::atomic<qint64>  m_failures{ 0 };
+    std::atomic<qint64>  m_firstNs{ -1 };
+    std::atomic<qint64>  m_lastNs{ 0 };
+    std::atomic<int>     m_activeAssociations{ 0 };
+    std::atomic<int>     m_totalAssociations{ 0 };
+    std::atomic<quint64> m_tmpCounter{ 0 };
+
+    // C-FIND: задержка поиска по индексу, последние kFindSamples запросов
+    mutable QMutex       m_findMutex;
+    QVector<qint64>      m_findLatencyNs;
+    int                  m_findNext = 0;
+    std::atomic<qint64>  m_findQueries{ 0 };
+    std::atomic<qint64>  m_findMatches{ 0 };
+};
@@ -0,0 +1,368 @@
+﻿// storescu.cpp
+#include "storescu.h"
+#include "boundedqueue.h"
+#include "dirwalker.h"
+#include "parallelfor.h"
+
+#include <QFile>
+#include <QFileInfo>
+#include <QHash>
+#include <QMutex>
+#include <QThread>
+#include <QThreadPool>
+#include <QVector>
+#include <QDebug>
+
+#include <memory>
+
+// DCMTK
+#include <dcmtk/dcmdata/dctk.h>
+#include <dcmtk/dcmdata/dcxfer.h>
+#include <dcmtk/dcmnet/dimse.h>
+#include <dcmtk/dcmnet/scu.h>
+
+namespace {
+    const Uint32 kHeaderOnlyReadLength = 256;
+    const qint64 kProgressIntervalMs = 100;
+    // DcmSCU нумерует контексты нечётными ID 1..255
+    const int kMaxPresentationContexts = 128;
+}
+
+// Заголовки всех файлов и список нужных контекстов представления
+struct StoreSCU::Plan {
+    struct File {
+        QString path;
+        QByteArray sopClass;
+        // Пусто — несжатый: такие наборы DcmSCU перекодирует сам, и им хватает одного
+        // контекста с Explicit/Implicit LE. Сжатые отправляются как есть в своём синтаксисе.
+        QByteArray transferSyntax;
+        qint64  size = 0;
+        int     context = -1;        // индекс в contexts
+    };
+    struct Context {
+        QByteArray sopClass;
+        QByteArray transferSyntax;
+    };
+
+    QVector<File>    files;
+    QVector<Context> contexts;
+};
+
+struct StoreSCU::Loaded {
+    int index = -1;
+    std::unique_ptr<DcmFileFormat> ff;
+};
+
+// Одна ассоциация с PACS; после обрыва переподключается с теми же контекстами.
+// DcmSCU после abortAssociation() или отказа в negotiateAssociation() освобождает параметры
+// ассоциации и без нового initNetwork() больше не соединяется — поэтому для переподключения
+// он создаётся заново.
+class StoreSCU::Association {
+public:
+    Association(const Options& opt, const QVector<Plan::Context>& contexts)
+        : m_opt(opt), m_contexts(contexts)
+    {
+        reset();
+    }
+
+    ~Association()
+    {
+        if (m_scu && m_scu->isConnected())
+            m_scu->releaseAssociation();
+    }
+
+    bool connect()
+    {
+        if (m_scu && m_scu->isConnected())
+            return true;
+        // каждое согласование — на свежем DcmSCU: прошлое (удачное или нет) съело его параметры
+        if (!m_fresh && !reset())
+            return false;
+        m_fresh = false;
+        const OFCondition st = m_scu->negotiateAssociation();
+        if (st.bad()) {
+            qWarning().noquote() << "[Lib4DICOM] StoreSCU: association rejected:" << st.text();
+            return false;
+        }
+        ++m_opened;
+        return true;
+    }
+
+    T_ASC_PresentationContextID presentationFor(const Plan::File& f)
+    {
+        if (!f.transferSyntax.isEmpty())
+            return m_scu->findPresentationContextID(f.sopClass.constData(), f.transferSyntax.constData());
+        T_ASC_PresentationContextID id =
+            m_scu->findPresentationContextID(f.sopClass.constData(), UID_LittleEndianExplicitTransferSyntax);
+        if (id == 0)
+            id = m_scu->findPresentationContextID(f.sopClass.constData(), UID_LittleEndianImplicitTransferSyntax);
+        return id;
+    }
+
+    OFCondition store(T_ASC_PresentationContextID id, DcmDataset* ds, Uint16& status)
+    {
+        return m_scu->sendSTORERequest(id, OFFilename(), ds, status);
+    }
+
+    void drop()
+    {
+        if (m_scu && m_scu->isConnected())
+            m_scu->abortAssociation();
+    }
+
+    int opened() const { return m_opened; }
+
+private:
+    // новый DcmSCU с теми же настройками и контекстами; false — сеть не поднялась
+    bool reset()
+    {
+        m_scu = std::make_unique<DcmSCU>();
+        m_scu->setAETitle(m_opt.callingAE.toLatin1().constData());
+        m_scu->setPeerHostName(m_opt.host.toLatin1().constData());
+        m_scu->setPeerPort(m_opt.port);
+        m_scu->setPeerAETitle(m_opt.calledAE.toLatin1().constData());
+        m_scu->setMaxReceivePDULength(ASC_MAXIMUMPDUSIZE);
+        m_scu->setACSETimeout(30);
+        m_scu->setDIMSEBlockingMode(DIMSE_NONBLOCKING);
+        m_scu->setDIMSETimeout(60);
+        m_scu->setVerbosePCMode(OFFalse);
+
+        for (const Plan::Context& c : m_contexts) {
+            OFList<OFString> xfers;
+            if (c.transferSyntax.isEmpty()) {
+                xfers.push_back(UID_LittleEndianExplicitTransferSyntax);
+                xfers.push_back(UID_LittleEndianImplicitTransferSyntax);
+            }
+            else {
+                xfers.push_back(c.transferSyntax.constData());
+            }
+            m_scu->addPresentationContext(c.sopClass.constData(), xfers);
+        }
+        const OFCondition st = m_scu->initNetwork();
+        m_fresh = st.good();
+        if (!m_fresh)
+            qWarning().noquote() << "[Lib4DICOM] StoreSCU: cannot init network:" << st.text();
+        return m_fresh;
+    }
+
+    const Options                 m_opt;
+    const QVector<Plan::Context>  m_contexts;
+    std::unique_ptr<DcmSCU>       m_scu;
+    bool                          m_fresh = false;  // m_scu после initNetwork() ещё не согласовывал
+    int                           m_opened = 0;
+};
+
+QStringList StoreSCU::collectFiles(const QStringList& folders)
+{
+    QStringList files;
+    for (const QString& folder : folders) {
+        if (QFileInfo(folder).isFile()) {
+            files << folder;
+            continue;
+        }
+        // папка исследования или пациента (stub пациента тоже уйдёт — это обычный SC)
+        DirWalker::walk(folder, 2, [&](const DirWalker::Entry& e) { files << e.filePath; });
+    }
+    return files;
+}
+
+void StoreSCU::reportProgress(bool force)
+{
+    // не чаще раза в 100 мс: сигнал уходит в GUI через очередь событий
+    const qint64 now = m_clock.elapsed();
+    qint64 last = m_lastReportMs.load();
+    if (!force) {
+        if (now - last < kProgressIntervalMs || !m_lastReportMs.compare_exchange_strong(last, now))
+            return;
+    }
+    emit progress(m_done.load(), m_failed.load(), m_total.load());
+}
+
+QVariantMap StoreSCU::send(const QStringList& files, const Options& opt)
+{
+    m_cancel = false;
+    m_done = 0;
+    m_failed = 0;
+    m_total = int(files.size());
+    m_lastReportMs = 0;
+    m_clock.start();
+
+    QMutex failMutex;
+    QStringList failedFiles;
+    auto fail = [&](const QString& path, const QString& why) {
+        qWarning().noquote() << "[Lib4DICOM] StoreSCU:" << why << path;
+        QMutexLocker lock(&failMutex);
+        failedFiles << path;
+        ++m_failed;
+    };
+
+    // ---- 1. Заголовки: SOP Class и синтаксис каждого файла ----
+    Plan plan;
+    plan.files.resize(files.size());
+    parallelFor(int(files.size()), qMax(1, opt.readThreads), [&](int i) {
+        Plan::File& f = plan.files[i];
+        f.path = files[i];
+        DcmFileFormat ff;
+        if (ff.loadFile(QFile::encodeName(f.path).constData(), EXS_Unknown,
+            EGL_noChange, kHeaderOnlyReadLength).bad())
+            return;
+        OFString v;
+        if (ff.getMetaInfo()->findAndGetOFString(DCM_MediaStorageSOPClassUID, v).good())
+            f.sopClass = QByteArray(v.c_str());
+        const DcmXfer xfer(ff.getDataset()->getOriginalXfer());
+        if (xfer.isEncapsulated())
+            f.transferSyntax = QByteArray(xfer.getXferID());
+        f.size = QFileInfo(f.path).size();
+    });
+
+    QHash<QByteArray, int> contextIndex;
+    for (Plan::File& f : plan.files) {
+        if (f.sopClass.isEmpty())
+            continue;
+        const QByteArray key = f.sopClass + '|' + f.transferSyntax;
+        auto it = contextIndex.constFind(key);
+        if (it == contextIndex.constEnd()) {
+            if (plan.contexts.size() >= kMaxPresentationContexts)
+                continue;   // останется без контекста и уйдёт в failedFiles
+            it = contextIndex.insert(key, int(plan.contexts.size()));
+            plan.contexts.push_back({ f.sopClass, f.transferSyntax });
+        }
+        f.context = it.value();
+    }
+
+    // ---- 2. Чтение с опережением и отправка ----
+    const int senders = opt.associationPerFile ? 1 : qBound(1, opt.associations, 32);
+    const int readers = qBound(1, opt.readThreads, 16);
+    BoundedQueue<Loaded> queue(qMax(senders, opt.readAhead));
+
+    std::atomic<int>    nextFile{ 0 };
+    std::atomic<int>    activeReaders{ readers };
+    std::atomic<int>    warnings{ 0 };
+    std::atomic<int>    retried{ 0 };
+    std::atomic<int>    opened{ 0 };
+    std::atomic<qint64> bytes{ 0 };
+
+    auto readLoop = [&]() {
+        for (int i = nextFile.fetch_add(1); i < plan.files.size() && !m_cancel; i = nextFile.fetch_add(1)) {
+            const Plan::File& f = plan.files[i];
+            if (f.context < 0) {
+                fail(f.path, f.sopClass.isEmpty() ? "not a DICOM file:" : "too many presentation contexts, skip");
+                reportProgress(false);
+                continue;
+            }
+            Loaded item;
+            item.index = i;
+            item.ff.reset(new DcmFileFormat);
+            if (item.ff->loadFile(QFile::encodeName(f.path).constData()).bad()
+                || item.ff->loadAllDataIntoMemory().bad())
+            {
+                fail(f.path, "cannot read");
+                reportProgress(false);
+                continue;
+            }
+            if (!queue.push(std::move(item)))
+                break;
+        }
+        if (--activeReaders == 0)
+            queue.close();
+    };
+
+    auto sendLoop = [&]() {
+        std::unique_ptr<Association> assoc;
+        if (!opt.associationPerFile)
+            assoc.reset(new Association(opt, plan.contexts));
+
+        Loaded item;
+        while (queue.pop(item)) {
+            if (m_cancel) {
+                queue.close();
+                break;
+            }
+            const Plan::File& f = plan.files[item.index];
+            if (opt.associationPerFile)   // как внешняя утилита: новое согласование на каждый файл
+                assoc.reset(new Association(opt, { plan.contexts[f.context] }));
+
+            bool sent = false;
+            QString why;
+            for (int attempt = 0; attempt <= opt.retries && !sent && !m_cancel; ++attempt) {
+                if (attempt > 0) {
+                    ++retried;
+                    QThread::msleep(200 * attempt);
+                }
+                if (!assoc->connect()) {
+                    why = "cannot connect, skip";
+                    continue;
+                }
+                const T_ASC_PresentationContextID id = assoc->presentationFor(f);
+                if (id == 0) {
+                    why = "presentation context not accepted for";
+                    break;   // повтор не поможет
+                }
+                Uint16 status = 0;
+                const OFCondition st = assoc->store(id, item.ff->getDataset(), status);
+                if (st.bad()) {
+                    why = QString("C-STORE failed (%1) for").arg(st.text());
+                    assoc->drop();   // следующая попытка — на новой ассоциации
+                    continue;
+                }
+                if (status == STATUS_Success || DICOM_WARNING_STATUS(status)) {
+                    if (status != STATUS_Success)
+                        ++warnings;
+                    sent = true;
+                    break;
+                }
+                why = QString("C-STORE status 0x%1 for").arg(status, 4, 16, QChar('0'));
+                if ((status & 0xff00) != STATUS_STORE_Refused_OutOfResources)
+                    break;   // отказ по существу; out of resources — повторяем
+            }
+
+            if (sent) {
+                ++m_done;
+                bytes += f.size;
+            }
+            else {
+                fail(f.path, why);
+            }
+            item.ff.reset();
+
+            if (opt.associationPerFile) {
+                opened += assoc->opened();
+                assoc.reset();
+            }
+            reportProgress(false);
+        }
+        if (assoc)
+            opened += assoc->opened();
+    };
+
+    QThreadPool pool;
+    pool.setMaxThreadCount(readers + senders);
+    for (int r = 0; r < readers; ++r)
+        pool.start(readLoop);
+    for (int s = 0; s < senders; ++s)
+        pool.start(sendLoop);
+    pool.waitForDone();
+
+    const double sec = m_clock.nsecsElapsed() / 1e9;
+    const int done = m_done.load();
+    reportProgress(true);
+
+    QVariantMap out;
+    out["total"] = int(files.size());
+    out["sent"] = done;
+    out["warnings"] = warnings.load();
+    out["failed"] = m_failed.load();
+    out["retried"] = retried.load();
+    out["cancelled"] = m_cancel.load();
+    out["associations"] = opened.load();
+    out["contexts"] = int(plan.contexts.size());
+    out["bytes"] = bytes.load();
+    out["seconds"] = sec;
+    out["instancesPerSec"] = sec > 0 ? done / sec : 0.0;
+    out["mbPerSec"] = sec > 0 ? bytes.load() / 1e6 / sec : 0.0;
+    out["failedFiles"] = failedFiles;
+
+    qDebug().noquote() << "[Lib4DICOM] StoreSCU:" << done << "of" << files.size() << "sent to"
+        << opt.calledAE << "over" << opened.load() << "associations in" << sec << "s";
+    return out;
+}
@@ -0,0 +1,62 @@
+﻿#pragma once
+
+#include <QElapsedTimer>
+#include <QObject>
+#include <QString>
+#include <QStringList>
+#include <QVariantMap>
+
+#include <atomic>
+
+#include "lib4dicom_global.h"
+
+// Отправка исследований в PACS (C-STORE SCU, DCMTK DcmSCU).
+// Несколько ассоциаций работают параллельно и берут снимки из общей очереди;
+// контексты представления (SOP Class + Transfer Syntax) собираются заранее по
+// заголовкам файлов и согласуются один раз на ассоциацию. Файлы читаются
+// отдельными потоками с опережением, неудачная посылка повторяется с переподключением.
+class LIB4DICOM_EXPORT StoreSCU : public QObject {
+    Q_OBJECT
+
+public:
+    struct Options {
+        QString host;
+        quint16 port = 104;
+        QString calledAE = "ANY-SCP";
+        QString callingAE = "LIB4DICOM";
+        int     associations = 4;         // параллельных ассоциаций
+        int     readThreads = 2;          // потоков чтения файлов
+        int     readAhead = 16;           // прочитанных, но ещё не отправленных снимков
+        int     retries = 2;              // повторов на снимок
+        bool    associationPerFile = false;   // эталон: отдельная ассоциация на каждый файл
+    };
+
+    explicit StoreSCU(QObject* parent = nullptr) : QObject(parent) {}
+
+    // все файлы DICOM в папках исследований (рекурсивно, без скрытых и DICOMDIR)
+    static QStringList collectFiles(const QStringList& folders);
+
+    // Блокирующая отправка; прогресс приходит сигналом progress() из рабочих потоков.
+    // total, sent, warnings, failed, retried, associations, bytes, seconds,
+    // instancesPerSec, mbPerSec, failedFiles
+    QVariantMap send(const QStringList& files, const Options& opt);
+
+    void cancel() { m_cancel = true; }
+
+signals:
+    void progress(int done, int failed, int total);
+
+private:
+    struct Plan;
+    struct Loaded;
+    class  Association;
+
+    void reportProgress(bool force);
+
+    std::atomic<bool> m_cancel{ false };
+    std::atomic<int>  m_done{ 0 };
+    std::atomic<int>  m_failed{ 0 };
+    std::atomic<int>  m_total{ 0 };
+    std::atomic<qint64> m_lastReportMs{ 0 };
+    QElapsedTimer     m_clock;
+};
@@ -0,0 +1,44 @@
+﻿#pragma once
+
+#include <QString>
+#include <QVariantMap>
+#include <QVector>
+
+#include "durablewriter.h"
+#include "lib4dicom_global.h"
+
+// Массовая правка заголовков (переименование, слияние пациентов, псевдонимизация) без перезаписи пикселей.
+// Набор данных читается только до (7FE0,0010), меняется и записывается заново в исходном
+// синтаксисе передачи; PixelData и всё после него переносятся байт в байт из исходного файла
+// (Linux: copy_file_range — копирование в ядре, на XFS/Btrfs с общими экстентами).
+// Каждый файл публикуется атомарно: временный файл рядом с целевым и rename, как в DurableBatch.
+// Big Endian, Deflate и файлы без преамбулы правятся медленным путём (полная загрузка и запись).
+class LIB4DICOM_EXPORT TagEditor {
+public:
+    struct Edit {
+        quint32 tag = 0;        // (группа << 16) | элемент, только верхний уровень набора данных
+        QString value;          // записывается в UTF-8
+        bool    remove = false; // удалить элемент вместо записи value
+    };
+
+    struct Item {
+        QString source;
+        QString target;         // пусто — правка на месте
+    };
+
+    struct Options {
+        int  threads = 0;       // 0 — все ядра
+        int  durability = DurableBatch::GroupCommit;
+        bool newUIDs = false;   // заменить UID исследования/серии/снимка/FoR, согласованно в пределах вызова
+    };
+
+    // files, edited, failed, fastPath, slowPath, headerBytes, pixelBytes, kernelCopyBytes,
+    // seconds, filesPerSec, mbPerSec, failedFiles
+    static QVariantMap apply(const QVector<Item>& items, const QVector<Edit>& edits, const Options& opt);
+
+    // правки для выгрузки в исследование: имя/ID заменяются, прочие идентификаторы, включая
+    // дату и время рождения, удаляются (правки одни на все файлы — год из даты не сохранить)
+    static QVector<Edit> pseudonymizeEdits(const QString& pseudonym, const QString& pseudoID);
+
+    static quint32 tagKey(quint16 group, quint16 element) { return (quint32(group) << 16) | element; }
+};
@@ -0,0 +1,1011 @@
+﻿// Lib4DICOMCli — запуск Lib4DICOM без Qt Quick: ночные импорты и аудит архива на серверах.
+//
+//   Lib4DICOMCli scan   --root <dir> [--depth N] [--json]
+//   Lib4DICOMCli import --root <dir> --name <ФИО> [--birth YYYY|YYYYMMDD] [--sex M|F|O] [--id <PatientID>]
+//                       [--label <метка>] [--series <имя>] [--jobs N] [--read-jobs N] [--batch N]
+//                       [--durability unsafe|per-file|group] [--dedup off|study|patient]
+//                       [--max-dim N] [--crop x,y,w,h] [--gray] <папка с изображениями>
+//   Lib4DICOMCli images  --out <dir> [--format png|jpg] [--quality N] [--series <UID>] [--jobs N]
+//                       [--in-flight N] [--window <центр>,<ширина>] <папка пациента/исследования>...
+//   Lib4DICOMCli render-bench [--size WxH] [--iterations N] [--jobs N]
+//   Lib4DICOMCli preprocess-bench [--size WxH] [--max-dim N] [--iterations N] [--jobs N]
+//   Lib4DICOMCli find-bench [--patients N] [--studies N] [--iterations N]
+//   Lib4DICOMCli pool-bench [--root <dir>] [--size WxH] [--batches N] [--batch N] [--jobs N]
+//   Lib4DICOMCli receive --root <dir> [--port N] [--aet <AE>] [--max-assoc N] [--seconds N]
+//                       [--durability unsafe|per-file|group]
+//   Lib4DICOMCli export  --host <host> [--port N] [--aec <AE>] [--aet <AE>] [--jobs N] [--read-jobs N]
+//                       [--retries N] [--baseline] <папка исследования>...
+//   Lib4DICOMCli edit    --root <dir> --patient <PatientID> [--name <ФИО>] [--id <ID>] [--birth ...] [--sex ...]
+//                       | --merge-into <PatientID> | --pseudonymize <псевдоним> --out <dir> [--pseudo-id <ID>]
+//                       [--jobs N] [--durability unsafe|per-file|group]
+//   Lib4DICOMCli migrate --root <dir> --to flat|fanout [--durability unsafe|per-file|group]
+//   Lib4DICOMCli verify  --root <dir> [--mbps N] [--no-idle] [--report <файл.tsv>] [--probe N]
+//
+// --root можно повторить: архив на нескольких дисках, каждый корень сканируется своим потоком,
+// новые пациенты раскладываются по --placement free|round-robin|hash,
+// внутри корня — по --layout flat|fanout (<корень>/<пациент> или <корень>/ab/cd/<пациент>).
+//
+// Вызовы идут через тот же Lib4DICOM, что и у QML (createStudy*, createPatientStubDicom,
+// saveImagesAsDicom), поэтому раскладка папок и содержимое файлов совпадают с GUI.
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QImage>
+#include <QImageReader>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QLoggingCategory>
+#include <QTextStream>
+#include <QThread>
+#include <QTimer>
+
+#include <algorithm>
+#include <memory>
+
+#include "lib4dicom.h"
+#include "parallelfor.h"
+#include "storescu.h"
+#include "imageexport.h"
+#include "grayrender.h"
+#include "imagepreprocess.h"
+#include "importsession.h"
+#include "archiveverifier.h"
+
+namespace {
+
+    enum ExitCode { ExitOk = 0, ExitFailed = 1, ExitUsage = 2 };
+
+    QTextStream& out() {
+        static QTextStream s(stdout);
+        return s;
+    }
+
+    QTextStream& err() {
+        static QTextStream s(stderr);
+        return s;
+    }
+
+    // перцентиль по уже отсортированному вектору
+    double percentileMs(const QVector<qint64>& sortedNs, double q) {
+        if (sortedNs.isEmpty())
+            return 0.0;
+        const int idx = qBound(0, int(q * (sortedNs.size() - 1) + 0.5), int(sortedNs.size() - 1));
+        return sortedNs[idx] / 1e6;
+    }
+
+    void printLatency(const char* label, QVector<qint64> ns) {
+        std::sort(ns.begin(), ns.end());
+        out() << QString("%1 p50 %2 ms, p99 %3 ms\n")
+            .arg(QLatin1String(label), -14)
+            .arg(percentileMs(ns, 0.50), 0, 'f', 2)
+            .arg(percentileMs(ns, 0.99), 0, 'f', 2);
+    }
+
+    void printRate(const char* label, double value) {
+        out() << QString("%1 %2\n").arg(QLatin1String(label), -14).arg(value, 0, 'f', 1);
+    }
+
+    int parseThreads(const QCommandLineParser& p, const QString& name) {
+        const int v = p.value(name).toInt();
+        return v > 0 ? v : QThread::idealThreadCount();
+    }
+
+    // "flat" | "fanout" -> StorageRoots::Layout; -1 — неизвестное значение
+    int parseLayout(const QString& v) {
+        if (v == "flat") return StorageRoots::Flat;
+        if (v == "fanout") return StorageRoots::FanOut;
+        return -1;
+    }
+
+    // "unsafe" | "per-file" | "group" -> DurableBatch::Mode; -1 — неизвестное значение
+    int parseDurability(const QString& v) {
+        if (v == "unsafe") return DurableBatch::Unsafe;
+        if (v == "per-file") return DurableBatch::SyncEachFile;
+        if (v == "group") return DurableBatch::GroupCommit;
+        return -1;
+    }
+
+    // политика размещения новых пациентов по корням архива и раскладка внутри корня
+    bool applyPlacement(const QCommandLineParser& p, Lib4DICOM& lib, const char* command) {
+        const QString v = p.value("placement");
+        if (v == "free") lib.setPlacementPolicy(StorageRoots::MostFreeSpace);
+        else if (v == "round-robin") lib.setPlacementPolicy(StorageRoots::RoundRobin);
+        else if (v == "hash") lib.setPlacementPolicy(StorageRoots::PatientIdHash);
+        else {
+            err() << command << ": unknown --placement " << v << '\n';
+            err().flush();
+            return false;
+        }
+        const int layout = parseLayout(p.value("layout"));
+        if (layout < 0) {
+            err() << command << ": unknown --layout " << p.value("layout") << '\n';
+            err().flush();
+            return false;
+        }
+        lib.setArchiveLayout(layout);
+        return true;
+    }
+
+    // ---------------- scan ----------------
+    int runScan(const QCommandLineParser& p) {
+        QElapsedTimer timer;
+        timer.start();
+
+        Lib4DICOM lib(p.values("root"));
+        if (p.isSet("depth")) {
+            lib.setScanDepth(p.value("depth").toInt());
+            lib.scanPatients();
+        }
+
+        const int n = lib.patientCount();
+        if (p.isSet("json")) {
+            QJsonArray arr;
+            for (int i = 0; i < n; ++i) {
+                QVariantMap d = lib.getPatientDemographics(i);
+                d.remove("ok");
+                arr.append(QJsonObject::fromVariantMap(d));
+            }
+            out() << QJsonDocument(arr).toJson(QJsonDocument::Indented);
+        }
+        else {
+            out() << "#\tpatientID\tfullName\tbirthYear\tsex\tstudies\timages\tlastStudyDate\tfolder\n";
+            for (int i = 0; i < n; ++i) {
+                const QVariantMap d = lib.getPatientDemographics(i);
+                out() << i << '\t' << d.value("patientID").toString()
+                    << '\t' << d.value("fullName").toString()
+                    << '\t' << d.value("birthYear").toString()
+                    << '\t' << d.value("sex").toString()
+                    << '\t' << d.value("studyCount").toInt()
+                    << '\t' << d.value("imageCount").toInt()
+                    << '\t' << d.value("lastStudyDate").toString()
+                    << '\t' << d.value("patientFolder").toString() << '\n';
+            }
+        }
+        out().flush();
+
+        const QVariantMap st = lib.patientStoreStats();
+        const double scanSec = st.value("scanMs").toLongLong() / 1000.0;
+        const qint64 read = st.value("scanFiles").toLongLong();
+        const qint64 indexed = st.value("scanIndexFiles").toLongLong();
+        const qint64 files = read + indexed;
+        err() << "roots          " << lib.storageRoots().join(", ") << '\n'
+            << "patients       " << n << '\n'
+            << "studies        " << st.value("studies").toInt() << '\n'
+            << "files          " << files << " in " << st.value("scanDirs").toLongLong() << " dirs ("
+            << indexed << " from DICOMDIR, " << read << " read)\n"
+            << "scan           " << QString::number(scanSec, 'f', 3) << " s\n"
+            << "files/s        " << QString::number(scanSec > 0 ? files / scanSec : 0.0, 'f', 1) << '\n'
+            << "total          " << QString::number(timer.elapsed() / 1000.0, 'f', 3) << " s\n";
+        err().flush();
+        return ExitOk;
+    }
+
+    // ---------------- import ----------------
+    QStringList listImages(const QString& dirPath) {
+        QStringList filters;
+        for (const QByteArray& fmt : QImageReader::supportedImageFormats())
+            filters << "*." + QString::fromLatin1(fmt);
+        QStringList files;
+        for (const QFileInfo& fi : QDir(dirPath).entryInfoList(filters, QDir::Files, QDir::Name))
+            files << fi.absoluteFilePath();
+        return files;
+    }
+
+    int runImport(const QCommandLineParser& p) {
+        const QStringList args = p.positionalArguments();
+        if (args.size() < 2) {
+            err() << "import: source folder is required\n";
+            return ExitUsage;
+        }
+        const QString srcDir = args.at(1);
+        const QString name = p.value("name").trimmed();
+        const QString pid = p.value("id").trimmed();
+        if (name.isEmpty() && pid.isEmpty()) {
+            err() << "import: --name or --id is required\n";
+            return ExitUsage;
+        }
+
+        const int mode = parseDurability(p.value("durability"));
+        if (mode < 0) {
+            err() << "import: unknown --durability " << p.value("durability") << '\n';
+            return ExitUsage;
+        }
+
+        const QString dedupArg = p.value("dedup");
+        int dedup = ContentHashIndex::SameStudy;   // как у библиотеки (Lib4DICOM::dedupScope)
+        if (dedupArg == "off") dedup = ContentHashIndex::Off;
+        else if (dedupArg == "patient") dedup = ContentHashIndex::SamePatient;
+        else if (dedupArg != "study") {
+            err() << "import: unknown --dedup " << dedupArg << '\n';
+            return ExitUsage;
+        }
+
+        ImagePreprocessor::Options prep;
+        prep.maxDimension = qMax(0, p.value("max-dim").toInt());
+        prep.grayscale = p.isSet("gray");
+        if (p.isSet("crop")) {
+            const QStringList r = p.value("crop").split(',');
+            prep.crop = QRect(r.value(0).toInt(), r.value(1).toInt(), r.value(2).toInt(), r.value(3).toInt());
+            if (r.size() != 4 || prep.crop.isEmpty()) {
+                err() << "import: --crop must be x,y,w,h\n";
+                return ExitUsage;
+            }
+        }
+
+        const QStringList images = listImages(srcDir);
+        if (images.isEmpty()) {
+            err() << "import: no readable images in " << srcDir << '\n';
+            return ExitFailed;
+        }
+
+        Lib4DICOM lib(p.values("root"));
+        if (!applyPlacement(p, lib, "import"))
+            return ExitUsage;
+        if (p.isSet("label"))
+            lib.setStudyLabel(p.value("label"));
+        lib.setSaveDurability(mode);
+        lib.setSaveThreads(parseThreads(p, "jobs"));
+        lib.setDedupScope(dedup);
+        lib.defaultSession()->setPreprocess(prep);
+        const int readJobs = parseThreads(p, "read-jobs");
+        const int batch = qMax(1, p.value("batch").toInt());
+
+        // 1) Пациент: существующий по PatientID или новый — как в QML
+        int existing = -1;
+        if (!pid.isEmpty()) {
+            for (int i = 0; i < lib.patientCount() && existing < 0; ++i)
+                if (lib.getPatientDemographics(i).value("patientID").toString() == pid)
+                    existing = i;
+        }
+
+        QVariantMap study;
+        if (existing >= 0) {
+            lib.selectExistingPatient(existing);
+            const QString folder = lib.getPatientDemographics(existing).value("patientFolder").toString();
+            study = lib.createStudyInPatientFolder(folder, pid);
+        }
+        else {
+            lib.selectNewPatient(lib.makePatientFromStrings(name, p.value("birth"), p.value("sex"), pid));
+            study = lib.createStudyForNewPatient();
+            if (study.value("ok").toBool()) {
+                const QVariantMap stub = lib.createPatientStubDicom(study.value("patientFolder").toString());
+                if (!stub.value("ok").toBool())
+                    err() << "import: stub DICOM failed: " << stub.value("error").toString() << '\n';
+            }
+        }
+        if (!study.value("ok").toBool()) {
+            err() << "import: cannot create study: " << study.value("error").toString() << '\n';
+            return ExitFailed;
+        }
+        lib.beginSeries(p.value("series"));
+
+        // 2) Порции: параллельное чтение изображений, затем запись серии через библиотеку
+        QElapsedTimer timer;
+        timer.start();
+
+        qint64 bytesIn = 0, bytesOut = 0, pixelsIn = 0, pixelsOut = 0, prepNs = 0;
+        int saved = 0, duplicates = 0, failed = 0, nextInstance = 1, allocations = 0;
+        QVector<qint64> readNs, writeNs;
+        readNs.reserve(images.size());
+        writeNs.reserve(images.size());
+
+        for (int from = 0; from < images.size(); from += batch) {
+            const int count = qMin(batch, int(images.size()) - from);
+            QVector<QImage> decoded(count);
+            QVector<qint64> sizes(count, 0), ns(count, 0);
+
+            parallelFor(count, readJobs, [&](int i) {
+                QElapsedTimer t;
+                t.start();
+                QImageReader reader(images[from + i]);
+                reader.setAutoTransform(true);
+                decoded[i] = reader.read();
+                sizes[i] = QFileInfo(images[from + i]).size();
+                ns[i] = t.nsecsElapsed();
+            });
+
+            QVector<QImage> chunk;
+            chunk.reserve(count);
+            for (int i = 0; i < count; ++i) {
+                if (decoded[i].isNull()) {
+                    err() << "import: cannot read " << images[from + i] << '\n';
+                    ++failed;
+                    continue;
+                }
+                chunk << decoded[i];
+                bytesIn += sizes[i];
+                readNs << ns[i];
+            }
+            decoded.clear();
+            if (chunk.isEmpty())
+                continue;
+
+            const SeriesWriteStats st = lib.saveImagesAsDicom(chunk, nextInstance);
+            nextInstance += chunk.size();
+            saved += st.saved;
+            duplicates += st.duplicates;
+            failed += chunk.size() - st.saved - st.duplicates;
+            bytesOut += st.bytes;
+            pixelsIn += st.pixelBytesIn;
+            pixelsOut += st.pixelBytesOut;
+            prepNs += st.preprocessNs;
+            allocations += st.bufferAllocations;
+            writeNs << st.latencyNs;
+        }
+        lib.endSeries();
+
+        // 3) Итог
+        const double sec = timer.nsecsElapsed() / 1e9;
+        out() << "study          " << study.value("studyFolder").toString() << '\n'
+            << "files          " << saved << " saved, " << duplicates << " duplicates, " << failed << " failed\n"
+            << "threads        " << readJobs << " read, " << lib.saveThreads() << " write\n"
+            << "durability     " << DurableBatch::modeName(DurableBatch::Mode(mode)) << '\n'
+            << "elapsed        " << QString::number(sec, 'f', 3) << " s\n";
+        printRate("files/s", sec > 0 ? saved / sec : 0.0);
+        printRate("MB/s in", sec > 0 ? bytesIn / 1e6 / sec : 0.0);
+        printRate("MB/s out", sec > 0 ? bytesOut / 1e6 / sec : 0.0);
+        if (prep.isActive() && pixelsIn > 0) {
+            out() << "preprocess     " << QString::number(pixelsIn / 1e6, 'f', 1) << " -> "
+                << QString::number(pixelsOut / 1e6, 'f', 1) << " MB pixels ("
+                << QString::number(100.0 * (pixelsIn - pixelsOut) / pixelsIn, 'f', 1) << "% saved), "
+                << QString::number(prepNs / 1e9, 'f', 3) << " s\n";
+        }
+        out() << "buffers        " << allocations << " allocated for " << (saved + duplicates) << " images ("
+            << lib.pixelPoolStats().value("reused").toLongLong() << " reused)\n";
+        printLatency("read", readNs);
+        printLatency("write", writeNs);
+        out().flush();
+
+        return failed == 0 ? ExitOk : ExitFailed;
+    }
+
+    // ---------------- images ----------------
+    int runImages(const QCommandLineParser& p) {
+        const QStringList sources = p.positionalArguments().mid(1);
+        if (sources.isEmpty() || !p.isSet("out")) {
+            err() << "images: --out and at least one patient or study folder are required\n";
+            err().flush();
+            return ExitUsage;
+        }
+
+        ImageExporter::Options opt;
+        opt.outDir = p.value("out");
+        opt.format = p.value("format").toLower();
+        if (opt.format != "png" && opt.format != "jpg" && opt.format != "jpeg") {
+            err() << "images: unknown --format " << opt.format << '\n';
+            err().flush();
+            return ExitUsage;
+        }
+        opt.quality = p.value("quality").toInt();
+        opt.seriesUID = p.value("series");
+        opt.threads = parseThreads(p, "jobs");
+        opt.inFlight = p.value("in-flight").toInt();
+        if (p.isSet("window")) {
+            const QStringList cw = p.value("window").split(',');
+            opt.windowCenter = cw.value(0).toDouble();
+            opt.windowWidth = cw.value(1).toDouble();
+        }
+
+        const QVariantMap r = ImageExporter::run(sources, opt);
+        const double sec = r.value("seconds").toDouble();
+        out() << "images         " << r.value("written").toInt() << " written, "
+            << r.value("skipped").toInt() << " skipped, " << r.value("failed").toInt() << " failed\n"
+            << "threads        " << opt.threads << ", in flight " << (opt.inFlight > 0 ? opt.inFlight : 2 * opt.threads) << '\n'
+            << "elapsed        " << QString::number(sec, 'f', 3) << " s\n";
+        printRate("images/s", r.value("imagesPerSec").toDouble());
+        printRate("MB/s in", sec > 0 ? r.value("bytesIn").toLongLong() / 1e6 / sec : 0.0);
+        printRate("MB/s out", sec > 0 ? r.value("bytesOut").toLongLong() / 1e6 / sec : 0.0);
+        for (const QString& f : r.value("failedFiles").toStringList())
+            out() << "failed         " << f << '\n';
+        out().flush();
+
+        return r.value("failed").toInt() == 0 ? ExitOk : ExitFailed;
+    }
+
+    // ---------------- render-bench ----------------
+    int runRenderBench(const QCommandLineParser& p) {
+        const QStringList size = p.value("size").split('x');
+        const int w = size.value(0).toInt(), h = size.value(1).toInt();
+        if (w <= 0 || h <= 0) {
+            err() << "render-bench: --size must be WxH\n";
+            err().flush();
+            return ExitUsage;
+        }
+        const QVariantMap r = GrayRenderer::benchmark(w, h, p.value("iterations").toInt(), parseThreads(p, "jobs"));
+
+        out() << "image          " << r.value("width").toInt() << "x" << r.value("height").toInt()
+            << " 12-bit, " << r.value("threads").toInt() << " threads, best " << r.value("isa").toString() << '\n';
+        for (auto it = r.cbegin(); it != r.cend(); ++it) {
+            if (it.key().startsWith("window_") || it.key().startsWith("lut_"))
+                printRate(qPrintable(it.key() + " MP/s"), it.value().toDouble());
+        }
+        out().flush();
+        return ExitOk;
+    }
+
+    // ---------------- preprocess-bench ----------------
+    int runPreprocessBench(const QCommandLineParser& p) {
+        const QStringList size = p.value("size").split('x');
+        const int w = size.value(0).toInt(), h = size.value(1).toInt();
+        if (w <= 0 || h <= 0) {
+            err() << "preprocess-bench: --size must be WxH\n";
+            err().flush();
+            return ExitUsage;
+        }
+        const QVariantMap r = ImagePreprocessor::benchmark(w, h, p.value("max-dim").toInt(),
+            p.value("iterations").toInt(), parseThreads(p, "jobs"));
+
+        out() << "image          " << r.value("width").toInt() << "x" << r.value("height").toInt()
+            << " RGB -> " << r.value("outWidth").toInt() << "x" << r.value("outHeight").toInt() << ", "
+            << r.value("threads").toInt() << " threads, best " << r.value("isa").toString() << '\n';
+        for (auto it = r.cbegin(); it != r.cend(); ++it) {
+            if (it.key().startsWith("resize_") || it.key().startsWith("gray_") || it.key().startsWith("qt_"))
+                printRate(qPrintable(it.key() + " MP/s"), it.value().toDouble());
+        }
+        const double mbIn = r.value("bytesIn").toLongLong() / 1e6;
+        out() << "pixels         " << QString::number(mbIn, 'f', 1) << " MB -> "
+            << QString::number(r.value("bytesOutColor").toLongLong() / 1e6, 'f', 2) << " MB RGB ("
+            << QString::number(r.value("savedPercentColor").toDouble(), 'f', 1) << "% saved), "
+            << QString::number(r.value("bytesOutGray").toLongLong() / 1e6, 'f', 2) << " MB gray ("
+            << QString::number(r.value("savedPercentGray").toDouble(), 'f', 1) << "% saved)\n";
+        out().flush();
+        return ExitOk;
+    }
+
+    // ---------------- find-bench ----------------
+    int runFindBench(const QCommandLineParser& p) {
+        // IndexQuery не экспортируется из DLL — замер через обёртку библиотеки; индекс замера синтетический,
+        // корень архива только открывается
+        Lib4DICOM lib(p.values("root"));
+        const QVariantMap r = lib.benchmarkFind(p.value("patients").toInt(), p.value("studies").toInt(),
+            p.value("iterations").toInt());
+
+        out() << "index          " << r.value("patients").toInt() << " patients, " << r.value("studies").toInt()
+            << " studies, built in " << QString::number(r.value("buildMs").toDouble(), 'f', 0) << " ms\n";
+        for (const char* name : { "patient_exact_id", "patient_wildcard_name", "study_exact_uid", "study_wildcard_name" }) {
+            const QString key = QString::fromLatin1(name);
+            out() << key.leftJustified(23) << QString("p50 %1 ms, p99 %2 ms, %3 matches\n")
+                .arg(r.value(key + "_p50Ms").toDouble(), 0, 'f', 2)
+                .arg(r.value(key + "_p99Ms").toDouble(), 0, 'f', 2)
+                .arg(r.value(key + "_matches").toInt());
+        }
+        out().flush();
+        return ExitOk;
+    }
+
+    // ---------------- pool-bench ----------------
+    int runPoolBench(const QCommandLineParser& p) {
+        const QStringList size = p.value("size").split('x');
+        const int w = size.value(0).toInt(), h = size.value(1).toInt();
+        if (w <= 0 || h <= 0) {
+            err() << "pool-bench: --size must be WxH\n";
+            err().flush();
+            return ExitUsage;
+        }
+
+        Lib4DICOM lib(p.values("root"));
+        lib.setSaveThreads(parseThreads(p, "jobs"));
+        const QVariantMap r = lib.benchmarkPixelPool(p.value("batches").toInt(), p.value("batch").toInt(), w, h);
+        if (!r.value("ok").toBool()) {
+            err() << "pool-bench: " << r.value("error").toString() << '\n';
+            err().flush();
+            return ExitFailed;
+        }
+
+        out() << "image          " << r.value("width").toInt() << "x" << r.value("height").toInt()
+            << " RGB32, " << r.value("threads").toInt() << " threads, durability unsafe\n";
+        for (const char* name : { "unpooled", "pooled" }) {
+            const QVariantMap m = r.value(name).toMap();
+            QStringList perBatch;
+            for (const QVariant& v : m.value("allocationsPerImage").toList())
+                perBatch << QString::number(v.toDouble(), 'f', 2);
+            out() << QString(name).leftJustified(15) << m.value("files").toInt() << " files, "
+                << QString::number(m.value("filesPerSec").toDouble(), 'f', 1) << " files/s, allocs/image "
+                << QString::number(m.value("steadyAllocationsPerImage").toDouble(), 'f', 3)
+                << " steady (by batch: " << perBatch.join(' ') << ")\n";
+        }
+        const QVariantMap pool = r.value("pool").toMap();
+        out() << "pool           " << pool.value("reused").toLongLong() << " reused, "
+            << pool.value("allocated").toLongLong() << " allocated, "
+            << QString::number(pool.value("cachedBytes").toLongLong() / 1e6, 'f', 1) << " MB cached\n";
+        out().flush();
+        return ExitOk;
+    }
+
+    // ---------------- export ----------------
+    int runExport(const QCommandLineParser& p) {
+        const QStringList folders = p.positionalArguments().mid(1);
+        if (folders.isEmpty() || !p.isSet("host")) {
+            err() << "export: --host and at least one study folder are required\n";
+            err().flush();
+            return ExitUsage;
+        }
+
+        StoreSCU::Options opt;
+        opt.host = p.value("host");
+        opt.port = quint16(p.value("port").toUInt());
+        opt.calledAE = p.value("aec");
+        opt.callingAE = p.value("aet");
+        opt.associations = parseThreads(p, "jobs");
+        opt.readThreads = qMax(1, p.value("read-jobs").toInt());
+        opt.retries = qMax(0, p.value("retries").toInt());
+        opt.associationPerFile = p.isSet("baseline");
+        if (opt.associationPerFile)
+            opt.associations = 1;
+
+        const QStringList files = StoreSCU::collectFiles(folders);
+        if (files.isEmpty()) {
+            err() << "export: no .dcm files found\n";
+            err().flush();
+            return ExitFailed;
+        }
+
+        StoreSCU scu;
+        QObject::connect(&scu, &StoreSCU::progress, [](int done, int failed, int total) {
+            err() << QString("\r%1 / %2, failed %3").arg(done).arg(total).arg(failed);
+            err().flush();
+        });
+        const QVariantMap r = scu.send(files, opt);
+        err() << '\n';
+        err().flush();
+
+        out() << "mode           " << (opt.associationPerFile ? "association per file" : "pipelined") << '\n'
+            << "sent           " << r.value("sent").toInt() << " of " << r.value("total").toInt()
+            << " (warnings " << r.value("warnings").toInt() << ", failed " << r.value("failed").toInt()
+            << ", retried " << r.value("retried").toInt() << ")\n"
+            << "associations   " << r.value("associations").toInt() << '\n'
+            << "contexts       " << r.value("contexts").toInt() << '\n';
+        printRate("seconds", r.value("seconds").toDouble());
+        printRate("instances/s", r.value("instancesPerSec").toDouble());
+        printRate("MB/s", r.value("mbPerSec").toDouble());
+        for (const QString& f : r.value("failedFiles").toStringList())
+            out() << "failed         " << f << '\n';
+        out().flush();
+
+        return r.value("failed").toInt() == 0 ? ExitOk : ExitFailed;
+    }
+
+    // ---------------- receive ----------------
+    void printReceiveStats(const QVariantMap& s) {
+        out() << QString("instances %1, %2 MB, failed %3, associations %4, %5 inst/s, %6 MB/s\n")
+            .arg(s.value("instances").toLongLong())
+            .arg(s.value("bytes").toLongLong() / 1e6, 0, 'f', 1)
+            .arg(s.value("failures").toLongLong())
+            .arg(s.value("associations").toInt())
+            .arg(s.value("instancesPerSec").toDouble(), 0, 'f', 1)
+            .arg(s.value("mbPerSec").toDouble(), 0, 'f', 1);
+        if (s.value("findQueries").toLongLong() > 0) {
+            out() << QString("C-FIND %1 queries, %2 matches, p50 %3 ms, p99 %4 ms\n")
+                .arg(s.value("findQueries").toLongLong())
+                .arg(s.value("findMatches").toLongLong())
+                .arg(s.value("findP50Ms").toDouble(), 0, 'f', 2)
+                .arg(s.value("findP99Ms").toDouble(), 0, 'f', 2);
+        }
+        out().flush();
+    }
+
+    int runReceive(const QCommandLineParser& p) {
+        Lib4DICOM lib(p.values("root"));
+
+        const int mode = parseDurability(p.value("durability"));
+        if (mode < 0) {
+            err() << "receive: unknown --durability " << p.value("durability") << '\n';
+            err().flush();
+            return ExitUsage;
+        }
+        lib.setSaveDurability(mode);
+        if (!applyPlacement(p, lib, "receive"))
+            return ExitUsage;
+
+        const int port = p.value("port").toInt();
+        if (!lib.startStoreSCP(port, p.value("aet"), p.value("max-assoc").toInt())) {
+            err() << "cannot listen on port " << port << "\n";
+            err().flush();
+            return ExitFailed;
+        }
+        err() << "listening on port " << port << " as " << p.value("aet") << "\n";
+        err().flush();
+
+        QTimer progress;
+        QObject::connect(&progress, &QTimer::timeout, &lib, [&lib] {
+            printReceiveStats(lib.storeSCPStats());
+        });
+        progress.start(5000);
+
+        const int seconds = p.value("seconds").toInt();
+        if (seconds > 0)
+            QTimer::singleShot(seconds * 1000, qApp, &QCoreApplication::quit);
+        QCoreApplication::exec();
+
+        lib.stopStoreSCP();
+        QCoreApplication::processEvents();   // доставить последние instanceStored
+        const QVariantMap stats = lib.storeSCPStats();
+        printReceiveStats(stats);
+        return stats.value("failures").toLongLong() == 0 ? ExitOk : ExitFailed;
+    }
+
+    // ---------------- edit ----------------
+    int findPatientRow(Lib4DICOM& lib, const QString& patientID) {
+        const int n = lib.patientCount();
+        for (int i = 0; i < n; ++i)
+            if (lib.getPatientDemographics(i).value("patientID").toString() == patientID)
+                return i;
+        return -1;
+    }
+
+    int runEdit(const QCommandLineParser& p) {
+        const QString pid = p.value("patient").trimmed();
+        const int modes = int(p.isSet("merge-into")) + int(p.isSet("pseudonymize"))
+            + int(p.isSet("name") || p.isSet("id") || p.isSet("birth") || p.isSet("sex"));
+        if (pid.isEmpty() || modes != 1) {
+            err() << "edit: --patient and exactly one of rename (--name/--id/--birth/--sex), "
+                     "--merge-into or --pseudonymize are required\n";
+            err().flush();
+            return ExitUsage;
+        }
+        if (p.isSet("pseudonymize") && !p.isSet("out")) {
+            err() << "edit: --pseudonymize needs --out\n";
+            err().flush();
+            return ExitUsage;
+        }
+
+        const int mode = parseDurability(p.value("durability"));
+        if (mode < 0) {
+            err() << "edit: unknown --durability " << p.value("durability") << '\n';
+            err().flush();
+            return ExitUsage;
+        }
+
+        Lib4DICOM lib(p.values("root"));
+        lib.setSaveDurability(mode);
+        lib.setSaveThreads(parseThreads(p, "jobs"));
+
+        const int row = findPatientRow(lib, pid);
+        if (row < 0) {
+            err() << "edit: no patient with ID " << pid << '\n';
+            err().flush();
+            return ExitFailed;
+        }
+
+        QVariantMap r;
+        if (p.isSet("merge-into")) {
+            const int into = findPatientRow(lib, p.value("merge-into").trimmed());
+            if (into < 0) {
+                err() << "edit: no patient with ID " << p.value("merge-into") << '\n';
+                err().flush();
+                return ExitFailed;
+            }
+            r = lib.mergePatients(row, into);
+        }
+        else if (p.isSet("pseudonymize")) {
+            r = lib.pseudonymizePatient(row, p.value("out"), p.value("pseudonymize"), p.value("pseudo-id"));
+        }
+        else {
+            QVariantMap patient;
+            if (p.isSet("name"))  patient["fullName"] = p.value("name");
+            if (p.isSet("id"))    patient["patientID"] = p.value("id");
+            if (p.isSet("sex"))   patient["sex"] = p.value("sex");
+            if (p.isSet("birth")) patient[p.value("birth").size() == 8 ? "birthDA" : "birthYear"] = p.value("birth");
+            r = lib.renamePatient(row, patient);
+        }
+
+        if (r.contains("error")) {
+            err() << "edit: " << r.value("error").toString() << '\n';
+            err().flush();
+            return ExitFailed;
+        }
+        const double sec = r.value("seconds").toDouble();
+        out() << "files          " << r.value("edited").toInt() << " of " << r.value("files").toInt()
+            << " edited, " << r.value("failed").toInt() << " failed\n"
+            << "header-only    " << r.value("fastPath").toInt() << ", full rewrite " << r.value("slowPath").toInt() << '\n'
+            << "pixel bytes    " << r.value("pixelBytes").toLongLong() << " (" << r.value("kernelCopyBytes").toLongLong()
+            << " copied in kernel)\n"
+            << "elapsed        " << QString::number(sec, 'f', 3) << " s\n";
+        printRate("files/s", r.value("filesPerSec").toDouble());
+        printRate("MB/s", r.value("mbPerSec").toDouble());
+        if (r.contains("outDir"))
+            out() << "out            " << r.value("outDir").toString() << '\n';
+        for (const QString& f : r.value("failedFiles").toStringList())
+            out() << "failed         " << f << '\n';
+        out().flush();
+        return r.value("ok").toBool() ? ExitOk : ExitFailed;
+    }
+
+    // ---------------- migrate ----------------
+    int runMigrate(const QCommandLineParser& p) {
+        const int layout = parseLayout(p.value("to"));
+        if (layout < 0) {
+            err() << "migrate: --to flat|fanout is required\n";
+            err().flush();
+            return ExitUsage;
+        }
+
+        const int mode = parseDurability(p.value("durability"));
+        if (mode < 0) {
+            err() << "migrate: unknown --durability " << p.value("durability") << '\n';
+            err().flush();
+            return ExitUsage;
+        }
+
+        Lib4DICOM lib(p.values("root"));
+        lib.setSaveDurability(mode);
+        const QVariantMap r = lib.migrateLayout(layout);
+        if (r.contains("error")) {
+            err() << "migrate: " << r.value("error").toString() << '\n';
+            err().flush();
+            return ExitFailed;
+        }
+
+        out() << "patients       " << r.value("moved").toInt() << " moved, " << r.value("kept").toInt()
+            << " already in place, " << r.value("failed").toInt() << " failed\n"
+            << "roots          " << r.value("roots").toInt() << '\n'
+            << "elapsed        " << QString::number(r.value("seconds").toDouble(), 'f', 3) << " s\n";
+        if (!r.value("ok").toBool())
+            out() << "incomplete     run migrate again to resume\n";
+        out().flush();
+        return r.value("ok").toBool() ? ExitOk : ExitFailed;
+    }
+
+    // ---------------- verify ----------------
+    int runVerify(const QCommandLineParser& p) {
+        Lib4DICOM lib(p.values("root"));
+
+        ArchiveVerifier::Options opt;
+        opt.mbPerSec = qMax(0.0, p.value("mbps").toDouble());
+        opt.idleIo = !p.isSet("no-idle");
+        opt.depth = lib.scanDepth();
+        opt.reportPath = p.value("report");
+
+        ArchiveVerifier verifier;
+        QStringList findings;
+        QObject::connect(&verifier, &ArchiveVerifier::finding, &verifier,
+            [&findings](int kind, const QString& path, const QString& detail) {
+                findings << QString("%1 %2  %3").arg(ArchiveVerifier::kindName(kind), -16).arg(path, detail);
+            }, Qt::DirectConnection);
+
+        // --probe N: N сканирований до проверки и N во время неё — цена проверки для интерактивной работы
+        const int probes = qMax(0, p.value("probe").toInt());
+        QVector<qint64> idleNs, busyNs;
+        auto probeScan = [&lib](QVector<qint64>& ns) {
+            QElapsedTimer t;
+            t.start();
+            lib.scanPatients();
+            ns << t.nsecsElapsed();
+        };
+        for (int i = 0; i < probes; ++i)
+            probeScan(idleNs);
+
+        QVariantMap r;
+        const QStringList roots = lib.storageRoots();
+        std::unique_ptr<QThread> worker(QThread::create([&]() { r = verifier.verify(roots, opt); }));
+        worker->start(QThread::LowestPriority);
+        while (busyNs.size() < probes && !worker->isFinished())
+            probeScan(busyNs);
+        worker->wait();
+
+        out() << "files          " << r.value("files").toInt() << " in " << r.value("folders").toInt()
+            << " patient folders, " << r.value("bytes").toLongLong() / (1024 * 1024) << " MB\n"
+            << "findings       " << r.value("findings").toInt() << " (unreadable " << r.value("unreadable").toInt()
+            << ", pixel length " << r.value("pixelLength").toInt()
+            << ", missing stub " << r.value("missingStub").toInt()
+            << ", patient mismatch " << r.value("patientMismatch").toInt() << ")\n"
+            << "elapsed        " << QString::number(r.value("seconds").toDouble(), 'f', 3) << " s, "
+            << r.value("throttledMs").toLongLong() << " ms throttled\n"
+            << "idle I/O       " << (r.value("idleIo").toBool() ? "yes" : "no") << '\n';
+        printRate("MB/s", r.value("mbPerSec").toDouble());
+        if (probes > 0) {
+            printLatency("scan idle", idleNs);
+            printLatency("scan verifying", busyNs);
+            if (busyNs.size() < probes)
+                out() << "(verification ended after " << busyNs.size() << " of " << probes << " probes)\n";
+        }
+        if (r.contains("report"))
+            out() << "report         " << r.value("report").toString() << '\n';
+        for (const QString& f : findings)
+            out() << f << '\n';
+        out().flush();
+        return r.value("findings").toInt() == 0 ? ExitOk : ExitFailed;
+    }
+
+}
+
+int main(int argc, char* argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("Lib4DICOMCli");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Lib4DICOM console: scan the patients archive, import or export images, receive or send C-STORE");
+    parser.addHelpOption();
+    parser.addPositionalArgument("command", "scan | import | images | render-bench | preprocess-bench | find-bench | pool-bench | receive | export | edit | migrate | verify");
+    parser.addOptions({
+        { "root",      "Patients root folder, repeat for several disks (default: <app dir>/patients).", "dir" },
+        { "placement", "Root for new patients: free (default) | round-robin | hash.", "policy", "free" },
+        { "layout",    "Folders of new patients: flat (default) | fanout (<root>/ab/cd/<patient>).", "layout", "flat" },
+        { "verbose",   "Print library debug output." },
+        });
+
+    // первый проход — только чтобы узнать подкоманду
+    parser.parse(QCoreApplication::arguments());
+    const QString command = parser.positionalArguments().value(0);
+
+    if (command == "scan") {
+        parser.clearPositionalArguments();
+        parser.addPositionalArgument("scan", "Scan the archive and dump the patient index.");
+        parser.addOptions({
+            { "depth", "Scan depth below root (default 2).", "n" },
+            { "json",  "Dump the index as JSON instead of TSV." },
+            });
+    }
+    else if (command == "import") {
+        parser.clearPositionalArguments();
+        parser.addPositionalArgument("import", "Import a folder of images as one series.");
+        parser.addPositionalArgument("source", "Folder with images.");
+        parser.addOptions({
+            { "name",       "Patient full name.", "name" },
+            { "birth",      "Birth year (YYYY) or date (YYYYMMDD).", "date" },
+            { "sex",        "Patient sex: M, F or O.", "sex" },
+            { "id",         "PatientID; an existing patient with this ID gets a new study.", "id" },
+            { "label",      "Study label (default: Study).", "label" },
+            { "series",     "Series name.", "name" },
+            { "jobs",       "Threads writing DICOM files (default: all cores).", "n" },
+            { "read-jobs",  "Threads decoding source images (default: all cores).", "n" },
+            { "batch",      "Images decoded and written per step (default 64).", "n", "64" },
+            { "durability", "unsafe | per-file | group (default).", "mode", "group" },
+            { "dedup",      "Skip images already stored: off | study (default) | patient.", "scope", "study" },
+            { "max-dim",    "Downscale so the longest side is at most N pixels.", "n" },
+            { "crop",       "Keep only this region of every image.", "x,y,w,h" },
+            { "gray",       "Store images as 8-bit grayscale." },
+            });
+    }
+    else if (command == "images") {
+        parser.clearPositionalArguments();
+        parser.addPositionalArgument("images", "Export archive images as PNG or JPEG.");
+        parser.addPositionalArgument("folders", "Patient or study folders, or single files.", "<folder>...");
+        parser.addOptions({
+            { "out",       "Output folder.", "dir" },
+            { "format",    "png (default) | jpg.", "fmt", "png" },
+            { "quality",   "JPEG quality 1..100 (default 90).", "n", "90" },
+            { "series",    "Only this SeriesInstanceUID.", "uid" },
+            { "jobs",      "Encoding threads (default: all cores).", "n" },
+            { "in-flight", "Datasets read but not yet written (default 2 x jobs).", "n" },
+            { "window",    "Window for 16-bit images: center,width (default: from file or min/max).", "c,w" },
+            });
+    }
+    else if (command == "render-bench") {
+        parser.clearPositionalArguments();
+        parser.addPositionalArgument("render-bench", "Measure 16-bit window/level and VOI LUT rendering.");
+        parser.addOptions({
+            { "size",       "Synthetic image size (default 4096x4096).", "WxH", "4096x4096" },
+            { "iterations", "Renders per kernel (default 20).", "n", "20" },
+            { "jobs",       "Threads for the banded runs (default: all cores).", "n" },
+            });
+    }
+    else if (command == "preprocess-bench") {
+        parser.clearPositionalArguments();
+        parser.addPositionalArgument("preprocess-bench", "Measure import-time downscaling and the storage it saves.");
+        parser.addOptions({
+            { "size",       "Synthetic RGB image size (default 4000x3000).", "WxH", "4000x3000" },
+            { "max-dim",    "Longest side after downscaling (default 1024).", "n", "1024" },
+            { "iterations", "Runs per kernel (default 10).", "n", "10" },
+            { "jobs",       "Threads for the banded runs (default: all cores).", "n" },
+            });
+    }
+    else if (command == "find-bench") {
+        parser.clearPositionalArguments();
+        parser.addPositionalArgument("find-bench", "Measure C-FIND latency on a synthetic in-memory patient index.");
+        parser.addOptions({
+            { "patients",   "Synthetic patients (default 100000).", "n", "100000" },
+            { "studies",    "Studies per patient (default 3).", "n", "3" },
+            { "iterations", "Runs per query (default 50).", "n", "50" },
+            });
+    }
+    else if (command == "pool-bench") {
+        parser.clearPositionalArguments();
+        parser.addPositionalArgument("pool-bench", "Measure per-image buffer allocations in batch saves with and without the pool.");
+        parser.addOptions({
+            { "size",    "Synthetic RGB32 image size (default 1280x1024).", "WxH", "1280x1024" },
+            { "batches", "Batches per run; the first one fills the pool (default 8).", "n", "8" },
+            { "batch",   "Images per batch (default 32).", "n", "32" },
+            { "jobs",    "Threads writing DICOM files (default: all cores).", "n" },
+            });
+    }
+    else if (command == "receive") {
+        parser.clearPositionalArguments();
+        parser.addPositionalArgument("receive", "Accept C-STORE into the archive and answer C-FIND.");
+        parser.addOptions({
+            { "port",       "TCP port (default 11112).", "n", "11112" },
+            { "aet",        "Own AE title (default LIB4DICOM).", "ae", "LIB4DICOM" },
+            { "max-assoc",  "Concurrent associations (default 8).", "n", "8" },
+            { "seconds",    "Stop after N seconds (default: run until killed).", "n" },
+            { "durability", "unsafe | per-file | group (default).", "mode", "group" },
+            });
+    }
+    else if (command == "edit") {
+        parser.clearPositionalArguments();
+        parser.addPositionalArgument("edit", "Rename, merge or pseudonymize a patient without rewriting pixel data.");
+        parser.addOptions({
+            { "patient",      "PatientID of the patient to edit.", "id" },
+            { "name",         "New full name.", "name" },
+            { "id",           "New PatientID.", "id" },
+            { "birth",        "New birth year (YYYY) or date (YYYYMMDD).", "date" },
+            { "sex",          "New sex: M, F or O.", "sex" },
+            { "merge-into",   "Merge into the patient with this PatientID.", "id" },
+            { "pseudonymize", "Write a pseudonymized copy under this name.", "name" },
+            { "pseudo-id",    "PatientID for the copy (default: the pseudonym).", "id" },
+            { "out",          "Output folder for --pseudonymize.", "dir" },
+            { "jobs",         "Threads (default: all cores).", "n" },
+            { "durability",   "unsafe | per-file | group (default).", "mode", "group" },
+            });
+    }
+    else if (command == "migrate") {
+        parser.clearPositionalArguments();
+        parser.addPositionalArgument("migrate", "Move patient folders in place to another layout; resumable.");
+        parser.addOptions({
+            { "to",         "Target layout: flat | fanout.", "layout" },
+            { "durability", "unsafe | per-file | group (default).", "mode", "group" },
+            });
+    }
+    else if (command == "verify") {
+        parser.clearPositionalArguments();
+        parser.addPositionalArgument("verify", "Check that archive files parse, stubs exist and patient fields agree.");
+        parser.addOptions({
+            { "mbps",    "Read rate cap in MB/s, 0 = unlimited (default 20).", "n", "20" },
+            { "no-idle", "Keep the normal I/O priority instead of idle." },
+            { "report",  "Write findings to this TSV file.", "file" },
+            { "probe",   "Time N scans before and N during verification.", "n", "0" },
+            });
+    }
+    else if (command == "export") {
+        parser.clearPositionalArguments();
+        parser.addPositionalArgument("export", "Send study folders to a Storage SCP.");
+        parser.addPositionalArgument("folders", "Study or patient folders.", "<folder>...");
+        parser.addOptions({
+            { "host",      "Storage SCP host.", "host" },
+            { "port",      "Storage SCP port (default 104).", "n", "104" },
+            { "aec",       "Called AE title (default ANY-SCP).", "ae", "ANY-SCP" },
+            { "aet",       "Calling AE title (default LIB4DICOM).", "ae", "LIB4DICOM" },
+            { "jobs",      "Parallel associations (default 4).", "n", "4" },
+            { "read-jobs", "Threads reading files ahead (default 2).", "n", "2" },
+            { "retries",   "Retries per instance (default 2).", "n", "2" },
+            { "baseline",  "One association per file, for comparison." },
+            });
+    }
+
+    parser.process(app);
+
+    if (!parser.isSet("verbose"))
+        QLoggingCategory::setFilterRules(QStringLiteral("*.debug=false"));
+
+    if (command == "scan")
+        return runScan(parser);
+    if (command == "import")
+        return runImport(parser);
+    if (command == "images")
+        return runImages(parser);
+    if (command == "render-bench")
+        return runRenderBench(parser);
+    if (command == "preprocess-bench")
+        return runPreprocessBench(parser);
+    if (command == "find-bench")
+        return runFindBench(parser);
+    if (command == "pool-bench")
+        return runPoolBench(parser);
+    if (command == "receive")
+        return runReceive(parser);
+    if (command == "export")
+        return runExport(parser);
+    if (command == "edit")
+        return runEdit(parser);
+    if (command == "migrate")
+        return runMigrate(parser);
+    if (command == "verify")
+        return runVerify(parser);
+
+    err() << "unknown command '" << command << "'\n\n" << parser.helpText();
+    err().flush();
+    return ExitUsage;
+}